@@ -0,0 +1,380 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks of the hot paths of Souper. Every benchmark runs over the
+// replacements of a fixed corpus of .opt files, so that its timings can be
+// compared across commits. The results are written as JSON.
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/KnownBits.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "souper/Extractor/ExprBuilder.h"
+#include "souper/Infer/AbstractInterpreter.h"
+#include "souper/Infer/EnumerativeSynthesis.h"
+#include "souper/Infer/Interpreter.h"
+#include "souper/Parser/Parser.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+
+using namespace llvm;
+using namespace souper;
+
+unsigned DebugLevel;
+
+static cl::list<std::string>
+InputFilenames(cl::Positional, cl::desc("<corpus .opt files>"),
+               cl::OneOrMore);
+
+static cl::opt<std::string> OutputFilename("o",
+    cl::desc("Write the results to this file (default=-)"),
+    cl::init("-"));
+
+static cl::opt<std::string> Filter("filter",
+    cl::desc("Only run the benchmarks whose name matches this regex "
+             "(default=all)"),
+    cl::init(""));
+
+static cl::opt<unsigned> MinTime("min-time-ms",
+    cl::desc("Run each repetition of a benchmark for at least this many "
+             "milliseconds (default=100)"),
+    cl::init(100));
+
+static cl::opt<unsigned> Repetitions("repetitions",
+    cl::desc("Number of timed repetitions of each benchmark (default=5)"),
+    cl::init(5));
+
+static cl::opt<unsigned> InputsPerLHS("inputs-per-lhs",
+    cl::desc("Number of random inputs the interpreter benchmark evaluates "
+             "each LHS on (default=16)"),
+    cl::init(16));
+
+static cl::opt<unsigned> Seed("seed",
+    cl::desc("Seed of the random inputs of the interpreter benchmark "
+             "(default=0)"),
+    cl::init(0));
+
+namespace {
+
+struct CorpusFile {
+  std::string Name;
+  std::unique_ptr<MemoryBuffer> Buffer;
+  // Whether the file holds LHSs only, which are parsed with
+  // ParseReplacementLHSs, or whole replacements.
+  bool LHSOnly;
+};
+
+struct Corpus {
+  InstContext IC;
+  std::vector<CorpusFile> Files;
+  std::vector<ParsedReplacement> Reps;
+  // The right hand side each replacement is checked against when building
+  // queries: its own if it has one, else a fresh variable.
+  std::vector<Inst *> QueryRHSs;
+  std::vector<std::vector<ValueCache>> Inputs;
+  // The abstract interpreters do not evaluate the LHS on an input, but some
+  // of their transfer functions look for constant operands, which have to
+  // be given values.
+  std::vector<ValueCache> AnalysisInputs;
+};
+
+bool loadCorpus(Corpus &C) {
+  for (const auto &Name : InputFilenames) {
+    auto MB = MemoryBuffer::getFileOrSTDIN(Name);
+    if (!MB) {
+      errs() << Name << ": " << MB.getError().message() << '\n';
+      return false;
+    }
+    std::string ErrStr;
+    std::vector<ReplacementContext> Contexts;
+    auto Reps = ParseReplacementLHSs(C.IC, Name, (*MB)->getBuffer(), Contexts,
+                                     ErrStr);
+    bool LHSOnly = ErrStr.empty();
+    if (!LHSOnly) {
+      ErrStr.clear();
+      Reps = ParseReplacements(C.IC, Name, (*MB)->getBuffer(), ErrStr);
+    }
+    if (!ErrStr.empty()) {
+      errs() << ErrStr << '\n';
+      return false;
+    }
+    C.Files.push_back({Name, std::move(*MB), LHSOnly});
+    C.Reps.insert(C.Reps.end(), Reps.begin(), Reps.end());
+  }
+
+  std::mt19937_64 Rand(Seed);
+  auto RandomInput = [&Rand](const std::vector<Inst *> &Vars) {
+    ValueCache Input;
+    for (auto *V : Vars) {
+      APInt Val(V->Width, 0);
+      for (unsigned Bit = 0; Bit < V->Width; Bit += 64)
+        Val.insertBits(APInt(64, Rand()).zextOrTrunc(
+                           std::min(64u, V->Width - Bit)), Bit);
+      Input.insert({V, EvalValue(Val)});
+    }
+    return Input;
+  };
+  for (auto &Rep : C.Reps) {
+    Inst *RHS = Rep.Mapping.RHS;
+    if (!RHS)
+      RHS = C.IC.createVar(Rep.Mapping.LHS->Width, "rhs");
+    C.QueryRHSs.push_back(RHS);
+
+    std::vector<Inst *> Vars;
+    findVars(Rep.Mapping.LHS, Vars);
+    C.AnalysisInputs.push_back(RandomInput(Vars));
+    std::vector<ValueCache> Inputs;
+    for (unsigned I = 0; I < InputsPerLHS; ++I)
+      Inputs.push_back(RandomInput(Vars));
+    C.Inputs.push_back(std::move(Inputs));
+  }
+  return true;
+}
+
+// One iteration of a benchmark runs it over the whole corpus. It returns a
+// checksum of its results, which must not vary between iterations, so that
+// a change of behavior can be told apart from a change of speed.
+struct Benchmark {
+  std::string Name;
+  std::function<uint64_t(Corpus &)> Run;
+};
+
+std::vector<Benchmark> getBenchmarks() {
+  std::vector<Benchmark> Benchmarks;
+
+  Benchmarks.push_back({"ParseReplacements", [](Corpus &C) {
+    uint64_t Sum = 0;
+    InstContext IC;
+    for (const auto &F : C.Files) {
+      std::string ErrStr;
+      std::vector<ReplacementContext> Contexts;
+      auto Reps = F.LHSOnly ?
+        ParseReplacementLHSs(IC, F.Name, F.Buffer->getBuffer(), Contexts,
+                             ErrStr) :
+        ParseReplacements(IC, F.Name, F.Buffer->getBuffer(), ErrStr);
+      Sum += Reps.size();
+    }
+    return Sum;
+  }});
+
+  // Copies every LHS into a new context twice. The first copy creates the
+  // instructions and the second one finds all of them again.
+  Benchmarks.push_back({"InstContext::getInst", [](Corpus &C) {
+    uint64_t Sum = 0;
+    InstContext IC;
+    std::map<Block *, Block *> BlockCache;
+    for (int Copy = 0; Copy < 2; ++Copy) {
+      for (auto &Rep : C.Reps) {
+        std::map<Inst *, Inst *> InstCache;
+        getInstCopy(Rep.Mapping.LHS, IC, InstCache, BlockCache, nullptr,
+                    /*CloneVars=*/false);
+        Sum += InstCache.size();
+      }
+    }
+    return Sum;
+  }});
+
+  Benchmarks.push_back({"ConcreteInterpreter::evaluateInst", [](Corpus &C) {
+    uint64_t Sum = 0;
+    for (size_t I = 0; I < C.Reps.size(); ++I) {
+      for (auto &Input : C.Inputs[I]) {
+        ConcreteInterpreter CI(Input);
+        CI.setEvalPhiFirstBranch();
+        auto Val = CI.evaluateInst(C.Reps[I].Mapping.LHS);
+        Sum += Val.hasValue() ? Val.getValue().getLoBits(16).getZExtValue() :
+                                static_cast<uint64_t>(Val.K);
+      }
+    }
+    return Sum;
+  }});
+
+  Benchmarks.push_back({"KnownBitsAnalysis", [](Corpus &C) {
+    uint64_t Sum = 0;
+    for (size_t I = 0; I < C.Reps.size(); ++I) {
+      ConcreteInterpreter CI(C.AnalysisInputs[I]);
+      auto KB = KnownBitsAnalysis().findKnownBits(C.Reps[I].Mapping.LHS, CI,
+                                                  /*UsePartialEval=*/false);
+      Sum += KB.Zero.countPopulation() + KB.One.countPopulation();
+    }
+    return Sum;
+  }});
+
+  Benchmarks.push_back({"ConstantRangeAnalysis", [](Corpus &C) {
+    uint64_t Sum = 0;
+    for (size_t I = 0; I < C.Reps.size(); ++I) {
+      ConcreteInterpreter CI(C.AnalysisInputs[I]);
+      auto CR = ConstantRangeAnalysis().findConstantRange(
+                  C.Reps[I].Mapping.LHS, CI, /*UsePartialEval=*/false);
+      Sum += CR.isFullSet() ? 0 : CR.getLower().getLoBits(16).getZExtValue() +
+                                  CR.getUpper().getLoBits(16).getZExtValue();
+    }
+    return Sum;
+  }});
+
+  Benchmarks.push_back({"BuildQuery", [](Corpus &C) {
+    uint64_t Sum = 0;
+    InstContext IC;
+    for (size_t I = 0; I < C.Reps.size(); ++I) {
+      auto &Rep = C.Reps[I];
+      InstMapping Mapping(Rep.Mapping.LHS, C.QueryRHSs[I]);
+      Sum += BuildQuery(IC, Rep.BPCs, Rep.PCs, Mapping, nullptr,
+                        /*Precondition=*/nullptr).size();
+    }
+    return Sum;
+  }});
+
+  Benchmarks.push_back({"ReplacementContext::printInst", [](Corpus &C) {
+    uint64_t Sum = 0;
+    for (auto &Rep : C.Reps) {
+      ReplacementContext Context;
+      Sum += GetReplacementLHSString(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
+                                     Context).size();
+      if (Rep.Mapping.RHS)
+        Sum += GetReplacementRHSString(Rep.Mapping.RHS, Context).size();
+    }
+    return Sum;
+  }});
+
+  // Enumerates the guesses of one instruction for every LHS without
+  // checking them, which main() arranges by setting the options of
+  // EnumerativeSynthesis. No RHS is found, so the checksum is the number
+  // of LHSs enumerated.
+  Benchmarks.push_back({"getGuesses", [](Corpus &C) {
+    uint64_t Sum = 0;
+    InstContext IC;
+    for (auto &Rep : C.Reps) {
+      std::vector<Inst *> RHSs;
+      EnumerativeSynthesis ES;
+      if (!ES.synthesize(/*SMTSolver=*/nullptr, Rep.BPCs, Rep.PCs,
+                         Rep.Mapping.LHS, RHSs, /*CheckAllGuesses=*/false, IC,
+                         /*Timeout=*/0))
+        ++Sum;
+    }
+    return Sum;
+  }});
+
+  return Benchmarks;
+}
+
+struct Result {
+  std::string Name;
+  uint64_t Iterations = 0;
+  uint64_t Checksum;
+  bool Stable = true;
+  // The mean time of an iteration in each repetition, in nanoseconds.
+  std::vector<double> Times;
+};
+
+Result runBenchmark(Benchmark &B, Corpus &C) {
+  using Clock = std::chrono::steady_clock;
+
+  Result R;
+  R.Name = B.Name;
+  // The first run warms up the caches and sets the expected checksum.
+  R.Checksum = B.Run(C);
+
+  for (unsigned Rep = 0; Rep < Repetitions; ++Rep) {
+    auto Start = Clock::now();
+    auto MinEnd = Start + std::chrono::milliseconds(MinTime);
+    unsigned N = 0;
+    auto End = Start;
+    do {
+      R.Stable &= B.Run(C) == R.Checksum;
+      ++N;
+      End = Clock::now();
+    } while (End < MinEnd);
+    R.Iterations += N;
+    R.Times.push_back(std::chrono::duration<double, std::nano>(End - Start)
+                        .count() / N);
+  }
+  std::sort(R.Times.begin(), R.Times.end());
+
+  if (!R.Stable)
+    errs() << "warning: the checksum of " << B.Name
+           << " varies between iterations\n";
+  return R;
+}
+
+void printResults(raw_ostream &Out, const Corpus &C,
+                  const std::vector<Result> &Results) {
+  json::OStream J(Out, 2);
+  J.object([&] {
+    J.attribute("files", static_cast<int64_t>(C.Files.size()));
+    J.attribute("replacements", static_cast<int64_t>(C.Reps.size()));
+    J.attributeArray("benchmarks", [&] {
+      for (auto &R : Results) {
+        J.object([&] {
+          J.attribute("name", R.Name);
+          J.attribute("iterations", static_cast<int64_t>(R.Iterations));
+          J.attribute("checksum", static_cast<int64_t>(R.Checksum));
+          J.attribute("stable", R.Stable);
+          if (!R.Times.empty()) {
+            J.attribute("min_ns", static_cast<int64_t>(R.Times.front()));
+            J.attribute("median_ns",
+                        static_cast<int64_t>(R.Times[R.Times.size() / 2]));
+            J.attribute("max_ns", static_cast<int64_t>(R.Times.back()));
+          }
+        });
+      }
+    });
+  });
+  Out << '\n';
+}
+
+}
+
+int main(int argc, char **argv) {
+  // Set up EnumerativeSynthesis to only generate guesses for getGuesses,
+  // before the command line, which may override it.
+  std::vector<const char *> Args{argv[0],
+    "-souper-enumerative-synthesis-skip-solver",
+    "-souper-enumerative-synthesis-max-instructions=1"};
+  Args.insert(Args.end(), argv + 1, argv + argc);
+  cl::ParseCommandLineOptions(Args.size(), Args.data(),
+                              "Souper microbenchmarks\n");
+
+  Regex FilterRegex(Filter);
+  std::string RegexErr;
+  if (!Filter.empty() && !FilterRegex.isValid(RegexErr)) {
+    errs() << "invalid -filter: " << RegexErr << '\n';
+    return 1;
+  }
+
+  Corpus C;
+  if (!loadCorpus(C))
+    return 1;
+
+  std::vector<Result> Results;
+  for (auto &B : getBenchmarks()) {
+    if (!Filter.empty() && !FilterRegex.match(B.Name))
+      continue;
+    Results.push_back(runBenchmark(B, C));
+  }
+
+  std::error_code EC;
+  raw_fd_ostream Out(OutputFilename, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << OutputFilename << ": " << EC.message() << '\n';
+    return 1;
+  }
+  printResults(Out, C, Results);
+  return 0;
+}
@@ -0,0 +1,455 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// End-to-end benchmark of synthesis. It infers an RHS for every LHS of a
+// fixed corpus and records the RHS, the number of solver queries of each
+// kind, the number of guesses, the wall time and the peak memory use. The
+// solver's answers are replayed from a query log, so that runs do not depend
+// on the solver and any change in the counts comes from Souper itself. The
+// Insts that queries are built from are ordered by creation, not by address,
+// so a run asks the same queries as the run that recorded them. The results
+// can be compared with a stored baseline.
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "souper/Parser/Parser.h"
+#include "souper/SMTLIB2/Solver.h"
+#include "souper/Tool/GetSolver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <set>
+#include <sys/resource.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace souper;
+
+unsigned DebugLevel;
+
+static cl::list<std::string>
+InputFilenames(cl::Positional, cl::desc("<corpus .opt files>"),
+               cl::OneOrMore);
+
+static cl::opt<std::string> QueryLogFilename("query-log",
+    cl::desc("Answer the solver queries from this file (default=none)"),
+    cl::init(""));
+
+static cl::opt<bool> Record("record",
+    cl::desc("Run the solver on the queries missing from the query log and "
+             "add its answers to the log (default=false)"),
+    cl::init(false));
+
+static cl::opt<std::string> BaselineFilename("baseline",
+    cl::desc("Compare the results with the results in this file "
+             "(default=none)"),
+    cl::init(""));
+
+static cl::opt<bool> UpdateBaseline("update-baseline",
+    cl::desc("Replace the baseline with the results of this run instead of "
+             "comparing with it (default=false)"),
+    cl::init(false));
+
+static cl::opt<std::string> OutputFilename("o",
+    cl::desc("Write the results to this file (default=none)"),
+    cl::init(""));
+
+static cl::opt<unsigned> Tolerance("tolerance",
+    cl::desc("Report changes of the wall time and memory use of an LHS "
+             "larger than this percentage, and than 1ms or 1MB "
+             "(default=10)"),
+    cl::init(10));
+
+namespace {
+
+struct LHSResult {
+  std::string Name;
+  std::string RHS;
+  std::string Error;
+  uint64_t WallMicros = 0;
+  uint64_t PeakRSSKB = 0;
+  // Solver queries by the statistic that counts them, e.g. PruningQueries.
+  std::map<std::string, uint64_t> Queries;
+  uint64_t TotalQueries = 0;
+  uint64_t UnansweredQueries = 0;
+  uint64_t GuessesGenerated = 0;
+  uint64_t GuessesPruned = 0;
+};
+
+// Linux keeps the peak resident set size of a process in VmHWM, which can be
+// reset by writing 5 to clear_refs. Elsewhere the peak is the one of the
+// whole run.
+void resetPeakRSS() {
+  int FD = ::open("/proc/self/clear_refs", O_WRONLY);
+  if (FD == -1)
+    return;
+  // If this fails, the peak also covers the earlier LHSs.
+  ssize_t Written = ::write(FD, "5", 1);
+  (void)Written;
+  ::close(FD);
+}
+
+uint64_t getPeakRSSKB() {
+  if (auto MB = MemoryBuffer::getFileAsStream("/proc/self/status")) {
+    SmallVector<StringRef, 64> Lines;
+    (*MB)->getBuffer().split(Lines, '\n');
+    for (StringRef L : Lines) {
+      uint64_t KB;
+      if (L.consume_front("VmHWM:") &&
+          !L.trim().rsplit(' ').first.trim().getAsInteger(10, KB))
+        return KB;
+    }
+  }
+  struct rusage Usage;
+  getrusage(RUSAGE_SELF, &Usage);
+#ifdef __APPLE__
+  return Usage.ru_maxrss / 1024;
+#else
+  return Usage.ru_maxrss;
+#endif
+}
+
+std::string getRHSString(const ParsedReplacement &Rep, Inst *RHS) {
+  ReplacementContext Context;
+  GetReplacementLHSString(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS, Context);
+  std::string Str = GetReplacementRHSString(RHS, Context);
+  return StringRef(Str).rtrim('\n').str();
+}
+
+LHSResult runLHS(Solver *S, InstContext &IC, const ParsedReplacement &Rep) {
+  LHSResult R;
+  ResetStatistics();
+  resetPeakRSS();
+
+  std::vector<Inst *> RHSs;
+  auto Start = std::chrono::steady_clock::now();
+  std::error_code EC = S->infer(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS, RHSs,
+                                /*AllowMultipleRHSs=*/false, IC);
+  auto End = std::chrono::steady_clock::now();
+  R.WallMicros =
+    std::chrono::duration_cast<std::chrono::microseconds>(End - Start).count();
+  R.PeakRSSKB = getPeakRSSKB();
+
+  if (EC)
+    R.Error = EC.message();
+  if (!RHSs.empty())
+    R.RHS = getRHSString(Rep, RHSs.front());
+
+  // Every query passes through the replaying solver, so its statistics give
+  // the total; the other statistics named *Queries split it by the method
+  // that asked.
+  for (const auto &Stat : GetStatistics()) {
+    StringRef Name = Stat.first;
+    if (Name == "QueriesReplayed" || Name == "QueriesRecorded") {
+      R.TotalQueries += Stat.second;
+    } else if (Name == "QueriesUnanswered") {
+      R.TotalQueries += Stat.second;
+      R.UnansweredQueries = Stat.second;
+    } else if (Name == "GuessesGenerated") {
+      R.GuessesGenerated = Stat.second;
+    } else if (Name == "GuessesPruned") {
+      R.GuessesPruned = Stat.second;
+    } else if (Name.endswith("Queries") && Stat.second) {
+      R.Queries[Name.str()] = Stat.second;
+    }
+  }
+  return R;
+}
+
+bool runCorpus(Solver *S, std::vector<LHSResult> &Results) {
+  InstContext IC;
+  for (const auto &Name : InputFilenames) {
+    auto MB = MemoryBuffer::getFileOrSTDIN(Name);
+    if (!MB) {
+      errs() << Name << ": " << MB.getError().message() << '\n';
+      return false;
+    }
+    std::string ErrStr;
+    std::vector<ReplacementContext> Contexts;
+    auto Reps = ParseReplacementLHSs(IC, Name, (*MB)->getBuffer(), Contexts,
+                                     ErrStr);
+    if (!ErrStr.empty()) {
+      ErrStr.clear();
+      Reps = ParseReplacements(IC, Name, (*MB)->getBuffer(), ErrStr);
+    }
+    if (!ErrStr.empty()) {
+      errs() << ErrStr << '\n';
+      return false;
+    }
+    for (unsigned I = 0; I != Reps.size(); ++I) {
+      Results.push_back(runLHS(S, IC, Reps[I]));
+      Results.back().Name = Name + ":" + std::to_string(I);
+    }
+  }
+  return true;
+}
+
+void printResults(raw_ostream &Out, const std::vector<LHSResult> &Results) {
+  json::OStream J(Out, 2);
+  J.object([&] {
+    J.attributeArray("lhss", [&] {
+      for (const auto &R : Results) {
+        J.object([&] {
+          J.attribute("name", R.Name);
+          J.attribute("rhs", R.RHS);
+          if (!R.Error.empty())
+            J.attribute("error", R.Error);
+          J.attribute("wall_us", static_cast<int64_t>(R.WallMicros));
+          J.attribute("peak_rss_kb", static_cast<int64_t>(R.PeakRSSKB));
+          J.attributeObject("solver_queries", [&] {
+            J.attribute("total", static_cast<int64_t>(R.TotalQueries));
+            for (const auto &Q : R.Queries)
+              J.attribute(Q.first, static_cast<int64_t>(Q.second));
+          });
+          J.attribute("unanswered_queries",
+                      static_cast<int64_t>(R.UnansweredQueries));
+          J.attribute("guesses_generated",
+                      static_cast<int64_t>(R.GuessesGenerated));
+          J.attribute("guesses_pruned", static_cast<int64_t>(R.GuessesPruned));
+        });
+      }
+    });
+  });
+  Out << '\n';
+}
+
+bool readResults(StringRef Filename, std::vector<LHSResult> &Results) {
+  auto MB = MemoryBuffer::getFile(Filename);
+  if (!MB) {
+    errs() << Filename << ": " << MB.getError().message() << '\n';
+    return false;
+  }
+  Expected<json::Value> V = json::parse((*MB)->getBuffer());
+  if (!V) {
+    errs() << Filename << ": " << toString(V.takeError()) << '\n';
+    return false;
+  }
+  const json::Object *Root = V->getAsObject();
+  const json::Array *LHSs = Root ? Root->getArray("lhss") : nullptr;
+  if (!LHSs) {
+    errs() << Filename << ": expected an object with an array of lhss\n";
+    return false;
+  }
+  auto getInt = [](const json::Object &O, StringRef Key) {
+    return static_cast<uint64_t>(O.getInteger(Key).value_or(0));
+  };
+  for (const auto &E : *LHSs) {
+    const json::Object *O = E.getAsObject();
+    if (!O || !O->getString("name")) {
+      errs() << Filename << ": expected an lhs with a name\n";
+      return false;
+    }
+    LHSResult R;
+    R.Name = O->getString("name")->str();
+    R.RHS = O->getString("rhs").value_or("").str();
+    R.Error = O->getString("error").value_or("").str();
+    R.WallMicros = getInt(*O, "wall_us");
+    R.PeakRSSKB = getInt(*O, "peak_rss_kb");
+    if (const json::Object *Q = O->getObject("solver_queries")) {
+      for (const auto &P : *Q) {
+        uint64_t N = P.second.getAsInteger().value_or(0);
+        if (P.first == "total")
+          R.TotalQueries = N;
+        else
+          R.Queries[P.first.str()] = N;
+      }
+    }
+    R.UnansweredQueries = getInt(*O, "unanswered_queries");
+    R.GuessesGenerated = getInt(*O, "guesses_generated");
+    R.GuessesPruned = getInt(*O, "guesses_pruned");
+    Results.push_back(std::move(R));
+  }
+  return true;
+}
+
+std::string formatChange(uint64_t Old, uint64_t New) {
+  std::string Str;
+  raw_string_ostream OS(Str);
+  OS << Old << " -> " << New;
+  if (Old)
+    OS << format(" (%+.1f%%)", (double(New) - double(Old)) * 100 / Old);
+  return OS.str();
+}
+
+// Prints the differences between the baseline and this run and returns
+// whether synthesis found a different RHS for any LHS, or the corpus changed.
+bool compareResults(raw_ostream &Out, const std::vector<LHSResult> &Baseline,
+                    const std::vector<LHSResult> &Results) {
+  std::map<std::string, const LHSResult *> Old;
+  for (const auto &R : Baseline)
+    Old[R.Name] = &R;
+
+  auto Oneline = [](StringRef RHS) {
+    if (RHS.empty())
+      return std::string("none");
+    std::string Str = RHS.str();
+    std::replace(Str.begin(), Str.end(), '\n', ';');
+    return Str;
+  };
+  auto IsSignificant = [](uint64_t Old, uint64_t New, uint64_t MinDiff) {
+    uint64_t Diff = New > Old ? New - Old : Old - New;
+    return Diff >= MinDiff && Diff * 100 > uint64_t(Tolerance) * Old;
+  };
+
+  bool Changed = false;
+  uint64_t OldTotals[4] = {0}, NewTotals[4] = {0};
+  for (const auto &R : Results) {
+    auto It = Old.find(R.Name);
+    if (It == Old.end()) {
+      Out << R.Name << ": not in the baseline\n";
+      Changed = true;
+      continue;
+    }
+    const LHSResult &B = *It->second;
+    Old.erase(It);
+
+    if (R.RHS != B.RHS) {
+      Out << R.Name << ": RHS changed from " << Oneline(B.RHS) << " to "
+          << Oneline(R.RHS) << '\n';
+      Changed = true;
+    }
+    auto Count = [&](StringRef What, uint64_t OldN, uint64_t NewN) {
+      if (OldN != NewN)
+        Out << R.Name << ": " << What << ' ' << formatChange(OldN, NewN)
+            << '\n';
+    };
+    Count("solver queries", B.TotalQueries, R.TotalQueries);
+    std::set<std::string> Methods;
+    for (const auto &Q : B.Queries)
+      Methods.insert(Q.first);
+    for (const auto &Q : R.Queries)
+      Methods.insert(Q.first);
+    for (const auto &M : Methods) {
+      auto OldQ = B.Queries.find(M), NewQ = R.Queries.find(M);
+      Count("  " + M, OldQ == B.Queries.end() ? 0 : OldQ->second,
+            NewQ == R.Queries.end() ? 0 : NewQ->second);
+    }
+    Count("guesses generated", B.GuessesGenerated, R.GuessesGenerated);
+    Count("guesses pruned", B.GuessesPruned, R.GuessesPruned);
+    if (IsSignificant(B.WallMicros, R.WallMicros, /*MinDiff=*/1000))
+      Out << R.Name << ": wall time (us) "
+          << formatChange(B.WallMicros, R.WallMicros) << '\n';
+    if (IsSignificant(B.PeakRSSKB, R.PeakRSSKB, /*MinDiff=*/1024))
+      Out << R.Name << ": peak RSS (KB) "
+          << formatChange(B.PeakRSSKB, R.PeakRSSKB) << '\n';
+
+    uint64_t OldValues[] = {B.TotalQueries, B.GuessesGenerated,
+                            B.GuessesPruned, B.WallMicros};
+    uint64_t NewValues[] = {R.TotalQueries, R.GuessesGenerated,
+                            R.GuessesPruned, R.WallMicros};
+    for (unsigned I = 0; I != 4; ++I) {
+      OldTotals[I] += OldValues[I];
+      NewTotals[I] += NewValues[I];
+    }
+  }
+  for (const auto &P : Old) {
+    Out << P.first << ": missing from this run\n";
+    Changed = true;
+  }
+
+  const char *Names[] = {"solver queries", "guesses generated",
+                         "guesses pruned", "wall time (us)"};
+  Out << "total:\n";
+  for (unsigned I = 0; I != 4; ++I)
+    Out << "  " << Names[I] << ' ' << formatChange(OldTotals[I], NewTotals[I])
+        << '\n';
+  return Changed;
+}
+
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Souper synthesis benchmark\n");
+  EnableStatistics(/*DoPrintOnExit=*/false);
+
+  if (Record && QueryLogFilename.empty()) {
+    errs() << "-record needs -query-log\n";
+    return 1;
+  }
+
+  QueryLog Log;
+  if (!QueryLogFilename.empty()) {
+    std::string ErrStr;
+    if (std::error_code EC = Log.load(QueryLogFilename, ErrStr)) {
+      errs() << (ErrStr.empty() ? QueryLogFilename + ": " + EC.message() :
+                                  ErrStr) << '\n';
+      return 1;
+    }
+  }
+
+  // No caches: every LHS asks the replaying solver all of its queries.
+  size_t LogSize = Log.size();
+  std::unique_ptr<Solver> S = createBaseSolver(
+    createReplayingSolver(Log, Record ? GetUnderlyingSolver() : nullptr),
+    SolverTimeout);
+
+  std::vector<LHSResult> Results;
+  if (!runCorpus(S.get(), Results))
+    return 1;
+
+  if (Record && Log.size() != LogSize) {
+    if (std::error_code EC = Log.save(QueryLogFilename)) {
+      errs() << QueryLogFilename << ": " << EC.message() << '\n';
+      return 1;
+    }
+    errs() << "recorded " << Log.size() - LogSize << " queries\n";
+  }
+
+  auto WriteResults = [&Results](StringRef Filename) {
+    std::error_code EC;
+    raw_fd_ostream Out(Filename, EC, sys::fs::OF_Text);
+    if (EC) {
+      errs() << Filename << ": " << EC.message() << '\n';
+      return false;
+    }
+    printResults(Out, Results);
+    return true;
+  };
+  if (!OutputFilename.empty() && !WriteResults(OutputFilename))
+    return 1;
+  if (UpdateBaseline) {
+    if (BaselineFilename.empty()) {
+      errs() << "-update-baseline needs -baseline\n";
+      return 1;
+    }
+    if (!WriteResults(BaselineFilename))
+      return 1;
+  }
+
+  int Ret = 0;
+  uint64_t Unanswered = 0;
+  for (const auto &R : Results)
+    Unanswered += R.UnansweredQueries;
+  if (Unanswered) {
+    errs() << Unanswered << " solver queries are missing from the query log; "
+              "rerun with -record\n";
+    Ret = 1;
+  }
+
+  if (!BaselineFilename.empty() && !UpdateBaseline) {
+    std::vector<LHSResult> Baseline;
+    if (!readResults(BaselineFilename, Baseline))
+      return 1;
+    if (compareResults(outs(), Baseline, Results))
+      Ret = 1;
+  }
+  return Ret;
+}
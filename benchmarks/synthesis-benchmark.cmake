@@ -0,0 +1,26 @@
+# Runs the synthesis benchmark of 'make synthesis-benchmark'. It fails if
+# the baseline or the query log is missing; 'make synthesis-benchmark-update'
+# creates them, and both are meant to be committed.
+#
+# Usage: cmake -DBENCHMARK=<souper_synthesis_benchmark> -DSOURCE_DIR=<dir>
+#              -DOUTPUT=<results file> -P synthesis-benchmark.cmake
+
+set(BASELINE ${SOURCE_DIR}/benchmarks/synthesis-baseline.json)
+set(QUERY_LOG ${SOURCE_DIR}/benchmarks/synthesis-queries.log)
+
+foreach(FILE ${BASELINE} ${QUERY_LOG})
+  if(NOT EXISTS ${FILE})
+    message(FATAL_ERROR "The synthesis benchmark cannot run: ${FILE} does "
+                        "not exist; run 'make synthesis-benchmark-update' to "
+                        "create it")
+  endif()
+endforeach()
+
+execute_process(
+  COMMAND ${BENCHMARK} @${SOURCE_DIR}/benchmarks/synthesis.rsp
+          -query-log=${QUERY_LOG} -baseline=${BASELINE} -o ${OUTPUT}
+  WORKING_DIRECTORY ${SOURCE_DIR}
+  RESULT_VARIABLE RESULT)
+if(NOT RESULT EQUAL 0)
+  message(FATAL_ERROR "The synthesis benchmark failed")
+endif()
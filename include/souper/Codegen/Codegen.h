@@ -24,9 +24,18 @@
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Verifier.h"
 #include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "llvm/Support/MemoryBuffer.h"
 
+namespace llvm {
+class TargetMachine;
+}
+
 namespace souper {
 
 class Codegen {
@@ -37,20 +46,33 @@ class Codegen {
 
   llvm::Instruction *ReplacedInst;
   const std::map<Inst *, llvm::Value *> &ReplacedValues;
+  std::map<Inst *, llvm::Value *> *Generated;
+  llvm::Instruction *InsertPt = nullptr;
+
+  llvm::Value *generate(Inst *I);
 
 public:
+  // New code is inserted after ReplacedInst and the PHI nodes that follow
+  // it. Generated, if not null, maps Insts to the code generated for them
+  // by earlier Codegens in the same function; that code is reused where it
+  // dominates the new code, and the new code is added to the map.
   Codegen(llvm::LLVMContext &Context_, llvm::Module *M_,
           llvm::IRBuilder<> &Builder_, llvm::DominatorTree *DT_,
           llvm::Instruction *ReplacedInst_,
-          const std::map<Inst *, llvm::Value *> &ReplacedValues_)
-      : Context(Context_), M(M_), Builder(Builder_), DT(DT_),
-        ReplacedInst(ReplacedInst_), ReplacedValues(ReplacedValues_) {}
+          const std::map<Inst *, llvm::Value *> &ReplacedValues_,
+          std::map<Inst *, llvm::Value *> *Generated_ = nullptr);
 
   static llvm::Type *GetInstReturnType(llvm::LLVMContext &Context, Inst *I);
 
   llvm::Value *getValue(Inst *I);
 };
 
+// Add a function called Name that returns the value of I, with one argument
+// per variable of I, to Module. If the function is broken, a message is
+// written to errs() and null is returned.
+llvm::Function *genFunction(InstContext &IC, Inst *I, llvm::Module &Module,
+                            llvm::StringRef Name);
+
 // If there are no errors, the function returns false. If an error is found,
 // a message describing the error is written to OS (if non-null) and true is
 // returned.
@@ -60,8 +82,48 @@ struct BackendCost {
   std::vector<int> C;
 };
 
-  // void getBackendCost(InstContext &IC, Inst *I, BackendCost &BC);
- 
+/// Measures the size of the code that LLVM's backends generate for Insts,
+/// once per target. The targets and their TargetMachines are set up once,
+/// and costs are cached by the structural key of the Inst, so that the model
+/// is cheap enough to rank the results of synthesis.
+class BackendCostModel {
+public:
+  struct Target {
+    std::string Triple, CPU;
+  };
+
+  /// Use those of the default targets, Skylake and Apple A12, that LLVM
+  /// was built with.
+  BackendCostModel();
+  explicit BackendCostModel(std::vector<Target> Targets);
+  ~BackendCostModel();
+
+  /// Set Costs to the costs of Is, with one entry per target in each.
+  /// Insts that are not cached are lowered together, into one module that
+  /// each target compiles from its own copy, in parallel.
+  void getCosts(InstContext &IC, const std::vector<Inst *> &Is,
+                std::vector<BackendCost> &Costs);
+
+  BackendCost getCost(InstContext &IC, Inst *I);
+
+  unsigned getNumTargets() const { return Targets.size(); }
+  const std::vector<Target> &getTargets() const { return Targets; }
+
+  /// Number of costs computed and of those found in the cache.
+  unsigned Lookups = 0;
+  unsigned Hits = 0;
+
+private:
+  std::vector<Target> Targets;
+  std::vector<std::unique_ptr<llvm::TargetMachine>> Machines;
+  std::mutex MachineMutex;
+  std::mutex CacheMutex;
+  std::unordered_map<std::string, BackendCost> Cache;
+
+  std::vector<int> measure(unsigned T, llvm::StringRef Bitcode,
+                           unsigned NumFunctions);
+};
+
 bool compareCosts(const BackendCost &C1, const BackendCost &C2);
 
 } // namespace souper
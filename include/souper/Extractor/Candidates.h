@@ -71,6 +71,9 @@ struct BlockCandidateSet {
 
 struct FunctionCandidateSet {
   std::vector<std::unique_ptr<BlockCandidateSet>> Blocks;
+
+  /// Number of candidates rejected by the -souper-harvest-* filters.
+  unsigned Skipped = 0;
 };
 
 struct ExprBuilderOptions {
@@ -99,6 +102,10 @@ struct ExprBuilderContext {
   std::map<llvm::BasicBlock *, BlockInfo> BlockMap;
 };
 
+/// Return false if F certainly has no candidates. This only looks at the
+/// instructions of F, so it is much cheaper than extracting candidates.
+bool MayHaveCandidates(const llvm::Function &F);
+
 FunctionCandidateSet ExtractCandidatesFromPass(
     llvm::Function *F, const llvm::LoopInfo *LI, llvm::DemandedBits *DB,
     llvm::LazyValueInfo *LVI, llvm::ScalarEvolution *SE,
@@ -38,9 +38,18 @@ class ExprBuilder {
 
   std::map<Block *, BlockPCPredMap> BlockPCMap;
   const unsigned MAX_PHI_DEPTH = 25;
+
+  // A builder may be reused for many queries that share an LHS, PCs and
+  // BPCs, e.g. while checking RHS guesses during synthesis. These caches
+  // keep the parts of the candidate that don't depend on the RHS.
+  std::map<Inst *, Inst *> UBInstConditionCache;
+  std::map<Inst *, Inst *> BlockPCCache;
+  std::map<Inst *, std::vector<Inst *>> VarInstCache;
+  BlockPCs CachedBPCs;
 public:
   enum Builder {
-    KLEE
+    KLEE,
+    SMTLIB2
   };
 
   ExprBuilder(InstContext &IC) : LIC(&IC) {}
@@ -80,11 +89,18 @@ protected:
   void setBlockPCMap(const BlockPCs &BPCs);
 
   Inst *getBlockPCs(Inst *Root);
-  std::map<Inst *, Inst *> getUBInstConstraints(Inst *Root);
+  Inst *getBlockPCsPaths(Inst *Root);
+  Inst *getUBInstConditionPaths(Inst *Root);
+  std::map<Inst *, Inst *> getPathGuards(Inst *Root);
+  Inst *getUBInstConditionLinear(Inst *Root);
+  Inst *getBlockPCsLinear(Inst *Root);
+  std::map<Inst *, Inst *, InstIdLess> getUBInstConstraints(Inst *Root);
   std::vector<Inst *> getUBPathInsts(Inst *Root);
   std::vector<Inst *> getVarInsts(const std::vector<Inst *> Insts);
   Inst *getExtractInst(Inst *I, unsigned Offset, unsigned W);
   Inst *getImpliesInst(Inst *Ante, Inst *I);
+  Inst *getAndInst(Inst *L, Inst *R);
+  Inst *getOrInst(Inst *L, Inst *R);
 
   Inst *addnswUB(Inst *I);
   Inst *addnuwUB(Inst *I);
@@ -113,6 +129,9 @@ std::string BuildQuery(InstContext &IC, const BlockPCs &BPCs,
        bool DropUB=false);
 
 std::unique_ptr<ExprBuilder> createKLEEBuilder(InstContext &IC);
+std::unique_ptr<ExprBuilder> createSMTLIBBuilder(InstContext &IC);
+// Create the builder selected by -souper-smt-expr-builder.
+std::unique_ptr<ExprBuilder> createExprBuilder(InstContext &IC);
 Inst *getUBInstCondition(InstContext &IC, Inst *Root);
 }
 
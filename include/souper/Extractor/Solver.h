@@ -100,6 +100,8 @@ std::unique_ptr<Solver> createMemCachingSolver(
     std::unique_ptr<Solver> UnderlyingSolver);
 std::unique_ptr<Solver> createExternalCachingSolver(
     std::unique_ptr<Solver> UnderlyingSolver, KVStore *KV);
+std::unique_ptr<Solver> createSlicingSolver(
+    std::unique_ptr<Solver> UnderlyingSolver);
 
 }
 
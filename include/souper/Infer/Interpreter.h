@@ -91,6 +91,8 @@ struct EvalValue {
 
 using ValueCache = std::unordered_map<souper::Inst *, EvalValue>;
 using BlockCache = std::unordered_set<souper::Block *>;
+// Values of variables for a batch of inputs, one per input.
+using BatchInputs = std::unordered_map<souper::Inst *, std::vector<llvm::APInt>>;
 
 EvalValue evaluateAddNSW(llvm::APInt A, llvm::APInt B);
 EvalValue evaluateAddNUW(llvm::APInt A, llvm::APInt B);
@@ -113,6 +115,7 @@ EvalValue evaluateAShr(llvm::APInt A, llvm::APInt B);
     bool CacheWritable = false;
     bool EvalPhiFirstBranch = false;
     EvalValue evaluateSingleInst(Inst *I, std::vector<EvalValue> &Args);
+    friend class BatchInterpreter;
 
   public:
     ConcreteInterpreter() {}
@@ -126,6 +129,24 @@ EvalValue evaluateAShr(llvm::APInt A, llvm::APInt B);
     EvalValue evaluateInst(Inst *Root);
   };
 
+  // Evaluates the DAGs of Roots for a batch of inputs at a time. Each
+  // instruction is evaluated for all inputs of the batch before the next
+  // one, and instructions shared by the DAGs are evaluated once per input.
+  class BatchInterpreter {
+    ConcreteInterpreter CI;
+    // The instructions of the DAGs, operands first, and the positions of
+    // their operands in this order.
+    std::vector<Inst *> Order;
+    std::vector<std::vector<unsigned>> OpIndices;
+    std::vector<unsigned> RootIndices;
+
+  public:
+    BatchInterpreter(const std::vector<Inst *> &Roots);
+    // Evaluates the first N inputs. Results gets the N values of each root.
+    void evaluate(const BatchInputs &Inputs, size_t N,
+                  std::vector<std::vector<EvalValue>> &Results);
+  };
+
 }
 
 
@@ -67,6 +67,10 @@ private:
   PruneFunc DataflowPrune;
   unsigned NumPruned;
   unsigned TotalGuesses;
+  // Names the variables that stand in for holes in solver queries. It is
+  // not global so that the queries of an LHS do not depend on the ones
+  // before it.
+  unsigned NumDummies = 0;
   int StatsLevel;
   std::vector<ValueCache> InputVals;
   std::vector<Inst *> &InputVars;
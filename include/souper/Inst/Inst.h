@@ -23,6 +23,7 @@
 
 #include "souper/SMTLIB2/Solver.h"
 
+#include <cstdint>
 #include <map>
 #include <memory>
 #include <set>
@@ -34,6 +35,12 @@ namespace souper {
 
 enum class HarvestType { HarvestedFromDef, HarvestedFromUse };
 
+/// What cost() measures. Default is the hand-written cost of each kind
+/// (Inst::getCost); the others come from the per-kind and per-width tables
+/// that gen-cost-table derives from LLVM's scheduling models, for the CPU
+/// given by -souper-cost-cpu.
+enum class CostMetric { Default, Latency, Throughput, UOps };
+
 const unsigned MaxPreds = 100000;
 extern const std::string ReservedConstPrefix;
 extern const std::string ReservedInstPrefix;
@@ -130,6 +137,9 @@ struct Inst : llvm::FoldingSetNode {
 
   Kind K;
   unsigned Number;
+  // Increases with every Inst created in the process; unlike the address of
+  // an Inst it does not depend on what was allocated before it.
+  uint64_t Id = getNextId();
   unsigned Width;
   Block *B;
   bool Available = true;
@@ -150,6 +160,7 @@ struct Inst : llvm::FoldingSetNode {
   void Print();
 #endif
 
+  static uint64_t getNextId();
   static const char *getKindName(Kind K);
   static std::string getKnownBitsString(llvm::APInt Zero, llvm::APInt One);
   static std::string getMoreKnownBitsString(bool NonZero, bool NonNegative,
@@ -170,6 +181,10 @@ struct Inst : llvm::FoldingSetNode {
   static bool isShift(Kind K);
   static bool isDivRem(Kind K);
   static int getCost(Kind K);
+  /// The cost of an instruction of kind K whose operands, or for a
+  /// comparison whose inputs, are Width bits wide. Kinds missing from the
+  /// table cost their getCost(K) times an add of that width.
+  static int getCost(Kind K, unsigned Width, CostMetric Metric);
   llvm::APInt KnownZeros;
   llvm::APInt KnownOnes;
   bool NonZero;
@@ -179,8 +194,8 @@ struct Inst : llvm::FoldingSetNode {
   unsigned NumSignBits;
   llvm::APInt DemandedBits;
   unsigned SynthesisConstID;
-  HarvestType HarvestKind;
-  llvm::BasicBlock* HarvestFrom;
+  HarvestType HarvestKind = HarvestType::HarvestedFromDef;
+  llvm::BasicBlock* HarvestFrom = nullptr;
   llvm::ConstantRange Range=llvm::ConstantRange(1, true);
   std::vector<llvm::ConstantRange> RangeRefinement;
   int nReservedConsts = -1;
@@ -231,6 +246,15 @@ public:
   bool empty();
 };
 
+/// Orders Insts by when they were created. Sets and maps of Insts that are
+/// iterated while building solver queries use it, so that the same input
+/// produces the same queries on every run.
+struct InstIdLess {
+  bool operator()(const Inst *A, const Inst *B) const {
+    return A->Id < B->Id;
+  }
+};
+
 class InstContext {
   typedef llvm::DenseMap<unsigned, std::vector<std::unique_ptr<Block>>>
       BlockMap;
@@ -243,6 +267,8 @@ class InstContext {
   llvm::FoldingSet<Inst> InstSet;
   unsigned ReservedConstCounter = 0;
 
+  std::vector<std::pair<Inst *, Block *>> CreationOrder;
+
 public:
   Inst *getConst(const llvm::APInt &I);
   Inst *getUntypedConst(const llvm::APInt &I);
@@ -270,6 +296,13 @@ public:
 
   std::vector<Inst *> getVariables() const;
   std::vector<Inst *> getVariablesFor(Inst *Root) const;
+
+  /// The variables and blocks created so far, in order of creation. Each
+  /// entry holds either a variable or a block; a block comes right before
+  /// the variables of its predecessors.
+  const std::vector<std::pair<Inst *, Block *>> &getCreationOrder() const {
+    return CreationOrder;
+  }
 };
 
 struct SynthesisContext {
@@ -283,7 +316,9 @@ struct SynthesisContext {
   unsigned Timeout;
 };
 
+/// The cost of I under the metric given by -souper-cost-metric.
 int cost(Inst *I, bool IgnoreDepsWithExternalUses = false);
+int cost(Inst *I, CostMetric Metric, bool IgnoreDepsWithExternalUses = false);
 int backendCost(Inst *I, bool IgnoreDepsWithExternalUses = false);
 int countHelper(Inst *I, std::set<Inst *> &Visited);
 int instCount(Inst *I);
@@ -304,13 +339,19 @@ std::string GetReplacementLHSString(const BlockPCs &BPCs,
                                     const std::vector<InstMapping> &PCs,
                                     Inst *LHS, ReplacementContext &Context,
                                     bool printNames = false);
+/// Return a compact binary key for the replacement LHS. Two keys are equal
+/// exactly when GetReplacementLHSString prints the LHSs identically, but
+/// the key is much cheaper to compute.
+std::string GetReplacementLHSKey(const BlockPCs &BPCs,
+                                 const std::vector<InstMapping> &PCs,
+                                 Inst *LHS);
 void PrintReplacementRHS(llvm::raw_ostream &Out, Inst *RHS,
                          ReplacementContext &Context,
                          bool printNames = false);
 std::string GetReplacementRHSString(Inst *RHS, ReplacementContext &Context,
                                     bool printNames = false);
 
-void findCands(Inst *Root, std::set<Inst *> &Guesses,
+void findCands(Inst *Root, std::set<Inst *, InstIdLess> &Guesses,
                bool WidthMustMatch, bool FilterVars, int Max);
 
 Inst *getInstCopy(Inst *I, InstContext &IC,
@@ -348,6 +389,15 @@ void separatePCs(const std::vector<InstMapping> &PCs,
 
 std::vector<Block *> getBlocksFromPhis(Inst *I);
 
+// Keep only the path conditions and block path conditions that are
+// transitively connected to one of the Roots through shared variables or
+// phi blocks; the others cannot influence the value of the Roots.
+void slicePathConditions(const std::vector<Inst *> &Roots,
+                         const BlockPCs &BPCs,
+                         const std::vector<InstMapping> &PCs,
+                         BlockPCs &SlicedBPCs,
+                         std::vector<InstMapping> &SlicedPCs);
+
 }
 
 #endif  // SOUPER_INST_INST_H
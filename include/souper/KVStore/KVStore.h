@@ -15,8 +15,12 @@
 #ifndef SOUPER_KVSTORE_KVSTORE_H
 #define SOUPER_KVSTORE_KVSTORE_H
 
+#include "llvm/ADT/STLFunctionalExtras.h"
 #include "llvm/ADT/StringRef.h"
+#include <cstdint>
+#include <map>
 #include <memory>
+#include <string>
 
 namespace souper {
 
@@ -26,9 +30,13 @@ class KVStore {
 public:
   KVStore();
   ~KVStore();
-  void hIncrBy(llvm::StringRef Key, llvm::StringRef Field, int Incr);
+  void hIncrBy(llvm::StringRef Key, llvm::StringRef Field, int64_t Incr);
   bool hGet(llvm::StringRef Key, llvm::StringRef Field, std::string &Value);
   void hSet(llvm::StringRef Key, llvm::StringRef Field, llvm::StringRef Value);
+  void hGetAll(llvm::StringRef Key, std::map<std::string, std::string> &Fields);
+  // Calls F on every key, a batch of keys at a time, without loading all of
+  // them first. A key may be seen more than once.
+  void scan(llvm::function_ref<void(llvm::StringRef Key)> F);
 };
 
 }
@@ -18,7 +18,10 @@
 #include "llvm/ADT/APInt.h"
 #include "llvm/ADT/StringRef.h"
 #include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <system_error>
 #include <vector>
 
@@ -44,6 +47,42 @@ SolverProgram makeInternalSolverProgram(int MainPtr(int argc, char **argv));
 
 std::unique_ptr<SMTLIBSolver> createZ3Solver(SolverProgram Prog, bool Keep);
 
+/// The number of queries that the current thread has run an SMT solver on.
+/// Answers from caches and remote solvers are not counted.
+unsigned long &threadQueryCount();
+
+/// Answers of an SMT solver, keyed by a hash of the query and the number of
+/// models asked for. The file format has one answer per line:
+///   <sha1 of query> <number of models> sat [<width>:<hex value>...]
+///   <sha1 of query> <number of models> unsat|timeout|error
+class QueryLog {
+public:
+  struct Answer {
+    enum { Sat, Unsat, Timeout, Error } Kind;
+    std::vector<llvm::APInt> Models;
+  };
+
+  /// Adds the answers in Filename. A missing file is an empty log.
+  std::error_code load(llvm::StringRef Filename, std::string &ErrStr);
+  std::error_code save(llvm::StringRef Filename) const;
+
+  bool lookup(llvm::StringRef Query, unsigned NumModels, Answer &A) const;
+  void insert(llvm::StringRef Query, unsigned NumModels, const Answer &A);
+  size_t size() const;
+
+private:
+  static std::string getKey(llvm::StringRef Query, unsigned NumModels);
+
+  mutable std::mutex Mutex;
+  std::map<std::string, Answer> Answers;
+};
+
+/// Answers queries from Log instead of running a solver, which makes runs
+/// deterministic and fast. Queries missing from Log are passed to S, if
+/// there is one, and its answers are added to Log; without S they fail.
+std::unique_ptr<SMTLIBSolver>
+createReplayingSolver(QueryLog &Log, std::unique_ptr<SMTLIBSolver> S);
+
 }
 
 #endif // SOUPER_SMTLIB2_SOLVER_H
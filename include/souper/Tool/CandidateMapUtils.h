@@ -21,26 +21,133 @@
 #include "souper/Extractor/Solver.h"
 #include "souper/KVStore/KVStore.h"
 
+#include <chrono>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 namespace llvm {
 
+class BlockFrequencyInfo;
+class Function;
+class Instruction;
 class Module;
 
 }
 
 namespace souper {
 
+class FunctionCache;
 class Solver;
 
-typedef std::vector<CandidateReplacement> CandidateMap;
+/// The orders in which -souper-candidate-order solves candidates.
+enum class CandidateOrderKind { Extraction, Static, Dynamic };
+
+/// The candidates extracted from a module. Candidates with structurally
+/// identical LHS, PCs and BPCs, up to the numbering of variables and
+/// blocks, are merged into a single entry that records the origins of all
+/// of them, so that each distinct candidate is solved only once.
+class CandidateMap {
+  std::vector<CandidateReplacement> Entries;
+  std::vector<std::vector<llvm::Instruction *>> Origins;
+  std::unordered_map<std::string, unsigned> Index;
+  unsigned NumCandidates = 0;
+
+public:
+  typedef std::vector<CandidateReplacement>::iterator iterator;
+  typedef std::vector<CandidateReplacement>::const_iterator const_iterator;
+
+  /// Add CR, returning false if it was merged into an existing entry.
+  bool add(const CandidateReplacement &CR);
+
+  iterator begin() { return Entries.begin(); }
+  iterator end() { return Entries.end(); }
+  const_iterator begin() const { return Entries.begin(); }
+  const_iterator end() const { return Entries.end(); }
+  unsigned size() const { return Entries.size(); }
+  bool empty() const { return Entries.empty(); }
+  CandidateReplacement &operator[](unsigned I) { return Entries[I]; }
+  const CandidateReplacement &operator[](unsigned I) const {
+    return Entries[I];
+  }
+
+  /// Return the origins of the candidates merged into entry I, starting
+  /// with the origin of the entry itself.
+  const std::vector<llvm::Instruction *> &getOrigins(unsigned I) const {
+    return Origins[I];
+  }
+  /// Return the number of candidates merged into entry I.
+  unsigned getProfile(unsigned I) const { return Origins[I].size(); }
+  /// Return the number of candidates added, including duplicates.
+  unsigned getNumCandidates() const { return NumCandidates; }
+};
 
 void AddToCandidateMap(CandidateMap &M, const CandidateReplacement &CR);
 
+struct ExtractionStats {
+  unsigned Threads = 1;
+  unsigned Functions = 0;
+  /// Candidates rejected by the harvesting filters.
+  unsigned Skipped = 0;
+  /// Elapsed time of the whole extraction.
+  double WallSeconds = 0;
+  /// Time spent extracting individual functions, summed over all threads:
+  /// the estimate of a serial extraction that speedups are measured against.
+  double FunctionSeconds = 0;
+};
+
+/// Extract the candidates of every function of M into CandMap. With more
+/// than one thread, functions are extracted concurrently from private
+/// copies of the module and then moved into IC in function order, so the
+/// resulting map does not depend on the number of threads. Functions found
+/// in FC are not extracted; their cached candidates are used instead.
 void AddModuleToCandidateMap(InstContext &IC, ExprBuilderContext &EBC,
-                             CandidateMap &CandMap, llvm::Module *M);
+                             CandidateMap &CandMap, llvm::Module *M,
+                             unsigned Threads = 1,
+                             ExtractionStats *Stats = nullptr,
+                             FunctionCache *FC = nullptr);
+
+/// Tracks the time spent solving candidates against -souper-solve-budget,
+/// and against -souper-function-budget and -souper-candidate-budget.
+class SolvingBudget {
+  std::chrono::steady_clock::time_point Start, FunctionStart;
+  bool InFunction = false;
+
+public:
+  SolvingBudget() : Start(std::chrono::steady_clock::now()) {}
+  /// Return true once the budget is used up; never true without a budget.
+  bool exhausted() const;
+
+  /// Start the budget of the next function.
+  void startFunction();
+  /// Return true once the budget of the current function, or the overall
+  /// budget, is used up.
+  bool functionExhausted() const;
+  /// Return the time by which a candidate whose solving starts now must be
+  /// solved, to be passed to a CancellationToken.
+  std::chrono::steady_clock::time_point candidateDeadline() const;
+};
+
+/// Return the indices of the entries of M in the order in which they
+/// should be solved, according to -souper-candidate-order: in extraction
+/// order, or hottest first, weighting the origins of each entry by their
+/// static block frequency or by the dynamic profile counts that the
+/// profiling runtime recorded in KV. GetBFI, if given, provides the block
+/// frequencies of a function instead of computing them.
+std::vector<unsigned> GetSolvingOrder(
+    CandidateMap &M, KVStore *KV,
+    std::function<llvm::BlockFrequencyInfo *(llvm::Function &)> GetBFI =
+      nullptr);
 
+/// Solve and print the candidates of M, in the order given by
+/// GetSolvingOrder and until the solving budget is used up. With FC, the
+/// cached results of reused functions are printed without querying the
+/// solver, and the results of the other functions are stored in FC.
 bool SolveCandidateMap(llvm::raw_ostream &OS, CandidateMap &M,
                        Solver *Solver, InstContext &IC,
-                       KVStore *KVForStaticProfile);
+                       KVStore *KVForStaticProfile,
+                       FunctionCache *FC = nullptr);
 
 bool CheckCandidateMap(llvm::Module &Mod, CandidateMap &M, Solver *S,
                        InstContext &IC);
@@ -0,0 +1,71 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SOUPER_TOOL_FUNCTIONCACHE_H
+#define SOUPER_TOOL_FUNCTIONCACHE_H
+
+#include "llvm/ADT/StringRef.h"
+#include "souper/KVStore/KVStore.h"
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+
+class Function;
+
+}
+
+namespace souper {
+
+/// Persistent per-function results, keyed by a hash of the function's IR
+/// and of the souper configuration, so that functions that did not change
+/// since a previous run can skip extraction and solving.
+class FunctionCache {
+  std::string Config;
+
+public:
+  FunctionCache(llvm::StringRef Config) : Config(Config) {}
+  virtual ~FunctionCache();
+
+  /// Return a key for F that ignores the numbering of metadata and
+  /// attribute groups, which depends on the rest of the module.
+  std::string getKey(const llvm::Function &F) const;
+
+  virtual bool get(const std::string &Key, std::string &Value) = 0;
+  virtual void set(const std::string &Key, llvm::StringRef Value) = 0;
+
+  /// Number of functions looked up and of those found in the cache.
+  unsigned Lookups = 0;
+  unsigned Reused = 0;
+
+  /// Solver results of the candidates of reused functions, indexed by the
+  /// replacement LHS string; an empty string means no RHS was found.
+  std::unordered_map<std::string, std::string> Results;
+
+  /// Functions that were extracted in this run, with their keys, whose
+  /// results should be stored once they have been solved.
+  std::vector<std::pair<llvm::Function *, std::string>> Pending;
+};
+
+std::unique_ptr<FunctionCache> createKVFunctionCache(KVStore *KV,
+                                                     llvm::StringRef Config);
+std::unique_ptr<FunctionCache> createDiskFunctionCache(llvm::StringRef Dir,
+                                                       llvm::StringRef Config);
+
+}
+
+#endif  // SOUPER_TOOL_FUNCTIONCACHE_H
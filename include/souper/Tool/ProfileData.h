@@ -0,0 +1,59 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SOUPER_TOOL_PROFILEDATA_H
+#define SOUPER_TOOL_PROFILEDATA_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <system_error>
+
+namespace souper {
+
+/// Execution counts written by the -souper-dynamic-profile runtime,
+/// indexed by replacement LHS string and by profile field ("dprofile "
+/// followed by the location of the profiled site).
+///
+/// A .souperprof file is a sequence of chunks, each appended by one run of
+/// an instrumented program. A chunk is the magic "SOUPRPF1" and a 64-bit
+/// record count, followed by the records: a 64-bit count, the 32-bit
+/// lengths of the key and of the field, and then their bytes. Integers are
+/// in host byte order.
+class ProfileData {
+public:
+  std::map<std::string, std::map<std::string, uint64_t>> Counts;
+
+  void add(llvm::StringRef Key, llvm::StringRef Field, uint64_t Count) {
+    Counts[Key.str()][Field.str()] += Count;
+  }
+
+  /// Sum of the counts of all the sites of Key.
+  uint64_t getCount(llvm::StringRef Key) const;
+
+  /// Add the counts of all the chunks of Buffer.
+  std::error_code read(llvm::StringRef Buffer);
+
+  /// Write all counts as a single chunk.
+  void write(llvm::raw_ostream &OS) const;
+};
+
+/// Add the counts of the .souperprof file at Path to Data.
+std::error_code readProfileFile(llvm::StringRef Path, ProfileData &Data);
+
+}
+
+#endif  // SOUPER_TOOL_PROFILEDATA_H
@@ -0,0 +1,66 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SOUPER_TOOL_REMOTESOLVER_H
+#define SOUPER_TOOL_REMOTESOLVER_H
+
+#include "llvm/ADT/StringRef.h"
+#include "souper/Extractor/Solver.h"
+#include <memory>
+#include <string>
+#include <system_error>
+
+namespace souper {
+
+/// Queries are sent to souper-server over a UNIX socket, one message per
+/// query and one per answer. A message is a 32-bit length in host byte
+/// order followed by that many bytes.
+///
+/// A query is a line with the command and the number of seconds the client
+/// is still willing to wait (0 for no limit), followed by the replacement
+/// in Souper's text format: an LHS for infer and the dataflow commands, an
+/// LHS and an RHS for valid. An answer is a line with "ok", "ok cached" if
+/// the server kept the answer from an earlier query, or "error" and the
+/// value of a std::errc, followed by the result.
+///
+/// A client first sends the "options" command, with the values of its
+/// solver options in place of a replacement, and the server answers with
+/// its own; the client does not use a server whose options differ.
+std::error_code readMessage(int FD, std::string &Message);
+std::error_code writeMessage(int FD, llvm::StringRef Message);
+
+/// A solver that sends its queries to the souper-server listening at Path.
+/// Options holds the values of the solver options of this process, one
+/// "name=value" line each. It returns null and sets ErrStr if it cannot
+/// connect or the server was started with other values. Queries that need
+/// more than a replacement to answer, such as inferConst() and
+/// testDemandedBits(), fail with std::errc::function_not_supported.
+std::unique_ptr<Solver> createRemoteSolver(llvm::StringRef Path,
+                                           llvm::StringRef Options,
+                                           std::string &ErrStr);
+
+/// Answer the query of a client with S. Complete, if given, is set to
+/// whether the answer holds for every client: a query that found nothing
+/// before the deadline of the client may have been cut short.
+std::string answerQuery(Solver &S, llvm::StringRef Query,
+                        bool *Complete = nullptr);
+
+/// Split an answer into its result, or return its error. Kept, if given, is
+/// set to whether the server kept the answer from an earlier query.
+std::error_code parseAnswer(llvm::StringRef Answer, std::string &Result,
+                            bool *Kept = nullptr);
+
+}
+
+#endif  // SOUPER_TOOL_REMOTESOLVER_H
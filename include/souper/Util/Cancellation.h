@@ -0,0 +1,84 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SOUPER_UTIL_CANCELLATION_H
+#define SOUPER_UTIL_CANCELLATION_H
+
+#include <atomic>
+#include <chrono>
+
+namespace souper {
+
+/// Lets the caller of a solver stop work that takes too long. The token of
+/// the current thread is checked before every SMT query; once its deadline
+/// has passed, queries fail with std::errc::timed_out without running the
+/// SMT solver.
+class CancellationToken {
+  std::chrono::steady_clock::time_point Deadline;
+  mutable std::atomic<bool> CancelledWork{false};
+
+public:
+  explicit CancellationToken(std::chrono::steady_clock::time_point Deadline =
+                               std::chrono::steady_clock::time_point::max())
+    : Deadline(Deadline) {}
+
+  bool isCancelled() const {
+    if (std::chrono::steady_clock::now() < Deadline)
+      return false;
+    CancelledWork = true;
+    return true;
+  }
+
+  /// Whether isCancelled() has returned true, i.e. whether some work was
+  /// given up. Answers that need no work, such as cache hits, never ask,
+  /// so they are complete even when they arrive after the deadline.
+  bool cancelledWork() const { return CancelledWork; }
+
+  /// Seconds left until the deadline, rounded up, or 0 if there is none.
+  unsigned remainingSeconds() const {
+    if (Deadline == std::chrono::steady_clock::time_point::max())
+      return 0;
+    auto Left = std::chrono::ceil<std::chrono::seconds>(
+      Deadline - std::chrono::steady_clock::now());
+    return Left.count() > 0 ? Left.count() : 1;
+  }
+
+  /// The token of the current thread, or null.
+  static CancellationToken *&current() {
+    static thread_local CancellationToken *Token = nullptr;
+    return Token;
+  }
+};
+
+/// Installs a token on the current thread for the lifetime of the scope.
+class CancellationScope {
+  CancellationToken *Previous;
+
+public:
+  CancellationScope(CancellationToken &Token)
+    : Previous(CancellationToken::current()) {
+    CancellationToken::current() = &Token;
+  }
+  ~CancellationScope() { CancellationToken::current() = Previous; }
+};
+
+/// Whether the work of the current thread has been cancelled.
+inline bool isCancelled() {
+  CancellationToken *Token = CancellationToken::current();
+  return Token && Token->isCancelled();
+}
+
+}
+
+#endif  // SOUPER_UTIL_CANCELLATION_H
@@ -27,6 +27,8 @@ STATISTIC(InstructionReplaced,
           "Number of instructions replaced by another instruction");
 STATISTIC(DominanceCheckFailed,
           "Number of failed replacement due to dominance check");
+STATISTIC(ValuesShared,
+          "Number of generated values shared between replacements");
 
 using namespace llvm;
 
@@ -34,6 +36,26 @@ extern unsigned DebugLevel;
 
 namespace souper {
 
+Codegen::Codegen(llvm::LLVMContext &Context_, llvm::Module *M_,
+                 llvm::IRBuilder<> &Builder_, llvm::DominatorTree *DT_,
+                 llvm::Instruction *ReplacedInst_,
+                 const std::map<Inst *, llvm::Value *> &ReplacedValues_,
+                 std::map<Inst *, llvm::Value *> *Generated_)
+    : Context(Context_), M(M_), Builder(Builder_), DT(DT_),
+      ReplacedInst(ReplacedInst_), ReplacedValues(ReplacedValues_),
+      Generated(Generated_) {
+  // PHI nodes must be the first instructions in a basic block. If we're
+  // replacing a PHI node with another instruction, make sure it comes after the
+  // other PHI nodes. All the new instructions are inserted before the same
+  // instruction, so that operands come before their users.
+  if (ReplacedInst) {
+    InsertPt = ReplacedInst->getNextNode();
+    while (isa<PHINode>(InsertPt))
+      InsertPt = InsertPt->getNextNode();
+    Builder.SetInsertPoint(InsertPt);
+  }
+}
+
 llvm::Type *Codegen::GetInstReturnType(llvm::LLVMContext &Context, Inst *I) {
   switch (I->K) {
   case Inst::SAddWithOverflow:
@@ -50,7 +72,6 @@ llvm::Type *Codegen::GetInstReturnType(llvm::LLVMContext &Context, Inst *I) {
 }
 
 llvm::Value *Codegen::getValue(Inst *I) {
-  const std::vector<Inst *> &Ops = I->orderedOps();
   if (I->K == Inst::UntypedConst) {
     // FIXME: We only get here because it is the second argument of
     // extractvalue instrs. This is not otherwise reachable.
@@ -68,6 +89,17 @@ llvm::Value *Codegen::getValue(Inst *I) {
   if (ReplacedValues.find(I) != ReplacedValues.end())
     return ReplacedValues.at(I);
 
+  if (Generated) {
+    auto It = Generated->find(I);
+    if (It != Generated->end()) {
+      auto *GI = dyn_cast<Instruction>(It->second);
+      if (!GI || !InsertPt || DT->dominates(GI, InsertPt)) {
+        ++ValuesShared;
+        return It->second;
+      }
+    }
+  }
+
   if (I->Origins.size() > 0) {
     // if there's an Origin, we're connecting to existing code
     for (auto V : I->Origins) {
@@ -94,20 +126,22 @@ llvm::Value *Codegen::getValue(Inst *I) {
   }
 
   // otherwise, recursively generate code
+  Value *V = generate(I);
+  if (V && Generated)
+    (*Generated)[I] = V;
+  return V;
+}
+
+llvm::Value *Codegen::generate(Inst *I) {
+  const std::vector<Inst *> &Ops = I->orderedOps();
+  Type *T;
+  if (I->K != Inst::ExtractValue)
+    T = Type::getIntNTy(Context, I->Width);
+
   Value *V0 = Codegen::getValue(Ops[0]);
   if (!V0)
     return nullptr;
 
-  // PHI nodes must be the first instructions in a basic block. If we're
-  // replacing a PHI node with another instruction, make sure it comes after the
-  // other PHI nodes.
-  if (ReplacedInst) {
-    Instruction *InsertPoint = ReplacedInst;
-    while (isa<PHINode>(InsertPoint->getNextNode()))
-      InsertPoint = InsertPoint->getNextNode();
-    Builder.SetInsertPoint(InsertPoint->getNextNode());
-  }
-
   switch (Ops.size()) {
   case 1: {
     switch (I->K) {
@@ -325,10 +359,8 @@ GetInputArgumentTypes(const InstContext &IC, llvm::LLVMContext &Context, Inst *R
 
   std::vector<llvm::Type *> ArgTypes;
   ArgTypes.reserve(AllVariables.size());
-  for (const Inst *const Var : AllVariables) {
-    llvm::errs() << "arg with width " << Var->Width << " and number " << Var->Number << "\n";
+  for (const Inst *const Var : AllVariables)
     ArgTypes.emplace_back(Type::getIntNTy(Context, Var->Width));
-  }
 
   return ArgTypes;
 }
@@ -344,17 +376,15 @@ static std::map<Inst *, Value *> GetArgsMapping(const InstContext &IC,
   return Args;
 };
 
-/// If there are no errors, the function returns false. If an error is found,
-/// a message describing the error is written to OS (if non-null) and true is
-/// returned.
-bool genModule(InstContext &IC, souper::Inst *I, llvm::Module &Module) {
+llvm::Function *genFunction(InstContext &IC, souper::Inst *I,
+                            llvm::Module &Module, llvm::StringRef Name) {
   llvm::LLVMContext &Context = Module.getContext();
   const std::vector<llvm::Type *> ArgTypes = GetInputArgumentTypes(IC, Context, I);
   const auto FT = llvm::FunctionType::get(
       /*Result=*/Codegen::GetInstReturnType(Context, I),
       /*Params=*/ArgTypes, /*isVarArg=*/false);
 
-  Function *F = Function::Create(FT, Function::ExternalLinkage, "fun", &Module);
+  Function *F = Function::Create(FT, Function::ExternalLinkage, Name, &Module);
 
   const std::map<Inst *, Value *> Args = GetArgsMapping(IC, F, I);
 
@@ -371,6 +401,15 @@ bool genModule(InstContext &IC, souper::Inst *I, llvm::Module &Module) {
 
   // Validate the generated code, checking for consistency.
   if (verifyFunction(*F, &llvm::errs()))
+    return nullptr;
+  return F;
+}
+
+/// If there are no errors, the function returns false. If an error is found,
+/// a message describing the error is written to OS (if non-null) and true is
+/// returned.
+bool genModule(InstContext &IC, souper::Inst *I, llvm::Module &Module) {
+  if (!genFunction(IC, I, Module, "fun"))
     return true;
   if (verifyModule(Module, &llvm::errs()))
     return true;
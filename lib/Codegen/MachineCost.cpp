@@ -15,6 +15,8 @@
 #include "souper/Codegen/Codegen.h"
 #include "souper/Inst/Inst.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
@@ -23,11 +25,12 @@
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Value.h"
 #include "llvm/MC/TargetRegistry.h"
-#include "llvm/Object/ObjectFile.h"
 #include "llvm/Passes/OptimizationLevel.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Object/ELFObjectFile.h"
 #include "llvm/Support/SmallVectorMemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
 #include <map>
@@ -59,89 +62,176 @@ void optimizeModule(llvm::Module &M) {
   MPM.run(M, MAM);
 }
 
-long getCodeSize(Module &M, TargetMachine *TM) {
-  M.setDataLayout(TM->createDataLayout());
-  SmallVector<char, 256> DotO;
-  raw_svector_ostream dest(DotO);
-
-  legacy::PassManager pass;
-  if (TM->addPassesToEmitFile(pass, dest, nullptr, CGFT_ObjectFile)) {
-    errs() << "Target machine can't emit a file of this type";
-    report_fatal_error("oops");
-  }
-  pass.run(M);
-
-  SmallVectorMemoryBuffer Buf(std::move(DotO));
-  auto ObjOrErr = object::ObjectFile::createObjectFile(Buf);
-  if (!ObjOrErr)
-    report_fatal_error("createObjectFile() failed");
-  object::ObjectFile *OF = ObjOrErr.get().get();  
-  auto SecList = OF->sections();
-  long Size = 0;
-  for (auto &S : SecList) {
-    if (S.isText())
-      Size += S.getSize();
-  }
-  if (Size > 0)
-    return Size;
-  else
-    report_fatal_error("no text segment found");
-}
-
-struct TargetInfo {
-  std::string Trip, CPU;
-};
-
-std::vector<TargetInfo> Targets {
-  { "x86_64", "skylake" },
-  { "aarch64", "apple-a12" },
-};
-
-bool Init = false;
-  
-void getBackendCost(InstContext &IC, souper::Inst *I, BackendCost &BC) {
-  // TODO is this better than just forcing all clients of this code to
-  // do the init themselves?
-  if (!Init) {
+static void initializeTargets() {
+  static std::once_flag Init;
+  std::call_once(Init, [] {
     InitializeAllTargetInfos();
     InitializeAllTargets();
     InitializeAllTargetMCs();
     InitializeAllAsmParsers();
     InitializeAllAsmPrinters();
-    Init = true;
+  });
+}
+
+static std::vector<BackendCostModel::Target> getDefaultTargets() {
+  initializeTargets();
+  const BackendCostModel::Target Defaults[] = {{"x86_64", "skylake"},
+                                               {"aarch64", "apple-a12"}};
+  std::vector<BackendCostModel::Target> Targets;
+  for (const auto &T : Defaults) {
+    std::string Error;
+    if (TargetRegistry::lookupTarget(T.Triple, Error))
+      Targets.push_back(T);
   }
+  return Targets;
+}
 
-  llvm::LLVMContext C;
-  llvm::Module M("", C);
-  if (genModule(IC, I, M))
-    llvm::report_fatal_error("codegen error in getBackendCost()");
+BackendCostModel::BackendCostModel()
+  : BackendCostModel(getDefaultTargets()) {}
 
-  optimizeModule(M);
+BackendCostModel::BackendCostModel(std::vector<Target> Targets)
+  : Targets(std::move(Targets)) {
+  initializeTargets();
 
-  llvm::errs() << M;
-  
-  BackendCost Cost;
-  for (auto &T : Targets) {
+  for (auto &T : this->Targets) {
     std::string Error;
-    auto Target = TargetRegistry::lookupTarget(T.Trip, Error);
+    auto Target = TargetRegistry::lookupTarget(T.Triple, Error);
     if (!Target) {
       errs() << Error;
       report_fatal_error("can't lookup target");
     }
-
-    auto Features = "";
     TargetOptions Opt;
     auto RM = Optional<Reloc::Model>();
-    auto TM = Target->createTargetMachine(T.Trip, T.CPU, Features, Opt, RM);
+    Machines.emplace_back(Target->createTargetMachine(T.Triple, T.CPU, "",
+                                                      Opt, RM));
+  }
+}
+
+BackendCostModel::~BackendCostModel() {}
 
-    Cost.C.push_back(getCodeSize(M, TM));
+// Lower Is, as functions fun0, fun1, ..., into a bitcode module. Lowering
+// reads the Insts and may cache things in them, so it is done once, on the
+// calling thread, and each target parses its own copy of the module.
+static SmallVector<char, 0> lowerToBitcode(InstContext &IC,
+                                           const std::vector<Inst *> &Is) {
+  llvm::LLVMContext C;
+  llvm::Module M("souper-backend-cost", C);
+  for (unsigned I = 0; I != Is.size(); ++I)
+    if (!genFunction(IC, Is[I], M, "fun" + std::to_string(I)))
+      report_fatal_error("codegen error in BackendCostModel::getCosts()");
+
+  SmallVector<char, 0> Bitcode;
+  raw_svector_ostream OS(Bitcode);
+  WriteBitcodeToFile(M, OS);
+  return Bitcode;
+}
+
+// Compile the NumFunctions functions of Bitcode for target T and return the
+// size of the code of each function.
+std::vector<int> BackendCostModel::measure(unsigned T, StringRef Bitcode,
+                                           unsigned NumFunctions) {
+  TargetMachine *TM = Machines[T].get();
+  llvm::LLVMContext C;
+  auto MOrErr =
+    parseBitcodeFile(MemoryBufferRef(Bitcode, "souper-backend-cost"), C);
+  if (!MOrErr)
+    report_fatal_error(toString(MOrErr.takeError()).c_str());
+  llvm::Module &M = **MOrErr;
+  M.setTargetTriple(TM->getTargetTriple().str());
+  M.setDataLayout(TM->createDataLayout());
+
+  optimizeModule(M);
+
+  SmallVector<char, 256> DotO;
+  raw_svector_ostream Dest(DotO);
+  legacy::PassManager PM;
+  if (TM->addPassesToEmitFile(PM, Dest, nullptr, CGFT_ObjectFile))
+    report_fatal_error("target machine can't emit an object file");
+  PM.run(M);
+
+  SmallVectorMemoryBuffer Buf(std::move(DotO));
+  auto ObjOrErr = object::ObjectFile::createObjectFile(Buf);
+  if (!ObjOrErr)
+    report_fatal_error("createObjectFile() failed");
+  // The size of each function is that of its ELF symbol, so alignment
+  // padding between the functions is not counted.
+  auto *OF = dyn_cast<object::ELFObjectFileBase>(ObjOrErr.get().get());
+  if (!OF)
+    report_fatal_error("backend costs need an ELF target");
+  std::vector<int> Sizes(NumFunctions);
+  for (const object::ELFSymbolRef &Sym : OF->symbols()) {
+    Expected<StringRef> Name = Sym.getName();
+    if (!Name) {
+      consumeError(Name.takeError());
+      continue;
+    }
+    StringRef N = *Name;
+    unsigned Idx;
+    if (N.consume_front("fun") && !N.getAsInteger(10, Idx) &&
+        Idx < NumFunctions)
+      Sizes[Idx] = Sym.getSize();
+  }
+  return Sizes;
+}
+
+void BackendCostModel::getCosts(InstContext &IC,
+                                const std::vector<Inst *> &Is,
+                                std::vector<BackendCost> &Costs) {
+  std::vector<std::string> Keys;
+  for (Inst *I : Is)
+    Keys.push_back(GetReplacementLHSKey({}, {}, I));
+
+  Costs.assign(Is.size(), BackendCost());
+  std::vector<Inst *> Missing;
+  std::unordered_map<std::string, unsigned> MissingIdx;
+  {
+    std::lock_guard<std::mutex> Lock(CacheMutex);
+    Lookups += Is.size();
+    for (unsigned I = 0; I != Is.size(); ++I) {
+      auto It = Cache.find(Keys[I]);
+      if (It != Cache.end()) {
+        ++Hits;
+        Costs[I] = It->second;
+      } else if (MissingIdx.emplace(Keys[I], Missing.size()).second) {
+        Missing.push_back(Is[I]);
+      }
+    }
+  }
+  if (Missing.empty())
+    return;
+
+  // The targets share nothing but the bitcode, which is only read. A
+  // TargetMachine must not be used by two threads at once.
+  SmallVector<char, 0> Bitcode = lowerToBitcode(IC, Missing);
+  StringRef BitcodeRef(Bitcode.data(), Bitcode.size());
+  std::vector<std::vector<int>> Sizes(Targets.size());
+  {
+    std::lock_guard<std::mutex> Lock(MachineMutex);
+    ThreadPool Pool(hardware_concurrency(Targets.size()));
+    for (unsigned T = 0; T != Targets.size(); ++T)
+      Pool.async([&, T] {
+        Sizes[T] = measure(T, BitcodeRef, Missing.size());
+      });
+    Pool.wait();
   }
 
-  llvm::errs() << "cost vector: ";
-  for (auto I : Cost.C) {
-    llvm::errs() << I << " ";
+  std::lock_guard<std::mutex> Lock(CacheMutex);
+  for (unsigned I = 0; I != Is.size(); ++I) {
+    auto It = MissingIdx.find(Keys[I]);
+    if (It == MissingIdx.end())
+      continue;
+    BackendCost &Cost = Costs[I];
+    Cost.C.clear();
+    for (unsigned T = 0; T != Targets.size(); ++T)
+      Cost.C.push_back(Sizes[T][It->second]);
+    Cache.emplace(Keys[I], Cost);
   }
-  llvm::errs() << "\n";
+}
+
+BackendCost BackendCostModel::getCost(InstContext &IC, Inst *I) {
+  std::vector<BackendCost> Costs;
+  getCosts(IC, {I}, Costs);
+  return Costs.front();
 }
 
 int threeWayCompare(int A, int B) {
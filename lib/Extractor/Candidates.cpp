@@ -15,6 +15,8 @@
 #include "souper/Extractor/Candidates.h"
 
 #include "llvm/ADT/EquivalenceClasses.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/LazyValueInfo.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/ScalarEvolution.h"
@@ -36,10 +38,21 @@
 #include <map>
 #include <memory>
 #include <sstream>
+#include <unordered_map>
 #include <unordered_set>
 #include <tuple>
 #include "llvm/Analysis/ValueTracking.h"
 
+#define DEBUG_TYPE "souper"
+STATISTIC(CandidatesTooLarge,
+          "Number of candidates skipped for exceeding -souper-harvest-max-size");
+STATISTIC(CandidatesTooDeep,
+          "Number of candidates skipped for exceeding -souper-harvest-max-depth");
+STATISTIC(CandidatesTooManyVars,
+          "Number of candidates skipped for exceeding -souper-harvest-max-vars");
+STATISTIC(CandidatesOptimal,
+          "Number of optimal candidates skipped by -souper-harvest-skip-optimal");
+
 static llvm::cl::opt<bool> ExploitBPCs(
     "souper-exploit-blockpcs",
     llvm::cl::desc("Exploit block path conditions (default=false)"),
@@ -52,6 +65,27 @@ static llvm::cl::opt<bool> HarvestUses(
     "souper-harvest-uses",
     llvm::cl::desc("Harvest operands (default=false)"),
     llvm::cl::init(false));
+static llvm::cl::opt<unsigned> HarvestMaxSize(
+    "souper-harvest-max-size",
+    llvm::cl::desc("Skip candidates with more instructions than this, "
+                   "0 for no limit (default=0)"),
+    llvm::cl::init(0));
+static llvm::cl::opt<unsigned> HarvestMaxDepth(
+    "souper-harvest-max-depth",
+    llvm::cl::desc("Skip candidates deeper than this, 0 for no limit "
+                   "(default=0)"),
+    llvm::cl::init(0));
+static llvm::cl::opt<unsigned> HarvestMaxVars(
+    "souper-harvest-max-vars",
+    llvm::cl::desc("Skip candidates with more variables than this, "
+                   "0 for no limit (default=0)"),
+    llvm::cl::init(0));
+static llvm::cl::opt<bool> HarvestSkipOptimal(
+    "souper-harvest-skip-optimal",
+    llvm::cl::desc("Skip candidates that no replacement can improve, such as "
+                   "variables that are not known to be constant "
+                   "(default=false)"),
+    llvm::cl::init(false));
 static llvm::cl::opt<bool> PrintNegAtReturn(
     "print-neg-at-return",
     llvm::cl::desc("Print negative dfa in each value returned from a function (default=false)"),
@@ -144,6 +178,13 @@ struct ExprBuilder {
   InstContext &IC;
   ExprBuilderContext &EBC;
 
+  // Blocks reachable from the entry of CyclicBlocksFn, and the subset of
+  // those that lie on a CFG cycle.
+  const Function *CyclicBlocksFn = nullptr;
+  std::unordered_set<const BasicBlock *> ReachableBlocks;
+  std::unordered_set<const BasicBlock *> CyclicBlocks;
+
+  void computeCyclicBlocks(const Function *F);
   void checkIrreducibleCFG(BasicBlock *BB,
                            BasicBlock *FirstBB,
                            std::unordered_set<const BasicBlock *> &VisitedBBs,
@@ -191,6 +232,23 @@ void ExprBuilder::checkIrreducibleCFG(BasicBlock *BB,
   }
 }
 
+// A block can reach itself iff its strongly connected component has a
+// cycle, so one walk over the SCCs of F answers the question for every
+// block reachable from the entry.
+void ExprBuilder::computeCyclicBlocks(const Function *F) {
+  CyclicBlocksFn = F;
+  ReachableBlocks.clear();
+  CyclicBlocks.clear();
+  for (auto I = scc_begin(F); !I.isAtEnd(); ++I) {
+    bool Cycle = I.hasCycle();
+    for (const BasicBlock *BB : *I) {
+      ReachableBlocks.insert(BB);
+      if (Cycle)
+        CyclicBlocks.insert(BB);
+    }
+  }
+}
+
 // Return true if the Basic Block containing the passed Phi node is
 // a loop entry point, either the loop header for a natural loop or
 // a entry point for an irreducible CFG.
@@ -203,6 +261,13 @@ bool ExprBuilder::isLoopEntryPoint(PHINode *Phi) {
   if (Phi->getNumIncomingValues() <= 1)
     return false;
 
+  if (CyclicBlocksFn != BB->getParent())
+    computeCyclicBlocks(BB->getParent());
+  if (ReachableBlocks.count(BB))
+    return CyclicBlocks.count(BB);
+
+  // Blocks that are unreachable from the entry are not covered by the SCC
+  // walk; fall back to searching for a path back to BB.
   bool Loop = false;
   std::unordered_set<const llvm::BasicBlock *> VisitedBBs;
   checkIrreducibleCFG(BB, BB, VisitedBBs, Loop);
@@ -945,6 +1010,74 @@ void PrintDataflowInfo(Function &F, Instruction &I, LazyValueInfo *LVI,
   }
 }
 
+// Walk the DAG below I, counting its instructions and variables and
+// returning its depth. The walk stops early once a limit is exceeded.
+unsigned measureCandidate(Inst *I, std::unordered_map<Inst *, unsigned> &Depth,
+                          unsigned &Size, unsigned &Vars) {
+  auto It = Depth.find(I);
+  if (It != Depth.end())
+    return It->second;
+  if (I->K == Inst::Var)
+    ++Vars;
+  else if (I->K != Inst::Const && I->K != Inst::UntypedConst)
+    ++Size;
+  unsigned D = 0;
+  if ((!HarvestMaxSize || Size <= HarvestMaxSize) &&
+      (!HarvestMaxVars || Vars <= HarvestMaxVars))
+    for (auto Op : I->Ops)
+      D = std::max(D, measureCandidate(Op, Depth, Size, Vars));
+  if (!I->Ops.empty())
+    ++D;
+  Depth[I] = D;
+  return D;
+}
+
+// Whether no replacement can be cheaper than I. Constants and variables
+// cost nothing, and a variable can only be replaced by a constant when its
+// data flow facts pin down all of its demanded bits. Path conditions are
+// not built yet and are not considered, so a few candidates that they would
+// make constant are skipped too.
+bool isKnownOptimal(Inst *I) {
+  if (I->K == Inst::Const)
+    return true;
+  if (I->K != Inst::Var)
+    return false;
+  if (I->Range.isSingleElement())
+    return false;
+  llvm::APInt Known = I->KnownZeros | I->KnownOnes | ~I->DemandedBits;
+  if (I->Width == 1 && (I->NonZero || I->NonNegative || I->Negative ||
+                        I->PowOfTwo))
+    Known.setAllBits();
+  return !Known.isAllOnesValue();
+}
+
+// Cheap filters applied before the path conditions of a candidate are
+// built, so that rejected candidates cost no more than their DAG.
+bool rejectCandidate(Inst *I) {
+  if (HarvestSkipOptimal && isKnownOptimal(I)) {
+    ++CandidatesOptimal;
+    return true;
+  }
+  if (!HarvestMaxSize && !HarvestMaxDepth && !HarvestMaxVars)
+    return false;
+  std::unordered_map<Inst *, unsigned> Depth;
+  unsigned Size = 0, Vars = 0;
+  unsigned D = measureCandidate(I, Depth, Size, Vars);
+  if (HarvestMaxSize && Size > HarvestMaxSize) {
+    ++CandidatesTooLarge;
+    return true;
+  }
+  if (HarvestMaxVars && Vars > HarvestMaxVars) {
+    ++CandidatesTooManyVars;
+    return true;
+  }
+  if (HarvestMaxDepth && D > HarvestMaxDepth) {
+    ++CandidatesTooDeep;
+    return true;
+  }
+  return false;
+}
+
 void ExtractExprCandidates(Function &F, const LoopInfo *LI, DemandedBits *DB,
                            LazyValueInfo *LVI, ScalarEvolution *SE,
                            TargetLibraryInfo *TLI,
@@ -995,6 +1128,10 @@ void ExtractExprCandidates(Function &F, const LoopInfo *LI, DemandedBits *DB,
             if (U->getType()->isIntegerTy()) {
               if(Visited.insert(U).second) {
                 Inst *In = EB.getFromUse(U);
+                if (rejectCandidate(In)) {
+                  ++Result.Skipped;
+                  continue;
+                }
                 In->HarvestKind = HarvestType::HarvestedFromUse;
                 In->HarvestFrom = &BB;
                 EB.markExternalUses(In);
@@ -1018,6 +1155,10 @@ void ExtractExprCandidates(Function &F, const LoopInfo *LI, DemandedBits *DB,
       } else {
         In = EB.get(&I);
       }
+      if (rejectCandidate(In)) {
+        ++Result.Skipped;
+        continue;
+      }
       In->HarvestKind = HarvestType::HarvestedFromDef;
       In->HarvestFrom = nullptr;
       EB.markExternalUses(In);
@@ -1087,6 +1228,20 @@ char ExtractExprCandidatesPass::ID = 0;
 
 }
 
+bool souper::MayHaveCandidates(const Function &F) {
+  // Data flow facts are printed at returns even without candidates.
+  if (PrintNegAtReturn || PrintNonNegAtReturn || PrintKnownAtReturn ||
+      PrintPowerTwoAtReturn || PrintNonZeroAtReturn || PrintSignBitsAtReturn ||
+      PrintRangeAtReturn || PrintDemandedBitsAtReturn)
+    return true;
+  // Both defs and uses are harvested from used integer instructions.
+  for (auto &BB : F)
+    for (auto &I : BB)
+      if (I.getType()->isIntegerTy() && !I.use_empty())
+        return true;
+  return false;
+}
+
 FunctionCandidateSet souper::ExtractCandidatesFromPass(
     Function *F, const LoopInfo *LI, DemandedBits *DB, LazyValueInfo *LVI,
     ScalarEvolution *SE, TargetLibraryInfo *TLI, InstContext &IC,
@@ -1100,6 +1255,8 @@ FunctionCandidateSet souper::ExtractCandidates(Function *F, InstContext &IC,
                                                ExprBuilderContext &EBC,
                                                const ExprBuilderOptions &Opts) {
   FunctionCandidateSet Result;
+  if (!MayHaveCandidates(*F))
+    return Result;
 
   PassRegistry &Registry = *PassRegistry::getPassRegistry();
   initializeAnalysis(Registry);
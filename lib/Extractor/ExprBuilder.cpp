@@ -24,9 +24,18 @@ static llvm::cl::opt<souper::ExprBuilder::Builder> SMTExprBuilder(
     llvm::cl::Hidden,
     llvm::cl::desc("SMT-LIBv2 expression builder (default=klee)"),
     llvm::cl::values(clEnumValN(souper::ExprBuilder::KLEE, "klee",
-                                "Use KLEE's Expr library")),
+                                "Use KLEE's Expr library"),
+                     clEnumValN(souper::ExprBuilder::SMTLIB2, "smtlib2",
+                                "Print SMT-LIBv2 directly from the Inst DAG")),
     llvm::cl::init(souper::ExprBuilder::KLEE));
 
+static llvm::cl::opt<bool> LinearPathEncoding(
+    "souper-linear-path-encoding",
+    llvm::cl::desc("Encode UB and BlockPC constraints with one guard per "
+                   "phi/select operand instead of enumerating paths "
+                   "(default=false)"),
+    llvm::cl::init(false));
+
 bool ExprBuilder::getUBPaths(Inst *I, UBPath *Current,
                              std::vector<std::unique_ptr<UBPath>> &Paths,
                              UBPathInstMap &CachedUBPathInsts, unsigned Depth) {
@@ -271,6 +280,16 @@ Inst *ExprBuilder::createPathPred(
 // generated by souper. For example, if we say %12 depends on %11, then
 // %12 would never appear earlier than %11.
 Inst *ExprBuilder::getUBInstCondition(Inst *Root) {
+  auto It = UBInstConditionCache.find(Root);
+  if (It != UBInstConditionCache.end())
+    return It->second;
+  Inst *Result = LinearPathEncoding ? getUBInstConditionLinear(Root)
+                                    : getUBInstConditionPaths(Root);
+  UBInstConditionCache[Root] = Result;
+  return Result;
+}
+
+Inst *ExprBuilder::getUBInstConditionPaths(Inst *Root) {
   // A map from a Phi instruction to all of its expressions that
   // encode the path and UB Inst predicates.
   UBPathInstMap CachedUBPathInsts;
@@ -424,7 +443,16 @@ Inst *ExprBuilder::getDataflowConditions(Inst *I) {
 // may make the code less structured. If we see big performance overhead,
 // we may consider to combine these two parts together.
 Inst *ExprBuilder::getBlockPCs(Inst *Root) {
+  auto It = BlockPCCache.find(Root);
+  if (It != BlockPCCache.end())
+    return It->second;
+  Inst *Result = LinearPathEncoding ? getBlockPCsLinear(Root)
+                                    : getBlockPCsPaths(Root);
+  BlockPCCache[Root] = Result;
+  return Result;
+}
 
+Inst *ExprBuilder::getBlockPCsPaths(Inst *Root) {
   UBPathInstMap CachedPhis;
   Inst *Result = LIC->getConst(llvm::APInt(1, true));
   // For each Phi instruction
@@ -458,7 +486,124 @@ Inst *ExprBuilder::getBlockPCs(Inst *Root) {
   return Result;
 }
 
+// The path enumeration above is exponential in the number of nested phis
+// and selects. Instead, compute for every instruction reachable from Root a
+// guard that holds whenever its value may flow into Root. The guard of an
+// operand is the disjunction, over its users, of the user's guard and the
+// predicate selecting that operand (phi edge or select branch). Guards are
+// shared Insts, so the resulting constraints are linear in the size of the
+// DAG.
+std::map<Inst *, Inst *> ExprBuilder::getPathGuards(Inst *Root) {
+  // Post-order DFS; its reverse visits every user before its operands.
+  std::vector<Inst *> PostOrder;
+  std::set<Inst *> Visited;
+  std::vector<std::pair<Inst *, unsigned>> Stack;
+  Stack.emplace_back(Root, 0);
+  Visited.insert(Root);
+  while (!Stack.empty()) {
+    Inst *I = Stack.back().first;
+    const std::vector<Inst *> &Ops = I->orderedOps();
+    if (Stack.back().second < Ops.size()) {
+      Inst *Op = Ops[Stack.back().second++];
+      if (Visited.insert(Op).second)
+        Stack.emplace_back(Op, 0);
+      continue;
+    }
+    PostOrder.push_back(I);
+    Stack.pop_back();
+  }
+
+  std::map<Inst *, Inst *> Guards;
+  Guards[Root] = LIC->getConst(llvm::APInt(1, true));
+  for (auto I = PostOrder.rbegin(), E = PostOrder.rend(); I != E; ++I) {
+    Inst *G = Guards[*I];
+    const std::vector<Inst *> &Ops = (*I)->orderedOps();
+    for (unsigned J = 0; J < Ops.size(); ++J) {
+      Inst *OpG = G;
+      if ((*I)->K == Inst::Phi && Ops.size() > 1) {
+        std::map<Block *, unsigned> BlockConstraints = {{(*I)->B, J}};
+        OpG = getAndInst(G, createPathPred(BlockConstraints, *I, nullptr));
+      } else if ((*I)->K == Inst::Select && J != 0) {
+        std::map<Block *, unsigned> BlockConstraints;
+        std::map<Inst *, bool> SelectBranches = {{*I, J == 1}};
+        OpG = getAndInst(G, createPathPred(BlockConstraints, *I,
+                                           &SelectBranches));
+      }
+      Inst *&Guard = Guards[Ops[J]];
+      Guard = Guard ? getOrInst(Guard, OpG) : OpG;
+    }
+  }
+
+  return Guards;
+}
+
+Inst *ExprBuilder::getUBInstConditionLinear(Inst *Root) {
+  Inst *True = LIC->getConst(llvm::APInt(1, true));
+  Inst *Result = True;
+  auto UBExprMap = getUBInstConstraints(Root);
+  if (UBExprMap.empty())
+    return Result;
+
+  auto Guards = getPathGuards(Root);
+  for (const auto &Entry : UBExprMap) {
+    Inst *G = Guards[Entry.first];
+    // It's possible that the instruction is not reachable through the
+    // ordered operands, e.g. it comes from a blockpc.
+    if (!G || G == True)
+      Result = LIC->getInst(Inst::And, 1, {Result, Entry.second});
+    else
+      Result = LIC->getInst(Inst::And, 1,
+                            {Result, getImpliesInst(G, Entry.second)});
+  }
+
+  return Result;
+}
+
+Inst *ExprBuilder::getBlockPCsLinear(Inst *Root) {
+  Inst *Result = LIC->getConst(llvm::APInt(1, true));
+  std::map<Inst *, Inst *> Guards;
+  std::set<Inst *> Visited;
+  for (const auto &I : getUBPathInsts(Root)) {
+    if (I->K != Inst::Phi || !Visited.insert(I).second)
+      continue;
+    auto PCMap = BlockPCMap.find(I->B);
+    if (PCMap == BlockPCMap.end())
+      continue;
+    if (Guards.empty())
+      Guards = getPathGuards(Root);
+    for (const auto &P : PCMap->second) {
+      if (P.first >= I->Ops.size())
+        continue;
+      Inst *Pred = Guards[I];
+      if (I->Ops.size() > 1) {
+        std::map<Block *, unsigned> BlockConstraints = {{I->B, P.first}};
+        Pred = getAndInst(Pred, createPathPred(BlockConstraints, I, nullptr));
+      }
+      Result = LIC->getInst(Inst::And, 1,
+                            {Result, getImpliesInst(Pred, P.second)});
+    }
+  }
+
+  return Result;
+}
+
+static bool sameBlockPCs(const BlockPCs &A, const BlockPCs &B) {
+  if (A.size() != B.size())
+    return false;
+  for (unsigned I = 0; I != A.size(); ++I)
+    if (A[I].B != B[I].B || A[I].PredIdx != B[I].PredIdx ||
+        A[I].PC.LHS != B[I].PC.LHS || A[I].PC.RHS != B[I].PC.RHS)
+      return false;
+  return true;
+}
+
 void ExprBuilder::setBlockPCMap(const BlockPCs &BPCs) {
+  // Nothing to do if this builder already saw these BPCs
+  if (!BlockPCMap.empty() && sameBlockPCs(BPCs, CachedBPCs))
+    return;
+  BlockPCMap.clear();
+  BlockPCCache.clear();
+  CachedBPCs = BPCs;
   for (auto BPC : BPCs) {
     assert(BPC.B && "Block is NULL!");
     BlockPCPredMap &PCMap = BlockPCMap[BPC.B];
@@ -525,6 +670,26 @@ Inst *ExprBuilder::getImpliesInst(Inst *Ante, Inst *I) {
   return LIC->getInst(Inst::Or, 1, {IsZero, I});
 }
 
+// Build L && R, folding a constant true operand.
+Inst *ExprBuilder::getAndInst(Inst *L, Inst *R) {
+  Inst *True = LIC->getConst(llvm::APInt(1, true));
+  if (L == True || L == R)
+    return R;
+  if (R == True)
+    return L;
+  return LIC->getInst(Inst::And, 1, {L, R});
+}
+
+// Build L || R, folding a constant true operand.
+Inst *ExprBuilder::getOrInst(Inst *L, Inst *R) {
+  Inst *True = LIC->getConst(llvm::APInt(1, true));
+  if (L == True || R == True)
+    return True;
+  if (L == R)
+    return L;
+  return LIC->getInst(Inst::Or, 1, {L, R});
+}
+
 Inst *ExprBuilder::addnswUB(Inst *I) {
    const std::vector<Inst *> &Ops = I->orderedOps();
    auto L = Ops[0];
@@ -700,10 +865,11 @@ Inst *ExprBuilder::ashrExactUB(Inst *I) {
    return LIC->getInst(Inst::Eq, 1, {LShift, L});
 }
 
-std::map<Inst *, Inst *> ExprBuilder::getUBInstConstraints(Inst *Root) {
+std::map<Inst *, Inst *, InstIdLess>
+ExprBuilder::getUBInstConstraints(Inst *Root) {
   // breadth-first search
   std::set<Inst *> Visited;
-  std::map<Inst *, Inst *> Result;
+  std::map<Inst *, Inst *, InstIdLess> Result;
   std::queue<Inst *> Q;
   Q.push(Root);
   while (!Q.empty()) {
@@ -949,8 +1115,15 @@ Inst *ExprBuilder::GetCandidateExprForReplacement(
     RHS = LIC->getInst(Inst::And, RHS->Width, {RHS, DemandedBits});
 
   // Get known bit constraints
-  for (const auto &I : getVarInsts({Mapping.LHS, Mapping.RHS}))
+  auto VI = VarInstCache.find(Mapping.LHS);
+  if (VI == VarInstCache.end())
+    VI = VarInstCache.emplace(Mapping.LHS, getVarInsts({Mapping.LHS})).first;
+  std::set<Inst *> LHSVars(VI->second.begin(), VI->second.end());
+  for (const auto &I : VI->second)
     Ante = LIC->getInst(Inst::And, 1, {Ante, getDataflowConditions(I)});
+  for (const auto &I : getVarInsts({Mapping.RHS}))
+    if (!LHSVars.count(I))
+      Ante = LIC->getInst(Inst::And, 1, {Ante, getDataflowConditions(I)});
 
   // Get UB constraints of RHS
   Inst *RHSUB = getUBInstCondition(Mapping.RHS);
@@ -978,33 +1151,26 @@ Inst *ExprBuilder::GetCandidateExprForReplacement(
   return Result;
 }
 
-std::string BuildQuery(InstContext &IC, const BlockPCs &BPCs,
-    const std::vector<InstMapping> &PCs, InstMapping Mapping,
-    std::vector<Inst *> *ModelVars, Inst *Precondition, bool Negate, bool DropUB) {
-  std::unique_ptr<ExprBuilder> EB;
+std::unique_ptr<ExprBuilder> createExprBuilder(InstContext &IC) {
   switch (SMTExprBuilder) {
   case ExprBuilder::KLEE:
-    EB = createKLEEBuilder(IC);
-    break;
+    return createKLEEBuilder(IC);
+  case ExprBuilder::SMTLIB2:
+    return createSMTLIBBuilder(IC);
   default:
     llvm::report_fatal_error("cannot reach here");
-    break;
   }
+}
 
+std::string BuildQuery(InstContext &IC, const BlockPCs &BPCs,
+    const std::vector<InstMapping> &PCs, InstMapping Mapping,
+    std::vector<Inst *> *ModelVars, Inst *Precondition, bool Negate, bool DropUB) {
+  std::unique_ptr<ExprBuilder> EB = createExprBuilder(IC);
   return EB->BuildQuery(BPCs, PCs, Mapping, ModelVars, Precondition, Negate, DropUB);
 }
 
 Inst *getUBInstCondition(InstContext &IC, Inst *Root) {
-  std::unique_ptr<ExprBuilder> EB;
-  switch (SMTExprBuilder) {
-  case ExprBuilder::KLEE:
-    EB = createKLEEBuilder(IC);
-    break;
-  default:
-    llvm::report_fatal_error("cannot reach here");
-    break;
-  }
-
+  std::unique_ptr<ExprBuilder> EB = createExprBuilder(IC);
   return EB->getUBInstCondition(Root);
 }
 
@@ -34,6 +34,7 @@ class KLEEBuilder : public ExprBuilder {
   UniqueNameSet ArrayNames;
   std::vector<std::unique_ptr<Array>> Arrays;
   std::map<Inst *, ref<Expr>> ExprMap;
+  std::map<Inst *, unsigned> VarArrays;
   std::vector<Inst *> Vars;
 
 public:
@@ -78,11 +79,18 @@ public:
     Printer.setQuery(KQuery);
     std::vector<const klee::Array *> Arr;
     if (ModelVars) {
-      for (unsigned I = 0; I != Vars.size(); ++I) {
-        if (Vars[I]) {
-          Arr.push_back(Arrays[I].get());
-          ModelVars->push_back(Vars[I]);
-        }
+      // The builder may have been used for earlier queries, so only ask for
+      // the arrays of the variables that this candidate refers to.
+      std::vector<unsigned> Indices;
+      for (Inst *V : getCandidateVars(Cand)) {
+        auto It = VarArrays.find(V);
+        if (It != VarArrays.end())
+          Indices.push_back(It->second);
+      }
+      llvm::sort(Indices);
+      for (unsigned I : Indices) {
+        Arr.push_back(Arrays[I].get());
+        ModelVars->push_back(Vars[I]);
       }
       Printer.setArrayValuesToGet(Arr);
     }
@@ -101,6 +109,27 @@ public:
   }
 
 private:
+  // The variables a candidate refers to, including block predicates.
+  std::vector<Inst *> getCandidateVars(Inst *Root) {
+    std::vector<Inst *> Result;
+    std::set<Inst *> Visited;
+    std::vector<Inst *> Worklist = { Root };
+    Visited.insert(Root);
+    while (!Worklist.empty()) {
+      Inst *I = Worklist.back();
+      Worklist.pop_back();
+      if (I->K == Inst::Var || I->K == Inst::Hole)
+        Result.push_back(I);
+      std::vector<Inst *> Ops = I->orderedOps();
+      if (I->K == Inst::Phi)
+        Ops.insert(Ops.end(), I->B->PredVars.begin(), I->B->PredVars.end());
+      for (Inst *Op : Ops)
+        if (Visited.insert(Op).second)
+          Worklist.push_back(Op);
+    }
+    return Result;
+  }
+
   ref<Expr> countOnes(ref<Expr> L) {
      Expr::Width Width = L->getWidth();
      ref<Expr> Count =  klee::ConstantExpr::alloc(llvm::APInt(Width, 0));
@@ -455,6 +484,10 @@ private:
     // since we will be appending new entries at the end.
     for (size_t InstNum = 0; InstNum < AllInst.size(); InstNum++) {
       Inst *CurrInst = AllInst[InstNum];
+      // Already built, e.g. by an earlier query using this builder.
+      auto It = ExprMap.find(CurrInst);
+      if (It != ExprMap.end() && !It->second.isNull())
+        continue;
       const std::vector<Inst *> &Ops = CurrInst->orderedOps();
       AllInst.insert(AllInst.end(), Ops.rbegin(), Ops.rend());
     }
@@ -489,6 +522,7 @@ private:
       NameStr = Name;
     Arrays.emplace_back(
      new Array(ArrayNames.makeName(NameStr), 1, 0, 0, Expr::Int32, Width));
+    VarArrays[Origin] = Vars.size();
     Vars.push_back(Origin);
 
     UpdateList UL(Arrays.back().get(), 0);
@@ -0,0 +1,495 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// An ExprBuilder that prints SMT-LIB2 bit-vector terms directly from the
+// Inst DAG, without going through KLEE's Expr library. Every value,
+// including i1, is modelled as a bit-vector; predicates are lowered to
+// (ite P #b1 #b0). Each non-leaf node is bound exactly once by a 'let', so
+// the size of the query is linear in the size of the DAG.
+
+#include "souper/Extractor/ExprBuilder.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace souper;
+
+namespace {
+
+class SMTLIBBuilder : public ExprBuilder {
+  // Translations are kept across queries, so a builder that is reused for
+  // many queries over one LHS only translates the Insts it hasn't seen.
+  struct Term {
+    // A let name, a variable name or a constant.
+    std::string Str;
+    // The Insts whose terms Str refers to.
+    std::vector<Inst *> Deps;
+    // Indices of the let bindings introduced while translating this Inst.
+    std::vector<unsigned> Bindings;
+  };
+
+  UniqueNameSet VarNames;
+  std::map<Inst *, Term> TermMap;
+  std::vector<std::pair<std::string, std::string>> Bindings;
+  Term *Building = nullptr;
+
+public:
+  SMTLIBBuilder(InstContext &IC) : ExprBuilder(IC) {}
+
+  std::string GetExprStr(const BlockPCs &BPCs,
+                         const std::vector<InstMapping> &PCs,
+                         InstMapping Mapping,
+                         std::vector<Inst *> *ModelVars, bool Negate,
+                         bool DropUB) override {
+    Inst *Cand = GetCandidateExprForReplacement(BPCs, PCs, Mapping,
+                                                /*Precondition=*/0, Negate,
+                                                DropUB);
+    if (!Cand)
+      return std::string();
+    prepopulateTermMap(Cand);
+    std::string Root = get(Cand);
+    std::vector<unsigned> Needed;
+    std::vector<Inst *> QueryVars;
+    collect(Cand, Needed, QueryVars);
+
+    std::string SStr;
+    llvm::raw_string_ostream SS(SStr);
+    printTerm(SS, Root, Needed);
+    return SS.str();
+  }
+
+  std::string BuildQuery(const BlockPCs &BPCs,
+                         const std::vector<InstMapping> &PCs,
+                         InstMapping Mapping,
+                         std::vector<Inst *> *ModelVars,
+                         Inst *Precondition, bool Negate,
+                         bool DropUB) override {
+    Inst *Cand = GetCandidateExprForReplacement(BPCs, PCs, Mapping,
+                                                Precondition, Negate, DropUB);
+    if (!Cand)
+      return std::string();
+    prepopulateTermMap(Cand);
+    std::string Root = get(Cand);
+    std::vector<unsigned> Needed;
+    std::vector<Inst *> QueryVars;
+    collect(Cand, Needed, QueryVars);
+
+    std::string SMTStr;
+    llvm::raw_string_ostream SMTSS(SMTStr);
+    SMTSS << "(set-logic QF_BV)\n";
+    if (ModelVars)
+      SMTSS << "(set-option :produce-models true)\n";
+    for (Inst *V : QueryVars)
+      SMTSS << "(declare-fun " << TermMap[V].Str << " () (_ BitVec "
+            << V->Width << "))\n";
+
+    // The candidate is valid iff its negation is unsatisfiable.
+    SMTSS << "(assert (= ";
+    printTerm(SMTSS, Root, Needed);
+    SMTSS << " #b0))\n";
+    SMTSS << "(check-sat)\n";
+
+    // One get-value per variable, which is the shape ParseModels expects.
+    if (ModelVars) {
+      for (Inst *V : QueryVars) {
+        SMTSS << "(get-value (" << TermMap[V].Str << "))\n";
+        ModelVars->push_back(V);
+      }
+    }
+    SMTSS << "(exit)\n";
+
+    return SMTSS.str();
+  }
+
+private:
+  // Find the let bindings and variables that the term of Root needs.
+  void collect(Inst *Root, std::vector<unsigned> &Needed,
+               std::vector<Inst *> &QueryVars) {
+    llvm::SmallPtrSet<Inst *, 32> Visited;
+    llvm::SmallVector<Inst *, 32> Worklist;
+    Worklist.push_back(Root);
+    Visited.insert(Root);
+    while (!Worklist.empty()) {
+      Inst *I = Worklist.pop_back_val();
+      const Term &T = TermMap[I];
+      if (I->K == Inst::Var || I->K == Inst::Hole)
+        QueryVars.push_back(I);
+      Needed.insert(Needed.end(), T.Bindings.begin(), T.Bindings.end());
+      for (Inst *D : T.Deps)
+        if (Visited.insert(D).second)
+          Worklist.push_back(D);
+    }
+    // Bindings are created after the bindings they refer to.
+    llvm::sort(Needed);
+  }
+
+  void printTerm(llvm::raw_ostream &OS, const std::string &Root,
+                 const std::vector<unsigned> &Needed) {
+    for (unsigned B : Needed)
+      OS << "(let ((" << Bindings[B].first << ' ' << Bindings[B].second
+         << ")) ";
+    OS << Root;
+    for (unsigned I = 0; I != Needed.size(); ++I)
+      OS << ')';
+  }
+
+  // Let-bind Term and return the name of the binding. Let names start with
+  // '?', which never appears in a sanitized variable name.
+  std::string bind(std::string Term) {
+    std::string Name = "?e" + std::to_string(Bindings.size());
+    Building->Bindings.push_back(Bindings.size());
+    Bindings.emplace_back(Name, std::move(Term));
+    return Name;
+  }
+
+  static std::string constant(const llvm::APInt &Val) {
+    std::string Str;
+    llvm::raw_string_ostream SS(Str);
+    SS << "(_ bv";
+    Val.print(SS, /*isSigned=*/false);
+    SS << ' ' << Val.getBitWidth() << ')';
+    return SS.str();
+  }
+
+  static std::string constant(uint64_t Val, unsigned Width) {
+    return constant(llvm::APInt(Width, Val));
+  }
+
+  static std::string app(llvm::StringRef Op, llvm::ArrayRef<std::string> Args) {
+    std::string Str = ("(" + Op).str();
+    for (const auto &A : Args)
+      Str += " " + A;
+    return Str + ")";
+  }
+
+  static std::string extract(const std::string &X, unsigned Hi, unsigned Lo) {
+    return "((_ extract " + std::to_string(Hi) + " " + std::to_string(Lo) +
+           ") " + X + ")";
+  }
+
+  static std::string extend(llvm::StringRef Op, const std::string &X,
+                            unsigned By) {
+    if (By == 0)
+      return X;
+    return ("((_ " + Op + " " + llvm::Twine(By) + ") " + X + ")").str();
+  }
+
+  // Lower an SMT-LIB predicate to a 1-bit bit-vector.
+  static std::string fromBool(const std::string &P) {
+    return "(ite " + P + " #b1 #b0)";
+  }
+
+  // Test a 1-bit bit-vector.
+  static std::string toBool(const std::string &X) {
+    return "(= " + X + " #b1)";
+  }
+
+  std::string buildAssoc(llvm::StringRef Op, llvm::ArrayRef<Inst *> Ops) {
+    if (Ops.size() == 1)
+      return get(Ops[0]);
+    std::vector<std::string> Args;
+    for (Inst *I : Ops)
+      Args.push_back(get(I));
+    return app(Op, Args);
+  }
+
+  std::string build2(llvm::StringRef Op, llvm::ArrayRef<Inst *> Ops) {
+    return app(Op, {get(Ops[0]), get(Ops[1])});
+  }
+
+  std::string countOnes(const std::string &X, unsigned Width) {
+    if (Width == 1)
+      return X;
+    std::vector<std::string> Bits;
+    for (unsigned I = 0; I != Width; ++I)
+      Bits.push_back(extend("zero_extend", extract(X, I, I), Width - 1));
+    return app("bvadd", Bits);
+  }
+
+  std::string build(Inst *I) {
+    const std::vector<Inst *> &Ops = I->orderedOps();
+    switch (I->K) {
+    case Inst::UntypedConst:
+      assert(0 && "unexpected kind");
+    case Inst::Const:
+      return constant(I->Val);
+    case Inst::Hole:
+    case Inst::Var:
+      return declareVar(I);
+    case Inst::Phi: {
+      const auto &PredExpr = I->B->PredVars;
+      assert((PredExpr.size() || Ops.size() == 1) &&
+             "there must be block predicates");
+      std::string E = get(Ops[0]);
+      // e.g. P2 ? (P1 ? Op1_Expr : Op2_Expr) : Op3_Expr
+      for (unsigned J = 1; J < Ops.size(); ++J)
+        E = app("ite", {toBool(get(PredExpr[J-1])), E, get(Ops[J])});
+      return E;
+    }
+    case Inst::Freeze:
+      return get(Ops[0]);
+    case Inst::Add:
+      return buildAssoc("bvadd", Ops);
+    case Inst::AddNSW:
+    case Inst::AddNUW:
+    case Inst::AddNW:
+      return build2("bvadd", Ops);
+    case Inst::Sub:
+    case Inst::SubNSW:
+    case Inst::SubNUW:
+    case Inst::SubNW:
+      return build2("bvsub", Ops);
+    case Inst::Mul:
+      return buildAssoc("bvmul", Ops);
+    case Inst::MulNSW:
+    case Inst::MulNUW:
+    case Inst::MulNW:
+      return build2("bvmul", Ops);
+
+    // Match the KLEE builder, which folds a division by a literal zero to
+    // zero; the UB constraints make the value irrelevant anyway.
+    case Inst::UDiv:
+    case Inst::SDiv:
+    case Inst::UDivExact:
+    case Inst::SDivExact:
+    case Inst::URem:
+    case Inst::SRem: {
+      if (Ops[1]->K == Inst::Const && Ops[1]->Val == 0)
+        return constant(0, I->Width);
+      switch (I->K) {
+      case Inst::UDiv:
+      case Inst::UDivExact:
+        return build2("bvudiv", Ops);
+      case Inst::SDiv:
+      case Inst::SDivExact:
+        return build2("bvsdiv", Ops);
+      case Inst::URem:
+        return build2("bvurem", Ops);
+      case Inst::SRem:
+        return build2("bvsrem", Ops);
+      default:
+        llvm_unreachable("unknown kind");
+      }
+    }
+
+    case Inst::And:
+      return buildAssoc("bvand", Ops);
+    case Inst::Or:
+      return buildAssoc("bvor", Ops);
+    case Inst::Xor:
+      return buildAssoc("bvxor", Ops);
+    case Inst::Shl:
+    case Inst::ShlNSW:
+    case Inst::ShlNUW:
+    case Inst::ShlNW:
+      return build2("bvshl", Ops);
+    case Inst::LShr:
+    case Inst::LShrExact:
+      return build2("bvlshr", Ops);
+    case Inst::AShr:
+    case Inst::AShrExact:
+      return build2("bvashr", Ops);
+    case Inst::Select:
+      return app("ite", {toBool(get(Ops[0])), get(Ops[1]), get(Ops[2])});
+    case Inst::ZExt:
+      return extend("zero_extend", get(Ops[0]), I->Width - Ops[0]->Width);
+    case Inst::SExt:
+      return extend("sign_extend", get(Ops[0]), I->Width - Ops[0]->Width);
+    case Inst::Trunc:
+      return extract(get(Ops[0]), I->Width - 1, 0);
+    case Inst::Eq:
+      return fromBool(build2("=", Ops));
+    case Inst::Ne:
+      return fromBool(build2("distinct", Ops));
+    case Inst::Ult:
+      return fromBool(build2("bvult", Ops));
+    case Inst::Slt:
+      return fromBool(build2("bvslt", Ops));
+    case Inst::Ule:
+      return fromBool(build2("bvule", Ops));
+    case Inst::Sle:
+      return fromBool(build2("bvsle", Ops));
+    case Inst::CtPop:
+      return countOnes(get(Ops[0]), I->Width);
+    case Inst::BSwap: {
+      std::string L = get(Ops[0]);
+      constexpr unsigned ByteLen = 8;
+      if (I->Width == ByteLen)
+        return L;
+      std::vector<std::string> Bytes;
+      for (unsigned J = 0; J < I->Width / ByteLen; ++J)
+        Bytes.push_back(extract(L, J * ByteLen + ByteLen - 1, J * ByteLen));
+      return app("concat", Bytes);
+    }
+    case Inst::BitReverse: {
+      std::string L = get(Ops[0]);
+      if (I->Width == 1)
+        return L;
+      std::vector<std::string> Bits;
+      for (unsigned J = 0; J < I->Width; ++J)
+        Bits.push_back(extract(L, J, J));
+      return app("concat", Bits);
+    }
+    case Inst::Cttz:
+    case Inst::Ctlz: {
+      // A chain of ites, one per bit, starting from the end we count from;
+      // the innermost value covers the all-zeros input.
+      std::string L = get(Ops[0]);
+      unsigned Width = I->Width;
+      std::string E = constant(Width, Width);
+      for (unsigned J = Width; J-- > 0; ) {
+        unsigned Bit = I->K == Inst::Cttz ? J : Width - 1 - J;
+        E = app("ite", {toBool(extract(L, Bit, Bit)), constant(J, Width), E});
+      }
+      return E;
+    }
+    case Inst::FShl:
+    case Inst::FShr: {
+      unsigned IWidth = I->Width;
+      std::string Concatenated = app("concat", {get(Ops[0]), get(Ops[1])});
+      std::string ShAmtModWidth = app("bvurem", {get(Ops[2]),
+                                                 constant(IWidth, IWidth)});
+      std::string ShAmt = extend("zero_extend", ShAmtModWidth, IWidth);
+      std::string Shifted = app(I->K == Inst::FShl ? "bvshl" : "bvlshr",
+                                {Concatenated, ShAmt});
+      unsigned BitOffset = I->K == Inst::FShr ? 0 : IWidth;
+      return extract(Shifted, BitOffset + IWidth - 1, BitOffset);
+    }
+    case Inst::SAddO:
+      return app("bvnot", {get(addnswUB(I))});
+    case Inst::UAddO:
+      return app("bvnot", {get(addnuwUB(I))});
+    case Inst::SSubO:
+      return app("bvnot", {get(subnswUB(I))});
+    case Inst::USubO:
+      return app("bvnot", {get(subnuwUB(I))});
+    case Inst::SMulO:
+      return app("bvnot", {get(mulnswUB(I))});
+    case Inst::UMulO:
+      return app("bvnot", {get(mulnuwUB(I))});
+    case Inst::ExtractValue: {
+      unsigned Index = Ops[1]->Val.getZExtValue();
+      return get(Ops[0]->Ops[Index]);
+    }
+    case Inst::SAddSat:
+    case Inst::SSubSat: {
+      unsigned W = I->Width;
+      llvm::StringRef Op = I->K == Inst::SAddSat ? "bvadd" : "bvsub";
+      std::string Res = build2(Op, Ops);
+      std::string Ext = bind(app(Op, {extend("sign_extend", get(Ops[0]), 1),
+                                      extend("sign_extend", get(Ops[1]), 1)}));
+      llvm::APInt SMin = llvm::APInt::getSignedMinValue(W);
+      llvm::APInt SMax = llvm::APInt::getSignedMaxValue(W);
+      std::string Sat = app("ite", {app("bvsge", {Ext, constant(SMax.sext(W + 1))}),
+                                    constant(SMax), Res});
+      return app("ite", {app("bvsle", {Ext, constant(SMin.sext(W + 1))}),
+                         constant(SMin), Sat});
+    }
+    case Inst::UAddSat:
+      return app("ite", {toBool(get(addnuwUB(I))), build2("bvadd", Ops),
+                         constant(llvm::APInt::getMaxValue(I->Width))});
+    case Inst::USubSat:
+      return app("ite", {toBool(get(subnuwUB(I))), build2("bvsub", Ops),
+                         constant(0, I->Width)});
+    case Inst::SAddWithOverflow:
+    case Inst::UAddWithOverflow:
+    case Inst::SSubWithOverflow:
+    case Inst::USubWithOverflow:
+    case Inst::SMulWithOverflow:
+    case Inst::UMulWithOverflow:
+    default:
+      break;
+    }
+    llvm_unreachable("unknown kind");
+  }
+
+  std::string get(Inst *I) {
+    if (Building)
+      Building->Deps.push_back(I);
+    auto It = TermMap.find(I);
+    if (It != TermMap.end())
+      return It->second.Str;
+
+    Term &T = TermMap[I];
+    Term *Outer = Building;
+    Building = &T;
+    std::string Str = build(I);
+    // Constants and variables are cheap to repeat; everything else is
+    // bound once and referred to by name.
+    if (Str[0] == '(' && !llvm::StringRef(Str).startswith("(_ bv"))
+      Str = bind(std::move(Str));
+    Building = Outer;
+    T.Str = Str;
+    return Str;
+  }
+
+  // As in the KLEE builder, get() is recursive, so visit the DAG Def->Use
+  // first to keep the recursion shallow. Unlike there, each Inst is
+  // visited once, so DAGs with a lot of sharing stay linear, and Insts
+  // translated by an earlier query are not visited at all.
+  void prepopulateTermMap(Inst *Root) {
+    llvm::SmallVector<Inst *, 32> PostOrder;
+    llvm::SmallPtrSet<Inst *, 32> Visited;
+    llvm::SmallVector<std::pair<Inst *, unsigned>, 32> Stack;
+    Stack.emplace_back(Root, 0);
+    Visited.insert(Root);
+    while (!Stack.empty()) {
+      Inst *I = Stack.back().first;
+      const std::vector<Inst *> &Ops = I->orderedOps();
+      if (Stack.back().second < Ops.size()) {
+        Inst *Op = Ops[Stack.back().second++];
+        if (!TermMap.count(Op) && Visited.insert(Op).second)
+          Stack.emplace_back(Op, 0);
+        continue;
+      }
+      PostOrder.push_back(I);
+      Stack.pop_back();
+    }
+
+    for (Inst *CurrInst : PostOrder) {
+      switch (CurrInst->K) {
+      case Inst::UntypedConst:
+      case Inst::SAddWithOverflow:
+      case Inst::UAddWithOverflow:
+      case Inst::SSubWithOverflow:
+      case Inst::USubWithOverflow:
+      case Inst::SMulWithOverflow:
+      case Inst::UMulWithOverflow:
+        continue;
+      default:
+        break;
+      }
+      (void)get(CurrInst);
+    }
+  }
+
+  // Variable names start with "v_", which no SMT-LIB keyword or theory
+  // symbol does, so that a variable named e.g. %true or %let is not taken
+  // for one; names that sanitize to the same string get unique suffixes.
+  std::string declareVar(Inst *Origin) {
+    std::string NameStr = "v_";
+    for (char C : Origin->Name)
+      NameStr += (llvm::isAlnum(C) || C == '_' || C == '.') ? C : '_';
+    return VarNames.makeName(NameStr);
+  }
+
+};
+
+}
+
+std::unique_ptr<ExprBuilder> souper::createSMTLIBBuilder(InstContext &IC) {
+  return std::unique_ptr<ExprBuilder>(new SMTLIBBuilder(IC));
+}
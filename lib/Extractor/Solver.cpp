@@ -29,7 +29,9 @@
 #include "souper/Infer/Pruning.h"
 #include "souper/KVStore/KVStore.h"
 #include "souper/Parser/Parser.h"
+#include "souper/Util/Cancellation.h"
 
+#include <numeric>
 #include <unordered_map>
 
 #define DEBUG_TYPE "souper"
@@ -40,6 +42,11 @@ STATISTIC(MemHitsIsValid, "Number of internal cache hits for isValid()");
 STATISTIC(MemMissesIsValid, "Number of internal cache misses for isValid()");
 STATISTIC(ExternalHits, "Number of external cache hits");
 STATISTIC(ExternalMisses, "Number of external cache misses");
+STATISTIC(PCsSliced, "Number of path conditions sliced away");
+STATISTIC(BlockPCsSliced, "Number of block path conditions sliced away");
+STATISTIC(IsValidQueries, "Number of SMT queries of isValid()");
+STATISTIC(BytesSliced,
+          "Number of bytes removed from queries by path condition slicing");
 
 using namespace souper;
 using namespace llvm;
@@ -58,6 +65,11 @@ static cl::opt<int> MaxLHSSize("souper-max-lhs-size",
 static cl::opt<int> MaxConstantSynthesisTries("souper-max-constant-synthesis-tries",
     cl::desc("Max number of constant synthesis tries. (default=30)"),
     cl::init(30));
+static cl::opt<bool> RankByBackendCost("souper-backend-cost",
+    cl::desc("Choose among the RHSs by the total size of the code that LLVM "
+             "generates for them on the backend cost targets "
+             "(default=false)"),
+    cl::init(false));
 
 
 class BaseSolver : public Solver {
@@ -466,17 +478,30 @@ public:
                         const std::vector<InstMapping> &PCs,
                         Inst *LHS, std::vector<Inst *> &RHSs,
                         bool AllowMultipleRHSs, InstContext &IC) override {
-    auto EC = inferHelper(BPCs, PCs, LHS, RHSs, AllowMultipleRHSs, IC);
+    // Ranking needs all the RHSs, also when only the best one is wanted.
+    auto EC = inferHelper(BPCs, PCs, LHS, RHSs,
+                          AllowMultipleRHSs || RankByBackendCost, IC);
     if (RHSs.size() <= 1)
       return EC;
 
-#if 0
-    for (auto &RHS : RHSs) {
-      BackendCost BC;
-      getBackendCost(IC, RHS, BC);
-      // FIXME sort the list
+    if (RankByBackendCost) {
+      static BackendCostModel Model;
+      std::vector<BackendCost> Costs;
+      Model.getCosts(IC, RHSs, Costs);
+      std::vector<std::pair<int, Inst *>> Ranked;
+      for (unsigned I = 0; I != RHSs.size(); ++I)
+        Ranked.emplace_back(std::accumulate(Costs[I].C.begin(),
+                                            Costs[I].C.end(), 0), RHSs[I]);
+      std::stable_sort(Ranked.begin(), Ranked.end(),
+                       [](const std::pair<int, Inst *> &A,
+                          const std::pair<int, Inst *> &B) {
+                         return A.first < B.first;
+                       });
+      for (unsigned I = 0; I != RHSs.size(); ++I)
+        RHSs[I] = Ranked[I].second;
     }
-#endif
+    if (!AllowMultipleRHSs)
+      RHSs.resize(1);
 
     return EC;
   }
@@ -498,6 +523,7 @@ public:
         return std::make_error_code(std::errc::value_too_large);
       bool IsSat;
       std::vector<llvm::APInt> ModelVals;
+      ++IsValidQueries;
       std::error_code EC = SMTSolver->isSatisfiable(
           Query, IsSat, ModelInsts.size(), &ModelVals, Timeout);
       if (!EC) {
@@ -514,6 +540,7 @@ public:
       if (Query.empty())
         return std::make_error_code(std::errc::value_too_large);
       bool IsSat;
+      ++IsValidQueries;
       std::error_code EC = SMTSolver->isSatisfiable(Query, IsSat, 0, 0, Timeout);
       IsValid = !IsSat;
       return EC;
@@ -675,6 +702,9 @@ public:
       ++MemMissesInfer;
       std::error_code EC = UnderlyingSolver->infer(BPCs, PCs, LHS, RHSs,
                                                    AllowMultipleRHSs, IC);
+      // Results of cancelled work say nothing about the LHS.
+      if (isCancelled())
+        return EC;
       std::string RHSStr;
       if (!EC && !RHSs.empty()) {
         // TODO: support multi RHSs caching
@@ -728,6 +758,8 @@ public:
       ++MemMissesIsValid;
       std::error_code EC = UnderlyingSolver->isValid(IC, BPCs, PCs,
                                                      Mapping, IsValid, 0);
+      if (isCancelled())
+        return EC;
       IsValidCache.emplace(Repl, std::make_pair(EC, IsValid));
       return EC;
     } else {
@@ -854,6 +886,8 @@ public:
       }
       std::error_code EC = UnderlyingSolver->infer(BPCs, PCs, LHS, RHSs,
                                                    AllowMultipleRHSs, IC);
+      if (isCancelled())
+        return EC;
       std::string RHSStr;
       if (!EC && !RHSs.empty()) {
         // TODO: support multi RHSs caching
@@ -944,6 +978,162 @@ public:
 
 };
 
+class SlicingSolver : public Solver {
+  std::unique_ptr<Solver> UnderlyingSolver;
+
+  void slice(const BlockPCs &BPCs, const std::vector<InstMapping> &PCs,
+             const std::vector<Inst *> &Roots, BlockPCs &SlicedBPCs,
+             std::vector<InstMapping> &SlicedPCs) {
+    slicePathConditions(Roots, BPCs, PCs, SlicedBPCs, SlicedPCs);
+    PCsSliced += PCs.size() - SlicedPCs.size();
+    BlockPCsSliced += BPCs.size() - SlicedBPCs.size();
+    if (llvm::AreStatisticsEnabled() &&
+        (PCs.size() != SlicedPCs.size() || BPCs.size() != SlicedBPCs.size())) {
+      ReplacementContext Context, SlicedContext;
+      BytesSliced +=
+        GetReplacementLHSString(BPCs, PCs, Roots.front(), Context).size() -
+        GetReplacementLHSString(SlicedBPCs, SlicedPCs, Roots.front(),
+                                SlicedContext).size();
+    }
+  }
+
+public:
+  SlicingSolver(std::unique_ptr<Solver> UnderlyingSolver)
+      : UnderlyingSolver(std::move(UnderlyingSolver)) {}
+
+  std::error_code infer(const BlockPCs &BPCs,
+                        const std::vector<InstMapping> &PCs,
+                        Inst *LHS, std::vector<Inst *> &RHSs,
+                        bool AllowMultipleRHSs, InstContext &IC) override {
+    BlockPCs SBPCs;
+    std::vector<InstMapping> SPCs;
+    slice(BPCs, PCs, {LHS}, SBPCs, SPCs);
+    return UnderlyingSolver->infer(SBPCs, SPCs, LHS, RHSs, AllowMultipleRHSs,
+                                   IC);
+  }
+
+  std::error_code inferConst(const BlockPCs &BPCs,
+                             const std::vector<InstMapping> &PCs,
+                             Inst *LHS, Inst *&RHS,
+                             std::set<Inst *> &ConstSet,
+                             std::map<Inst *, llvm::APInt> &ResultMap,
+                             InstContext &IC) override {
+    BlockPCs SBPCs;
+    std::vector<InstMapping> SPCs;
+    slice(BPCs, PCs, {LHS, RHS}, SBPCs, SPCs);
+    return UnderlyingSolver->inferConst(SBPCs, SPCs, LHS, RHS, ConstSet,
+                                        ResultMap, IC);
+  }
+
+  llvm::ConstantRange constantRange(const BlockPCs &BPCs,
+                                    const std::vector<InstMapping> &PCs,
+                                    Inst *LHS,
+                                    InstContext &IC) override {
+    BlockPCs SBPCs;
+    std::vector<InstMapping> SPCs;
+    slice(BPCs, PCs, {LHS}, SBPCs, SPCs);
+    return UnderlyingSolver->constantRange(SBPCs, SPCs, LHS, IC);
+  }
+
+  std::error_code isValid(InstContext &IC, const BlockPCs &BPCs,
+                          const std::vector<InstMapping> &PCs,
+                          InstMapping Mapping, bool &IsValid,
+                          std::vector<std::pair<Inst *, llvm::APInt>> *Model)
+    override {
+    BlockPCs SBPCs;
+    std::vector<InstMapping> SPCs;
+    slice(BPCs, PCs, {Mapping.LHS, Mapping.RHS}, SBPCs, SPCs);
+    return UnderlyingSolver->isValid(IC, SBPCs, SPCs, Mapping, IsValid, Model);
+  }
+
+  std::string getName() override {
+    return UnderlyingSolver->getName();
+  }
+
+  std::error_code testDemandedBits(const BlockPCs &BPCs,
+                                   const std::vector<InstMapping> &PCs,
+                                   Inst *LHS,
+                                   std::map<std::string, APInt> &DBitsVect,
+                                   InstContext &IC) override {
+    BlockPCs SBPCs;
+    std::vector<InstMapping> SPCs;
+    slice(BPCs, PCs, {LHS}, SBPCs, SPCs);
+    return UnderlyingSolver->testDemandedBits(SBPCs, SPCs, LHS, DBitsVect, IC);
+  }
+
+  std::error_code nonNegative(const BlockPCs &BPCs,
+                              const std::vector<InstMapping> &PCs,
+                              Inst *LHS, bool &NonNegative,
+                              InstContext &IC) override {
+    BlockPCs SBPCs;
+    std::vector<InstMapping> SPCs;
+    slice(BPCs, PCs, {LHS}, SBPCs, SPCs);
+    return UnderlyingSolver->nonNegative(SBPCs, SPCs, LHS, NonNegative, IC);
+  }
+
+  std::error_code negative(const BlockPCs &BPCs,
+                           const std::vector<InstMapping> &PCs,
+                           Inst *LHS, bool &Negative,
+                           InstContext &IC) override {
+    BlockPCs SBPCs;
+    std::vector<InstMapping> SPCs;
+    slice(BPCs, PCs, {LHS}, SBPCs, SPCs);
+    return UnderlyingSolver->negative(SBPCs, SPCs, LHS, Negative, IC);
+  }
+
+  std::error_code abstractPrecondition(const BlockPCs &BPCs,
+                  const std::vector<InstMapping> &PCs,
+                  InstMapping &Mapping, InstContext &IC,
+                  bool &FoundWeakest) override {
+    BlockPCs SBPCs;
+    std::vector<InstMapping> SPCs;
+    slice(BPCs, PCs, {Mapping.LHS, Mapping.RHS}, SBPCs, SPCs);
+    return UnderlyingSolver->abstractPrecondition(SBPCs, SPCs, Mapping, IC,
+                                                  FoundWeakest);
+  }
+
+  std::error_code knownBits(const BlockPCs &BPCs,
+                            const std::vector<InstMapping> &PCs,
+                            Inst *LHS, KnownBits &Known,
+                            InstContext &IC) override {
+    BlockPCs SBPCs;
+    std::vector<InstMapping> SPCs;
+    slice(BPCs, PCs, {LHS}, SBPCs, SPCs);
+    return UnderlyingSolver->knownBits(SBPCs, SPCs, LHS, Known, IC);
+  }
+
+  std::error_code powerTwo(const BlockPCs &BPCs,
+                           const std::vector<InstMapping> &PCs,
+                           Inst *LHS, bool &PowerTwo,
+                           InstContext &IC) override {
+    BlockPCs SBPCs;
+    std::vector<InstMapping> SPCs;
+    slice(BPCs, PCs, {LHS}, SBPCs, SPCs);
+    return UnderlyingSolver->powerTwo(SBPCs, SPCs, LHS, PowerTwo, IC);
+  }
+
+  std::error_code nonZero(const BlockPCs &BPCs,
+                          const std::vector<InstMapping> &PCs,
+                          Inst *LHS, bool &NonZero,
+                          InstContext &IC) override {
+    BlockPCs SBPCs;
+    std::vector<InstMapping> SPCs;
+    slice(BPCs, PCs, {LHS}, SBPCs, SPCs);
+    return UnderlyingSolver->nonZero(SBPCs, SPCs, LHS, NonZero, IC);
+  }
+
+  std::error_code signBits(const BlockPCs &BPCs,
+                           const std::vector<InstMapping> &PCs,
+                           Inst *LHS, unsigned &SignBits,
+                           InstContext &IC) override {
+    BlockPCs SBPCs;
+    std::vector<InstMapping> SPCs;
+    slice(BPCs, PCs, {LHS}, SBPCs, SPCs);
+    return UnderlyingSolver->signBits(SBPCs, SPCs, LHS, SignBits, IC);
+  }
+
+};
+
 }
 
 namespace souper {
@@ -967,4 +1157,10 @@ std::unique_ptr<Solver> createExternalCachingSolver(
       new ExternalCachingSolver(std::move(UnderlyingSolver), KV));
 }
 
+std::unique_ptr<Solver> createSlicingSolver(
+    std::unique_ptr<Solver> UnderlyingSolver) {
+  return std::unique_ptr<Solver>(
+      new SlicingSolver(std::move(UnderlyingSolver)));
+}
+
 }
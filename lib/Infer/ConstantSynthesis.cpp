@@ -15,6 +15,7 @@
 #define DEBUG_TYPE "souper"
 
 #include "llvm/ADT/APInt.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Support/CommandLine.h"
 #include "souper/Infer/ConstantSynthesis.h"
 #include "souper/Infer/Interpreter.h"
@@ -22,6 +23,9 @@
 
 extern unsigned DebugLevel;
 
+STATISTIC(ConstantSynthesisQueries,
+          "Number of SMT queries synthesizing constants");
+
 namespace {
   using namespace llvm;
   static cl::opt<bool> EnableConcreteInterpreter("souper-constant-synthesis-use-concrete-interpreter",
@@ -313,7 +317,7 @@ ConstantSynthesis::synthesize(SMTLIBSolver *SMTSolver,
 
   Inst *TrueConst = IC.getConst(llvm::APInt(1, true));
   Inst *FalseConst = IC.getConst(llvm::APInt(1, false));
-
+  std::unique_ptr<ExprBuilder> EB = createExprBuilder(IC);
 
   // generalization by substitution
   Inst *SubstAnte = TrueConst;
@@ -357,12 +361,13 @@ ConstantSynthesis::synthesize(SMTLIBSolver *SMTSolver,
                                       { ConstConstraints,
                                         IC.getInst(Inst::And, 1, {SubstAnte, TriedAnte})});
 
-    std::string Query = BuildQuery(IC, BPCs, PCs, InstMapping(Mapping.LHS, Mapping.RHS),
-                                   &ModelInstsFirstQuery, FirstQueryAnte, true, true);
+    std::string Query = EB->BuildQuery(BPCs, PCs, InstMapping(Mapping.LHS, Mapping.RHS),
+                                       &ModelInstsFirstQuery, FirstQueryAnte, true, true);
 
     if (Query.empty())
       return std::make_error_code(std::errc::value_too_large);
 
+    ++ConstantSynthesisQueries;
     EC = SMTSolver->isSatisfiable(Query, IsSat, ModelInstsFirstQuery.size(),
                                   &ModelValsFirstQuery, Timeout);
 
@@ -426,12 +431,13 @@ ConstantSynthesis::synthesize(SMTLIBSolver *SMTSolver,
     std::vector<Inst *> ModelInstsSecondQuery;
     std::vector<llvm::APInt> ModelValsSecondQuery;
 
-    Query = BuildQuery(IC, BPCs, PCs, InstMapping(Mapping.LHS, RHSCopy),
-                       &ModelInstsSecondQuery, 0);
+    Query = EB->BuildQuery(BPCs, PCs, InstMapping(Mapping.LHS, RHSCopy),
+                           &ModelInstsSecondQuery, 0);
 
     if (Query.empty())
       return std::make_error_code(std::errc::value_too_large);
 
+    ++ConstantSynthesisQueries;
     EC = SMTSolver->isSatisfiable(Query, IsSat, ModelInstsSecondQuery.size(),
                                   &ModelValsSecondQuery, Timeout);
     if (EC) {
@@ -12,8 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#define DEBUG_TYPE "souper"
+
 #include "llvm/ADT/APInt.h"
 #include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Support/CommandLine.h"
 #include "souper/Infer/AliveDriver.h"
 #include "souper/Infer/ConstantSynthesis.h"
@@ -32,6 +35,14 @@ extern unsigned DebugLevel;
 using namespace souper;
 using namespace llvm;
 
+STATISTIC(GuessesGenerated,
+          "Number of guesses generated by enumerative synthesis");
+STATISTIC(GuessesPruned, "Number of partial or complete guesses pruned");
+STATISTIC(GuessesTooExpensive, "Number of guesses dropped for costing too much");
+STATISTIC(LSBPruningQueries, "Number of SMT queries for LSB pruning");
+STATISTIC(GuessVerificationQueries,
+          "Number of SMT queries verifying guesses without constants");
+
 static const std::vector<Inst::Kind> UnaryOperators = {
   Inst::CtPop, Inst::BSwap, Inst::BitReverse, Inst::Cttz, Inst::Ctlz, Inst::Freeze
 };
@@ -184,7 +195,7 @@ void sortGuesses(Container &Guesses) {
 
 using CallbackType = std::function<bool(Inst *)>;
 
-bool getGuesses(const std::set<Inst *> &Inputs,
+bool getGuesses(const std::set<Inst *, InstIdLess> &Inputs,
                 int Width, int LHSCost,
                 InstContext &IC, Inst *PrevInst, Inst *PrevSlot,
                 int &TooExpensive,
@@ -521,6 +532,8 @@ bool getGuesses(const std::set<Inst *> &Inputs,
             return false;
           }
         }
+      } else {
+        ++GuessesPruned;
       }
       continue;
     }
@@ -534,6 +547,8 @@ bool getGuesses(const std::set<Inst *> &Inputs,
                       CurrSlots.front(), TooExpensive, prune, Generate)) {
         return false;
       }
+    } else {
+      ++GuessesPruned;
     }
   }
   return true;
@@ -583,6 +598,7 @@ bool canDifferInLSB(SynthesisContext &SC, Inst *RHSGuess) {
   auto Query = BuildQuery(SC.IC, SC.BPCs, SC.PCs, NewMapping, 0, 0);
 
   bool QueryIsSat;
+  ++LSBPruningQueries;
   auto EC = SC.SMTSolver->isSatisfiable(Query, QueryIsSat, 0, 0, SC.Timeout);
   if (EC) {
     if (DebugLevel > 1)
@@ -654,12 +670,14 @@ std::error_code synthesizeWithAlive(SynthesisContext &SC, std::vector<Inst *> &R
   return EC;
 }
 
-std::error_code isConcreteCandidateSat(SynthesisContext &SC, Inst *RHSGuess, bool &IsSat) {
+std::error_code isConcreteCandidateSat(SynthesisContext &SC, ExprBuilder &EB,
+                                       Inst *RHSGuess, bool &IsSat) {
   std::error_code EC;
   InstMapping Mapping(SC.LHS, RHSGuess);
 
-  std::string Query2 = BuildQuery(SC.IC, SC.BPCs, SC.PCs, Mapping, 0, 0);
+  std::string Query2 = EB.BuildQuery(SC.BPCs, SC.PCs, Mapping, 0, 0);
 
+  ++GuessVerificationQueries;
   EC = SC.SMTSolver->isSatisfiable(Query2, IsSat, 0, 0, SC.Timeout);
   if (EC && DebugLevel > 1) {
     llvm::errs() << "verification query failed!\n";
@@ -683,6 +701,10 @@ std::error_code synthesizeWithKLEE(SynthesisContext &SC, std::vector<Inst *> &RH
     llvm::errs() << "there are " << Guesses.size() << " guesses to check\n";
   }
 
+  // All guesses share the LHS, PCs and BPCs, so use a single builder and
+  // only translate each guess.
+  std::unique_ptr<ExprBuilder> EB = createExprBuilder(SC.IC);
+
   for (auto I : Guesses) {
     GuessIndex++;
     if (DebugLevel > 2) {
@@ -702,7 +724,7 @@ std::error_code synthesizeWithKLEE(SynthesisContext &SC, std::vector<Inst *> &RH
     if (!GuessHasConstant) {
       bool IsSAT;
 
-      EC = isConcreteCandidateSat(SC, I, IsSAT);
+      EC = isConcreteCandidateSat(SC, *EB, I, IsSAT);
       if (EC) {
         if (DebugLevel > 0)
           llvm::errs() << "OOPS: error from isConcreteCanddiateSat()\n";
@@ -814,7 +836,7 @@ EnumerativeSynthesis::synthesize(SMTLIBSolver *SMTSolver,
   SynthesisContext SC{IC, SMTSolver, LHS, getUBInstCondition(SC.IC, SC.LHS),
       PCs, BPCs, CheckAllGuesses, Timeout};
   std::error_code EC;
-  std::set<Inst *> Cands;
+  std::set<Inst *, InstIdLess> Cands;
   findCands(SC.LHS, Cands, /*WidthMustMatch=*/false, /*FilterVars=*/false, 1 + MaxLHSCands);
   if (DebugLevel > 1)
     llvm::errs() << "got " << Cands.size() << " candidates from LHS\n";
@@ -851,6 +873,7 @@ EnumerativeSynthesis::synthesize(SMTLIBSolver *SMTSolver,
   std::vector<Inst *> Guesses;
 
   auto Generate = [&SC, &Guesses, &RHSs, &EC](Inst *Guess) {
+    ++GuessesGenerated;
     Guesses.push_back(Guess);
     if (Guesses.size() >= MaxV && !SkipSolver) {
       sortGuesses(Guesses);
@@ -874,12 +897,14 @@ EnumerativeSynthesis::synthesize(SMTLIBSolver *SMTSolver,
     }
   }
 
+  GuessesGenerated += Guesses.size();
   if (DebugLevel > 1)
     llvm::errs() << "There are " << Guesses.size() << " guesses before enumeration\n";
 
   if (MaxNumInstructions > 0)
     getGuesses(Cands, SC.LHS->Width,
                LHSCost, SC.IC, nullptr, nullptr, TooExpensive, PruneCallback, Generate);
+  GuessesTooExpensive += TooExpensive;
 
   if (DebugLevel > 1) {
     DataflowPruning.printStats(llvm::errs());
@@ -896,7 +921,7 @@ EnumerativeSynthesis::synthesize(SMTLIBSolver *SMTSolver,
   if (DebugLevel > 3)
     llvm::errs() << "There are " << RHSs.size() << " RHSs before deduplication\n";
 
-  std::set<Inst *> Dedup(RHSs.begin(), RHSs.end());
+  std::set<Inst *, InstIdLess> Dedup(RHSs.begin(), RHSs.end());
   RHSs.assign(Dedup.begin(), Dedup.end());
 
   // RHSs count, after duplication
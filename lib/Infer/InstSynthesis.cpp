@@ -12,6 +12,9 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#define DEBUG_TYPE "souper"
+
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 #include "souper/Extractor/ExprBuilder.h"
@@ -22,6 +25,8 @@
 using namespace souper;
 using namespace llvm;
 
+STATISTIC(CegisQueries, "Number of SMT queries of CEGIS synthesis");
+
 namespace {
 
 static cl::opt<unsigned> DebugLevel("souper-synthesis-debug-level",
@@ -181,6 +186,7 @@ std::error_code InstSynthesis::synthesize(SMTLIBSolver *SMTSolver,
       bool IsSat;
       if (DebugLevel > 1)
         llvm::outs() << "solving synthesis constraint.. ";
+      ++CegisQueries;
       EC = SMTSolver->isSatisfiable(QueryStr, IsSat, ModelInsts.size(),
                                     &ModelVals, Timeout);
       if (EC)
@@ -234,6 +240,7 @@ std::error_code InstSynthesis::synthesize(SMTLIBSolver *SMTSolver,
       QueryStr = BuildQuery(IC, BPCs, PCs, CandMapping, &ModelInsts, /*Precondition=*/0, /*Negate=*/false);
       if (QueryStr.empty())
         return std::make_error_code(std::errc::value_too_large);
+      ++CegisQueries;
       EC = SMTSolver->isSatisfiable(QueryStr, IsSat, ModelInsts.size(),
                                     &ModelVals, Timeout);
       if (EC)
@@ -1381,6 +1388,7 @@ std::error_code InstSynthesis::getInitialConcreteInputs(std::vector<std::map<Ins
     if (QueryStr.empty())
       return std::make_error_code(std::errc::value_too_large);
     bool IsSat;
+    ++CegisQueries;
     EC = LSMTSolver->isSatisfiable(QueryStr, IsSat, ModelInsts.size(),
                                    &ModelVals, LTimeout);
     if (EC)
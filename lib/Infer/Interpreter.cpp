@@ -14,6 +14,8 @@
 
 #include "souper/Infer/Interpreter.h"
 
+#include <functional>
+
 namespace souper {
   EvalValue evaluateAddNSW(llvm::APInt a, llvm::APInt b) {
     bool Ov;
@@ -468,4 +470,56 @@ namespace souper {
       Cache[Root] = Result;
     return Result;
   }
+
+  BatchInterpreter::BatchInterpreter(const std::vector<Inst *> &Roots) {
+    std::unordered_map<Inst *, unsigned> Index;
+    std::function<unsigned(Inst *)> Visit = [&](Inst *I) {
+      auto It = Index.find(I);
+      if (It != Index.end())
+        return It->second;
+      std::vector<unsigned> Ops;
+      for (auto *Op : I->Ops)
+        Ops.push_back(Visit(Op));
+      unsigned Pos = Order.size();
+      Index[I] = Pos;
+      Order.push_back(I);
+      OpIndices.push_back(std::move(Ops));
+      return Pos;
+    };
+    for (auto *R : Roots)
+      RootIndices.push_back(Visit(R));
+  }
+
+  void BatchInterpreter::evaluate(const BatchInputs &Inputs, size_t N,
+                                  std::vector<std::vector<EvalValue>> &Results) {
+    std::vector<std::vector<EvalValue>> Values(Order.size());
+    std::vector<EvalValue> Args;
+    for (unsigned Pos = 0; Pos != Order.size(); ++Pos) {
+      Inst *I = Order[Pos];
+      auto &V = Values[Pos];
+      V.reserve(N);
+      if (I->K == Inst::Var) {
+        auto It = Inputs.find(I);
+        if (It == Inputs.end() || It->second.size() < N)
+          llvm::report_fatal_error("Interpreter can't find an input value, exiting");
+        V.assign(It->second.begin(), It->second.begin() + N);
+        continue;
+      }
+      // Constants are the same for every input.
+      if (OpIndices[Pos].empty()) {
+        Args.clear();
+        V.assign(N, CI.evaluateSingleInst(I, Args));
+        continue;
+      }
+      for (size_t J = 0; J != N; ++J) {
+        Args.clear();
+        for (unsigned Op : OpIndices[Pos])
+          Args.push_back(Values[Op][J]);
+        V.push_back(CI.evaluateSingleInst(I, Args));
+      }
+    }
+    Results.clear();
+    for (unsigned Pos : RootIndices)
+      Results.push_back(Values[Pos]);
+  }
 }
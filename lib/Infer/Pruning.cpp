@@ -12,13 +12,18 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#define DEBUG_TYPE "souper"
+
 #include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Support/CommandLine.h"
 #include "souper/Infer/AbstractInterpreter.h"
 #include "souper/Infer/Pruning.h"
 #include "souper/Extractor/Candidates.h"
 #include <cstdlib>
 
+STATISTIC(PruningQueries, "Number of SMT queries pruning guesses");
+
 namespace {
   static llvm::cl::opt<bool> EnableHeavyDataflowPruning("souper-dataflow-pruning-heavy",
     llvm::cl::desc("Enable all pruning techniques (default=false)"),
@@ -51,11 +56,6 @@ namespace {
 
 namespace souper {
 
-std::string getUniqueName() {
-  static int counter = 0;
-  return "dummy" + std::to_string(counter++);
-}
-
 llvm::ConstantRange mkCR(llvm::APInt Low, llvm::APInt High) {
   return llvm::ConstantRange(Low, High);
 }
@@ -487,7 +487,8 @@ bool PruningManager::isInfeasibleWithSolver(Inst *RHS, unsigned StatsLevel) {
         std::map<Inst *, Inst *> InstCache;
         std::vector<Inst *> Empty;
         for (auto *Hole : Holes) {
-          auto DummyVar = SC.IC.createVar(Hole->Width, getUniqueName());
+          auto DummyVar = SC.IC.createVar(Hole->Width,
+                                          "dummy" + std::to_string(NumDummies++));
           InstCache[Hole] = DummyVar;
         }
         std::map<Inst *, llvm::APInt> ConstMap;
@@ -516,6 +517,7 @@ bool PruningManager::isInfeasibleWithSolver(Inst *RHS, unsigned StatsLevel) {
 
         bool Result;
         std::vector<llvm::APInt> Models(ModelVars.size());
+        ++PruningQueries;
         auto EC = SC.SMTSolver->isSatisfiable(Query, Result, Models.size(), &Models, 1000);
 
         if (EC) {
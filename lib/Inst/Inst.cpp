@@ -15,11 +15,15 @@
 #include "souper/Inst/Inst.h"
 
 #include "llvm/ADT/StringSwitch.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
+#include <atomic>
 #include <queue>
 #include <set>
+#include <unordered_map>
 
 using namespace souper;
 
@@ -27,6 +31,22 @@ const std::string souper::ReservedConstPrefix = "reservedconst_";
 const std::string souper::ReservedInstPrefix = "reservedinst";
 const std::string souper::BlockPred = "blockpred";
 
+static llvm::cl::opt<CostMetric> CostMetricFlag("souper-cost-metric",
+    llvm::cl::desc("Cost of instructions used to rank replacements "
+                   "(default=default)"),
+    llvm::cl::init(CostMetric::Default),
+    llvm::cl::values(
+        clEnumValN(CostMetric::Default, "default", "Hand-written costs"),
+        clEnumValN(CostMetric::Latency, "latency", "Latency in cycles"),
+        clEnumValN(CostMetric::Throughput, "throughput",
+                   "Reciprocal throughput in quarter cycles"),
+        clEnumValN(CostMetric::UOps, "uops", "Number of micro-ops")));
+
+static llvm::cl::opt<std::string> CostCPU("souper-cost-cpu",
+    llvm::cl::desc("CPU whose cost tables the latency, throughput and uops "
+                   "metrics use (default=skylake)"),
+    llvm::cl::init("skylake"));
+
 bool Inst::hasOrigin(llvm::Value *V) const {
   return std::find(Origins.begin(), Origins.end(), V) != Origins.end();
 }
@@ -320,6 +340,11 @@ std::string Inst::getDemandedBitsString(llvm::APInt DBVal) {
   return Str;
 }
 
+uint64_t Inst::getNextId() {
+  static std::atomic<uint64_t> NextId(0);
+  return NextId++;
+}
+
 const char *Inst::getKindName(Kind K) {
   switch (K) {
   case Const:
@@ -656,6 +681,7 @@ Inst *InstContext::createVar(unsigned Width, llvm::StringRef Name,
   I->NumSignBits = NumSignBits;
   I->DemandedBits = DemandedBits;
   I->SynthesisConstID = SynthesisConstID;
+  CreationOrder.emplace_back(I, nullptr);
   return I;
 }
 
@@ -685,6 +711,7 @@ Block *InstContext::createBlock(unsigned Preds) {
 
   B->Number = Number;
   B->Preds = Preds;
+  CreationOrder.emplace_back(nullptr, B);
   for (unsigned J = 0; J < Preds-1; ++J)
     B->PredVars.push_back(createVar(1, BlockPred));
   return B;
@@ -732,7 +759,7 @@ Inst *InstContext::getInst(Inst::Kind K, unsigned Width,
   const std::vector<Inst *> *InstOps;
   if (Inst::isCommutative(K)) {
     OrderedOps = Ops;
-    std::sort(OrderedOps.begin(), OrderedOps.end());
+    std::sort(OrderedOps.begin(), OrderedOps.end(), InstIdLess());
     InstOps = &OrderedOps;
   } else {
     InstOps = &Ops;
@@ -952,23 +979,95 @@ int Inst::getCost(Inst::Kind K) {
   }
 }
 
+namespace {
+
+struct CostEntry {
+  const char *CPU, *Kind;
+  unsigned Width;
+  int Latency, Throughput, UOps;
+};
+
+const CostEntry CostEntries[] = {
+#define SOUPER_INST_COST(CPU, Kind, Width, Latency, Throughput, UOps) \
+  {CPU, Kind, Width, Latency, Throughput, UOps},
+#include "souper/Inst/InstCostTable.inc"
+#undef SOUPER_INST_COST
+};
+
+const unsigned CostWidths[] = {8, 16, 32, 64};
+
+// The costs of the -souper-cost-cpu, indexed by metric, kind and width
+// (8, 16, 32 and 64 bits), or -1 where the table has no entry.
+struct CostTable {
+  int Costs[3][Inst::None + 1][4];
+
+  CostTable() {
+    std::fill(&Costs[0][0][0], &Costs[0][0][0] + sizeof(Costs) / sizeof(int),
+              -1);
+    bool Found = false;
+    for (const auto &E : CostEntries) {
+      if (CostCPU != E.CPU)
+        continue;
+      Found = true;
+      Inst::Kind K = Inst::getKind(E.Kind);
+      auto W = std::find(std::begin(CostWidths), std::end(CostWidths),
+                         E.Width);
+      if (K == Inst::None || W == std::end(CostWidths))
+        continue;
+      unsigned WI = W - std::begin(CostWidths);
+      Costs[0][K][WI] = E.Latency;
+      Costs[1][K][WI] = E.Throughput;
+      Costs[2][K][WI] = E.UOps;
+    }
+    if (!Found)
+      llvm::report_fatal_error(("no cost table for CPU '" + CostCPU +
+                                "'").c_str());
+  }
+};
+
+}
+
+int Inst::getCost(Inst::Kind K, unsigned Width, CostMetric Metric) {
+  if (Metric == CostMetric::Default)
+    return getCost(K);
+  static const CostTable Table;
+  unsigned WI = Width <= 8 ? 0 : Width <= 16 ? 1 : Width <= 32 ? 2 : 3;
+  int Cost = Table.Costs[unsigned(Metric) - 1][K][WI];
+  // Kinds that were not measured, such as the overflow intrinsics, keep
+  // their hand-written cost. It counts in adds, so it is converted to the
+  // metric's unit through the measured cost of an add of the same width.
+  if (Cost < 0) {
+    int AddCost = Table.Costs[unsigned(Metric) - 1][Add][WI];
+    Cost = getCost(K) * std::max(AddCost, 1);
+  }
+  // Wider instructions are assumed to take one 64-bit operation per word.
+  if (Width > 64)
+    Cost *= (Width + 63) / 64;
+  return Cost;
+}
+
 static int costHelper(Inst *I, Inst *Root, std::set<Inst *> &Visited,
-                      bool IgnoreDepsWithExternalUses) {
+                      CostMetric Metric, bool IgnoreDepsWithExternalUses) {
   if (!Visited.insert(I).second)
     return 0;
   if (IgnoreDepsWithExternalUses && I != Root &&
       Root->DepsWithExternalUses.find(I) != Root->DepsWithExternalUses.end()) {
     return 0;
   }
-  int Cost = Inst::getCost(I->K);
+  unsigned Width = Inst::isCmp(I->K) ? I->Ops[0]->Width : I->Width;
+  int Cost = Inst::getCost(I->K, Width, Metric);
   for (auto Op : I->Ops)
-    Cost += costHelper(Op, Root, Visited, IgnoreDepsWithExternalUses);
+    Cost += costHelper(Op, Root, Visited, Metric, IgnoreDepsWithExternalUses);
   return Cost;
 }
 
 int souper::cost(Inst *I, bool IgnoreDepsWithExternalUses) {
+  return cost(I, CostMetricFlag, IgnoreDepsWithExternalUses);
+}
+
+int souper::cost(Inst *I, CostMetric Metric, bool IgnoreDepsWithExternalUses) {
   std::set<Inst *> Visited;
-  return costHelper(I, I, Visited, IgnoreDepsWithExternalUses);
+  return costHelper(I, I, Visited, Metric, IgnoreDepsWithExternalUses);
 }
 
 int souper::countHelper(Inst *I, std::set<Inst *> &Visited) {
@@ -1065,6 +1164,123 @@ std::string souper::GetReplacementLHSString(const BlockPCs &BPCs,
   return SS.str();
 }
 
+namespace {
+
+// Serializes a replacement LHS in the order in which ReplacementContext
+// prints it, numbering instructions and blocks as the printer does.
+class LHSKeyBuilder {
+  enum Tag : uint64_t { RefTag, ConstTag, UntypedConstTag, InstTag, BlockTag,
+                        PCTag, BlockPCTag, InferTag };
+
+  std::unordered_map<Inst *, uint64_t> InstNames;
+  std::unordered_map<Block *, uint64_t> BlockNames;
+  std::string Key;
+
+  void add(uint64_t V) {
+    Key.append(reinterpret_cast<const char *>(&V), sizeof(V));
+  }
+
+  void add(const llvm::APInt &V) {
+    add(V.getBitWidth());
+    Key.append(reinterpret_cast<const char *>(V.getRawData()),
+               V.getNumWords() * sizeof(uint64_t));
+  }
+
+  uint64_t nextName() {
+    return InstNames.size() + BlockNames.size();
+  }
+
+public:
+  void addBlock(Block *B) {
+    auto It = BlockNames.find(B);
+    if (It != BlockNames.end()) {
+      add(RefTag);
+      add(It->second);
+      return;
+    }
+    BlockNames[B] = nextName();
+    add(BlockTag);
+    add(B->Preds);
+  }
+
+  void addInst(Inst *I, Inst *Root) {
+    auto It = InstNames.find(I);
+    if (It != InstNames.end()) {
+      add(RefTag);
+      add(It->second);
+      return;
+    }
+
+    switch (I->K) {
+    case Inst::Const:
+      add(ConstTag);
+      add(I->Val);
+      return;
+    case Inst::UntypedConst:
+      add(UntypedConstTag);
+      add(I->Val);
+      return;
+    case Inst::Phi:
+      addBlock(I->B);
+      break;
+    default:
+      break;
+    }
+
+    const std::vector<Inst *> &Ops = I->orderedOps();
+    for (unsigned Idx = 0; Idx != Ops.size(); ++Idx)
+      addInst(Inst::isOverflowIntrinsicMain(I->K) ? I->Ops[1]->Ops[Idx]
+                                                  : Ops[Idx], Root);
+
+    InstNames[I] = nextName();
+    add(InstTag);
+    add(I->K);
+    add(I->Width);
+    if (I->K == Inst::Var) {
+      add(I->KnownZeros);
+      add(I->KnownOnes);
+      add(I->NonNegative | I->Negative << 1 | I->NonZero << 2 |
+          I->PowOfTwo << 3);
+      add(I->NumSignBits > 1 ? I->NumSignBits : 1);
+      add(I->Range.isFullSet());
+      if (!I->Range.isFullSet()) {
+        add(I->Range.getLower());
+        add(I->Range.getUpper());
+      }
+    }
+    add(Root->DepsWithExternalUses.count(I));
+  }
+
+  std::string get(const BlockPCs &BPCs, const std::vector<InstMapping> &PCs,
+                  Inst *LHS) {
+    for (const auto &PC : PCs) {
+      addInst(PC.LHS, PC.LHS);
+      addInst(PC.RHS, PC.RHS);
+      add(PCTag);
+    }
+    for (const auto &BPC : BPCs) {
+      addBlock(BPC.B);
+      addInst(BPC.PC.LHS, BPC.PC.LHS);
+      addInst(BPC.PC.RHS, BPC.PC.RHS);
+      add(BlockPCTag);
+      add(BPC.PredIdx);
+    }
+    addInst(LHS, LHS);
+    add(InferTag);
+    add(LHS->DemandedBits);
+    add(LHS->HarvestKind == HarvestType::HarvestedFromUse);
+    return std::move(Key);
+  }
+};
+
+}
+
+std::string souper::GetReplacementLHSKey(const BlockPCs &BPCs,
+                                         const std::vector<InstMapping> &PCs,
+                                         Inst *LHS) {
+  return LHSKeyBuilder().get(BPCs, PCs, LHS);
+}
+
 void souper::PrintReplacementRHS(llvm::raw_ostream &Out, Inst *RHS,
                                  ReplacementContext &Context, bool printNames) {
   std::string SRef = Context.printInst(RHS, Out, printNames);
@@ -1081,7 +1297,7 @@ std::string souper::GetReplacementRHSString(Inst *RHS,
 }
 
 // breadth-first search
-void souper::findCands(Inst *Root, std::set<Inst *> &Guesses,
+void souper::findCands(Inst *Root, std::set<Inst *, InstIdLess> &Guesses,
 		       bool WidthMustMatch, bool FilterVars,int Max) {
   std::set<Inst *> Visited;
   std::queue<Inst *> Q;
@@ -1336,3 +1552,81 @@ std::vector<Block *> souper::getBlocksFromPhis(Inst *I) {
 
   return Result;
 }
+
+void souper::slicePathConditions(const std::vector<Inst *> &Roots,
+                                 const BlockPCs &BPCs,
+                                 const std::vector<InstMapping> &PCs,
+                                 BlockPCs &SlicedBPCs,
+                                 std::vector<InstMapping> &SlicedPCs) {
+  // The cone of influence is made of variables and of the blocks of phis:
+  // two expressions sharing a phi block share its (implicit) predicate
+  // variables.
+  std::set<Inst *> ConeVars;
+  std::set<Block *> ConeBlocks;
+  std::set<Inst *> Visited;
+  auto AddToCone = [&](Inst *Root) {
+    std::vector<Inst *> Stack{Root};
+    while (!Stack.empty()) {
+      Inst *I = Stack.back();
+      Stack.pop_back();
+      if (!Visited.insert(I).second)
+        continue;
+      if (I->K == Inst::Var)
+        ConeVars.insert(I);
+      else if (I->K == Inst::Phi)
+        ConeBlocks.insert(I->B);
+      Stack.insert(Stack.end(), I->Ops.begin(), I->Ops.end());
+    }
+  };
+  for (auto R : Roots)
+    if (R)
+      AddToCone(R);
+
+  std::vector<std::vector<Inst *>> PCVars(PCs.size());
+  std::vector<std::vector<Block *>> PCBlocks(PCs.size());
+  for (unsigned I = 0; I != PCs.size(); ++I) {
+    for (Inst *Side : {PCs[I].LHS, PCs[I].RHS}) {
+      findVars(Side, PCVars[I]);
+      for (auto B : getBlocksFromPhis(Side))
+        PCBlocks[I].push_back(B);
+    }
+  }
+
+  // Iterate to a fixed point: every condition pulled into the cone may
+  // connect further conditions to it.
+  std::vector<bool> KeepPC(PCs.size()), KeepBPC(BPCs.size());
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (unsigned I = 0; I != BPCs.size(); ++I) {
+      if (KeepBPC[I] || !ConeBlocks.count(BPCs[I].B))
+        continue;
+      KeepBPC[I] = true;
+      AddToCone(BPCs[I].PC.LHS);
+      AddToCone(BPCs[I].PC.RHS);
+      Changed = true;
+    }
+    for (unsigned I = 0; I != PCs.size(); ++I) {
+      if (KeepPC[I])
+        continue;
+      bool Connected =
+        std::any_of(PCVars[I].begin(), PCVars[I].end(),
+                    [&](Inst *V) { return ConeVars.count(V); }) ||
+        std::any_of(PCBlocks[I].begin(), PCBlocks[I].end(),
+                    [&](Block *B) { return ConeBlocks.count(B); });
+      if (!Connected)
+        continue;
+      KeepPC[I] = true;
+      AddToCone(PCs[I].LHS);
+      AddToCone(PCs[I].RHS);
+      Changed = true;
+    }
+  }
+
+  for (unsigned I = 0; I != BPCs.size(); ++I)
+    if (KeepBPC[I])
+      SlicedBPCs.push_back(BPCs[I]);
+  for (unsigned I = 0; I != PCs.size(); ++I)
+    if (KeepPC[I])
+      SlicedPCs.push_back(PCs[I]);
+}
@@ -36,9 +36,11 @@ class KVStore::KVImpl {
 public:
   KVImpl();
   ~KVImpl();
-  void hIncrBy(llvm::StringRef Key, llvm::StringRef Field, int Incr);
+  void hIncrBy(llvm::StringRef Key, llvm::StringRef Field, int64_t Incr);
   bool hGet(llvm::StringRef Key, llvm::StringRef Field, std::string &Value);
   void hSet(llvm::StringRef Key, llvm::StringRef Field, llvm::StringRef Value);
+  void hGetAll(llvm::StringRef Key, std::map<std::string, std::string> &Fields);
+  void scan(llvm::function_ref<void(llvm::StringRef Key)> F);
   void connect();
 };
 
@@ -77,10 +79,11 @@ KVStore::KVImpl::~KVImpl() {
 }
 
 void KVStore::KVImpl::hIncrBy(llvm::StringRef Key, llvm::StringRef Field,
-                              int Incr) {
+                              int64_t Incr) {
  again:
-  redisReply *reply = (redisReply *)redisCommand(Ctx, "HINCRBY %s %s 1",
-                                                 Key.data(), Field.data());
+  redisReply *reply = (redisReply *)redisCommand(Ctx, "HINCRBY %s %s %lld",
+                                                 Key.data(), Field.data(),
+                                                 (long long)Incr);
   if (!reply || Ctx->err) {
     llvm::errs() << (llvm::StringRef)"Redis error: " + Ctx->errstr;
     connect();
@@ -131,11 +134,58 @@ void KVStore::KVImpl::hSet(llvm::StringRef Key, llvm::StringRef Field,
   freeReplyObject(reply);
 }
 
+void KVStore::KVImpl::hGetAll(llvm::StringRef Key,
+                              std::map<std::string, std::string> &Fields) {
+ again:
+  redisReply *reply = (redisReply *)redisCommand(Ctx, "HGETALL %b",
+                                                 Key.data(), Key.size());
+  if (!reply || Ctx->err) {
+    llvm::errs() << (llvm::StringRef)"Redis error: " + Ctx->errstr;
+    connect();
+    goto again;
+  }
+  if (reply->type != REDIS_REPLY_ARRAY || reply->elements % 2)
+    llvm::report_fatal_error(
+        ("Redis protocol error for hash lookup, didn't expect reply type " +
+         std::to_string(reply->type)).c_str());
+  Fields.clear();
+  for (size_t I = 0; I + 1 < reply->elements; I += 2)
+    Fields[std::string(reply->element[I]->str, reply->element[I]->len)] =
+      std::string(reply->element[I + 1]->str, reply->element[I + 1]->len);
+  freeReplyObject(reply);
+}
+
+void KVStore::KVImpl::scan(llvm::function_ref<void(llvm::StringRef Key)> F) {
+  std::string Cursor = "0";
+  do {
+   again:
+    redisReply *reply = (redisReply *)redisCommand(Ctx, "SCAN %s COUNT 1000",
+                                                   Cursor.c_str());
+    if (!reply || Ctx->err) {
+      llvm::errs() << (llvm::StringRef)"Redis error: " + Ctx->errstr;
+      connect();
+      goto again;
+    }
+    if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+        reply->element[0]->type != REDIS_REPLY_STRING ||
+        reply->element[1]->type != REDIS_REPLY_ARRAY)
+      llvm::report_fatal_error(
+          ("Redis protocol error for key scan, didn't expect reply type " +
+           std::to_string(reply->type)).c_str());
+    Cursor = reply->element[0]->str;
+    redisReply *Keys = reply->element[1];
+    for (size_t I = 0; I != Keys->elements; ++I)
+      F(llvm::StringRef(Keys->element[I]->str, Keys->element[I]->len));
+    freeReplyObject(reply);
+  } while (Cursor != "0");
+}
+
 KVStore::KVStore() : Impl (new KVImpl) {}
 
 KVStore::~KVStore() {}
 
-void KVStore::hIncrBy(llvm::StringRef Key, llvm::StringRef Field, int Incr) {
+void KVStore::hIncrBy(llvm::StringRef Key, llvm::StringRef Field,
+                      int64_t Incr) {
   Impl->hIncrBy(Key, Field, Incr);
 }
 
@@ -149,4 +199,13 @@ void KVStore::hSet(llvm::StringRef Key, llvm::StringRef Field,
   Impl->hSet(Key, Field, Value);
 }
 
+void KVStore::hGetAll(llvm::StringRef Key,
+                      std::map<std::string, std::string> &Fields) {
+  Impl->hGetAll(Key, Fields);
+}
+
+void KVStore::scan(llvm::function_ref<void(llvm::StringRef Key)> F) {
+  Impl->scan(F);
+}
+
 }
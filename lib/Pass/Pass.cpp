@@ -12,7 +12,9 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include "llvm/ADT/PostOrderIterator.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/Analysis/DemandedBits.h"
 #include "llvm/Analysis/LazyValueInfo.h"
 #include "llvm/Analysis/LoopInfo.h"
@@ -33,31 +35,82 @@
 #include "llvm/IR/Verifier.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Transforms/Scalar/ADCE.h"
 #include "llvm/Transforms/Scalar/DCE.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "souper/KVStore/KVStore.h"
+#include "souper/Parser/Parser.h"
 #include "souper/SMTLIB2/Solver.h"
 #include "souper/Codegen/Codegen.h"
 #include "souper/Tool/GetSolver.h"
 #include "souper/Tool/CandidateMapUtils.h"
+#include "souper/Tool/FunctionCache.h"
+#include "souper/Tool/ProfileData.h"
+#include "souper/Util/Cancellation.h"
 #include "set"
+#include <algorithm>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
 
 #define DEBUG_TYPE "souper"
 STATISTIC(InstructionReplaced, "Number of instructions replaced by another instruction");
 STATISTIC(DominanceCheckFailed, "Number of failed replacement due to dominance check");
+STATISTIC(FunctionsReused, "Number of functions skipped because the function cache had no replacement for them");
+STATISTIC(CandidatesOverBudget, "Number of candidates not solved because a solving budget was exhausted");
+STATISTIC(FunctionsOverBudget, "Number of functions whose solving budget was exhausted");
+STATISTIC(SolverErrors, "Number of candidates whose query failed");
+STATISTIC(CandidatesNotHot, "Number of candidates skipped because the dynamic profile did not select them");
+STATISTIC(CandidatesSolvedOnThreads, "Number of candidates solved on the solver threads");
 
 using namespace souper;
 using namespace llvm;
 
 unsigned DebugLevel;
+extern bool UseAlive;
 
 namespace {
 std::unique_ptr<Solver> S;
+std::unique_ptr<FunctionCache> FC;
+std::unique_ptr<SolvingBudget> Budget;
+// Candidates of the current function left unsolved by the budgets or by
+// solver errors.
+std::atomic<unsigned> SkippedCandidates;
 unsigned ReplacementIdx, ReplacementsDone, LHSNum;
+// Whether the function being processed was changed.
+bool Changed;
 KVStore *KV;
 
+// Each solver thread has its own solver, and its own connection to the
+// external cache, since the solvers and their caches are not thread safe.
+struct SolverWorker {
+  std::unique_ptr<Solver> S;
+};
+std::vector<SolverWorker> Workers;
+
+// Results of the solver threads for the current function, indexed by the
+// replacement LHS string, in the format of the solver caches.
+std::unordered_map<std::string, std::pair<std::error_code, std::string>>
+  ThreadResults;
+
+// RHSs read from -souper-replacements-file in apply mode, indexed by the
+// replacement LHS string.
+std::unordered_map<std::string, std::string> AppliedResults;
+
+// Candidates recorded for the current function in record mode.
+std::string Recorded;
+
+// Counts read from -souper-profile-file, and the replacement LHS strings
+// selected by -souper-profile-top.
+ProfileData Profile;
+std::unordered_set<std::string> HotLHSs;
+
+enum class PassMode { Solve, Record, Apply };
+
 static cl::opt<unsigned, /*ExternalStorage=*/true>
 DebugFlagParser("souper-debug-level",
      cl::desc("Control the verbose level of debug output (default=1). "
@@ -74,6 +127,46 @@ static cl::opt<bool> DynamicProfile("souper-dynamic-profile", cl::init(false),
 static cl::opt<bool> StaticProfile("souper-static-profile", cl::init(false),
     cl::desc("Static profiling of Souper optimizations (default=false)"));
 
+static cl::opt<PassMode> Mode("souper-pass-mode",
+    cl::desc("What the pass does with candidates (default=solve)"),
+    cl::init(PassMode::Solve),
+    cl::values(clEnumValN(PassMode::Solve, "solve",
+                          "Solve candidates and replace them"),
+               clEnumValN(PassMode::Record, "record",
+                          "Only record candidates, to be solved offline"),
+               clEnumValN(PassMode::Apply, "apply",
+                          "Only apply replacements found offline, without "
+                          "a solver")));
+
+static cl::opt<std::string> ReplacementsFile("souper-replacements-file",
+    cl::desc("File that record mode appends candidates to, and that apply "
+             "mode reads replacements from; the external cache is used "
+             "when empty"),
+    cl::init(""));
+
+static cl::opt<unsigned> SolverThreads("souper-solver-threads", cl::init(1),
+    cl::desc("Number of threads solving the candidates of a function; "
+             "replacements are still applied in order (default=1)"));
+
+static cl::opt<std::string> ProfileFile("souper-profile-file",
+    cl::desc("Merged .souperprof file whose counts select the candidates to "
+             "solve or apply; the dprofile counts of the external cache are "
+             "used when empty"),
+    cl::init(""));
+
+static cl::opt<unsigned long long> ProfileMinCount("souper-profile-min-count",
+    cl::desc("Only solve or apply candidates that were executed at least "
+             "this many times according to the dynamic profile "
+             "(default=0)"),
+    cl::init(0));
+
+static cl::opt<unsigned> ProfileTop("souper-profile-top",
+    cl::desc("Only solve or apply the candidates of -souper-profile-file "
+             "with the largest benefit times execution count; in solve "
+             "mode, the cost of the LHS bounds the benefit (default=0, "
+             "no limit)"),
+    cl::init(0));
+
 static cl::opt<unsigned> FirstReplace("souper-first-opt", cl::Hidden,
     cl::init(0),
     cl::desc("First Souper optimization to perform (default=0)"));
@@ -82,19 +175,25 @@ static cl::opt<unsigned> LastReplace("souper-last-opt", cl::Hidden,
     cl::init(std::numeric_limits<unsigned>::max()),
     cl::desc("Last Souper optimization to perform (default=infinite)"));
 
+// Each counter of the dynamic profile is split into this many shards, one
+// cache line each, so that threads rarely increment the same line.
+static const unsigned ProfileShards = 8;
+static const unsigned ProfileShardWords = 8;
+
 #ifdef DYNAMIC_PROFILE_ALL
 static const bool DynamicProfileAll = true;
 #else
 static const bool DynamicProfileAll = false;
 #endif
 
-static void eliminateDeadCode(Function &F) {
-  FunctionPassManager FPM;
-  FPM.addPass(DCEPass());
-  FunctionAnalysisManager FAM;
-  FAM.registerPass([&] { return TargetLibraryAnalysis(); });
-  FAM.registerPass([&] { return PassInstrumentationAnalysis(); });
-  FPM.run(F, FAM);
+// Run a cleanup pass with the analyses of the enclosing pipeline, so that
+// they are only invalidated when the pass changes something.
+template <typename PassT>
+static bool runCleanupPass(PassT Pass, Function &F,
+                           FunctionAnalysisManager &FAM) {
+  PreservedAnalyses PA = Pass.run(F, FAM);
+  FAM.invalidate(F, PA);
+  return !PA.areAllPreserved();
 }
 
 struct SouperPass : PassInfoMixin<SouperPass> {
@@ -102,21 +201,27 @@ struct SouperPass : PassInfoMixin<SouperPass> {
 
   Value* getOperand(Inst* I, unsigned index, Instruction *ReplacedInst,
                     ExprBuilderContext &EBC, DominatorTree &DT,
-                    std::map<Inst *, Value *> &ReplacedValues,
+                    std::map<Inst *, Value *> &Generated,
                     IRBuilder<> &Builder, Module *M) {
     Value *Result = nullptr;
     if (Inst::isOverflowIntrinsicMain(I->K)) {
       assert(I->Ops.size() == 2 && I->Ops[0]->Ops.size() == 2);
-      Result = getValue(I->Ops[0]->Ops[index], ReplacedInst, EBC, DT, ReplacedValues, Builder, M);
+      Result = getValue(I->Ops[0]->Ops[index], ReplacedInst, EBC, DT, Generated, Builder, M);
     } else {
-      Result = getValue(I->Ops[index], ReplacedInst, EBC, DT, ReplacedValues, Builder, M);
+      Result = getValue(I->Ops[index], ReplacedInst, EBC, DT, Generated, Builder, M);
     }
 
     return Result;
   }
 
 public:
+  // Count the executions of the origin of Cand. The counter and a record
+  // naming it are placed in the souper_prof section, which the profile
+  // runtime walks at exit, so nothing has to run at startup. Each counter
+  // has ProfileShards cache lines, and a thread increments the one picked
+  // by hashing the address of a thread-local variable of the runtime.
   void dynamicProfile(Function *F, CandidateReplacement &Cand) {
+    Changed = true;
     std::string Str;
     llvm::raw_string_ostream Loc(Str);
     Cand.Origin->getDebugLoc().print(Loc);
@@ -125,71 +230,353 @@ public:
                                               Cand.Mapping.LHS, Context);
     LLVMContext &C = F->getContext();
     Module *M = F->getParent();
-    Function *RegisterFunc = M->getFunction("_souper_profile_register");
-    if (!RegisterFunc) {
-      Type *RegisterArgs[] = {
-        PointerType::getInt8PtrTy(C),
-        PointerType::getInt8PtrTy(C),
-        PointerType::getInt64PtrTy(C),
-      };
-      FunctionType *RegisterType = FunctionType::get(Type::getVoidTy(C),
-                                                     RegisterArgs, false);
-      RegisterFunc = Function::Create(RegisterType, Function::ExternalLinkage,
-                                      "_souper_profile_register", M);
-    }
+    Type *Int64Ty = Type::getInt64Ty(C);
+    Type *Int8PtrTy = PointerType::getInt8PtrTy(C);
+
+    GlobalVariable *TLS = M->getGlobalVariable("_souper_profile_tls");
+    if (!TLS)
+      TLS = new GlobalVariable(*M, Type::getInt8Ty(C), false,
+                               GlobalValue::ExternalLinkage, nullptr,
+                               "_souper_profile_tls", nullptr,
+                               GlobalValue::GeneralDynamicTLSModel);
 
     // todo: should check if this string exists before creating it
     Constant *Repl = ConstantDataArray::getString(C, LHS, true);
     Constant *ReplVar = new GlobalVariable(*M, Repl->getType(), true,
         GlobalValue::PrivateLinkage, Repl, "");
-    Constant *ReplPtr = ConstantExpr::getPointerCast(ReplVar,
-        PointerType::getInt8PtrTy(C));
+    Constant *ReplPtr = ConstantExpr::getPointerCast(ReplVar, Int8PtrTy);
 
     Constant *Field = ConstantDataArray::getString(C, "dprofile " + Loc.str(),
                                                    true);
     Constant *FieldVar = new GlobalVariable(*M, Field->getType(), true,
                                             GlobalValue::PrivateLinkage, Field,
                                             "");
-    Constant *FieldPtr = ConstantExpr::getPointerCast(FieldVar,
-        PointerType::getInt8PtrTy(C));
-
-    Constant *CntVar = new GlobalVariable(*M, Type::getInt64Ty(C), false,
-                                          GlobalValue::PrivateLinkage,
-                                          ConstantInt::get(C, APInt(64, 0)),
-                                          "_souper_profile_cnt");
-
-    FunctionType *CtorType = FunctionType::get(Type::getVoidTy(C), false);
-    Function *Ctor = Function::Create(CtorType, GlobalValue::InternalLinkage,
-                                      "_souper_profile_ctor", M);
-
-    BasicBlock *BB = BasicBlock::Create(C, "entry", Ctor);
-    IRBuilder<> Builder(BB);
-
-    Value *Args[] = { ReplPtr, FieldPtr, CntVar };
-    Builder.CreateCall(RegisterFunc, Args);
-    Builder.CreateRetVoid();
-
-    appendToGlobalCtors(*M, Ctor, 0);
+    Constant *FieldPtr = ConstantExpr::getPointerCast(FieldVar, Int8PtrTy);
+
+    ArrayType *ShardTy = ArrayType::get(Int64Ty, ProfileShardWords);
+    ArrayType *CntTy = ArrayType::get(ShardTy, ProfileShards);
+    auto *CntVar = new GlobalVariable(*M, CntTy, false,
+                                      GlobalValue::PrivateLinkage,
+                                      ConstantAggregateZero::get(CntTy),
+                                      "_souper_profile_cnt");
+    CntVar->setAlignment(Align(ProfileShardWords * 8));
+
+    // Must match struct souper_prof_rec in runtime/souperPassProfile.c.
+    StructType *RecTy = StructType::get(C, {Int8PtrTy, Int8PtrTy, Int8PtrTy,
+                                            Int64Ty});
+    Constant *Rec = ConstantStruct::get(RecTy, {
+        ReplPtr, FieldPtr, ConstantExpr::getPointerCast(CntVar, Int8PtrTy),
+        ConstantInt::get(Int64Ty, ProfileShards)});
+    auto *RecVar = new GlobalVariable(*M, RecTy, true,
+                                      GlobalValue::PrivateLinkage, Rec,
+                                      "_souper_profile_rec");
+    RecVar->setSection("souper_prof");
+    RecVar->setAlignment(Align(8));
+    appendToCompilerUsed(*M, RecVar);
 
     BasicBlock::iterator BI(Cand.Origin);
     while (isa<PHINode>(*BI))
       ++BI;
-    Align A{8};
-    new AtomicRMWInst(AtomicRMWInst::Add, CntVar,
-                      ConstantInt::get(C, APInt(64, 1)),
-                      A, AtomicOrdering::Monotonic,
-                      SyncScope::System, Cand.Origin);
+    // The address of the thread-local variable must be computed by an
+    // instruction, not folded into a constant expression.
+    Value *Addr = new PtrToIntInst(TLS, Int64Ty, "", &*BI);
+    IRBuilder<> Builder(&*BI);
+    Value *Hash = Builder.CreateMul(Addr,
+                                    Builder.getInt64(0x9E3779B97F4A7C15));
+    Value *Shard = Builder.CreateLShr(Hash,
+                                      64 - Log2_32(ProfileShards));
+    Value *Cnt = Builder.CreateInBoundsGEP(CntTy, CntVar,
+        {Builder.getInt64(0), Shard, Builder.getInt64(0)});
+    Builder.CreateAtomicRMW(AtomicRMWInst::Add, Cnt, Builder.getInt64(1),
+                            Align(8), AtomicOrdering::Monotonic);
   }
 
   Value *getValue(Inst *I, Instruction *ReplacedInst,
                   ExprBuilderContext &EBC, DominatorTree &DT,
-                  std::map<Inst *, Value *> &ReplacedValues,
+                  std::map<Inst *, Value *> &Generated,
                   IRBuilder<> &Builder, Module *M) {
+    std::map<Inst *, Value *> ReplacedValues;
     return Codegen(ReplacedInst->getContext(), M, Builder, &DT, ReplacedInst,
-                   ReplacedValues)
+                   ReplacedValues, &Generated)
         .getValue(I);
   }
 
+  // Solve the candidates in Order on the solver threads, so that the
+  // replacement loop only has to look up their results. Candidates are
+  // passed to the threads as strings and solved in private contexts.
+  void solveOnThreads(CandidateMap &CandMap,
+                      const std::vector<unsigned> &Order) {
+    std::vector<std::string> LHSs;
+    for (unsigned CandIdx : Order) {
+      auto &Cand = CandMap[CandIdx];
+      // A constant LHS cannot be parsed back; it is solved in order.
+      if (Cand.Mapping.LHS->K == Inst::Const)
+        continue;
+      ReplacementContext Context;
+      std::string LHS = GetReplacementLHSString(Cand.BPCs, Cand.PCs,
+                                                Cand.Mapping.LHS, Context);
+      if (!ThreadResults.count(LHS))
+        LHSs.push_back(std::move(LHS));
+    }
+    if (LHSs.empty())
+      return;
+
+    if (Workers.empty()) {
+      Workers.resize(SolverThreads);
+      for (auto &W : Workers) {
+        KVStore *WorkerKV = nullptr;
+        W.S = GetSolver(WorkerKV);
+      }
+    }
+
+    std::vector<std::pair<std::error_code, std::string>> Results(LHSs.size());
+    std::vector<char> Solved(LHSs.size());
+    std::atomic<unsigned> Next(0);
+    ThreadPool Pool(hardware_concurrency(Workers.size()));
+    for (auto &W : Workers) {
+      Pool.async([&] {
+        for (unsigned I = Next++; I < LHSs.size(); I = Next++) {
+          if (Budget->functionExhausted())
+            return;
+          InstContext IC;
+          ReplacementContext ParseContext;
+          std::string ES;
+          ParsedReplacement R = ParseReplacementLHS(IC, "<solver thread>",
+                                                    LHSs[I], ParseContext, ES);
+          if (ES != "") {
+            Results[I].first = std::make_error_code(std::errc::protocol_error);
+            Solved[I] = true;
+            continue;
+          }
+          std::vector<Inst *> RHSs;
+          CancellationToken Token(Budget->candidateDeadline());
+          CancellationScope Scope(Token);
+          Results[I].first = W.S->infer(R.BPCs, R.PCs, R.Mapping.LHS, RHSs,
+                                        /*AllowMultipleRHSs=*/false, IC);
+          if (RHSs.empty() && Token.cancelledWork()) {
+            ++CandidatesOverBudget;
+            ++SkippedCandidates;
+            Results[I].first =
+              std::make_error_code(std::errc::operation_canceled);
+          } else {
+            ++CandidatesSolvedOnThreads;
+          }
+          if (!Results[I].first && !RHSs.empty()) {
+            ReplacementContext Context;
+            GetReplacementLHSString(R.BPCs, R.PCs, R.Mapping.LHS, Context);
+            Results[I].second = GetReplacementRHSString(RHSs.front(), Context);
+          }
+          Solved[I] = true;
+        }
+      });
+    }
+    Pool.wait();
+
+    for (unsigned I = 0; I != LHSs.size(); ++I)
+      if (Solved[I])
+        ThreadResults.emplace(LHSs[I], Results[I]);
+  }
+
+  // Read the replacements found offline, for instance by
+  // souper-check -infer-rhs -print-replacement on a file written in record
+  // mode. LHSs without a replacement are skipped.
+  void loadReplacements() {
+    auto MB = MemoryBuffer::getFile(ReplacementsFile);
+    if (!MB)
+      report_fatal_error(("cannot read '" + ReplacementsFile + "': " +
+                          MB.getError().message()).c_str());
+    SmallVector<StringRef, 0> Lines;
+    (*MB)->getBuffer().split(Lines, '\n');
+    std::string Chunk;
+    bool HasLHS = false;
+    for (StringRef Line : Lines) {
+      StringRef T = Line.trim();
+      // An LHS that was not solved is followed by a comment or a blank
+      // line; otherwise the instructions of its RHS and a result follow.
+      if (T.empty() || T.startswith(";")) {
+        if (HasLHS) {
+          Chunk.clear();
+          HasLHS = false;
+        }
+        continue;
+      }
+      Chunk += Line;
+      Chunk += '\n';
+      if (T.startswith("infer")) {
+        HasLHS = true;
+      } else if (T.startswith("result") || T.startswith("cand")) {
+        InstContext IC;
+        std::string ES;
+        ParsedReplacement R = ParseReplacement(IC, ReplacementsFile, Chunk,
+                                               ES);
+        if (ES != "")
+          report_fatal_error(ES.c_str());
+        ReplacementContext Context;
+        std::string LHS = GetReplacementLHSString(R.BPCs, R.PCs,
+                                                  R.Mapping.LHS, Context);
+        AppliedResults.emplace(LHS, GetReplacementRHSString(R.Mapping.RHS,
+                                                            Context));
+        Chunk.clear();
+        HasLHS = false;
+      }
+    }
+  }
+
+  // Record the candidate together with the function and the instructions
+  // it was extracted from. A constant LHS cannot be parsed back, so there
+  // is nothing to solve offline.
+  void recordCandidate(const std::string &FunctionName,
+                       CandidateReplacement &Cand,
+                       ArrayRef<Instruction *> Origins) {
+    if (Cand.Mapping.LHS->K == Inst::Const)
+      return;
+    ReplacementContext Context;
+    std::string LHS = GetReplacementLHSString(Cand.BPCs, Cand.PCs,
+                                              Cand.Mapping.LHS, Context);
+    if (ReplacementsFile.empty()) {
+      // The field names the function and its value lists the instructions.
+      std::string Instructions;
+      raw_string_ostream OS(Instructions);
+      for (auto Origin : Origins) {
+        Origin->print(OS);
+        OS << "\n";
+      }
+      KV->hSet(LHS, "record " + FunctionName, OS.str());
+      return;
+    }
+    raw_string_ostream OS(Recorded);
+    OS << "; Function: " << FunctionName << "\n";
+    for (auto Origin : Origins) {
+      OS << "; Instruction:";
+      Origin->print(OS);
+      OS << "\n";
+    }
+    OS << LHS << "\n";
+  }
+
+  // Keep the -souper-profile-top LHSs of the profile with the largest
+  // benefit times execution count. The benefit of an LHS is known in apply
+  // mode; otherwise no replacement can save more than the cost of the LHS.
+  void selectHotLHSs() {
+    std::vector<std::pair<double, std::string>> Weights;
+    for (const auto &Entry : Profile.Counts) {
+      const std::string &LHS = Entry.first;
+      uint64_t Count = Profile.getCount(LHS);
+      if (Count < ProfileMinCount)
+        continue;
+      InstContext IC;
+      ReplacementContext Context;
+      std::string ES;
+      ParsedReplacement R = ParseReplacementLHS(IC, ProfileFile, LHS, Context,
+                                                ES);
+      if (ES != "")
+        continue;
+      int Benefit;
+      if (Mode == PassMode::Apply) {
+        std::string RHS;
+        if (ReplacementsFile.empty()) {
+          KV->hGet(LHS, "rhs", RHS);
+        } else {
+          auto It = AppliedResults.find(LHS);
+          if (It != AppliedResults.end())
+            RHS = It->second;
+        }
+        if (RHS == "")
+          continue;
+        ParsedReplacement RR = ParseReplacementRHS(IC, "<replacements>", RHS,
+                                                   Context, ES);
+        if (ES != "")
+          continue;
+        Benefit = benefit(R.Mapping.LHS, RR.Mapping.RHS);
+      } else {
+        Benefit = cost(R.Mapping.LHS, /*IgnoreDepsWithExternalUses=*/true);
+      }
+      if (Benefit > 0)
+        Weights.emplace_back(double(Benefit) * Count, LHS);
+    }
+    std::stable_sort(Weights.begin(), Weights.end(),
+                     [](const std::pair<double, std::string> &A,
+                        const std::pair<double, std::string> &B) {
+                       return A.first > B.first;
+                     });
+    if (Weights.size() > ProfileTop)
+      Weights.resize(ProfileTop);
+    for (auto &W : Weights)
+      HotLHSs.insert(std::move(W.second));
+  }
+
+  // Whether the dynamic profile selects the candidate, whose origins are
+  // counted under the same key and fields as by dynamicProfile.
+  bool isHot(CandidateReplacement &Cand, ArrayRef<Instruction *> Origins) {
+    ReplacementContext Context;
+    std::string LHS = GetReplacementLHSString(Cand.BPCs, Cand.PCs,
+                                              Cand.Mapping.LHS, Context);
+    if (ProfileTop)
+      return HotLHSs.count(LHS);
+    if (!ProfileFile.empty())
+      return Profile.getCount(LHS) >= ProfileMinCount;
+    uint64_t Count = 0;
+    for (auto Origin : Origins) {
+      std::string Str;
+      llvm::raw_string_ostream Loc(Str);
+      Origin->getDebugLoc().print(Loc);
+      std::string Value;
+      uint64_t N;
+      if (KV->hGet(LHS, "dprofile " + Loc.str(), Value) &&
+          !StringRef(Value).getAsInteger(10, N))
+        Count += N;
+    }
+    return Count >= ProfileMinCount;
+  }
+
+  std::error_code infer(CandidateReplacement &Cand, std::vector<Inst *> &RHSs,
+                        InstContext &IC) {
+    if (Mode == PassMode::Apply) {
+      ReplacementContext Context;
+      std::string LHS = GetReplacementLHSString(Cand.BPCs, Cand.PCs,
+                                                Cand.Mapping.LHS, Context);
+      std::string RHS;
+      if (ReplacementsFile.empty()) {
+        if (!KV->hGet(LHS, "rhs", RHS))
+          return std::error_code();
+      } else {
+        auto It = AppliedResults.find(LHS);
+        if (It == AppliedResults.end())
+          return std::error_code();
+        RHS = It->second;
+      }
+      if (RHS == "")
+        return std::error_code();
+      std::string ES;
+      ParsedReplacement R = ParseReplacementRHS(IC, "<replacements>", RHS,
+                                                Context, ES);
+      if (ES != "")
+        return std::make_error_code(std::errc::protocol_error);
+      RHSs.emplace_back(R.Mapping.RHS);
+      return std::error_code();
+    }
+    if (!ThreadResults.empty()) {
+      ReplacementContext Context;
+      std::string LHS = GetReplacementLHSString(Cand.BPCs, Cand.PCs,
+                                                Cand.Mapping.LHS, Context);
+      auto It = ThreadResults.find(LHS);
+      if (It != ThreadResults.end()) {
+        if (It->second.first || It->second.second.empty())
+          return It->second.first;
+        std::string ES;
+        ParsedReplacement R = ParseReplacementRHS(IC, "<solver thread>",
+                                                  It->second.second, Context,
+                                                  ES);
+        if (ES != "")
+          return std::make_error_code(std::errc::protocol_error);
+        RHSs.emplace_back(R.Mapping.RHS);
+        return std::error_code();
+      }
+    }
+    return S->infer(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS, RHSs,
+                    /*AllowMultipleRHSs=*/false, IC);
+  }
+
   bool runOnFunction(Function &F, FunctionAnalysisManager &FAM) {
     std::string FunctionName;
     if (F.hasLocalLinkage()) {
@@ -206,8 +593,9 @@ public:
       errs() << "\n";
     }
 
+    // Analyses are computed only for functions that may have candidates,
+    // and are reused until a replacement invalidates them.
     auto &LI = FAM.getResult<llvm::LoopAnalysis>(F);
-    auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
     auto &DB = FAM.getResult<DemandedBitsAnalysis>(F);
     auto &LVI = FAM.getResult<LazyValueAnalysis>(F);
     auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
@@ -215,20 +603,6 @@ public:
 
     InstContext IC;
     ExprBuilderContext EBC;
-    std::map<Inst *, Value *> ReplacedValues;
-
-    // Run UnreachableBlockElim and ADCE locally
-    // TODO: In the long run, switch this tool to the new pass manager.
-    {
-      FunctionPassManager FM2;
-      FunctionAnalysisManager FAM2;
-      FAM2.registerPass([&] { return PassInstrumentationAnalysis(); });
-      FAM2.registerPass([&] { return DominatorTreeAnalysis(); });
-      FAM2.registerPass([&] { return PostDominatorTreeAnalysis(); });
-      FM2.addPass(UnreachableBlockElimPass());
-      FM2.addPass(ADCEPass());
-      FM2.run(F, FAM2);
-    }
 
     FunctionCandidateSet CS = ExtractCandidatesFromPass(&F, &LI, &DB, &LVI, &SE, &TLI, IC, EBC);
 
@@ -240,7 +614,27 @@ public:
       for (auto &R : B->Replacements)
         AddToCandidateMap(CandMap, R);
 
-    for (auto &Cand : CandMap) {
+    auto GetBFI = [&](Function &) {
+      return &FAM.getResult<BlockFrequencyAnalysis>(F);
+    };
+    std::vector<unsigned> Order = GetSolvingOrder(CandMap, KV, GetBFI);
+    // Cold candidates are neither solved nor applied, and keep the function
+    // out of the function cache like candidates over budget.
+    if ((ProfileMinCount || ProfileTop) && Mode != PassMode::Record &&
+        !DynamicProfileAll) {
+      auto Cold = std::remove_if(Order.begin(), Order.end(), [&](unsigned I) {
+        return !isHot(CandMap[I], CandMap.getOrigins(I));
+      });
+      CandidatesNotHot += Order.end() - Cold;
+      SkippedCandidates += Order.end() - Cold;
+      Order.erase(Cold, Order.end());
+    }
+    if (SolverThreads > 1 && Mode == PassMode::Solve && !DynamicProfileAll)
+      solveOnThreads(CandMap, Order);
+    std::vector<unsigned> Accepted;
+    for (unsigned Pos = 0; Pos != Order.size(); ++Pos) {
+      unsigned CandIdx = Order[Pos];
+      auto &Cand = CandMap[CandIdx];
 
       if (DebugLevel > 1)
         errs() << "\n================= LHS number " << ++LHSNum << " ====================\n\n";
@@ -253,24 +647,59 @@ public:
         PrintReplacementLHS(errs(), Cand.BPCs, Cand.PCs, Cand.Mapping.LHS, Context);
       }
       
+      // Candidates merged into this one are profiled at their own origins.
       if (StaticProfile) {
-        std::string Str;
-        llvm::raw_string_ostream Loc(Str);
-        Cand.Origin->getDebugLoc().print(Loc);
-        std::string HField = "sprofile " + Loc.str();
         ReplacementContext Context;
-        KV->hIncrBy(GetReplacementLHSString(Cand.BPCs, Cand.PCs,
-                                            Cand.Mapping.LHS,
-                                            Context), HField, 1);
+        std::string LHS = GetReplacementLHSString(Cand.BPCs, Cand.PCs,
+                                                  Cand.Mapping.LHS, Context);
+        for (auto Origin : CandMap.getOrigins(CandIdx)) {
+          std::string Str;
+          llvm::raw_string_ostream Loc(Str);
+          Origin->getDebugLoc().print(Loc);
+          std::string HField = "sprofile " + Loc.str();
+          KV->hIncrBy(LHS, HField, 1);
+        }
       }
       if (DynamicProfileAll) {
-        dynamicProfile(&F, Cand);
+        for (auto Origin : CandMap.getOrigins(CandIdx)) {
+          CandidateReplacement Dup = Cand;
+          Dup.Origin = Origin;
+          dynamicProfile(&F, Dup);
+        }
+        continue;
+      }
+      if (Mode == PassMode::Record) {
+        recordCandidate(FunctionName, Cand, CandMap.getOrigins(CandIdx));
         continue;
       }
+      if (Budget->functionExhausted()) {
+        if (DebugLevel > 1)
+          errs() << "solving budget exhausted at LHS number " << LHSNum
+                 << "\n";
+        CandidatesOverBudget += Order.size() - Pos;
+        SkippedCandidates += Order.size() - Pos;
+        ++FunctionsOverBudget;
+        break;
+      }
       std::vector<Inst *> RHSs;
-      if (std::error_code EC =
-          S->infer(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
-                   RHSs, /*AllowMultipleRHSs=*/false, IC)) {
+      CancellationToken Token(Budget->candidateDeadline());
+      CancellationScope Scope(Token);
+      std::error_code EC = infer(Cand, RHSs, IC);
+      if (RHSs.empty() && Token.cancelledWork()) {
+        if (DebugLevel > 1)
+          errs() << "solving budget exhausted for LHS number " << LHSNum
+                 << "\n";
+        ++CandidatesOverBudget;
+        ++SkippedCandidates;
+        continue;
+      }
+      // A solver thread ran out of budget, which it already counted.
+      if (EC == std::errc::operation_canceled)
+        continue;
+      if (EC) {
+        // Another run may solve it, so the function is not cached either.
+        ++SolverErrors;
+        ++SkippedCandidates;
         if (EC == std::errc::timed_out ||
             EC == std::errc::value_too_large) {
           if (DebugLevel > 1)
@@ -293,13 +722,56 @@ public:
       }
 
       Cand.Mapping.RHS = RHSs.front();
+      Accepted.push_back(CandIdx);
+    }
+
+    return applyReplacements(F, FAM, EBC, CandMap, Accepted);
+  }
+
+  // Make the accepted replacements of a function all at once. The code of
+  // the RHSs is generated in reverse post order of the instructions they
+  // replace, so that a subexpression shared by several RHSs is generated
+  // once and reused by the replacements it dominates. Uses are replaced
+  // only when all the code is there, and dead code is removed once.
+  bool applyReplacements(Function &F, FunctionAnalysisManager &FAM,
+                         ExprBuilderContext &EBC, CandidateMap &CandMap,
+                         std::vector<unsigned> &Accepted) {
+    if (Accepted.empty())
+      return false;
 
+    auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+    DenseMap<Instruction *, unsigned> Position;
+    for (BasicBlock *BB : ReversePostOrderTraversal<Function *>(&F))
+      for (Instruction &I : *BB) {
+        unsigned Pos = Position.size();
+        Position[&I] = Pos;
+      }
+    std::stable_sort(Accepted.begin(), Accepted.end(),
+                     [&](unsigned A, unsigned B) {
+      return Position.lookup(CandMap[A].Origin) <
+             Position.lookup(CandMap[B].Origin);
+    });
+
+    if (DebugLevel > 2) {
+      if (DebugLevel > 4) {
+        errs() << "\nModule before replacement:\n";
+        F.getParent()->dump();
+      } else {
+        errs() << "\nFunction before replacement:\n";
+        F.print(errs());
+      }
+    }
+
+    std::map<Inst *, Value *> Generated;
+    std::vector<std::pair<CandidateReplacement *, Value *>> Replacements;
+    for (unsigned CandIdx : Accepted) {
+      auto &Cand = CandMap[CandIdx];
       Instruction *I = Cand.Origin;
       assert(Cand.Mapping.LHS->K == Inst::Const || Cand.Mapping.LHS->hasOrigin(I));
       IRBuilder<> Builder(I);
 
       Value *NewVal = getValue(Cand.Mapping.RHS, I, EBC, DT,
-                               ReplacedValues, Builder, F.getParent());
+                               Generated, Builder, F.getParent());
 
       // if LHS comes from use, then NewVal should be a constant
       assert(Cand.Mapping.LHS->HarvestKind != HarvestType::HarvestedFromUse ||
@@ -307,8 +779,11 @@ public:
 
       // TODO can we assert that getValue() succeeds?
       if (!NewVal) {
-        if (DebugLevel > 1)
-          errs() << "\"\n; replacement failed for LHS number " << LHSNum << ", getValue() returned null\n";
+        if (DebugLevel > 1) {
+          errs() << "\n; replacement failed for \"";
+          I->print(errs());
+          errs() << "\", getValue() returned null\n";
+        }
         continue;
       }
 
@@ -325,19 +800,7 @@ public:
         ++ReplacementIdx;
       ReplacementsDone++;
 
-      if (Cand.Mapping.LHS->HarvestKind == HarvestType::HarvestedFromDef)
-        ReplacedValues[Cand.Mapping.LHS] = NewVal;
-
       if (DebugLevel > 1) {
-        if (DebugLevel > 2) {
-          if (DebugLevel > 4) {
-            errs() << "\nModule before replacement:\n";
-            F.getParent()->dump();
-          } else {
-            errs() << "\nFunction before replacement:\n";
-            F.print(errs());
-          }
-        }
         errs() << "\n";
         errs() << "; Replacing \"";
         I->print(errs());
@@ -352,11 +815,30 @@ public:
         errs() << "\"\n";
       }
 
+      Replacements.push_back({&Cand, NewVal});
+    }
+
+    if (Replacements.empty())
+      return false;
+
+    // The RHS of one replacement may be the instruction of another, whose
+    // uses then go to the value that replaces it.
+    DenseMap<Value *, Value *> ReplacedBy;
+    for (auto &R : Replacements) {
+      CandidateReplacement &Cand = *R.first;
+      Instruction *I = Cand.Origin;
+      Value *NewVal = R.second;
+      while (Value *V = ReplacedBy.lookup(NewVal))
+        NewVal = V;
+
       if (DynamicProfile)
         dynamicProfile(&F, Cand);
 
       if (Cand.Mapping.LHS->HarvestKind == HarvestType::HarvestedFromDef) {
+        if (NewVal == I)
+          continue;
         I->replaceAllUsesWith(NewVal);
+        ReplacedBy[I] = NewVal;
       } else {
         for (llvm::Value::use_iterator UI = I->use_begin();
              UI != I->use_end(); ) {
@@ -369,47 +851,130 @@ public:
           }
         }
       }
+    }
 
-      eliminateDeadCode(F);
-
-      if (DebugLevel > 2) {
-        if (DebugLevel > 4) {
-          errs() << "\nModule after replacement:\n";
-          F.getParent()->dump();
-        } else {
-          errs() << "\nFunction after replacement:\n\n";
-          F.print(errs());
-        }
-        errs() << "\n";
+    // Replacements never change the CFG, but the values that the other
+    // analyses describe are gone.
+    Changed = true;
+    runCleanupPass(DCEPass(), F, FAM);
+    PreservedAnalyses PA;
+    PA.preserveSet<CFGAnalyses>();
+    FAM.invalidate(F, PA);
+
+    if (DebugLevel > 2) {
+      if (DebugLevel > 4) {
+        errs() << "\nModule after replacement:\n";
+        F.getParent()->dump();
+      } else {
+        errs() << "\nFunction after replacement:\n\n";
+        F.print(errs());
       }
-
-      if (DebugLevel > 1)
-        errs() << "done with LHS number " << LHSNum << " after doing a replacement\n";
-      
-      return true;
+      errs() << "\n";
     }
 
-    return false;
+    if (DebugLevel > 1)
+      errs() << "done with " << Replacements.size()
+             << " replacements in " << F.getName() << "()\n";
+
+    return true;
   }
-  
+
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
-    if (!S) {
-      S = GetSolver(KV);
-      if (StaticProfile && !KV)
+    if (!Budget) {
+      // Alive2 shares one Z3 context, so it cannot solve on several
+      // threads.
+      if (UseAlive && SolverThreads > 1 && Mode == PassMode::Solve)
+        report_fatal_error("-souper-use-alive cannot be used with "
+                           "-souper-solver-threads greater than 1",
+                           /*GenCrashDiag=*/false);
+      // Record and apply modes never solve, so they need no solver.
+      if (Mode == PassMode::Solve)
+        S = GetSolver(KV);
+      // Profiling instruments or counts every candidate, so it cannot
+      // skip functions.
+      if (Mode == PassMode::Solve && !StaticProfile && !DynamicProfile &&
+          !DynamicProfileAll)
+        FC = GetFunctionCache(KV, "pass");
+      bool ProfileFromKV = ProfileMinCount && !ProfileTop &&
+                           ProfileFile.empty();
+      if ((StaticProfile || ProfileFromKV ||
+           (Mode != PassMode::Solve && ReplacementsFile.empty())) && !KV)
         KV = new KVStore;
+      if (Mode == PassMode::Apply && !ReplacementsFile.empty())
+        loadReplacements();
+      if (ProfileTop && ProfileFile.empty())
+        report_fatal_error("-souper-profile-top needs -souper-profile-file");
+      if (!ProfileFile.empty()) {
+        if (std::error_code EC = readProfileFile(ProfileFile, Profile))
+          report_fatal_error(("cannot read '" + ProfileFile + "': " +
+                              EC.message()).c_str());
+        if (ProfileTop)
+          selectHotLHSs();
+      }
+      Budget.reset(new SolvingBudget);
     }
 
     if (Verify && verifyFunction(F))
       llvm::report_fatal_error(("function " + F.getName() + " broken before Souper").str().c_str());
 
+    if (!MayHaveCandidates(F))
+      return PreservedAnalyses::all();
+
+    // Only functions that Souper left unchanged are cached, so that a hit
+    // means there is nothing to do.
+    std::string Key;
+    if (FC) {
+      Key = FC->getKey(F);
+      std::string Value;
+      ++FC->Lookups;
+      if (FC->get(Key, Value)) {
+        ++FC->Reused;
+        ++FunctionsReused;
+        if (DebugLevel > 1)
+          errs() << "; reusing cached result for " << F.getName() << "()\n";
+        return PreservedAnalyses::all();
+      }
+    }
+
+    Changed = runCleanupPass(UnreachableBlockElimPass(), F, FAM);
+    Changed |= runCleanupPass(ADCEPass(), F, FAM);
+
+    unsigned FirstIdx = ReplacementIdx;
+    Budget->startFunction();
+    SkippedCandidates = 0;
     bool res;
     do {
       res = runOnFunction(F, FAM);
       if (res && verifyFunction(F))
         llvm::report_fatal_error("function broken after Souper changed it");
     } while (res);
-    
-    return PreservedAnalyses::none();
+    ThreadResults.clear();
+
+    if (!Recorded.empty()) {
+      std::error_code EC;
+      raw_fd_ostream OS(ReplacementsFile, EC, sys::fs::OF_Append);
+      if (EC)
+        report_fatal_error(("cannot write '" + ReplacementsFile + "': " +
+                            EC.message()).c_str());
+      // Parallel compile jobs append to the same file, so the records of a
+      // function are written under a lock in case they take more than one
+      // write().
+      Expected<sys::fs::FileLocker> Lock = OS.lock();
+      if (!Lock)
+        report_fatal_error(("cannot lock '" + ReplacementsFile + "': " +
+                            toString(Lock.takeError())).c_str());
+      OS << Recorded;
+      OS.flush();
+      Recorded.clear();
+    }
+
+    // A function whose candidates were not all solved, because of the
+    // budgets or of solver errors, may still have a replacement.
+    if (FC && ReplacementIdx == FirstIdx && !SkippedCandidates &&
+        FC->getKey(F) == Key)
+      FC->set(Key, "");
+
+    return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
   }
 
 };
@@ -0,0 +1,214 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define DEBUG_TYPE "souper"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+#include "souper/SMTLIB2/Solver.h"
+
+using namespace llvm;
+using namespace souper;
+
+STATISTIC(QueriesReplayed, "Number of SMT queries answered from a query log");
+STATISTIC(QueriesRecorded, "Number of SMT queries added to a query log");
+STATISTIC(QueriesUnanswered,
+          "Number of SMT queries missing from a query log");
+
+std::string QueryLog::getKey(StringRef Query, unsigned NumModels) {
+  SHA1 Hasher;
+  Hasher.update(Query);
+  return toHex(Hasher.final(), /*LowerCase=*/true) + " " +
+         std::to_string(NumModels);
+}
+
+std::error_code QueryLog::load(StringRef Filename, std::string &ErrStr) {
+  if (!sys::fs::exists(Filename))
+    return std::error_code();
+  auto MB = MemoryBuffer::getFile(Filename);
+  if (!MB)
+    return MB.getError();
+
+  std::lock_guard<std::mutex> Lock(Mutex);
+  SmallVector<StringRef, 16> Lines;
+  (*MB)->getBuffer().split(Lines, '\n', /*MaxSplit=*/-1, /*KeepEmpty=*/false);
+  for (unsigned LineNo = 0; LineNo != Lines.size(); ++LineNo) {
+    SmallVector<StringRef, 8> Fields;
+    Lines[LineNo].split(Fields, ' ', /*MaxSplit=*/-1, /*KeepEmpty=*/false);
+    auto Fail = [&](const Twine &Msg) {
+      ErrStr = (Filename + ":" + Twine(LineNo + 1) + ": " + Msg).str();
+      return std::make_error_code(std::errc::invalid_argument);
+    };
+    unsigned NumModels;
+    if (Fields.size() < 3 || Fields[0].size() != 40 ||
+        Fields[1].getAsInteger(10, NumModels))
+      return Fail("expected a query hash, a number of models and an answer");
+
+    Answer A;
+    if (Fields[2] == "sat")
+      A.Kind = Answer::Sat;
+    else if (Fields[2] == "unsat")
+      A.Kind = Answer::Unsat;
+    else if (Fields[2] == "timeout")
+      A.Kind = Answer::Timeout;
+    else if (Fields[2] == "error")
+      A.Kind = Answer::Error;
+    else
+      return Fail("unknown answer '" + Fields[2] + "'");
+
+    for (unsigned I = 3; I != Fields.size(); ++I) {
+      StringRef Width, Value;
+      std::tie(Width, Value) = Fields[I].split(':');
+      unsigned W;
+      if (A.Kind != Answer::Sat || Width.getAsInteger(10, W) || W == 0 ||
+          Value.empty())
+        return Fail("malformed model '" + Fields[I] + "'");
+      APInt Model;
+      if (Value.getAsInteger(16, Model))
+        return Fail("malformed model '" + Fields[I] + "'");
+      A.Models.push_back(Model.zextOrTrunc(W));
+    }
+    if (A.Kind == Answer::Sat && A.Models.size() != NumModels)
+      return Fail("expected " + Twine(NumModels) + " models");
+
+    Answers[(Fields[0] + " " + Fields[1]).str()] = std::move(A);
+  }
+  return std::error_code();
+}
+
+std::error_code QueryLog::save(StringRef Filename) const {
+  std::error_code EC;
+  raw_fd_ostream Out(Filename, EC, sys::fs::OF_Text);
+  if (EC)
+    return EC;
+
+  std::lock_guard<std::mutex> Lock(Mutex);
+  for (const auto &P : Answers) {
+    const Answer &A = P.second;
+    Out << P.first << ' ';
+    switch (A.Kind) {
+    case Answer::Sat:
+      Out << "sat";
+      for (const auto &M : A.Models)
+        Out << ' ' << M.getBitWidth() << ':'
+            << toString(M, 16, /*Signed=*/false);
+      break;
+    case Answer::Unsat:
+      Out << "unsat";
+      break;
+    case Answer::Timeout:
+      Out << "timeout";
+      break;
+    case Answer::Error:
+      Out << "error";
+      break;
+    }
+    Out << '\n';
+  }
+  Out.close();
+  return Out.error();
+}
+
+bool QueryLog::lookup(StringRef Query, unsigned NumModels, Answer &A) const {
+  std::string Key = getKey(Query, NumModels);
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto It = Answers.find(Key);
+  if (It == Answers.end())
+    return false;
+  A = It->second;
+  return true;
+}
+
+void QueryLog::insert(StringRef Query, unsigned NumModels, const Answer &A) {
+  std::string Key = getKey(Query, NumModels);
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Answers[Key] = A;
+}
+
+size_t QueryLog::size() const {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  return Answers.size();
+}
+
+namespace {
+
+class ReplayingSolver : public SMTLIBSolver {
+  QueryLog &Log;
+  std::unique_ptr<SMTLIBSolver> S;
+
+public:
+  ReplayingSolver(QueryLog &Log, std::unique_ptr<SMTLIBSolver> S)
+    : Log(Log), S(std::move(S)) {}
+
+  std::string getName() const override {
+    return S ? "replaying " + S->getName() : "replaying";
+  }
+
+  std::error_code isSatisfiable(StringRef Query, bool &Result,
+                                unsigned NumModels, std::vector<APInt> *Models,
+                                unsigned Timeout) override {
+    QueryLog::Answer A;
+    if (Log.lookup(Query, NumModels, A)) {
+      ++QueriesReplayed;
+    } else if (!S) {
+      ++QueriesUnanswered;
+      return std::make_error_code(std::errc::no_message_available);
+    } else {
+      std::vector<APInt> SolverModels;
+      bool Sat;
+      std::error_code EC = S->isSatisfiable(Query, Sat, NumModels,
+                                            &SolverModels, Timeout);
+      if (EC == std::errc::timed_out)
+        A.Kind = QueryLog::Answer::Timeout;
+      else if (EC)
+        A.Kind = QueryLog::Answer::Error;
+      else if (Sat)
+        A.Kind = QueryLog::Answer::Sat;
+      else
+        A.Kind = QueryLog::Answer::Unsat;
+      if (A.Kind == QueryLog::Answer::Sat)
+        A.Models = std::move(SolverModels);
+      ++QueriesRecorded;
+      Log.insert(Query, NumModels, A);
+    }
+
+    switch (A.Kind) {
+    case QueryLog::Answer::Sat:
+      Result = true;
+      if (Models)
+        *Models = A.Models;
+      return std::error_code();
+    case QueryLog::Answer::Unsat:
+      Result = false;
+      return std::error_code();
+    case QueryLog::Answer::Timeout:
+      return std::make_error_code(std::errc::timed_out);
+    case QueryLog::Answer::Error:
+      break;
+    }
+    return std::make_error_code(std::errc::protocol_error);
+  }
+};
+
+}
+
+std::unique_ptr<SMTLIBSolver>
+souper::createReplayingSolver(QueryLog &Log, std::unique_ptr<SMTLIBSolver> S) {
+  return std::unique_ptr<SMTLIBSolver>(new ReplayingSolver(Log, std::move(S)));
+}
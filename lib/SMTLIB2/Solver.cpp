@@ -23,6 +23,7 @@
 #include "llvm/Support/Program.h"
 #include "llvm/Support/raw_ostream.h"
 #include "souper/SMTLIB2/Solver.h"
+#include "souper/Util/Cancellation.h"
 #include <fcntl.h>
 #include <stdio.h>
 #include <sys/resource.h>
@@ -39,6 +40,7 @@ STATISTIC(Errors, "Number of SMT solver errors");
 STATISTIC(Sats, "Number of satisfiable SMT queries");
 STATISTIC(Timeouts, "Number of SMT solver timeouts");
 STATISTIC(Unsats, "Number of unsatisfiable SMT queries");
+STATISTIC(Cancelled, "Number of SMT queries skipped because their work was cancelled");
 
 SMTLIBSolver::~SMTLIBSolver() {}
 
@@ -224,6 +226,17 @@ public:
   std::error_code isSatisfiable(StringRef Query, bool &Result,
                                 unsigned NumModels, std::vector<APInt> *Models,
                                 unsigned Timeout) override {
+    // Queries may not outlive the token of the work they are part of.
+    if (CancellationToken *Token = CancellationToken::current()) {
+      if (Token->isCancelled()) {
+        ++Cancelled;
+        return std::make_error_code(std::errc::timed_out);
+      }
+      unsigned Remaining = Token->remainingSeconds();
+      if (Remaining && (!Timeout || Remaining < Timeout))
+        Timeout = Remaining;
+    }
+
     int InputFD;
     SmallString<64> InputPath;
     if (std::error_code EC =
@@ -246,6 +259,7 @@ public:
     }
     ::close(OutputFD);
 
+    ++threadQueryCount();
     int ExitCode =
         Prog(Args, InputPath, OutputPath, /*ErrorPath=*/"/dev/null", Timeout);
 
@@ -370,3 +384,8 @@ std::unique_ptr<SMTLIBSolver> souper::createZ3Solver(SolverProgram Prog,
   return std::unique_ptr<SMTLIBSolver>(
       new ProcessSMTLIBSolver("Z3", Keep, Prog, {"-smt2", "-in"}));
 }
+
+unsigned long &souper::threadQueryCount() {
+  static thread_local unsigned long Count = 0;
+  return Count;
+}
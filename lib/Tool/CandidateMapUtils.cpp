@@ -13,63 +13,681 @@
 // limitations under the License.
 
 #include "souper/Tool/CandidateMapUtils.h"
+#include "souper/Parser/Parser.h"
+#include "souper/Tool/FunctionCache.h"
+#include "souper/Util/Cancellation.h"
 #include "souper/Util/DfaUtils.h"
 
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/KnownBits.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
 #include "souper/KVStore/KVStore.h"
 #include "souper/SMTLIB2/Solver.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+
+static llvm::cl::opt<souper::CandidateOrderKind> CandidateOrder(
+    "souper-candidate-order",
+    llvm::cl::desc("Order in which candidates are solved"),
+    llvm::cl::values(
+      clEnumValN(souper::CandidateOrderKind::Extraction, "extraction",
+                 "In the order they were extracted (default)"),
+      clEnumValN(souper::CandidateOrderKind::Static, "static",
+                 "Hottest first, by static block frequency"),
+      clEnumValN(souper::CandidateOrderKind::Dynamic, "dynamic",
+                 "Hottest first, by the dynamic profile counts in the "
+                 "external cache")),
+    llvm::cl::init(souper::CandidateOrderKind::Extraction));
+
+static llvm::cl::opt<unsigned> SolveBudget("souper-solve-budget",
+    llvm::cl::desc("Stop solving candidates after this many seconds "
+                   "(default=0, no limit)"),
+    llvm::cl::init(0));
+
+static llvm::cl::opt<int> FunctionBudget("souper-function-budget",
+    llvm::cl::desc("Stop solving the candidates of a function after this "
+                   "many seconds (default=-1, no limit)"),
+    llvm::cl::init(-1));
+
+static llvm::cl::opt<int> CandidateBudget("souper-candidate-budget",
+    llvm::cl::desc("Give up on a candidate after solving it for this many "
+                   "seconds (default=-1, no limit)"),
+    llvm::cl::init(-1));
+
+bool souper::CandidateMap::add(const CandidateReplacement &CR) {
+  ++NumCandidates;
+  auto Inserted = Index.emplace(
+    GetReplacementLHSKey(CR.BPCs, CR.PCs, CR.Mapping.LHS), Entries.size());
+  if (!Inserted.second) {
+    Origins[Inserted.first->second].push_back(CR.Origin);
+    return false;
+  }
+  Entries.push_back(CR);
+  Origins.push_back({CR.Origin});
+  return true;
+}
 
 void souper::AddToCandidateMap(CandidateMap &M,
                                const CandidateReplacement &CR) {
-  M.emplace_back(CR);
+  M.add(CR);
 }
 
-void souper::AddModuleToCandidateMap(InstContext &IC, ExprBuilderContext &EBC,
-                                     CandidateMap &CandMap, llvm::Module *M) {
-  for (auto &F : *M) {
-    FunctionCandidateSet CS = ExtractCandidates(&F, IC, EBC);
+namespace souper {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point Start) {
+  return std::chrono::duration<double>(Clock::now() - Start).count();
+}
+
+// A private copy of the module, parsed into its own LLVMContext, together
+// with the souper state needed to extract candidates from it. Extraction
+// workers never share LLVM or souper state.
+struct ExtractionWorker {
+  llvm::LLVMContext Context;
+  std::unique_ptr<llvm::Module> M;
+  InstContext IC;
+  ExprBuilderContext EBC;
+};
+
+// Moves candidates from the workers' InstContexts into the shared one, and
+// their origins from the workers' copies of the module back to the
+// original module.
+class CandidateImporter {
+  InstContext &IC;
+  std::unordered_map<const llvm::Value *, llvm::Value *> Origins;
+  std::map<Inst *, Inst *> InstCache;
+  std::map<Block *, Block *> BlockCache;
+  std::set<const llvm::Module *> MappedModules;
+  // The variables of globals and constant expressions, which a sequential
+  // extraction shares between all functions of the module.
+  std::unordered_map<const llvm::Value *, Inst *> ModuleVars;
+
+  void mapConstant(const llvm::Constant *From, llvm::Constant *To) {
+    if (!Origins.emplace(From, To).second ||
+        llvm::isa<llvm::GlobalValue>(From))
+      return;
+    for (unsigned I = 0; I != From->getNumOperands(); ++I)
+      if (auto C = llvm::dyn_cast<llvm::Constant>(From->getOperand(I)))
+        mapConstant(C, llvm::cast<llvm::Constant>(To->getOperand(I)));
+  }
+
+  // The global or constant expression in the original module that V was
+  // built for, if any.
+  const llvm::Value *getModuleLevelOrigin(Inst *V) {
+    for (auto O : V->Origins) {
+      if (!llvm::isa<llvm::Constant>(O))
+        continue;
+      auto It = Origins.find(O);
+      if (It != Origins.end())
+        return It->second;
+    }
+    return nullptr;
+  }
+
+  Inst *import(Inst *I) {
+    auto It = InstCache.find(I);
+    if (It != InstCache.end())
+      return It->second;
+
+    std::vector<Inst *> Ops;
+    for (auto Op : I->Ops)
+      Ops.push_back(import(Op));
+
+    Inst *Copy;
+    switch (I->K) {
+    case Inst::Const:
+      Copy = IC.getConst(I->Val);
+      break;
+    case Inst::UntypedConst:
+      Copy = IC.getUntypedConst(I->Val);
+      break;
+    case Inst::Phi:
+      Copy = IC.getPhi(BlockCache.at(I->B), Ops, I->DemandedBits);
+      break;
+    default:
+      Copy = IC.getInst(I->K, I->Width, Ops, I->DemandedBits, I->Available);
+      break;
+    }
+    InstCache[I] = Copy;
+    copyAttributes(I, Copy);
+    return Copy;
+  }
+
+  // Copy what the extractor records on an instruction after building it.
+  void copyAttributes(Inst *From, Inst *To) {
+    if (To->K == Inst::Const || To->K == Inst::UntypedConst)
+      return;
+    for (auto V : From->Origins) {
+      auto It = Origins.find(V);
+      if (It != Origins.end() && !To->hasOrigin(It->second))
+        To->Origins.push_back(It->second);
+    }
+    To->HarvestKind = From->HarvestKind;
+    To->HarvestFrom = nullptr;
+    if (From->HarvestFrom)
+      To->HarvestFrom =
+        llvm::cast<llvm::BasicBlock>(Origins.at(From->HarvestFrom));
+    for (auto D : From->DepsWithExternalUses) {
+      auto It = InstCache.find(D);
+      if (It != InstCache.end())
+        To->DepsWithExternalUses.insert(It->second);
+    }
+  }
+
+  // Create the variables and blocks that the worker created while
+  // extracting a function, in the same order, so that they are numbered and
+  // commutative operands are sorted as in a sequential extraction. Begin and
+  // End delimit the function's part of the worker's creation order.
+  void replay(const InstContext &WorkerIC, size_t Begin, size_t End) {
+    const auto &Created = WorkerIC.getCreationOrder();
+    for (size_t I = Begin; I != End; ++I) {
+      if (Block *B = Created[I].second) {
+        Block *Copy = IC.createBlock(B->Preds);
+        BlockCache[B] = Copy;
+        for (unsigned J = 0; J != B->PredVars.size(); ++J)
+          InstCache[B->PredVars[J]] = Copy->PredVars[J];
+        I += B->PredVars.size();
+        continue;
+      }
+      Inst *V = Created[I].first;
+      const llvm::Value *Origin = getModuleLevelOrigin(V);
+      if (Origin) {
+        // Another worker may already have built this global or constant
+        // expression for an earlier function.
+        auto It = ModuleVars.find(Origin);
+        if (It != ModuleVars.end()) {
+          InstCache[V] = It->second;
+          copyAttributes(V, It->second);
+          continue;
+        }
+      }
+      Inst *Copy = IC.createVar(V->Width, V->Name, V->Range, V->KnownZeros,
+                                V->KnownOnes, V->NonZero, V->NonNegative,
+                                V->PowOfTwo, V->Negative, V->NumSignBits,
+                                V->DemandedBits, V->SynthesisConstID);
+      InstCache[V] = Copy;
+      copyAttributes(V, Copy);
+      if (Origin)
+        ModuleVars[Origin] = Copy;
+    }
+  }
+
+public:
+  CandidateImporter(InstContext &IC) : IC(IC) {}
+
+  // Every function must be mapped before any candidate is imported, since
+  // the worker may have attached values of later functions to instructions
+  // that it shares between functions.
+  void mapValues(llvm::Function &From, llvm::Function &To) {
+    if (MappedModules.insert(From.getParent()).second) {
+      auto FromGV = From.getParent()->global_values().begin();
+      for (auto &ToGV : To.getParent()->global_values())
+        Origins[&*FromGV++] = &ToGV;
+    }
+    for (auto FromArg = From.arg_begin(), ToArg = To.arg_begin();
+         FromArg != From.arg_end(); ++FromArg, ++ToArg)
+      Origins[&*FromArg] = &*ToArg;
+    for (auto FromBB = From.begin(), ToBB = To.begin(); FromBB != From.end();
+         ++FromBB, ++ToBB) {
+      Origins[&*FromBB] = &*ToBB;
+      for (auto FromI = FromBB->begin(), ToI = ToBB->begin();
+           FromI != FromBB->end(); ++FromI, ++ToI) {
+        Origins[&*FromI] = &*ToI;
+        for (unsigned Op = 0; Op != FromI->getNumOperands(); ++Op)
+          if (auto C = llvm::dyn_cast<llvm::Constant>(FromI->getOperand(Op)))
+            mapConstant(C, llvm::cast<llvm::Constant>(ToI->getOperand(Op)));
+      }
+    }
+  }
+
+  void import(FunctionCandidateSet &CS, const InstContext &WorkerIC,
+              size_t CreatedBegin, size_t CreatedEnd, CandidateMap &CandMap) {
+    replay(WorkerIC, CreatedBegin, CreatedEnd);
+
     for (auto &B : CS.Blocks) {
       for (auto &R : B->Replacements) {
+        CandidateReplacement Copy(
+          llvm::cast<llvm::Instruction>(Origins.at(R.Origin)),
+          InstMapping(import(R.Mapping.LHS), nullptr));
+        for (auto &PC : R.PCs)
+          Copy.PCs.emplace_back(import(PC.LHS), import(PC.RHS));
+        for (auto &BPC : R.BPCs)
+          Copy.BPCs.emplace_back(BlockCache.at(BPC.B), BPC.PredIdx,
+                                 InstMapping(import(BPC.PC.LHS),
+                                             import(BPC.PC.RHS)));
+        AddToCandidateMap(CandMap, Copy);
+      }
+    }
+  }
+};
+
+// Print Cand as found at Origin, which may be the origin of a candidate
+// that was merged into Cand.
+void printCandidate(llvm::raw_ostream &OS, const CandidateReplacement &Cand,
+                    llvm::Instruction *Origin) {
+  if (Origin == Cand.Origin) {
+    Cand.printFunction(OS);
+  } else {
+    const llvm::Function *F = Origin->getFunction();
+    OS << "; Function: ";
+    if (F->hasLocalLinkage())
+      OS << F->getParent()->getModuleIdentifier() << ":";
+    OS << F->getName() << '\n';
+  }
+  Cand.print(OS);
+}
+
+// The cached value of a function is a sequence of records, one per
+// candidate:
+//
+//   <origin index> <LHS size> <result size>\n<LHS><result>
+//
+// where the origin index counts the instructions of the function, the LHS
+// is printed as by GetReplacementLHSString and the result is the printed
+// replacement, or is empty if the solver found none.
+void appendCacheRecord(std::string &Value, unsigned OriginIdx,
+                       llvm::StringRef LHS, llvm::StringRef Result) {
+  llvm::raw_string_ostream OS(Value);
+  OS << OriginIdx << ' ' << LHS.size() << ' ' << Result.size() << '\n'
+     << LHS << Result;
+}
+
+std::vector<llvm::Instruction *> getInstructions(llvm::Function &F) {
+  std::vector<llvm::Instruction *> Insts;
+  for (auto &BB : F)
+    for (auto &I : BB)
+      Insts.push_back(&I);
+  return Insts;
+}
+
+// Parse the cached candidates of F into IC. Returns false if the value is
+// malformed, in which case F has to be extracted again.
+bool parseCachedCandidates(llvm::Function &F, llvm::StringRef Value,
+                           InstContext &IC,
+                           std::vector<CandidateReplacement> &Candidates,
+                           FunctionCache &FC) {
+  std::vector<llvm::Instruction *> Insts = getInstructions(F);
+  std::vector<CandidateReplacement> Cands;
+  std::vector<std::pair<std::string, std::string>> Results;
+  while (!Value.empty()) {
+    llvm::StringRef Header;
+    std::tie(Header, Value) = Value.split('\n');
+    llvm::SmallVector<llvm::StringRef, 3> Fields;
+    Header.split(Fields, ' ');
+    unsigned OriginIdx, LHSSize, ResultSize;
+    if (Fields.size() != 3 || Fields[0].getAsInteger(10, OriginIdx) ||
+        Fields[1].getAsInteger(10, LHSSize) ||
+        Fields[2].getAsInteger(10, ResultSize) ||
+        OriginIdx >= Insts.size() || LHSSize + ResultSize > Value.size())
+      return false;
+    llvm::StringRef LHS = Value.substr(0, LHSSize);
+    llvm::StringRef Result = Value.substr(LHSSize, ResultSize);
+    Value = Value.drop_front(LHSSize + ResultSize);
+
+    ReplacementContext Context;
+    std::string ErrStr;
+    ParsedReplacement P =
+      ParseReplacementLHS(IC, "<function cache>", LHS, Context, ErrStr);
+    if (!ErrStr.empty())
+      return false;
+    llvm::Instruction *Origin = Insts[OriginIdx];
+    if (!P.Mapping.LHS->hasOrigin(Origin))
+      P.Mapping.LHS->Origins.push_back(Origin);
+    CandidateReplacement Cand(Origin, InstMapping(P.Mapping.LHS, nullptr));
+    Cand.PCs = P.PCs;
+    Cand.BPCs = P.BPCs;
+    Cands.push_back(Cand);
+
+    ReplacementContext PrintContext;
+    Results.emplace_back(GetReplacementLHSString(Cand.BPCs, Cand.PCs,
+                                                 Cand.Mapping.LHS,
+                                                 PrintContext),
+                         Result.str());
+  }
+  Candidates.insert(Candidates.end(), Cands.begin(), Cands.end());
+  for (auto &R : Results)
+    FC.Results[R.first] = R.second;
+  return true;
+}
+
+// Store the candidates of the pending functions of FC along with their
+// results. LHSStrings, Results and Solved are indexed by entry of M.
+void storeCachedFunctions(FunctionCache &FC, CandidateMap &M,
+                          const std::vector<std::string> &LHSStrings,
+                          const std::vector<std::string> &Results,
+                          const std::vector<bool> &Solved) {
+  std::unordered_map<llvm::Function *, std::string> Values;
+  std::unordered_map<llvm::Instruction *, unsigned> OriginIdx;
+  for (auto &P : FC.Pending) {
+    Values[P.first];
+    unsigned Idx = 0;
+    for (auto I : getInstructions(*P.first))
+      OriginIdx[I] = Idx++;
+  }
+  // The parser does not accept a constant LHS, so functions with such
+  // candidates are never stored, and neither are functions with candidates
+  // left unsolved when the solving budget ran out.
+  std::set<llvm::Function *> Uncacheable;
+  for (unsigned I = 0; I != M.size(); ++I) {
+    for (auto Origin : M.getOrigins(I)) {
+      llvm::Function *F = Origin->getFunction();
+      auto It = Values.find(F);
+      if (It == Values.end())
+        continue;
+      if (M[I].Mapping.LHS->K == Inst::Const || !Solved[I])
+        Uncacheable.insert(F);
+      else
+        appendCacheRecord(It->second, OriginIdx.at(Origin), LHSStrings[I],
+                          Results[I]);
+    }
+  }
+  for (auto &P : FC.Pending)
+    if (!Uncacheable.count(P.first))
+      FC.set(P.second, Values[P.first]);
+  FC.Pending.clear();
+}
+
+// Look up every function of M in FC, parsing the candidates of the
+// functions that are found. The others are recorded as pending so that
+// their results can be stored once they are solved.
+std::vector<bool> reuseCachedFunctions(
+    llvm::Module *M, InstContext &IC, FunctionCache &FC,
+    std::vector<std::vector<CandidateReplacement>> &Cached) {
+  std::vector<bool> Reused;
+  Cached.resize(M->size());
+  unsigned FI = 0;
+  for (auto &F : *M) {
+    std::string Key = FC.getKey(F);
+    std::string Value;
+    ++FC.Lookups;
+    bool Found = FC.get(Key, Value) &&
+      parseCachedCandidates(F, Value, IC, Cached[FI], FC);
+    if (Found)
+      ++FC.Reused;
+    else
+      FC.Pending.emplace_back(&F, Key);
+    Reused.push_back(Found);
+    ++FI;
+  }
+  return Reused;
+}
+
+void AddModuleToCandidateMapParallel(InstContext &IC, CandidateMap &CandMap,
+                                     llvm::Module *M, unsigned Threads,
+                                     ExtractionStats *Stats,
+                                     const std::vector<bool> &Reused,
+                                     std::vector<std::vector<
+                                       CandidateReplacement>> &Cached) {
+  llvm::SmallVector<char, 0> Bitcode;
+  {
+    llvm::raw_svector_ostream OS(Bitcode);
+    llvm::WriteBitcodeToFile(*M, OS);
+  }
+  llvm::MemoryBufferRef Buffer(llvm::StringRef(Bitcode.data(), Bitcode.size()),
+                               M->getModuleIdentifier());
+
+  std::vector<llvm::Function *> Functions;
+  for (auto &F : *M)
+    Functions.push_back(&F);
+
+  // Functions are handed out dynamically, but each result is stored at its
+  // function's index so that the candidate order does not depend on the
+  // scheduling.
+  std::vector<std::unique_ptr<ExtractionWorker>> Workers(Threads);
+  std::vector<FunctionCandidateSet> Results(Functions.size());
+  std::vector<llvm::Function *> ResultFunctions(Functions.size());
+  std::vector<unsigned> ResultWorkers(Functions.size());
+  std::vector<std::pair<size_t, size_t>> Created(Functions.size());
+  std::vector<double> Seconds(Threads);
+  std::atomic<unsigned> Next(0);
+  llvm::ThreadPool Pool(llvm::hardware_concurrency(Threads));
+  for (unsigned T = 0; T != Threads; ++T) {
+    Pool.async([&, T] {
+      Workers[T].reset(new ExtractionWorker);
+      ExtractionWorker &W = *Workers[T];
+      auto MOrErr = llvm::getLazyBitcodeModule(Buffer, W.Context);
+      if (!MOrErr)
+        llvm::report_fatal_error(llvm::toString(MOrErr.takeError()).c_str());
+      W.M = std::move(*MOrErr);
+      std::vector<llvm::Function *> WorkerFunctions;
+      for (auto &F : *W.M)
+        WorkerFunctions.push_back(&F);
+      for (unsigned FI = Next++; FI < Functions.size(); FI = Next++) {
+        if (!Reused.empty() && Reused[FI])
+          continue;
+        auto Start = Clock::now();
+        llvm::Function *F = WorkerFunctions[FI];
+        if (llvm::Error E = F->materialize())
+          llvm::report_fatal_error(llvm::toString(std::move(E)).c_str());
+        size_t CreatedBegin = W.IC.getCreationOrder().size();
+        Results[FI] = ExtractCandidates(F, W.IC, W.EBC);
+        ResultFunctions[FI] = F;
+        ResultWorkers[FI] = T;
+        Created[FI] = {CreatedBegin, W.IC.getCreationOrder().size()};
+        Seconds[T] += secondsSince(Start);
+      }
+    });
+  }
+  Pool.wait();
+
+  CandidateImporter Importer(IC);
+  for (unsigned FI = 0; FI != Functions.size(); ++FI)
+    if (ResultFunctions[FI])
+      Importer.mapValues(*ResultFunctions[FI], *Functions[FI]);
+  for (unsigned FI = 0; FI != Functions.size(); ++FI) {
+    if (ResultFunctions[FI]) {
+      Importer.import(Results[FI], Workers[ResultWorkers[FI]]->IC,
+                      Created[FI].first, Created[FI].second, CandMap);
+      if (Stats)
+        Stats->Skipped += Results[FI].Skipped;
+    } else
+      for (auto &R : Cached[FI])
         AddToCandidateMap(CandMap, R);
+  }
+
+  if (Stats)
+    for (auto S : Seconds)
+      Stats->FunctionSeconds += S;
+}
+
+}
+
+}
+
+void souper::AddModuleToCandidateMap(InstContext &IC, ExprBuilderContext &EBC,
+                                     CandidateMap &CandMap, llvm::Module *M,
+                                     unsigned Threads,
+                                     ExtractionStats *Stats,
+                                     FunctionCache *FC) {
+  auto Start = Clock::now();
+  // Cached functions are parsed first in both modes, so that their
+  // variables are numbered independently of the number of threads.
+  std::vector<bool> Reused;
+  std::vector<std::vector<CandidateReplacement>> Cached;
+  if (FC)
+    Reused = reuseCachedFunctions(M, IC, *FC, Cached);
+  if (Threads > 1) {
+    AddModuleToCandidateMapParallel(IC, CandMap, M, Threads, Stats, Reused,
+                                    Cached);
+  } else {
+    unsigned FI = 0;
+    for (auto &F : *M) {
+      unsigned Idx = FI++;
+      if (!Reused.empty() && Reused[Idx]) {
+        for (auto &R : Cached[Idx])
+          AddToCandidateMap(CandMap, R);
+        continue;
+      }
+      FunctionCandidateSet CS = ExtractCandidates(&F, IC, EBC);
+      for (auto &B : CS.Blocks) {
+        for (auto &R : B->Replacements) {
+          AddToCandidateMap(CandMap, R);
+        }
       }
+      if (Stats)
+        Stats->Skipped += CS.Skipped;
     }
   }
+  if (Stats) {
+    Stats->Threads = std::max(Threads, 1u);
+    Stats->Functions = M->size();
+    Stats->WallSeconds = secondsSince(Start);
+    if (Threads <= 1)
+      Stats->FunctionSeconds = Stats->WallSeconds;
+  }
+}
+
+bool souper::SolvingBudget::exhausted() const {
+  return SolveBudget && secondsSince(Start) >= SolveBudget;
+}
+
+void souper::SolvingBudget::startFunction() {
+  FunctionStart = Clock::now();
+  InFunction = true;
+}
+
+bool souper::SolvingBudget::functionExhausted() const {
+  return exhausted() || (InFunction && FunctionBudget >= 0 &&
+                         secondsSince(FunctionStart) >= FunctionBudget);
+}
+
+std::chrono::steady_clock::time_point
+souper::SolvingBudget::candidateDeadline() const {
+  auto Deadline = Clock::time_point::max();
+  auto Now = Clock::now();
+  if (SolveBudget)
+    Deadline = std::min(Deadline, Start + std::chrono::seconds(SolveBudget));
+  if (InFunction && FunctionBudget >= 0)
+    Deadline = std::min(Deadline,
+                        FunctionStart + std::chrono::seconds(FunctionBudget));
+  if (CandidateBudget >= 0)
+    Deadline = std::min(Deadline, Now + std::chrono::seconds(CandidateBudget));
+  return Deadline;
+}
+
+namespace {
+
+// Block frequencies of a function for which no analysis manager is
+// available.
+struct FunctionFrequencies {
+  llvm::DominatorTree DT;
+  llvm::LoopInfo LI;
+  llvm::BranchProbabilityInfo BPI;
+  llvm::BlockFrequencyInfo BFI;
+
+  FunctionFrequencies(llvm::Function &F)
+    : DT(F), LI(DT), BPI(F, LI), BFI(F, BPI, LI) {}
+};
+
+}
+
+std::vector<unsigned> souper::GetSolvingOrder(
+    CandidateMap &M, KVStore *KV,
+    std::function<llvm::BlockFrequencyInfo *(llvm::Function &)> GetBFI) {
+  std::vector<unsigned> Order(M.size());
+  for (unsigned I = 0; I != M.size(); ++I)
+    Order[I] = I;
+  if (CandidateOrder == CandidateOrderKind::Extraction)
+    return Order;
+
+  std::unique_ptr<KVStore> OwnedKV;
+  if (CandidateOrder == CandidateOrderKind::Dynamic && !KV) {
+    OwnedKV.reset(new KVStore);
+    KV = OwnedKV.get();
+  }
+  std::unordered_map<llvm::Function *,
+                     std::unique_ptr<FunctionFrequencies>> Frequencies;
+  auto getBFI = [&](llvm::Function &F) {
+    if (GetBFI)
+      return GetBFI(F);
+    auto &FF = Frequencies[&F];
+    if (!FF)
+      FF.reset(new FunctionFrequencies(F));
+    return &FF->BFI;
+  };
+
+  std::vector<double> Weights(M.size());
+  for (unsigned I = 0; I != M.size(); ++I) {
+    auto &Cand = M[I];
+    std::string LHS;
+    if (CandidateOrder == CandidateOrderKind::Dynamic) {
+      ReplacementContext Context;
+      LHS = GetReplacementLHSString(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
+                                    Context);
+    }
+    for (auto Origin : M.getOrigins(I)) {
+      if (CandidateOrder == CandidateOrderKind::Static) {
+        llvm::BlockFrequencyInfo *BFI = getBFI(*Origin->getFunction());
+        Weights[I] += double(BFI->getBlockFreq(Origin->getParent())
+                               .getFrequency()) / BFI->getEntryFreq();
+      } else {
+        // The profiling runtime counts executions under the same key and
+        // field as the pass's instrumentation.
+        std::string Loc;
+        llvm::raw_string_ostream LocOS(Loc);
+        Origin->getDebugLoc().print(LocOS);
+        std::string Count;
+        uint64_t N;
+        if (KV->hGet(LHS, "dprofile " + LocOS.str(), Count) &&
+            !llvm::StringRef(Count).getAsInteger(10, N))
+          Weights[I] += N;
+      }
+    }
+  }
+
+  std::stable_sort(Order.begin(), Order.end(), [&](unsigned A, unsigned B) {
+    return Weights[A] > Weights[B];
+  });
+  return Order;
 }
 
 namespace souper {
 
 bool SolveCandidateMap(llvm::raw_ostream &OS, CandidateMap &M,
-                       Solver *S, InstContext &IC, KVStore *KVForStaticProfile) {
+                       Solver *S, InstContext &IC, KVStore *KVForStaticProfile,
+                       FunctionCache *FC) {
   if (S) {
     OS << "; Listing valid replacements.\n";
     OS << "; Using solver: " << S->getName() << '\n';
 
-    std::vector<int> Profile;
-    std::map<std::string,int> Index;
-    for (int I=0; I < M.size(); ++I) {
-      auto &Cand = M[I];
-      ReplacementContext Context;
-      auto S = GetReplacementLHSString(Cand.BPCs, Cand.PCs,
-                                       Cand.Mapping.LHS, Context);
-      if (Index.find(S) == Index.end()) {
-        Index[S] = I;
-        Profile.push_back(1);
-      } else {
-        ++Profile[Index[S]];
-        Profile.push_back(0);
+    // The function cache is indexed by printed LHS, and stores the printed
+    // result of each entry, or an empty string if the solver found no RHS.
+    std::vector<std::string> LHSStrings, Results;
+    std::vector<bool> Solved;
+    if (FC) {
+      for (auto &Cand : M) {
+        ReplacementContext Context;
+        LHSStrings.push_back(GetReplacementLHSString(Cand.BPCs, Cand.PCs,
+                                                     Cand.Mapping.LHS,
+                                                     Context));
       }
+      Results.resize(M.size());
+      Solved.resize(M.size());
     }
 
-    for (int I=0; I < M.size(); ++I) {
-      if (Profile[I] == 0)
-        continue;
+    SolvingBudget Budget;
+    unsigned Unsolved = 0;
+    for (unsigned I : GetSolvingOrder(M, KVForStaticProfile)) {
       auto &Cand = M[I];
 
       if (KVForStaticProfile) {
@@ -84,6 +702,10 @@ bool SolveCandidateMap(llvm::raw_ostream &OS, CandidateMap &M,
       }
 
       if (isInferDFA()) {
+        if (Budget.exhausted()) {
+          ++Unsolved;
+          continue;
+        }
         OS << '\n';
         Cand.printFunction(OS);
         ReplacementContext Context;
@@ -168,24 +790,54 @@ bool SolveCandidateMap(llvm::raw_ostream &OS, CandidateMap &M,
           return false;
         }
       } else {
-        std::vector<Inst *> RHSs;
-        if (std::error_code EC =
-            S->infer(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
-                     RHSs, /*AllowMultipleRHSs=*/false, IC)) {
-          llvm::errs() << "Unable to query solver: " << EC.message() << '\n';
-          return false;
+        std::string Result;
+        if (FC && FC->Results.count(LHSStrings[I])) {
+          Result = FC->Results[LHSStrings[I]];
+        } else if (Budget.exhausted()) {
+          ++Unsolved;
+          continue;
+        } else {
+          std::vector<Inst *> RHSs;
+          CancellationToken Token(Budget.candidateDeadline());
+          CancellationScope Scope(Token);
+          std::error_code EC = S->infer(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
+                                        RHSs, /*AllowMultipleRHSs=*/false, IC);
+          if (RHSs.empty() && Token.cancelledWork()) {
+            ++Unsolved;
+            continue;
+          }
+          if (EC) {
+            llvm::errs() << "Unable to query solver: " << EC.message() << '\n';
+            return false;
+          }
+          if (!RHSs.empty()) {
+            // use the first RHS in list if there are multiple valid RHSs
+            Cand.Mapping.RHS = RHSs.front();
+            llvm::raw_string_ostream ResultOS(Result);
+            Cand.print(ResultOS);
+          }
+        }
+        if (FC) {
+          Results[I] = Result;
+          Solved[I] = true;
         }
 
-        if (!RHSs.empty()) {
+        if (!Result.empty()) {
           OS << '\n';
-          OS << "; Static profile " << Profile[I] << '\n';
-          // use the first RHS in list if there are multiple valid RHSs
-          Cand.Mapping.RHS = RHSs.front();
+          OS << "; Static profile " << M.getProfile(I) << '\n';
           Cand.printFunction(OS);
-          Cand.print(OS);
+          OS << Result;
         }
       }
     }
+
+    if (Unsolved)
+      llvm::errs() << "; Solving budget exhausted, " << Unsolved << " of "
+                   << M.size() << " candidates were not solved\n";
+
+    // Results of the data flow queries are not cached.
+    if (FC && !isInferDFA())
+      storeCachedFunctions(*FC, M, LHSStrings, Results, Solved);
   } else {
     OS << "; No solver specified; listing all candidate replacements.\n";
     for (auto &Cand : M) {
@@ -209,7 +861,8 @@ bool CheckCandidateMap(llvm::Module &Mod, CandidateMap &M, Solver *S,
   unsigned ExpectedID = Mod.getContext().getMDKindID("expected");
 
   bool OK = true;
-  for (auto &Cand : M) {
+  for (unsigned I = 0; I != M.size(); ++I) {
+    auto &Cand = M[I];
     std::vector<Inst *> RHSs;
     if (std::error_code EC =
         S->infer(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
@@ -217,28 +870,29 @@ bool CheckCandidateMap(llvm::Module &Mod, CandidateMap &M, Solver *S,
       llvm::errs() << "Unable to query solver: " << EC.message() << '\n';
       return false;
     }
-    if (!RHSs.empty()) {
-       // use the first RHS in list if there are multiple valid RHSs
-      Cand.Mapping.RHS = RHSs.front();
-      if (Cand.Mapping.RHS->K != Inst::Const) {
-        llvm::errs() << "found replacement:\n";
-        Cand.printFunction(llvm::errs());
-        Cand.print(llvm::errs());
-        llvm::errs() << "but cannot yet analyze non-constant replacements\n";
-        OK = false;
-        continue;
-      }
-      llvm::APInt ActualVal = Cand.Mapping.RHS->Val;
+    if (RHSs.empty())
+      continue;
+    // use the first RHS in list if there are multiple valid RHSs
+    Cand.Mapping.RHS = RHSs.front();
+    if (Cand.Mapping.RHS->K != Inst::Const) {
+      llvm::errs() << "found replacement:\n";
+      Cand.printFunction(llvm::errs());
+      Cand.print(llvm::errs());
+      llvm::errs() << "but cannot yet analyze non-constant replacements\n";
+      OK = false;
+      continue;
+    }
+    llvm::APInt ActualVal = Cand.Mapping.RHS->Val;
 
-      llvm::Instruction *Inst = Cand.Origin;
+    // A constant RHS holds for every candidate merged into this entry.
+    for (llvm::Instruction *Inst : M.getOrigins(I)) {
       llvm::MDNode *ExpectedMD = Inst->getMetadata(ExpectedID);
       if (!ExpectedMD) {
         llvm::errs() << "instruction:\n";
         Inst->print(llvm::errs(), /*IsForDebug=*/true);
         llvm::errs() << "\n";
         llvm::errs() << "unexpected simplification:\n";
-        Cand.printFunction(llvm::errs());
-        Cand.print(llvm::errs());
+        printCandidate(llvm::errs(), Cand, Inst);
         OK = false;
         continue;
       }
@@ -266,8 +920,7 @@ bool CheckCandidateMap(llvm::Module &Mod, CandidateMap &M, Solver *S,
         llvm::errs() << "\n";
         llvm::errs() << "unexpected simplification, wanted " << ExpectedVal
                      << ":\n";
-        Cand.printFunction(llvm::errs());
-        Cand.print(llvm::errs());
+        printCandidate(llvm::errs(), Cand, Inst);
         OK = false;
         continue;
       }
@@ -0,0 +1,186 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "souper/Tool/FunctionCache.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ModuleSlotTracker.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+#include "souper/Tool/Revision.h"
+
+using namespace llvm;
+using namespace souper;
+
+// Bump whenever the format of the cached values changes.
+static const char FunctionCacheVersion[] = "souper-function-cache-1";
+
+FunctionCache::~FunctionCache() {}
+
+// Print MD and, recursively, the nodes it refers to. Debug information is
+// left out: it does not change the results, and it would make every
+// function that moves within its file miss the cache.
+static void printMetadata(const Metadata *MD, ModuleSlotTracker &MST,
+                          raw_ostream &OS,
+                          SmallPtrSetImpl<const MDNode *> &Printed) {
+  auto *N = dyn_cast<MDNode>(MD);
+  if (!N || isa<DINode>(N) || isa<DILocation>(N) || !Printed.insert(N).second)
+    return;
+  N->print(OS, MST);
+  OS << '\n';
+  for (const MDOperand &Op : N->operands())
+    if (Op)
+      printMetadata(Op.get(), MST, OS, Printed);
+}
+
+std::string FunctionCache::getKey(const Function &F) const {
+  std::string IR;
+  raw_string_ostream OS(IR);
+  F.print(OS);
+
+  // F refers to metadata nodes and attribute groups by number, and to the
+  // attributes of its callees not at all; these are printed with the rest
+  // of the module, so they are added here, as are the data layout and the
+  // target triple.
+  const Module *M = F.getParent();
+  OS << "target triple = " << M->getTargetTriple() << '\n'
+     << "target datalayout = " << M->getDataLayoutStr() << '\n';
+  F.getAttributes().print(OS);
+  ModuleSlotTracker MST(M);
+  SmallPtrSet<const MDNode *, 16> PrintedMD;
+  SmallPtrSet<const Function *, 8> PrintedCallees;
+  SmallVector<std::pair<unsigned, MDNode *>, 4> MDs;
+  F.getAllMetadata(MDs);
+  for (auto &MD : MDs)
+    if (MD.first != LLVMContext::MD_dbg)
+      printMetadata(MD.second, MST, OS, PrintedMD);
+  for (const Instruction &I : instructions(F)) {
+    MDs.clear();
+    I.getAllMetadataOtherThanDebugLoc(MDs);
+    for (auto &MD : MDs)
+      printMetadata(MD.second, MST, OS, PrintedMD);
+    auto *CB = dyn_cast<CallBase>(&I);
+    if (!CB || isa<DbgInfoIntrinsic>(CB))
+      continue;
+    CB->getAttributes().print(OS);
+    for (const Use &Arg : CB->args())
+      if (auto *MAV = dyn_cast<MetadataAsValue>(Arg))
+        printMetadata(MAV->getMetadata(), MST, OS, PrintedMD);
+    const Function *Callee = CB->getCalledFunction();
+    if (Callee && PrintedCallees.insert(Callee).second) {
+      OS << "callee " << Callee->getName() << '\n';
+      Callee->getAttributes().print(OS);
+    }
+  }
+  OS.flush();
+
+  // Metadata (!N) and attribute group (#N) numbers are assigned per module,
+  // so they change whenever an unrelated function does.
+  std::string Normalized;
+  Normalized.reserve(IR.size());
+  for (size_t I = 0; I != IR.size(); ++I) {
+    Normalized += IR[I];
+    if (IR[I] == '!' || IR[I] == '#')
+      while (I + 1 != IR.size() && isDigit(IR[I + 1]))
+        ++I;
+  }
+
+  // Results are not reused across souper revisions either.
+  SHA1 Hasher;
+  Hasher.update(FunctionCacheVersion);
+  Hasher.update(StringRef("\0", 1));
+  Hasher.update(SOUPER_REVISION);
+  Hasher.update(StringRef("\0", 1));
+  Hasher.update(Config);
+  Hasher.update(StringRef("\0", 1));
+  Hasher.update(Normalized);
+  return toHex(Hasher.final(), /*LowerCase=*/true);
+}
+
+namespace {
+
+class KVFunctionCache : public FunctionCache {
+  KVStore *KV;
+
+public:
+  KVFunctionCache(KVStore *KV, StringRef Config)
+    : FunctionCache(Config), KV(KV) {}
+
+  bool get(const std::string &Key, std::string &Value) override {
+    return KV->hGet("fcache " + Key, "candidates", Value);
+  }
+
+  void set(const std::string &Key, StringRef Value) override {
+    KV->hSet("fcache " + Key, "candidates", Value);
+  }
+};
+
+class DiskFunctionCache : public FunctionCache {
+  std::string Dir;
+
+public:
+  DiskFunctionCache(StringRef Dir, StringRef Config)
+    : FunctionCache(Config), Dir(Dir) {
+    if (std::error_code EC = sys::fs::create_directories(Dir))
+      report_fatal_error(("cannot create function cache directory '" + Dir +
+                          "': " + EC.message()).str().c_str());
+  }
+
+  bool get(const std::string &Key, std::string &Value) override {
+    SmallString<128> Path(Dir);
+    sys::path::append(Path, Key);
+    auto MB = MemoryBuffer::getFile(Path);
+    if (!MB)
+      return false;
+    Value = (*MB)->getBuffer().str();
+    return true;
+  }
+
+  void set(const std::string &Key, StringRef Value) override {
+    // Write to a temporary file and rename it, so that concurrent runs
+    // sharing the directory never observe a partial entry.
+    SmallString<128> Path(Dir), TmpPath;
+    sys::path::append(Path, Key);
+    int FD;
+    if (sys::fs::createUniqueFile(Path + ".tmp%%%%%%", FD, TmpPath))
+      return;
+    {
+      raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << Value;
+    }
+    if (sys::fs::rename(TmpPath, Path))
+      sys::fs::remove(TmpPath);
+  }
+};
+
+}
+
+std::unique_ptr<FunctionCache> souper::createKVFunctionCache(
+    KVStore *KV, StringRef Config) {
+  return std::unique_ptr<FunctionCache>(new KVFunctionCache(KV, Config));
+}
+
+std::unique_ptr<FunctionCache> souper::createDiskFunctionCache(
+    StringRef Dir, StringRef Config) {
+  return std::unique_ptr<FunctionCache>(new DiskFunctionCache(Dir, Config));
+}
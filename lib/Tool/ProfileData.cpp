@@ -0,0 +1,113 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "souper/Tool/ProfileData.h"
+
+#include "llvm/Support/MemoryBuffer.h"
+#include <cstring>
+
+using namespace llvm;
+using namespace souper;
+
+static const char ProfileMagic[] = "SOUPRPF1";
+
+namespace {
+
+// Reads host-order integers and strings from a buffer, failing once
+// the buffer is exhausted.
+class Reader {
+  StringRef Buffer;
+
+public:
+  Reader(StringRef Buffer) : Buffer(Buffer) {}
+
+  bool empty() const { return Buffer.empty(); }
+
+  template <typename T> bool readInt(T &Value) {
+    if (Buffer.size() < sizeof(T))
+      return false;
+    std::memcpy(&Value, Buffer.data(), sizeof(T));
+    Buffer = Buffer.drop_front(sizeof(T));
+    return true;
+  }
+
+  bool readString(size_t Size, StringRef &Value) {
+    if (Buffer.size() < Size)
+      return false;
+    Value = Buffer.take_front(Size);
+    Buffer = Buffer.drop_front(Size);
+    return true;
+  }
+};
+
+template <typename T> void writeInt(raw_ostream &OS, T Value) {
+  OS.write(reinterpret_cast<const char *>(&Value), sizeof(T));
+}
+
+}
+
+uint64_t ProfileData::getCount(StringRef Key) const {
+  auto It = Counts.find(Key.str());
+  if (It == Counts.end())
+    return 0;
+  uint64_t Count = 0;
+  for (const auto &Field : It->second)
+    Count += Field.second;
+  return Count;
+}
+
+std::error_code ProfileData::read(StringRef Buffer) {
+  Reader R(Buffer);
+  while (!R.empty()) {
+    StringRef Magic;
+    uint64_t Records;
+    if (!R.readString(sizeof(ProfileMagic) - 1, Magic) ||
+        Magic != ProfileMagic || !R.readInt(Records))
+      return std::make_error_code(std::errc::illegal_byte_sequence);
+    for (uint64_t I = 0; I != Records; ++I) {
+      uint64_t Count;
+      uint32_t KeyLen, FieldLen;
+      StringRef Key, Field;
+      if (!R.readInt(Count) || !R.readInt(KeyLen) || !R.readInt(FieldLen) ||
+          !R.readString(KeyLen, Key) || !R.readString(FieldLen, Field))
+        return std::make_error_code(std::errc::illegal_byte_sequence);
+      add(Key, Field, Count);
+    }
+  }
+  return std::error_code();
+}
+
+void ProfileData::write(raw_ostream &OS) const {
+  uint64_t Records = 0;
+  for (const auto &Key : Counts)
+    Records += Key.second.size();
+  OS.write(ProfileMagic, sizeof(ProfileMagic) - 1);
+  writeInt(OS, Records);
+  for (const auto &Key : Counts) {
+    for (const auto &Field : Key.second) {
+      writeInt(OS, Field.second);
+      writeInt(OS, uint32_t(Key.first.size()));
+      writeInt(OS, uint32_t(Field.first.size()));
+      OS << Key.first << Field.first;
+    }
+  }
+}
+
+std::error_code souper::readProfileFile(StringRef Path, ProfileData &Data) {
+  auto MB = MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                  /*RequiresNullTerminator=*/false);
+  if (!MB)
+    return MB.getError();
+  return Data.read((*MB)->getBuffer());
+}
@@ -0,0 +1,552 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "souper/Tool/RemoteSolver.h"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/KnownBits.h"
+#include "llvm/Support/raw_ostream.h"
+#include "souper/Parser/Parser.h"
+#include "souper/Util/Cancellation.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define DEBUG_TYPE "souper"
+
+STATISTIC(RemoteQueries, "Number of queries sent to souper-server");
+STATISTIC(RemoteErrors, "Number of queries that could not reach souper-server");
+STATISTIC(RemoteCacheHits, "Number of queries that souper-server answered from the answers it kept");
+
+using namespace llvm;
+using namespace souper;
+
+// Larger messages are taken to be garbage.
+static const uint32_t MaxMessageSize = 1 << 28;
+
+static std::error_code lastError() {
+  return std::error_code(errno, std::generic_category());
+}
+
+static std::error_code readAll(int FD, char *Buf, size_t Size) {
+  while (Size) {
+    ssize_t N = read(FD, Buf, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N < 0)
+      return lastError();
+    if (N == 0)
+      return std::make_error_code(std::errc::connection_aborted);
+    Buf += N;
+    Size -= N;
+  }
+  return std::error_code();
+}
+
+static std::error_code writeAll(int FD, const char *Buf, size_t Size) {
+  while (Size) {
+    // A peer that went away must not kill the process with SIGPIPE.
+    ssize_t N = send(FD, Buf, Size, MSG_NOSIGNAL);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N < 0)
+      return lastError();
+    Buf += N;
+    Size -= N;
+  }
+  return std::error_code();
+}
+
+std::error_code souper::readMessage(int FD, std::string &Message) {
+  uint32_t Size;
+  if (std::error_code EC = readAll(FD, reinterpret_cast<char *>(&Size),
+                                   sizeof(Size)))
+    return EC;
+  if (Size > MaxMessageSize)
+    return std::make_error_code(std::errc::protocol_error);
+  Message.resize(Size);
+  return readAll(FD, &Message[0], Size);
+}
+
+std::error_code souper::writeMessage(int FD, StringRef Message) {
+  if (Message.size() > MaxMessageSize)
+    return std::make_error_code(std::errc::value_too_large);
+  std::string Buf(sizeof(uint32_t), 0);
+  uint32_t Size = Message.size();
+  std::memcpy(&Buf[0], &Size, sizeof(Size));
+  Buf += Message;
+  return writeAll(FD, Buf.data(), Buf.size());
+}
+
+static std::error_code connectTo(StringRef Path, int &FD) {
+  sockaddr_un Addr;
+  std::memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  if (Path.size() >= sizeof(Addr.sun_path))
+    return std::make_error_code(std::errc::filename_too_long);
+  std::memcpy(Addr.sun_path, Path.data(), Path.size());
+  int S = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (S < 0)
+    return lastError();
+  if (connect(S, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) < 0) {
+    std::error_code EC = lastError();
+    close(S);
+    return EC;
+  }
+  FD = S;
+  return std::error_code();
+}
+
+// Options that both sides register must have the same values; the others
+// are only used by one of them.
+static std::string mismatchedOptions(StringRef Ours, StringRef Theirs) {
+  StringMap<StringRef> Values;
+  SmallVector<StringRef, 64> Lines;
+  Theirs.split(Lines, '\n', -1, /*KeepEmpty=*/false);
+  for (StringRef Line : Lines) {
+    StringRef Name, Value;
+    std::tie(Name, Value) = Line.split('=');
+    Values[Name] = Value;
+  }
+  std::string Mismatched;
+  Lines.clear();
+  Ours.split(Lines, '\n', -1, /*KeepEmpty=*/false);
+  for (StringRef Line : Lines) {
+    StringRef Name, Value;
+    std::tie(Name, Value) = Line.split('=');
+    auto It = Values.find(Name);
+    if (It != Values.end() && It->second != Value)
+      Mismatched += (" -" + Name + "=" + Value + " (server: " + It->second +
+                     ")").str();
+  }
+  return Mismatched;
+}
+
+// Check that the server behind FD answers as this process would.
+static std::error_code sendOptions(int FD, StringRef Options,
+                                   std::string &ErrStr) {
+  std::string Answer, Result;
+  std::error_code EC = writeMessage(FD, ("options 0\n" + Options).str());
+  if (!EC)
+    EC = readMessage(FD, Answer);
+  if (!EC)
+    EC = parseAnswer(Answer, Result);
+  if (EC) {
+    ErrStr = "souper-server did not send its options: " + EC.message();
+    return EC;
+  }
+  std::string Mismatched = mismatchedOptions(Options, Result);
+  if (!Mismatched.empty()) {
+    ErrStr = "souper-server was started with other solver options:" +
+             Mismatched;
+    return std::make_error_code(std::errc::invalid_argument);
+  }
+  return std::error_code();
+}
+
+static std::string printReplacement(const BlockPCs &BPCs,
+                                    const std::vector<InstMapping> &PCs,
+                                    InstMapping Mapping,
+                                    ReplacementContext &Context) {
+  std::string Str;
+  raw_string_ostream SS(Str);
+  PrintReplacementLHS(SS, BPCs, PCs, Mapping.LHS, Context);
+  PrintReplacementRHS(SS, Mapping.RHS, Context);
+  return SS.str();
+}
+
+namespace {
+
+class RemoteSolver : public Solver {
+  std::string Path;
+  std::string Options;
+  int FD;
+
+  // Send a query about a replacement and return the result of the answer.
+  // The connection is closed after an error and opened again by the next
+  // query, so that a restarted server is picked up.
+  std::error_code query(StringRef Command, StringRef Repl,
+                        std::string &Result) {
+    if (isCancelled())
+      return std::make_error_code(std::errc::timed_out);
+    ++RemoteQueries;
+    std::error_code EC;
+    if (FD < 0) {
+      std::string ErrStr;
+      EC = connectTo(Path, FD);
+      if (!EC)
+        EC = sendOptions(FD, Options, ErrStr);
+    }
+    unsigned Timeout = 0;
+    if (CancellationToken *Token = CancellationToken::current())
+      Timeout = Token->remainingSeconds();
+    std::string Answer;
+    if (!EC)
+      EC = writeMessage(FD, (Command + " " + Twine(Timeout) + "\n" +
+                             Repl).str());
+    if (!EC)
+      EC = readMessage(FD, Answer);
+    if (EC) {
+      ++RemoteErrors;
+      if (FD >= 0)
+        close(FD);
+      FD = -1;
+      return EC;
+    }
+    bool Kept;
+    EC = parseAnswer(Answer, Result, &Kept);
+    if (Kept)
+      ++RemoteCacheHits;
+    return EC;
+  }
+
+  std::error_code queryLHS(StringRef Command, const BlockPCs &BPCs,
+                           const std::vector<InstMapping> &PCs, Inst *LHS,
+                           std::string &Result) {
+    ReplacementContext Context;
+    return query(Command, GetReplacementLHSString(BPCs, PCs, LHS, Context),
+                 Result);
+  }
+
+  std::error_code queryBool(StringRef Command, const BlockPCs &BPCs,
+                            const std::vector<InstMapping> &PCs, Inst *LHS,
+                            bool &Value) {
+    std::string Result;
+    if (std::error_code EC = queryLHS(Command, BPCs, PCs, LHS, Result))
+      return EC;
+    if (Result != "0" && Result != "1")
+      return std::make_error_code(std::errc::protocol_error);
+    Value = Result == "1";
+    return std::error_code();
+  }
+
+  static bool parseAPInt(StringRef Str, unsigned Width, APInt &Value) {
+    APInt V;
+    if (Str.getAsInteger(10, V))
+      return false;
+    Value = V.zextOrTrunc(Width);
+    return true;
+  }
+
+public:
+  RemoteSolver(StringRef Path, StringRef Options, int FD)
+    : Path(Path.str()), Options(Options.str()), FD(FD) {}
+
+  ~RemoteSolver() {
+    if (FD >= 0)
+      close(FD);
+  }
+
+  std::error_code infer(const BlockPCs &BPCs,
+                        const std::vector<InstMapping> &PCs,
+                        Inst *LHS, std::vector<Inst *> &RHSs,
+                        bool AllowMultipleRHSs, InstContext &IC) override {
+    ReplacementContext Context;
+    std::string Result;
+    if (std::error_code EC = query("infer",
+                                   GetReplacementLHSString(BPCs, PCs, LHS,
+                                                           Context),
+                                   Result))
+      return EC;
+    // Like the caches, the server only keeps the first RHS.
+    RHSs.clear();
+    if (Result.empty())
+      return std::error_code();
+    std::string ES;
+    ParsedReplacement R = ParseReplacementRHS(IC, "<souper-server>", Result,
+                                              Context, ES);
+    if (ES != "")
+      return std::make_error_code(std::errc::protocol_error);
+    RHSs.emplace_back(R.Mapping.RHS);
+    return std::error_code();
+  }
+
+  std::error_code inferConst(const BlockPCs &BPCs,
+                             const std::vector<InstMapping> &PCs,
+                             Inst *LHS, Inst *&RHS,
+                             std::set<Inst *> &ConstSet,
+                             std::map<Inst *, llvm::APInt> &ResultMap,
+                             InstContext &IC) override {
+    return std::make_error_code(std::errc::function_not_supported);
+  }
+
+  std::error_code isValid(InstContext &IC, const BlockPCs &BPCs,
+                          const std::vector<InstMapping> &PCs,
+                          InstMapping Mapping, bool &IsValid,
+                          std::vector<std::pair<Inst *, llvm::APInt>> *Model)
+  override {
+    ReplacementContext Context;
+    std::string Result;
+    if (std::error_code EC = query(Model ? "model" : "valid",
+                                   printReplacement(BPCs, PCs, Mapping,
+                                                    Context),
+                                   Result))
+      return EC;
+    // The first line is the verdict and every other line a variable of
+    // the model, named as Context names it, and its value.
+    SmallVector<StringRef, 4> Lines;
+    StringRef(Result).split(Lines, '\n', -1, /*KeepEmpty=*/false);
+    if (Lines.empty() || (Lines[0] != "0" && Lines[0] != "1"))
+      return std::make_error_code(std::errc::protocol_error);
+    IsValid = Lines[0] == "1";
+    for (StringRef Line : makeArrayRef(Lines).drop_front()) {
+      if (!Model)
+        break;
+      StringRef Name, Value;
+      std::tie(Name, Value) = Line.split(' ');
+      Inst *I = Context.getInst(Name);
+      APInt V;
+      if (!I || !parseAPInt(Value, I->Width, V))
+        return std::make_error_code(std::errc::protocol_error);
+      Model->emplace_back(I, V);
+    }
+    return std::error_code();
+  }
+
+  std::string getName() override {
+    return "souper-server at " + Path;
+  }
+
+  llvm::ConstantRange constantRange(const BlockPCs &BPCs,
+                                    const std::vector<InstMapping> &PCs,
+                                    Inst *LHS, InstContext &IC) override {
+    std::string Result;
+    if (queryLHS("range", BPCs, PCs, LHS, Result) || Result == "full")
+      return llvm::ConstantRange(LHS->Width, /*isFullSet=*/true);
+    if (Result == "empty")
+      return llvm::ConstantRange(LHS->Width, /*isFullSet=*/false);
+    StringRef Lower, Upper;
+    std::tie(Lower, Upper) = StringRef(Result).split(' ');
+    APInt L, U;
+    if (!parseAPInt(Lower, LHS->Width, L) ||
+        !parseAPInt(Upper, LHS->Width, U) || L == U)
+      return llvm::ConstantRange(LHS->Width, /*isFullSet=*/true);
+    return llvm::ConstantRange(L, U);
+  }
+
+  std::error_code negative(const BlockPCs &BPCs,
+                           const std::vector<InstMapping> &PCs,
+                           Inst *LHS, bool &Negative,
+                           InstContext &IC) override {
+    return queryBool("negative", BPCs, PCs, LHS, Negative);
+  }
+
+  std::error_code knownBits(const BlockPCs &BPCs,
+                            const std::vector<InstMapping> &PCs,
+                            Inst *LHS, llvm::KnownBits &Known,
+                            InstContext &IC) override {
+    std::string Result;
+    if (std::error_code EC = queryLHS("knownbits", BPCs, PCs, LHS, Result))
+      return EC;
+    StringRef Zero, One;
+    std::tie(Zero, One) = StringRef(Result).split(' ');
+    Known = llvm::KnownBits(LHS->Width);
+    if (!parseAPInt(Zero, LHS->Width, Known.Zero) ||
+        !parseAPInt(One, LHS->Width, Known.One))
+      return std::make_error_code(std::errc::protocol_error);
+    return std::error_code();
+  }
+
+  std::error_code nonNegative(const BlockPCs &BPCs,
+                              const std::vector<InstMapping> &PCs,
+                              Inst *LHS, bool &NonNegative,
+                              InstContext &IC) override {
+    return queryBool("nonnegative", BPCs, PCs, LHS, NonNegative);
+  }
+
+  std::error_code powerTwo(const BlockPCs &BPCs,
+                           const std::vector<InstMapping> &PCs,
+                           Inst *LHS, bool &PowerTwo,
+                           InstContext &IC) override {
+    return queryBool("powertwo", BPCs, PCs, LHS, PowerTwo);
+  }
+
+  std::error_code nonZero(const BlockPCs &BPCs,
+                          const std::vector<InstMapping> &PCs,
+                          Inst *LHS, bool &NonZero,
+                          InstContext &IC) override {
+    return queryBool("nonzero", BPCs, PCs, LHS, NonZero);
+  }
+
+  std::error_code signBits(const BlockPCs &BPCs,
+                           const std::vector<InstMapping> &PCs,
+                           Inst *LHS, unsigned &SignBits,
+                           InstContext &IC) override {
+    std::string Result;
+    if (std::error_code EC = queryLHS("signbits", BPCs, PCs, LHS, Result))
+      return EC;
+    if (StringRef(Result).getAsInteger(10, SignBits))
+      return std::make_error_code(std::errc::protocol_error);
+    return std::error_code();
+  }
+
+  std::error_code testDemandedBits(const BlockPCs &BPCs,
+                                   const std::vector<InstMapping> &PCs,
+                                   Inst *LHS,
+                                   std::map<std::string, APInt> &DBitsVect,
+                                   InstContext &IC) override {
+    return std::make_error_code(std::errc::function_not_supported);
+  }
+
+  std::error_code abstractPrecondition(const BlockPCs &BPCs,
+                  const std::vector<InstMapping> &PCs,
+                  InstMapping &Mapping, InstContext &IC,
+                  bool &FoundWeakest) override {
+    return std::make_error_code(std::errc::function_not_supported);
+  }
+};
+
+}
+
+std::unique_ptr<Solver> souper::createRemoteSolver(StringRef Path,
+                                                   StringRef Options,
+                                                   std::string &ErrStr) {
+  int FD;
+  if (std::error_code EC = connectTo(Path, FD)) {
+    ErrStr = "cannot connect to souper-server at '" + Path.str() + "': " +
+             EC.message();
+    return nullptr;
+  }
+  if (sendOptions(FD, Options, ErrStr)) {
+    close(FD);
+    return nullptr;
+  }
+  return std::unique_ptr<Solver>(new RemoteSolver(Path, Options, FD));
+}
+
+static std::string errorAnswer(std::error_code EC) {
+  return "error " + std::to_string(EC.value()) + "\n";
+}
+
+std::error_code souper::parseAnswer(StringRef Answer, std::string &Result,
+                                   bool *Kept) {
+  StringRef Status, Rest;
+  std::tie(Status, Rest) = Answer.split('\n');
+  if (Kept)
+    *Kept = Status == "ok cached";
+  if (Status == "ok" || Status == "ok cached") {
+    Result = Rest.str();
+    return std::error_code();
+  }
+  int Value;
+  if (Status.consume_front("error ") && !Status.getAsInteger(10, Value))
+    return std::error_code(Value, std::generic_category());
+  return std::make_error_code(std::errc::protocol_error);
+}
+
+std::string souper::answerQuery(Solver &S, StringRef Query, bool *Complete) {
+  StringRef Header, Repl, Command, TimeoutStr;
+  std::tie(Header, Repl) = Query.split('\n');
+  std::tie(Command, TimeoutStr) = Header.split(' ');
+  unsigned Timeout;
+  if (TimeoutStr.getAsInteger(10, Timeout))
+    return errorAnswer(std::make_error_code(std::errc::protocol_error));
+  CancellationToken Token(Timeout ? std::chrono::steady_clock::now() +
+                                    std::chrono::seconds(Timeout)
+                                  : std::chrono::steady_clock::time_point::max());
+  CancellationScope Scope(Token);
+
+  InstContext IC;
+  std::string ES;
+  ParsedReplacement R;
+  bool HasRHS = Command == "valid" || Command == "model";
+  if (HasRHS) {
+    R = ParseReplacement(IC, "<query>", Repl, ES);
+  } else {
+    ReplacementContext Context;
+    R = ParseReplacementLHS(IC, "<query>", Repl, Context, ES);
+  }
+  if (ES != "")
+    return errorAnswer(std::make_error_code(std::errc::protocol_error));
+
+  // Results are named as the client names them when it prints the query.
+  ReplacementContext Context;
+  if (HasRHS)
+    printReplacement(R.BPCs, R.PCs, R.Mapping, Context);
+  else
+    GetReplacementLHSString(R.BPCs, R.PCs, R.Mapping.LHS, Context);
+
+  std::string Result;
+  raw_string_ostream OS(Result);
+  std::error_code EC;
+  // Whether the solver found more than it answers when it finds nothing.
+  bool Found;
+  Inst *LHS = R.Mapping.LHS;
+  if (Command == "infer") {
+    std::vector<Inst *> RHSs;
+    EC = S.infer(R.BPCs, R.PCs, LHS, RHSs, /*AllowMultipleRHSs=*/false, IC);
+    Found = !RHSs.empty();
+    if (!EC && Found)
+      OS << GetReplacementRHSString(RHSs.front(), Context);
+  } else if (HasRHS) {
+    bool Valid = false;
+    std::vector<std::pair<Inst *, APInt>> Model;
+    EC = S.isValid(IC, R.BPCs, R.PCs, R.Mapping, Valid,
+                   Command == "model" ? &Model : nullptr);
+    Found = Valid;
+    OS << Valid << "\n";
+    for (auto &M : Model)
+      OS << StringRef(Context.printInst(M.first, nulls(), false)).drop_front()
+         << " " << toString(M.second, 10, false) << "\n";
+  } else if (Command == "range") {
+    ConstantRange CR = S.constantRange(R.BPCs, R.PCs, LHS, IC);
+    Found = !CR.isFullSet();
+    if (CR.isFullSet())
+      OS << "full";
+    else if (CR.isEmptySet())
+      OS << "empty";
+    else
+      OS << toString(CR.getLower(), 10, false) << " "
+         << toString(CR.getUpper(), 10, false);
+  } else if (Command == "knownbits") {
+    KnownBits Known(LHS->Width);
+    EC = S.knownBits(R.BPCs, R.PCs, LHS, Known, IC);
+    Found = !Known.isUnknown();
+    OS << toString(Known.Zero, 10, false) << " "
+       << toString(Known.One, 10, false);
+  } else if (Command == "signbits") {
+    unsigned SignBits = 1;
+    EC = S.signBits(R.BPCs, R.PCs, LHS, SignBits, IC);
+    Found = SignBits > 1;
+    OS << SignBits;
+  } else {
+    bool Value = false;
+    if (Command == "negative")
+      EC = S.negative(R.BPCs, R.PCs, LHS, Value, IC);
+    else if (Command == "nonnegative")
+      EC = S.nonNegative(R.BPCs, R.PCs, LHS, Value, IC);
+    else if (Command == "powertwo")
+      EC = S.powerTwo(R.BPCs, R.PCs, LHS, Value, IC);
+    else if (Command == "nonzero")
+      EC = S.nonZero(R.BPCs, R.PCs, LHS, Value, IC);
+    else
+      EC = std::make_error_code(std::errc::function_not_supported);
+    Found = Value;
+    OS << Value;
+  }
+  if (Complete)
+    *Complete = !Timeout || (!EC && Found);
+  if (EC)
+    return errorAnswer(EC);
+  return "ok\n" + OS.str();
+}
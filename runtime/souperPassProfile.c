@@ -12,106 +12,140 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+// Runtime of -souper-dynamic-profile. The pass places a record for each
+// profiled site in the souper_prof section; at exit, the counts are
+// appended to a .souperprof file (see include/souper/Tool/ProfileData.h),
+// which souper-profdata can merge, print, or upload to Redis.
+
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#include "hiredis.h"
+// Must match the record emitted by SouperPass::dynamicProfile.
+struct souper_prof_rec {
+  const char *repl;
+  const char *field;
+  int64_t *counters;
+  int64_t shards;
+};
 
-static const char *hostname = "127.0.0.1";
-static const int port = 6379;
+// Each shard of a counter fills a cache line.
+#define SHARD_WORDS 8
 
-static redisContext *connect(void)
-{
-  struct timeval timeout = { 1, 500000 }; // 1.5 seconds
-  redisContext *ctx = redisConnectWithTimeout(hostname, port, timeout);
-  if (!ctx) {
-    fprintf(stderr, "FATAL: Can't allocate redis context\n");
-    _exit(-1);
-  }
-  if (ctx->err) {
-    fprintf(stderr, "FATAL: Redis connection error: %s\n", ctx->errstr);
-    _exit(-1);
-  }
-  return ctx;
-}
+extern struct souper_prof_rec __start_souper_prof[] __attribute__((weak));
+extern struct souper_prof_rec __stop_souper_prof[] __attribute__((weak));
+
+// Referenced by the instrumentation; its address tells threads apart.
+__thread char _souper_profile_tls;
 
-static void ensure_integer_reply(redisReply *reply, redisContext *ctx)
+static int64_t count(const struct souper_prof_rec *rec)
 {
-  if (!reply || ctx->err) {
-    fprintf(stderr, "FATAL: Redis error: %s\n", ctx->errstr);
-    _exit(-1);
-  }
-  if (reply->type != REDIS_REPLY_INTEGER) {
-    fprintf(stderr, "FATAL: Redis protocol error, didn't expect reply type %d\n",
-            reply->type);
-    _exit(-1);
-  }
-  freeReplyObject(reply);
+  int64_t sum = 0;
+  for (int64_t i = 0; i < rec->shards; ++i)
+    sum += __atomic_load_n(&rec->counters[i * SHARD_WORDS], __ATOMIC_RELAXED);
+  return sum;
 }
 
-static int to_stdout;
-static int to_stderr;
-
-static struct rec_t {
-  const char *repl;
-  const char *field;
-  int64_t *cntp;
-  struct rec_t *next;
-} *recs;
+struct buf_t {
+  char *data;
+  size_t size, cap;
+};
 
-static void _souper_atexit_handler(void)
+static void append(struct buf_t *buf, const void *data, size_t size)
 {
-  redisContext *ctx;
-  if (!to_stdout && !to_stderr)
-    ctx = connect();
-  struct rec_t *rec;
-  for (rec = recs; rec; rec = rec->next) {
-    int64_t inc = *rec->cntp;
-    if (to_stdout || to_stderr) {
-      FILE *f = to_stdout ? stdout : stderr;
-      fprintf(f, "Souper profile key = '%s'\n", rec->repl);
-      fprintf(f, "  field = '%s'\n", rec->field);
-      fprintf(f, "  count = %" PRId64 "\n\n", inc);
-    } else if (inc > 0) {
-      redisReply *reply = (redisReply *)redisCommand(ctx,
-          "HINCRBY %s %s %" PRId64 "", rec->repl, rec->field, inc);
-      ensure_integer_reply(reply, ctx);
+  if (buf->size + size > buf->cap) {
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (buf->size + size > cap)
+      cap *= 2;
+    buf->data = realloc(buf->data, cap);
+    if (!buf->data) {
+      fprintf(stderr, "FATAL: Allocation failure\n");
+      _exit(-1);
     }
+    buf->cap = cap;
   }
+  memcpy(buf->data + buf->size, data, size);
+  buf->size += size;
 }
 
-static volatile int lock;
-static int init;
-
-void _souper_profile_register(const char *repl, const char *field, int64_t *cntp)
+// The file name comes from SOUPER_PROFILE_FILE, where %p stands for the
+// process id.
+static void file_name(char *name, size_t size)
 {
-  while (__atomic_exchange_n(&lock, 1, __ATOMIC_ACQUIRE));
-
-  if (!init) {
-    init = 1;
-    if (atexit(_souper_atexit_handler) != 0) {
-      fprintf(stderr, "FATAL: Can't install atexit handler\n");
-      exit(-1);
+  const char *pattern = getenv("SOUPER_PROFILE_FILE");
+  if (!pattern || !*pattern)
+    pattern = "default.souperprof";
+  size_t len = 0;
+  for (; *pattern && len + 1 < size; ++pattern) {
+    if (pattern[0] == '%' && pattern[1] == 'p') {
+      len += snprintf(name + len, size - len, "%d", (int)getpid());
+      if (len >= size)
+        len = size - 1;
+      ++pattern;
+    } else {
+      name[len++] = *pattern;
     }
-    if (getenv("SOUPER_PROFILE_TO_STDOUT"))
-      to_stdout = 1;
-    if (getenv("SOUPER_PROFILE_TO_STDERR"))
-      to_stderr = 1;
   }
+  name[len] = 0;
+}
 
-  struct rec_t *rec = malloc(sizeof(struct rec_t));
-  if (!rec) {
-    fprintf(stderr, "FATAL: Allocation failure\n");
-    exit(-1);
+// The counts are written with a single append, so that processes sharing
+// a file each add a complete chunk to it.
+static void write_file(void)
+{
+  struct buf_t buf = { 0, 0, 0 };
+  uint64_t records = 0;
+  append(&buf, "SOUPRPF1", 8);
+  append(&buf, &records, sizeof(records));
+  const struct souper_prof_rec *rec;
+  for (rec = __start_souper_prof; rec < __stop_souper_prof; ++rec) {
+    uint64_t cnt = count(rec);
+    if (cnt == 0)
+      continue;
+    uint32_t repl_len = strlen(rec->repl), field_len = strlen(rec->field);
+    append(&buf, &cnt, sizeof(cnt));
+    append(&buf, &repl_len, sizeof(repl_len));
+    append(&buf, &field_len, sizeof(field_len));
+    append(&buf, rec->repl, repl_len);
+    append(&buf, rec->field, field_len);
+    ++records;
+  }
+  if (records == 0) {
+    free(buf.data);
+    return;
   }
+  memcpy(buf.data + 8, &records, sizeof(records));
 
-  rec->repl = repl;
-  rec->field = field;
-  rec->cntp = cntp;
-  rec->next = recs;
-  recs = rec;
+  char name[4096];
+  file_name(name, sizeof(name));
+  int fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0 || write(fd, buf.data, buf.size) != (ssize_t)buf.size)
+    fprintf(stderr, "Souper profile: can't write '%s'\n", name);
+  if (fd >= 0)
+    close(fd);
+  free(buf.data);
+}
+
+static void print(FILE *f)
+{
+  const struct souper_prof_rec *rec;
+  for (rec = __start_souper_prof; rec < __stop_souper_prof; ++rec) {
+    fprintf(f, "Souper profile key = '%s'\n", rec->repl);
+    fprintf(f, "  field = '%s'\n", rec->field);
+    fprintf(f, "  count = %" PRId64 "\n\n", count(rec));
+  }
+}
 
-  __atomic_exchange_n(&lock, 0, __ATOMIC_RELEASE);
+__attribute__((destructor))
+static void _souper_profile_dump(void)
+{
+  if (getenv("SOUPER_PROFILE_TO_STDOUT"))
+    print(stdout);
+  else if (getenv("SOUPER_PROFILE_TO_STDERR"))
+    print(stderr);
+  else
+    write_file();
 }
@@ -0,0 +1,40 @@
+
+
+; RUN: %llvm-as -o %t %s
+; RUN: %souper %t > %t1
+; RUN: %FileCheck -check-prefix=EXTRACTION %s < %t1
+; RUN: %souper -souper-candidate-order=static %t > %t2
+; RUN: %FileCheck -check-prefix=STATIC %s < %t2
+
+; With -souper-candidate-order=static, the candidate in the loop is solved
+; and reported before the one in straight-line code.
+
+; EXTRACTION: ; Function: cold
+; EXTRACTION: ; Function: hot
+
+; STATIC: ; Function: hot
+; STATIC: ; Function: cold
+
+define i1 @cold(i32 %a) {
+entry:
+  %x = and i32 %a, 1
+  %c = icmp ult i32 %x, 2
+  ret i1 %c
+}
+
+define i32 @hot(i32 %n, i32 %b) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %y = or i32 %b, 4
+  %d = icmp ne i32 %y, 0
+  %z = zext i1 %d to i32
+  %i.next = add i32 %i, %z
+  %c = icmp ult i32 %i.next, %n
+  br i1 %c, label %loop, label %exit
+
+exit:
+  ret i32 %i.next
+}
@@ -0,0 +1,29 @@
+
+
+; RUN: %llvm-as -o %t %s
+; RUN: %souper -check %t
+; RUN: %souper %t > %t1
+; RUN: %FileCheck %s < %t1
+
+; Identical candidates from different functions are solved and reported
+; once, but -check still verifies each of them.
+
+; CHECK: ; Static profile 2
+; CHECK-NEXT: ; Function: f1
+; CHECK-NOT: ; Function: f2
+
+define i1 @f1(i32 %a) {
+entry:
+  %x = and i32 %a, 1
+  %c = icmp ult i32 %x, 2, !expected !0
+  ret i1 %c
+}
+
+define i1 @f2(i32 %b) {
+entry:
+  %y = and i32 %b, 1
+  %d = icmp ult i32 %y, 2, !expected !0
+  ret i1 %d
+}
+
+!0 = !{i1 1}
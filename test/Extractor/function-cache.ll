@@ -0,0 +1,43 @@
+
+
+; RUN: %llvm-as -o %t %s
+; RUN: rm -rf %t.cache
+; RUN: %souper -souper-function-cache-dir=%t.cache %t > %t1 2> %t1.err
+; RUN: %souper -souper-function-cache-dir=%t.cache %t > %t2 2> %t2.err
+; RUN: %FileCheck -check-prefix=FIRST %s < %t1.err
+; RUN: %FileCheck -check-prefix=SECOND %s < %t2.err
+; RUN: %FileCheck %s < %t1
+; RUN: %FileCheck %s < %t2
+; RUN: diff %t1 %t2
+; RUN: echo -souper-harvest-max-depth=5 > %t.rsp
+; RUN: %souper -souper-function-cache-dir=%t.cache @%t.rsp %t > %t3 2> %t3.err
+; RUN: echo -souper-harvest-max-depth=6 > %t.rsp
+; RUN: %souper -souper-function-cache-dir=%t.cache @%t.rsp %t > %t4 2> %t4.err
+; RUN: %FileCheck -check-prefix=FIRST %s < %t3.err
+; RUN: %FileCheck -check-prefix=FIRST %s < %t4.err
+
+; The second run reuses the candidates and results of both functions, and
+; reports the same replacements. Runs with other option values, even when
+; the command lines are the same, reuse nothing.
+
+; FIRST: ; Function cache: reused 0 of 2 functions
+; SECOND: ; Function cache: reused 2 of 2 functions
+
+; CHECK: ; Function: f1
+; CHECK: cand %{{[0-9]+}} 0:i1
+; CHECK: ; Function: f2
+; CHECK: cand %{{[0-9]+}} 1:i1
+
+define i1 @f1(i32 %a) {
+entry:
+  %x = and i32 %a, 1
+  %c = icmp ugt i32 %x, 1
+  ret i1 %c
+}
+
+define i1 @f2(i32 %a) {
+entry:
+  %x = or i32 %a, 4
+  %c = icmp ne i32 %x, 0
+  ret i1 %c
+}
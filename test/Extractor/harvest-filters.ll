@@ -0,0 +1,37 @@
+
+
+; RUN: %llvm-as -o %t %s
+; RUN: %souper -souper-debug-level=2 %t 2>&1 | %FileCheck -check-prefix=ALL %s
+; RUN: %souper -souper-debug-level=2 -souper-harvest-max-size=2 %t 2>&1 | %FileCheck -check-prefix=SIZE %s
+; RUN: %souper -souper-debug-level=2 -souper-harvest-max-depth=1 %t 2>&1 | %FileCheck -check-prefix=DEPTH %s
+; RUN: %souper -souper-debug-level=2 -souper-harvest-max-vars=2 %t 2>&1 | %FileCheck -check-prefix=VARS %s
+; RUN: %souper -souper-debug-level=2 -souper-harvest-skip-optimal %t 2>&1 | %FileCheck -check-prefix=OPTIMAL %s
+
+; The harvesting filters reject candidates before their path conditions
+; are built, and the rejected candidates are counted. The load without
+; range metadata in g is a variable that no constant can replace, while the
+; one with range metadata is known to be 5.
+
+; ALL: ; Extracted 6 candidates (6 distinct, 0 skipped)
+; SIZE: ; Extracted 5 candidates (5 distinct, 1 skipped)
+; DEPTH: ; Extracted 4 candidates (4 distinct, 2 skipped)
+; VARS: ; Extracted 4 candidates (4 distinct, 2 skipped)
+; OPTIMAL: ; Extracted 5 candidates (5 distinct, 1 skipped)
+
+define i32 @f(i32 %a, i32 %b, i32 %c) {
+entry:
+  %x = add i32 %a, %b
+  %y = mul i32 %x, %c
+  %z = xor i32 %y, %a
+  ret i32 %z
+}
+
+define i32 @g(i32* %p) {
+entry:
+  %l = load i32, i32* %p
+  %r = load i32, i32* %p, !range !0
+  %x = add i32 %l, %r
+  ret i32 %x
+}
+
+!0 = !{i32 5, i32 6}
@@ -0,0 +1,94 @@
+
+
+; RUN: %llvm-as -o %t %s
+; RUN: %souper -check -souper-extract-threads=3 %t
+; RUN: %souper -souper-extract-threads=3 %t > %t1
+; RUN: %FileCheck %s < %t1
+; RUN: %souper -souper-extract-threads=1 %t > %t2
+; RUN: %souper -souper-extract-threads=4 %t > %t3
+; RUN: diff %t2 %t3
+
+; Candidates extracted in parallel must be reported in function order, and
+; exactly as a sequential extraction reports them. f5 to f7 share a global
+; and a constant expression, which must get the same variable in every
+; function whichever thread extracts it.
+
+; CHECK: ; Function: f1
+; CHECK: ; Function: f2
+; CHECK: ; Function: f3
+; CHECK: ; Function: f4
+; CHECK: ; Function: f5
+; CHECK: ; Function: f6
+; CHECK: ; Function: f7
+
+define i1 @f1(i32 %a) {
+entry:
+  %x = and i32 %a, 1
+  %c = icmp ult i32 %x, 2, !expected !0
+  ret i1 %c
+}
+
+define i1 @f2(i32 %a, i1 %p) {
+entry:
+  br i1 %p, label %t, label %f
+
+t:
+  br label %m
+
+f:
+  br label %m
+
+m:
+  %v = phi i32 [ 3, %t ], [ 5, %f ]
+  %c = icmp ne i32 %v, 4, !expected !0
+  ret i1 %c
+}
+
+define i1 @f3(i32 %a) {
+entry:
+  %c = icmp eq i32 %a, 7
+  br i1 %c, label %t, label %f
+
+t:
+  %d = icmp eq i32 %a, 7, !expected !0
+  ret i1 %d
+
+f:
+  ret i1 false
+}
+
+define i1 @f4(i8 %a) {
+entry:
+  %x = zext i8 %a to i32
+  %c = icmp ult i32 %x, 256, !expected !0
+  ret i1 %c
+}
+
+@g = global i32 0
+
+define i1 @f5(i64 %a, i64 %b) {
+entry:
+  %x = add i64 %a, %b
+  %y = and i64 %x, ptrtoint (i32* @g to i64)
+  %c = icmp ule i64 %y, ptrtoint (i32* @g to i64), !expected !0
+  ret i1 %c
+}
+
+define i1 @f6(i64 %a) {
+entry:
+  %x = add i64 %a, ptrtoint (i32* @g to i64)
+  %y = or i64 %x, ptrtoint (i32* @g to i64)
+  %c = icmp uge i64 %y, ptrtoint (i32* @g to i64), !expected !0
+  ret i1 %c
+}
+
+define i1 @f7(i32* %p, i64 %a) {
+entry:
+  %q = ptrtoint i32* %p to i64
+  %x = and i64 %q, %a
+  %y = and i64 %x, ptrtoint (i32* @g to i64)
+  %c = icmp ule i64 %y, ptrtoint (i32* @g to i64), !expected !0
+  ret i1 %c
+}
+
+!0 = !{i1 1}
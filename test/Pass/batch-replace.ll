@@ -0,0 +1,38 @@
+
+; RUN: sed -n 's/^; REPL: //p' %s > %t.res
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -souper-pass-mode=apply -souper-replacements-file=%t.res -S -o - %s | %FileCheck %s
+
+; Both replacements are made at once. Their RHSs share x - 1, which is
+; generated once, before the instructions that use it.
+
+; REPL: ; RHS inferred successfully
+; REPL: %0:i32 = var
+; REPL: %1:i32 = sub 0:i32, %0 (hasExternalUses)
+; REPL: %2:i32 = or %0, %1
+; REPL: %3:i32 = add %0, %2
+; REPL: infer %3
+; REPL: %4:i32 = add 4294967295:i32, %0
+; REPL: %5:i32 = and %0, %4
+; REPL: result %5
+; REPL: ; RHS inferred successfully
+; REPL: %0:i32 = var
+; REPL: %1:i32 = sub 0:i32, %0 (hasExternalUses)
+; REPL: %2:i32 = xor 4294967295:i32, %1
+; REPL: infer %2
+; REPL: %3:i32 = add 4294967295:i32, %0
+; REPL: result %3
+
+; CHECK-LABEL: @blsr
+; CHECK-NEXT: %1 = add i32 -1, %x
+; CHECK-NEXT: %2 = and i32 %x, %1
+; CHECK-NEXT: store i32 %2, i32* %p
+; CHECK-NEXT: ret i32 %1
+
+define i32 @blsr(i32 %x, i32* %p) {
+  %a = sub i32 0, %x
+  %b = or i32 %a, %x
+  %c = add i32 %b, %x
+  store i32 %c, i32* %p
+  %e = xor i32 %a, -1
+  ret i32 %e
+}
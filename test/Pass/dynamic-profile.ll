@@ -0,0 +1,26 @@
+
+
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -souper-dynamic-profile -S -o - %s | %FileCheck %s
+
+; Profiled sites need no constructor: their counters are found through
+; records in the souper_prof section.
+
+; CHECK: @_souper_profile_tls = external thread_local global i8
+; CHECK: @_souper_profile_cnt = private global [8 x [8 x i64]] zeroinitializer, align 64
+; CHECK: @_souper_profile_rec = private constant {{.*}} section "souper_prof", align 8
+; CHECK: @llvm.compiler.used = {{.*}}@_souper_profile_rec
+; CHECK-NOT: @llvm.global_ctors
+; CHECK-NOT: _souper_profile_register
+
+; CHECK-LABEL: @foo
+; CHECK: atomicrmw add {{.*}} monotonic
+; CHECK: ret i32 1
+
+
+define i32 @foo(i32 %x) {
+entry:
+  %add = add nsw i32 %x, 1
+  %cmp = icmp sgt i32 %add, %x
+  %conv = zext i1 %cmp to i32
+  ret i32 %conv
+}
@@ -0,0 +1,23 @@
+
+
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -souper-debug-level=2 -S -o /dev/null %s 2>&1 | %FileCheck %s
+
+; Functions without integer instructions are skipped before any analysis
+; is computed.
+
+; CHECK-NOT: runOnFunction() for g()
+; CHECK: runOnFunction() for h()
+; CHECK-NOT: runOnFunction() for g()
+
+define void @g(float %a, float* %p) {
+entry:
+  %b = fadd float %a, 1.0
+  store float %b, float* %p
+  ret void
+}
+
+define i32 @h(i32 %x) {
+entry:
+  %y = and i32 %x, 3
+  ret i32 %y
+}
@@ -0,0 +1,46 @@
+
+
+; RUN: rm -f %t.opt
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -souper-pass-mode=record -souper-replacements-file=%t.opt -S -o /dev/null %s
+; RUN: %souper-check -infer-rhs -print-replacement %t.opt > %t.res
+
+; A profile in which the comparison of foo ran 1000 times and the one of
+; bar 10 times.
+; RUN: printf 'SOUPRPF1\002\0\0\0\0\0\0\0' > %t.prof
+; RUN: printf '\350\003\0\0\0\0\0\0\103\0\0\0\011\0\0\0' >> %t.prof
+; RUN: printf '%%%%0:i32 = var\n%%%%1:i32 = addnsw 1:i32, %%%%0\n%%%%2:i1 = slt %%%%0, %%%%1\ninfer %%%%2\ndprofile ' >> %t.prof
+; RUN: printf '\012\0\0\0\0\0\0\0\103\0\0\0\011\0\0\0' >> %t.prof
+; RUN: printf '%%%%0:i64 = var\n%%%%1:i64 = addnsw 1:i64, %%%%0\n%%%%2:i1 = slt %%%%0, %%%%1\ninfer %%%%2\ndprofile ' >> %t.prof
+
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -souper-pass-mode=apply -souper-replacements-file=%t.res -souper-profile-file=%t.prof -souper-profile-min-count=5 -S -o - %s | %FileCheck -check-prefix=ALL %s
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -souper-pass-mode=apply -souper-replacements-file=%t.res -souper-profile-file=%t.prof -souper-profile-min-count=100 -S -o - %s | %FileCheck -check-prefix=HOT %s
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -souper-pass-mode=apply -souper-replacements-file=%t.res -souper-profile-file=%t.prof -souper-profile-top=1 -S -o - %s | %FileCheck -check-prefix=HOT %s
+
+; Only the comparisons are in the profile, so only they can be replaced.
+
+; ALL-LABEL: @foo
+; ALL-NOT: icmp
+; ALL-LABEL: @bar
+; ALL-NOT: icmp
+
+; HOT-LABEL: @foo
+; HOT-NOT: icmp
+; HOT-LABEL: @bar
+; HOT: %cmp = icmp sgt i64 %add, %x
+
+
+define i32 @foo(i32 %x) {
+entry:
+  %add = add nsw i32 %x, 1
+  %cmp = icmp sgt i32 %add, %x
+  %conv = zext i1 %cmp to i32
+  ret i32 %conv
+}
+
+define i64 @bar(i64 %x) {
+entry:
+  %add = add nsw i64 %x, 1
+  %cmp = icmp sgt i64 %add, %x
+  %conv = zext i1 %cmp to i64
+  ret i64 %conv
+}
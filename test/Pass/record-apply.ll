@@ -0,0 +1,37 @@
+
+
+; RUN: rm -f %t.opt
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -souper-pass-mode=record -souper-replacements-file=%t.opt -S -o - %s | %FileCheck -check-prefix=RECORD %s
+; RUN: %FileCheck -check-prefix=CANDS %s < %t.opt
+; RUN: %souper-check -infer-rhs -print-replacement %t.opt > %t.res
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -souper-pass-mode=apply -souper-replacements-file=%t.res -S -o - %s | %FileCheck -check-prefix=APPLY %s
+; RUN: sed -e 's/^result 1:i1$/%%r:i1 = xor 0:i1, 1:i1\n%%s:i1 = and %%r, 1:i1\nresult %%s/' %t.res > %t.multi
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -souper-pass-mode=apply -souper-replacements-file=%t.multi -S -o - %s | %FileCheck -check-prefix=APPLY %s
+; RUN: rm -rf %t.kv && mkdir %t.kv
+; RUN: cd %t.kv && %python %S/../Tool/Inputs/fake-redis.py -dump cache.json -port-file cache.port
+; RUN: cd %t.kv && %opt -load-pass-plugin %pass -passes='function(souper)' -souper-pass-mode=record -souper-redis-port=`cat cache.port` -S -o /dev/null %s
+; RUN: %python %S/../Tool/Inputs/fake-redis.py -show %t.kv/cache.json | %FileCheck -check-prefix=KV %s
+
+; Record mode leaves the code alone and writes the candidates, which are
+; solved offline; apply mode then uses the results without a solver. An RHS
+; may take several instructions. Without a file, the candidates go to the
+; external cache with the instructions they come from.
+
+; RECORD: %cmp = icmp sgt i32 %add, %x
+
+; CANDS: ; Function: foo
+; CANDS: ; Instruction: %cmp = icmp sgt i32 %add, %x
+; CANDS: infer
+
+; KV: "{{[^"]*}}infer{{[^"]*}}" "record foo" "  %cmp = icmp sgt i32 %add, %x\n"
+
+; APPLY-LABEL: @foo
+; APPLY: ret i32 1
+
+define i32 @foo(i32 %x) {
+entry:
+  %add = add nsw i32 %x, 1
+  %cmp = icmp sgt i32 %add, %x
+  %conv = zext i1 %cmp to i32
+  ret i32 %conv
+}
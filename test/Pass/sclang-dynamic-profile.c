@@ -0,0 +1,47 @@
+// RUN: SOUPER_NO_EXTERNAL_CACHE=1 SOUPER_DYNAMIC_PROFILE=1 %sclang -O3 %s -o %t
+// RUN: rm -f %t.souperprof
+// RUN: SOUPER_PROFILE_FILE=%t.souperprof %t
+// RUN: SOUPER_PROFILE_FILE=%t.souperprof %t
+// RUN: %souper-profdata merge -o %t.merged %t.souperprof
+// RUN: %souper-profdata show %t.merged | %FileCheck %s
+
+// Each run appends its counts to the profile.
+// CHECK: field = 'dprofile
+// CHECK-NEXT: count = 10
+
+#include <limits.h>
+#include <stdint.h>
+
+static int pop16(uint16_t x) {
+  return
+    ((x & 1) != 0) +
+    ((x & 2) != 0) +
+    ((x & 4) != 0) +
+    ((x & 8) != 0) +
+    ((x & 16) != 0) +
+    ((x & 32) != 0) +
+    ((x & 64) != 0) +
+    ((x & 128) != 0) +
+    ((x & 256) != 0) +
+    ((x & 512) != 0) +
+    ((x & 1024) != 0) +
+    ((x & 2048) != 0) +
+    ((x & 4096) != 0) +
+    ((x & 8192) != 0) +
+    ((x & 16384) != 0) +
+    ((x & 32768) != 0);
+}
+
+__attribute__((noinline))
+int return_16(uint16_t x) {
+  return pop16(x) + pop16(x ^ 65535);
+}
+
+volatile uint16_t input = 1234;
+
+int main(void) {
+  int sum = 0;
+  for (int i = 0; i < 5; ++i)
+    sum += return_16(input);
+  return sum != 80;
+}
@@ -0,0 +1,33 @@
+; RUN: rm -rf %t && mkdir %t
+; RUN: cd %t && %python %S/../Tool/Inputs/fake-redis.py -dump cache.json -port-file cache.port
+; RUN: cd %t && %opt -load-pass-plugin %pass -passes='function(souper)' -souper-external-cache -souper-static-profile -souper-redis-port=`cat cache.port` -S -o /dev/null %s
+; RUN: %python %S/../Tool/Inputs/fake-redis.py -show %t/cache.json | %FileCheck -check-prefix=CACHE %s
+; RUN: cd %t && %opt -load-pass-plugin %pass -passes='function(souper)' -souper-pass-mode=apply -souper-redis-port=`cat cache.port` -S -o - %s | %FileCheck -check-prefix=APPLY %s
+
+; The comparison is guarded by a path condition on %y that is sliced away
+; before solving. Its RHS must still be stored under the LHS that the pass
+; profiles it under and that apply mode looks it up by, which has the path
+; condition.
+
+; CACHE: [[LHS:"[^"]*pc [^"]*"]] "rhs" "{{.+}}"
+; CACHE-NEXT: [[LHS]] "sprofile {{.*}}" "1"
+
+; APPLY-LABEL: @foo
+; APPLY: then:
+; APPLY-NOT: icmp
+; APPLY: else:
+
+define i32 @foo(i32 %x, i32 %y) {
+entry:
+  %c = icmp ult i32 %y, 4
+  br i1 %c, label %then, label %else
+
+then:
+  %add = add nsw i32 %x, 1
+  %cmp = icmp sgt i32 %add, %x
+  %conv = zext i1 %cmp to i32
+  ret i32 %conv
+
+else:
+  ret i32 0
+}
@@ -0,0 +1,34 @@
+
+
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -S -o %t1 %s
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -souper-solver-threads=4 -S -stats -o %t2 %s 2> %t2.err
+; RUN: %FileCheck %s < %t2
+; RUN: %FileCheck -check-prefix=STATS %s < %t2.err
+; RUN: diff %t1 %t2
+; RUN: not %opt -load-pass-plugin %pass -passes='function(souper)' -souper-solver-threads=4 -souper-use-alive -S -o /dev/null %s 2>&1 | %FileCheck -check-prefix=ALIVE %s
+
+; Solving on several threads applies the same replacements, in the same
+; order, as solving on the compiler thread.
+
+; STATS: {{[1-9][0-9]*}} souper{{ +}}- Number of candidates solved on the solver threads
+; ALIVE: -souper-use-alive cannot be used with -souper-solver-threads greater than 1
+
+; CHECK-LABEL: @foo
+define i32 @foo(i32 %x) {
+entry:
+  %add = add nsw i32 %x, 1
+  %cmp = icmp sgt i32 %add, %x
+  ; CHECK: ret i32 1
+  %conv = zext i1 %cmp to i32
+  ret i32 %conv
+}
+
+; CHECK-LABEL: @bar
+define i32 @bar(i32 %x) {
+entry:
+  %and = and i32 %x, 1
+  %cmp = icmp ult i32 %and, 2
+  ; CHECK: ret i32 1
+  %conv = zext i1 %cmp to i32
+  ret i32 %conv
+}
@@ -0,0 +1,38 @@
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -souper-function-budget=0 -S -stats -o %t1 %s 2> %t1.err
+; RUN: %FileCheck %s < %t1
+; RUN: %FileCheck -check-prefix=FUNCTION %s < %t1.err
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -souper-candidate-budget=0 -S -stats -o %t2 %s 2> %t2.err
+; RUN: %FileCheck -check-prefix=CANDIDATE %s < %t2.err
+; RUN: %opt -load-pass-plugin %pass -passes='function(souper)' -souper-candidate-budget=0 -souper-solver-threads=2 -S -stats -o %t3 %s 2> %t3.err
+; RUN: %FileCheck -check-prefix=CANDIDATE %s < %t3.err
+; RUN: %llvm-as -o %t4 %s
+; RUN: %souper -souper-candidate-budget=0 %t4 2>&1 | %FileCheck -check-prefix=SOLVE %s
+
+; A function or candidate budget of 0 seconds is used up before the first
+; candidate is solved, so nothing is replaced and every candidate is
+; counted as over budget.
+
+; FUNCTION: 6 souper{{ +}}- Number of candidates not solved because a solving budget was exhausted
+; FUNCTION: 2 souper{{ +}}- Number of functions whose solving budget was exhausted
+; CANDIDATE: {{[1-9][0-9]*}} souper{{ +}}- Number of candidates not solved because a solving budget was exhausted
+; SOLVE: ; Solving budget exhausted, {{[1-9][0-9]*}} of 6 candidates were not solved
+
+; CHECK-LABEL: @foo
+define i32 @foo(i32 %x) {
+entry:
+  %add = add nsw i32 %x, 1
+  %cmp = icmp sgt i32 %add, %x
+  %conv = zext i1 %cmp to i32
+  ; CHECK: ret i32 %conv
+  ret i32 %conv
+}
+
+; CHECK-LABEL: @bar
+define i32 @bar(i32 %x) {
+entry:
+  %and = and i32 %x, 1
+  %cmp = icmp ult i32 %and, 2
+  %conv = zext i1 %cmp to i32
+  ; CHECK: ret i32 %conv
+  ret i32 %conv
+}
@@ -2,6 +2,7 @@
 
 ; RUN: %llvm-as -o %t %s
 ; RUN: %souper -souper-exploit-blockpcs -check -souper-only-infer-i1 %t
+; RUN: %souper -souper-smt-expr-builder=smtlib2 -souper-exploit-blockpcs -check -souper-only-infer-i1 %t
 
 define i32 @foo(i32 %x) {
 entry:
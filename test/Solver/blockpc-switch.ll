@@ -2,6 +2,7 @@
 
 ; RUN: %llvm-as -o %t %s
 ; RUN: %souper -souper-exploit-blockpcs -souper-only-infer-i1 -check %t
+; RUN: %souper -souper-linear-path-encoding -souper-exploit-blockpcs -souper-only-infer-i1 -check %t
 
 define i32 @foo(i32 %a) #0 {
 entry:
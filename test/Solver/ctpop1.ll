@@ -2,6 +2,7 @@
 
 ; RUN: %llvm-as -o %t %s
 ; RUN: %souper -check -souper-only-infer-i1 %t
+; RUN: %souper -souper-smt-expr-builder=smtlib2 -check -souper-only-infer-i1 %t
 ; This test case input in hex is 0xAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA
 
 declare i256 @llvm.ctpop.i256(i256) nounwind readnone
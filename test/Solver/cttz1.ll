@@ -2,6 +2,7 @@
 
 ; RUN: %llvm-as -o %t %s
 ; RUN: %souper -check -souper-only-infer-i1 %t
+; RUN: %souper -souper-smt-expr-builder=smtlib2 -check -souper-only-infer-i1 %t
 
 declare i64 @llvm.cttz.i64(i64) nounwind readnone
 
@@ -2,6 +2,7 @@
 
 ; RUN: %llvm-as -o %t %s
 ; RUN: %souper -check -souper-only-infer-i1 %t
+; RUN: %souper -souper-smt-expr-builder=smtlib2 -check -souper-only-infer-i1 %t
 
 declare i8 @llvm.fshl.i8(i8, i8, i8) nounwind readnone
 
@@ -2,6 +2,7 @@
 
 ; RUN: %llvm-as -o %t %s
 ; RUN: %souper -check -souper-only-infer-i1 %t
+; RUN: %souper -souper-smt-expr-builder=smtlib2 -check -souper-only-infer-i1 %t
 
 declare i32 @llvm.fshr.i32(i32, i32, i32) nounwind readnone
 
@@ -2,6 +2,7 @@
 
 ; RUN: %llvm-as -o %t %s
 ; RUN: %souper -check %t
+; RUN: %souper -souper-smt-expr-builder=smtlib2 -check %t
 
 ; Function Attrs: nounwind readnone
 declare { i8, i1 } @llvm.sadd.with.overflow.i8(i8, i8)
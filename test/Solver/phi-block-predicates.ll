@@ -2,6 +2,7 @@
 
 ; RUN: %llvm-as -o %t %s
 ; RUN: %souper -check %t
+; RUN: %souper -souper-smt-expr-builder=smtlib2 -check %t
 
 define i1 @foo(i32 %a) {
 entry:
@@ -2,6 +2,7 @@
 
 ; RUN: %llvm-as -o %t %s
 ; RUN: %souper -check %t
+; RUN: %souper -souper-linear-path-encoding -check %t
 
 define i1 @foo(i32 %a) {
 entry:
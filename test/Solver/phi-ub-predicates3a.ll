@@ -2,6 +2,7 @@
 
 ; RUN: %llvm-as -o %t %s
 ; RUN: %souper -check -souper-only-infer-i1 %t
+; RUN: %souper -souper-linear-path-encoding -check -souper-only-infer-i1 %t
 
 define i1 @foo(i32 %a, i32 %b, i32 %c) {
   switch i32 %a, label %9 [
@@ -2,6 +2,7 @@
 
 ; RUN: %llvm-as -o %t %s
 ; RUN: %souper -check -souper-only-infer-i1=true %t
+; RUN: %souper -souper-smt-expr-builder=smtlib2 -check -souper-only-infer-i1=true %t
 
 define i32 @foo(i32 %x0) {
 entry:
@@ -2,6 +2,7 @@
 
 ; RUN: %llvm-as -o %t %s
 ; RUN: %souper -check -souper-only-infer-iN %t
+; RUN: %souper -souper-linear-path-encoding -check -souper-only-infer-iN %t
 
 define i1 @foo(i32 %a, i1 %b) {
 entry:
@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+
+# Copyright 2014 The Souper Authors. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# A stand-in for the Redis server of the external cache, for the tests of
+# the tools that use it. It serves the commands that KVStore sends on a TCP
+# port of localhost, keeps the hashes in memory, and writes all of them to a
+# JSON file, in the order their keys were added, after every change.
+#
+# With -show, it prints the hashes of such a file instead, one field per
+# line, in the order of their keys.
+
+import argparse
+import json
+import os
+import socket
+import socketserver
+import sys
+import threading
+import time
+
+parser = argparse.ArgumentParser()
+parser.add_argument('-load', help='start with the hashes in this JSON file')
+parser.add_argument('-drop-field', action='append', default=[],
+                    help='leave out this field of the loaded hashes')
+parser.add_argument('-dump', help='write the hashes to this JSON file')
+parser.add_argument('-port-file', help='write the port to this file')
+parser.add_argument('-idle-timeout', type=int, default=10,
+                    help='exit after this many seconds without clients')
+parser.add_argument('-show', help='print the hashes of this JSON file')
+parser.add_argument('-field', action='append', default=[],
+                    help='only print this field')
+args = parser.parse_args()
+
+if args.show:
+    with open(args.show) as f:
+        for key, fields in json.load(f).items():
+            for name, value in sorted(fields.items()):
+                if not args.field or name in args.field:
+                    print(json.dumps(key), json.dumps(name), json.dumps(value))
+    sys.exit(0)
+
+hashes = {}
+if args.load:
+    with open(args.load) as f:
+        for key, fields in json.load(f).items():
+            hashes[key] = {name: value for name, value in fields.items()
+                           if name not in args.drop_field}
+lock = threading.Lock()
+clients = 0
+last_seen = time.monotonic()
+
+
+def dump():
+    if not args.dump:
+        return
+    with open(args.dump + '.tmp', 'w') as f:
+        json.dump(hashes, f, indent=1)
+        f.write('\n')
+    os.replace(args.dump + '.tmp', args.dump)
+
+
+def bulk(value):
+    if value is None:
+        return b'$-1\r\n'
+    data = value.encode()
+    return b'$%d\r\n%s\r\n' % (len(data), data)
+
+
+def array(items):
+    return b'*%d\r\n' % len(items) + b''.join(items)
+
+
+def run(command):
+    name = command[0].upper()
+    if name == 'HGET':
+        return bulk(hashes.get(command[1], {}).get(command[2]))
+    if name == 'HGETALL':
+        fields = hashes.get(command[1], {})
+        return array([bulk(s) for f in fields.items() for s in f])
+    if name == 'HSET':
+        fields = hashes.setdefault(command[1], {})
+        added = command[2] not in fields
+        fields[command[2]] = command[3]
+        dump()
+        return b':%d\r\n' % added
+    if name == 'HINCRBY':
+        fields = hashes.setdefault(command[1], {})
+        value = int(fields.get(command[2], '0')) + int(command[3])
+        fields[command[2]] = str(value)
+        dump()
+        return b':%d\r\n' % value
+    if name == 'SCAN':
+        # The cursor is the index of the next key; the count is a hint that
+        # is followed exactly.
+        keys = list(hashes)
+        start = int(command[1])
+        count = 10
+        if len(command) > 3 and command[2].upper() == 'COUNT':
+            count = int(command[3])
+        end = min(start + count, len(keys))
+        cursor = str(end) if end < len(keys) else '0'
+        return array([bulk(cursor), array([bulk(k) for k in keys[start:end]])])
+    if name == 'PING':
+        return b'+PONG\r\n'
+    return b'-ERR unknown command\r\n'
+
+
+class Handler(socketserver.StreamRequestHandler):
+    def read_command(self):
+        line = self.rfile.readline()
+        if not line:
+            return None
+        if not line.startswith(b'*'):
+            return line.decode().split()
+        command = []
+        for _ in range(int(line[1:])):
+            size = int(self.rfile.readline()[1:])
+            command.append(self.rfile.read(size + 2)[:-2].decode())
+        return command
+
+    def handle(self):
+        global clients, last_seen
+        with lock:
+            clients += 1
+        try:
+            while True:
+                command = self.read_command()
+                if command is None:
+                    break
+                with lock:
+                    reply = run(command)
+                self.wfile.write(reply)
+                self.wfile.flush()
+        finally:
+            with lock:
+                clients -= 1
+                last_seen = time.monotonic()
+
+
+class Server(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    daemon_threads = True
+    timeout = 1
+
+
+server = Server(('127.0.0.1', 0), Handler)
+with lock:
+    dump()
+if args.port_file:
+    with open(args.port_file, 'w') as f:
+        f.write('%d\n' % server.server_address[1])
+
+# Run in the background once the port accepts connections; the test must
+# not wait for output that will never come.
+if os.fork():
+    os._exit(0)
+os.setsid()
+null = os.open(os.devnull, os.O_RDWR)
+for fd in range(3):
+    os.dup2(null, fd)
+
+while True:
+    server.handle_request()
+    with lock:
+        if not clients and time.monotonic() - last_seen > args.idle_timeout:
+            break
@@ -0,0 +1,320 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the cost of each Souper instruction kind at the widths 8, 16, 32
+// and 64 on a set of CPUs, using LLVM's scheduling models, and writes the
+// table that souper::cost() consults for -souper-cost-metric. Each
+// instruction is compiled on its own and its machine code is disassembled
+// along the fall-through path up to the first return; x86 division bypasses,
+// whose fast and slow paths are mutually exclusive, are turned off. Returns
+// and register moves are left out. The latency is the critical path through
+// the register dependencies of that sequence, the reciprocal throughput is
+// its block throughput as llvm-mca computes it, from the issue width and the
+// pressure on each processor resource, and the micro-ops are added up.
+//
+// Regenerate the table after an LLVM upgrade with:
+//   gen-cost-table -o include/souper/Inst/InstCostTable.inc
+
+#include "souper/Codegen/Codegen.h"
+#include "souper/Inst/Inst.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/MCAsmInfo.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/MC/MCDisassembler/MCDisassembler.h"
+#include "llvm/MC/MCInst.h"
+#include "llvm/MC/MCInstrInfo.h"
+#include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/MC/MCSchedule.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/SmallVectorMemoryBuffer.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace souper;
+using namespace llvm;
+
+unsigned DebugLevel;
+
+static cl::list<std::string> CPUs("cpu",
+    cl::desc("<triple>:<cpu> to measure, may be repeated (default="
+             "x86_64:skylake, x86_64:znver3 and aarch64:apple-a12)"));
+
+static cl::opt<std::string> OutputFilename("o",
+    cl::desc("Output file (default=stdout)"), cl::init("-"));
+
+static const unsigned Widths[] = {8, 16, 32, 64};
+
+// The instruction of kind K at width W, on variable operands, or null if
+// K is not measured at W.
+static Inst *getMeasuredInst(InstContext &IC, Inst::Kind K, unsigned W) {
+  auto Var = [&](unsigned Width) { return IC.createVar(Width, "x"); };
+  switch (K) {
+  case Inst::Add: case Inst::AddNSW: case Inst::AddNUW: case Inst::AddNW:
+  case Inst::Sub: case Inst::SubNSW: case Inst::SubNUW: case Inst::SubNW:
+  case Inst::Mul: case Inst::MulNSW: case Inst::MulNUW: case Inst::MulNW:
+  case Inst::UDiv: case Inst::SDiv: case Inst::UDivExact: case Inst::SDivExact:
+  case Inst::URem: case Inst::SRem:
+  case Inst::And: case Inst::Or: case Inst::Xor:
+  case Inst::Shl: case Inst::ShlNSW: case Inst::ShlNUW: case Inst::ShlNW:
+  case Inst::LShr: case Inst::LShrExact: case Inst::AShr: case Inst::AShrExact:
+  case Inst::SAddSat: case Inst::UAddSat: case Inst::SSubSat:
+  case Inst::USubSat:
+    return IC.getInst(K, W, {Var(W), Var(W)});
+  case Inst::Eq: case Inst::Ne: case Inst::Ult: case Inst::Slt:
+  case Inst::Ule: case Inst::Sle:
+    return IC.getInst(K, 1, {Var(W), Var(W)});
+  case Inst::Select:
+    return IC.getInst(K, W, {Var(1), Var(W), Var(W)});
+  case Inst::FShl: case Inst::FShr:
+    return IC.getInst(K, W, {Var(W), Var(W), Var(W)});
+  case Inst::ZExt: case Inst::SExt:
+    return IC.getInst(K, W, {Var(W == 8 ? 1 : W / 2)});
+  case Inst::Trunc:
+    return IC.getInst(K, W, {Var(W * 2)});
+  case Inst::BSwap:
+    if (W == 8)
+      return nullptr;
+    return IC.getInst(K, W, {Var(W)});
+  case Inst::CtPop: case Inst::Cttz: case Inst::Ctlz: case Inst::BitReverse:
+  case Inst::Freeze:
+    return IC.getInst(K, W, {Var(W)});
+  default:
+    return nullptr;
+  }
+}
+
+struct Cost {
+  int Latency = 0;
+  double RThroughput = 0;
+  int UOps = 0;
+};
+
+static void measureCPU(StringRef Triple, StringRef CPU, raw_ostream &OS) {
+  std::string Error;
+  const Target *T = TargetRegistry::lookupTarget(Triple.str(), Error);
+  if (!T)
+    report_fatal_error(("can't lookup target " + Triple + ": " + Error).str()
+                         .c_str());
+  // A division bypass tests the operands and branches to a narrower
+  // division, so the code would hold two exclusive paths.
+  llvm::Triple TheTriple(Triple);
+  std::string Features;
+  if (TheTriple.isX86())
+    Features = "-idivq-to-divl,-idivl-to-divb";
+  TargetOptions Opt;
+  std::unique_ptr<TargetMachine> TM(T->createTargetMachine(
+      Triple, CPU, Features, Opt, Optional<Reloc::Model>()));
+  std::unique_ptr<MCSubtargetInfo> STI(
+      T->createMCSubtargetInfo(Triple, CPU, Features));
+  const MCSchedModel &SM = STI->getSchedModel();
+  if (!SM.hasInstrSchedModel())
+    report_fatal_error(("no scheduling model for " + CPU).str().c_str());
+  std::unique_ptr<MCRegisterInfo> MRI(T->createMCRegInfo(Triple));
+  MCTargetOptions MCOptions;
+  std::unique_ptr<MCAsmInfo> MAI(T->createMCAsmInfo(*MRI, Triple, MCOptions));
+  std::unique_ptr<MCInstrInfo> MII(T->createMCInstrInfo());
+  MCContext Ctx(TheTriple, MAI.get(), MRI.get(), STI.get());
+  std::unique_ptr<MCDisassembler> Dis(T->createMCDisassembler(*STI, Ctx));
+
+  // Compile all the instructions into one module, as functions named after
+  // their index.
+  InstContext IC;
+  std::vector<std::pair<Inst::Kind, unsigned>> Measured;
+  LLVMContext C;
+  Module M("gen-cost-table", C);
+  M.setTargetTriple(Triple);
+  M.setDataLayout(TM->createDataLayout());
+  for (int K = Inst::Const; K != Inst::None; ++K) {
+    for (unsigned W : Widths) {
+      Inst *I = getMeasuredInst(IC, Inst::Kind(K), W);
+      if (!I)
+        continue;
+      if (!genFunction(IC, I, M, "f" + std::to_string(Measured.size())))
+        report_fatal_error("codegen error in gen-cost-table");
+      Measured.emplace_back(Inst::Kind(K), W);
+    }
+  }
+
+  SmallVector<char, 0> DotO;
+  raw_svector_ostream Dest(DotO);
+  legacy::PassManager PM;
+  if (TM->addPassesToEmitFile(PM, Dest, nullptr, CGFT_ObjectFile))
+    report_fatal_error("target machine can't emit an object file");
+  PM.run(M);
+
+  SmallVectorMemoryBuffer Buf(std::move(DotO));
+  auto ObjOrErr = object::ObjectFile::createObjectFile(Buf);
+  if (!ObjOrErr)
+    report_fatal_error("createObjectFile() failed");
+  auto *OF = dyn_cast<object::ELFObjectFileBase>(ObjOrErr.get().get());
+  if (!OF)
+    report_fatal_error("gen-cost-table needs an ELF target");
+
+  std::vector<Cost> Costs(Measured.size());
+  for (const object::ELFSymbolRef &Sym : OF->symbols()) {
+    Expected<StringRef> Name = Sym.getName();
+    Expected<uint64_t> Addr = Sym.getAddress();
+    Expected<object::section_iterator> Sec = Sym.getSection();
+    if (!Name || !Addr || !Sec || *Sec == OF->section_end()) {
+      consumeError(Name.takeError());
+      consumeError(Addr.takeError());
+      consumeError(Sec.takeError());
+      continue;
+    }
+    StringRef N = *Name;
+    unsigned Idx;
+    if (!N.consume_front("f") || N.getAsInteger(10, Idx) ||
+        Idx >= Measured.size())
+      continue;
+    Expected<StringRef> Contents = (*Sec)->getContents();
+    if (!Contents)
+      report_fatal_error("can't read the text section");
+    ArrayRef<uint8_t> Bytes(
+        reinterpret_cast<const uint8_t *>(Contents->data()) + *Addr,
+        Sym.getSize());
+
+    // The cycle at which each register unit is written, and the cycles
+    // that the sequence keeps each processor resource busy.
+    DenseMap<unsigned, int> Ready;
+    std::vector<double> Pressure(SM.getNumProcResourceKinds());
+    auto ReadyAt = [&](MCRegister Reg) {
+      int Cycle = 0;
+      for (MCRegUnitIterator Unit(Reg, MRI.get()); Unit.isValid(); ++Unit)
+        Cycle = std::max(Cycle, Ready.lookup(*Unit));
+      return Cycle;
+    };
+    auto SetReady = [&](MCRegister Reg, int Cycle) {
+      for (MCRegUnitIterator Unit(Reg, MRI.get()); Unit.isValid(); ++Unit)
+        Ready[*Unit] = Cycle;
+    };
+
+    Cost &Cost = Costs[Idx];
+    for (uint64_t Offset = 0; Offset < Bytes.size();) {
+      MCInst MI;
+      uint64_t Size;
+      if (Dis->getInstruction(MI, Size, Bytes.slice(Offset), Offset,
+                              nulls()) != MCDisassembler::Success)
+        report_fatal_error("can't disassemble the generated code");
+      Offset += Size;
+      const MCInstrDesc &Desc = MII->get(MI.getOpcode());
+      if (Desc.isReturn() || Desc.isUnconditionalBranch())
+        break;
+      // A conditional branch is taken as not taken.
+      if (Desc.isBranch())
+        continue;
+
+      std::vector<MCRegister> Defs, Uses;
+      for (unsigned I = 0; I != MI.getNumOperands(); ++I) {
+        const MCOperand &Op = MI.getOperand(I);
+        if (Op.isReg() && Op.getReg())
+          (I < Desc.getNumDefs() ? Defs : Uses).push_back(Op.getReg());
+      }
+      Defs.insert(Defs.end(), Desc.getImplicitDefs(),
+                  Desc.getImplicitDefs() + Desc.getNumImplicitDefs());
+      Uses.insert(Uses.end(), Desc.getImplicitUses(),
+                  Desc.getImplicitUses() + Desc.getNumImplicitUses());
+      int Start = 0;
+      for (MCRegister Reg : Uses)
+        Start = std::max(Start, ReadyAt(Reg));
+      // Moves only rename their source.
+      if (Desc.isMoveReg()) {
+        for (MCRegister Reg : Defs)
+          SetReady(Reg, Start);
+        continue;
+      }
+      int End = Start + SM.computeInstrLatency(*STI, *MII, MI);
+      for (MCRegister Reg : Defs)
+        SetReady(Reg, End);
+      Cost.Latency = std::max(Cost.Latency, End);
+
+      unsigned SchedClass = Desc.getSchedClass();
+      const MCSchedClassDesc *SCD = SM.getSchedClassDesc(SchedClass);
+      while (SCD->isVariant()) {
+        SchedClass = STI->resolveVariantSchedClass(SchedClass, &MI, MII.get(),
+                                                   SM.getProcessorID());
+        SCD = SM.getSchedClassDesc(SchedClass);
+      }
+      if (!SCD->isValid())
+        continue;
+      Cost.UOps += SCD->NumMicroOps;
+      for (const MCWriteProcResEntry &PRE :
+           make_range(STI->getWriteProcResBegin(SCD),
+                      STI->getWriteProcResEnd(SCD)))
+        Pressure[PRE.ProcResourceIdx] += PRE.Cycles;
+    }
+
+    // The sequence issues no faster than the issue width allows, nor than
+    // its busiest resource can serve it.
+    if (SM.IssueWidth)
+      Cost.RThroughput = double(Cost.UOps) / SM.IssueWidth;
+    for (unsigned R = 1; R != Pressure.size(); ++R)
+      if (unsigned Units = SM.getProcResource(R)->NumUnits)
+        Cost.RThroughput = std::max(Cost.RThroughput, Pressure[R] / Units);
+  }
+
+  OS << "\n// " << CPU << " (" << Triple << ")\n";
+  for (unsigned I = 0; I != Measured.size(); ++I) {
+    // Reciprocal throughputs are in quarter cycles, so that a simple
+    // instruction costs about 1 under every metric.
+    OS << "SOUPER_INST_COST(\"" << CPU << "\", \""
+       << Inst::getKindName(Measured[I].first) << "\", " << Measured[I].second
+       << ", " << Costs[I].Latency << ", "
+       << int(std::ceil(Costs[I].RThroughput * 4)) << ", " << Costs[I].UOps
+       << ")\n";
+  }
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv);
+
+  InitializeAllTargetInfos();
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+  InitializeAllDisassemblers();
+
+  std::vector<std::string> Targets(CPUs.begin(), CPUs.end());
+  if (Targets.empty())
+    Targets = {"x86_64:skylake", "x86_64:znver3", "aarch64:apple-a12"};
+
+  std::error_code EC;
+  raw_fd_ostream OS(OutputFilename, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << OutputFilename << ": " << EC.message() << '\n';
+    return 1;
+  }
+  OS << "// Generated by gen-cost-table; do not edit.\n"
+     << "//\n"
+     << "// SOUPER_INST_COST(CPU, Kind, Width, Latency in cycles,\n"
+     << "//                  reciprocal throughput in quarter cycles,"
+     << " micro-ops)\n"
+     << "//\n"
+     << "// Kinds without an entry keep their hand-written cost, scaled by the"
+     << "\n"
+     << "// cost of an add of the same width.\n";
+  for (const auto &T : Targets) {
+    StringRef Triple, CPU;
+    std::tie(Triple, CPU) = StringRef(T).split(':');
+    measureCPU(Triple, CPU, OS);
+  }
+  return 0;
+}
@@ -0,0 +1,468 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Infers an RHS for every LHS in the Redis cache that does not have one yet,
+// like the cache_infer script, and stores the results the way
+// -souper-external-cache does. Every LHS that was tried is tagged with
+// -tag, and LHSs that already have the tag are skipped.
+
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include "souper/KVStore/KVStore.h"
+#include "souper/Tool/GetSolver.h"
+#include "souper/Tool/RemoteSolver.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <mutex>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+using namespace llvm;
+using namespace souper;
+
+unsigned DebugLevel;
+extern bool UseAlive;
+
+static cl::opt<unsigned, /*ExternalStorage=*/true>
+DebugFlagParser("souper-debug-level",
+     cl::desc("Control the verbose level of debug output (default=1). "
+     "The larger the number is, the more fine-grained debug "
+     "information will be printed."),
+     cl::location(DebugLevel), cl::init(1));
+
+static cl::opt<unsigned> Jobs("j",
+    cl::desc("Number of LHSs solved at the same time, always 1 with "
+             "-souper-use-alive and -sandbox=false (default=0, one per "
+             "hardware thread)"),
+    cl::init(0));
+
+static cl::opt<std::string> Tag("tag",
+    cl::desc("Tag the LHSs that were tried with this, and skip LHSs that "
+             "have it (default=x)"),
+    cl::init("x"));
+
+static cl::opt<unsigned> CPULimit("cpu-limit",
+    cl::desc("Seconds of CPU time an LHS may take, 0 for no limit "
+             "(default=900)"),
+    cl::init(900));
+
+static cl::opt<unsigned> MemoryLimit("memory-limit",
+    cl::desc("Megabytes of memory an LHS may take, 0 for no limit "
+             "(default=4096)"),
+    cl::init(4096));
+
+static cl::opt<bool> Sandbox("sandbox",
+    cl::desc("Solve the LHSs in worker processes, which enforce "
+             "-memory-limit and -wall-limit and survive crashes of the "
+             "solver; otherwise only -cpu-limit is enforced, as a deadline "
+             "(default=true)"),
+    cl::init(true));
+
+static cl::opt<unsigned> WallLimit("wall-limit",
+    cl::desc("Seconds an LHS may take before its worker process is killed "
+             "(default=1800)"),
+    cl::init(1800));
+
+static cl::opt<bool> SandboxWorkerMode("sandbox-worker", cl::Hidden,
+    cl::desc("Answer the queries of souper-cache-infer on file descriptor 3 "
+             "(default=false)"),
+    cl::init(false));
+
+static cl::opt<std::string> CheckpointFile("checkpoint-file",
+    cl::desc("Skip the LHSs listed in this file, and add each LHS to it "
+             "once it is done, so that an interrupted run can be resumed "
+             "(default=none)"),
+    cl::init(""));
+
+enum class Priority { None, Static, Dynamic, Both };
+
+static cl::opt<Priority> PriorityOrder("priority",
+    cl::desc("Order in which the LHSs are solved (default=both)"),
+    cl::values(
+      clEnumValN(Priority::None, "none", "The order of the cache"),
+      clEnumValN(Priority::Static, "static",
+                 "Most often found by the pass first"),
+      clEnumValN(Priority::Dynamic, "dynamic",
+                 "Most often executed first"),
+      clEnumValN(Priority::Both, "both",
+                 "Best sum of the static and dynamic ranks first")),
+    cl::init(Priority::Both));
+
+static cl::opt<bool> Verbose("verbose",
+    cl::desc("Print each LHS and its result (default=false)"),
+    cl::init(false));
+
+static const char TagField[] = "cache-infer-tag";
+
+namespace {
+
+struct Task {
+  std::string LHS;
+  uint64_t StaticCount = 0;
+  uint64_t DynamicCount = 0;
+  unsigned Rank = 0;
+};
+
+// Keys that were finished by an earlier run, and the file this run adds
+// its finished keys to. A key is written as a JSON string on a line of its
+// own; a line cut short by a crash is ignored.
+class Checkpoint {
+  std::mutex Mutex;
+  std::unique_ptr<raw_fd_ostream> OS;
+
+public:
+  StringSet<> Done;
+
+  std::error_code open(StringRef Path) {
+    auto MB = MemoryBuffer::getFile(Path);
+    bool CutShort = false;
+    if (MB) {
+      CutShort = !(*MB)->getBuffer().empty() &&
+                 !(*MB)->getBuffer().endswith("\n");
+      SmallVector<StringRef, 0> Lines;
+      (*MB)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+      for (StringRef Line : Lines) {
+        Expected<json::Value> V = json::parse(Line);
+        if (!V) {
+          consumeError(V.takeError());
+          continue;
+        }
+        if (Optional<StringRef> Key = V->getAsString())
+          Done.insert(*Key);
+      }
+    } else if (MB.getError() != std::errc::no_such_file_or_directory) {
+      return MB.getError();
+    }
+    std::error_code EC;
+    OS.reset(new raw_fd_ostream(Path, EC, sys::fs::OF_Append));
+    // Keys are added on lines of their own, not to the end of a line that
+    // was cut short.
+    if (!EC && CutShort)
+      *OS << '\n';
+    return EC;
+  }
+
+  void add(StringRef Key) {
+    if (!OS)
+      return;
+    std::lock_guard<std::mutex> Lock(Mutex);
+    *OS << json::Value(Key) << '\n';
+    OS->flush();
+  }
+};
+
+}
+
+static uint64_t sumCounts(const std::map<std::string, std::string> &Fields,
+                          StringRef Prefix) {
+  uint64_t Sum = 0;
+  for (const auto &F : Fields) {
+    uint64_t Count;
+    if (StringRef(F.first).startswith(Prefix) &&
+        !StringRef(F.second).getAsInteger(10, Count))
+      Sum += Count;
+  }
+  return Sum;
+}
+
+// Rank the tasks by Count, largest first.
+static void rankBy(std::vector<Task> &Tasks, uint64_t Task::*Count) {
+  std::vector<Task *> Sorted;
+  for (auto &T : Tasks)
+    Sorted.push_back(&T);
+  std::stable_sort(Sorted.begin(), Sorted.end(), [&](Task *A, Task *B) {
+    return A->*Count > B->*Count;
+  });
+  for (unsigned I = 0; I != Sorted.size(); ++I)
+    Sorted[I]->Rank += I;
+}
+
+static std::string inferQuery(StringRef LHS) {
+  return ("infer " + Twine(CPULimit) + "\n" + LHS).str();
+}
+
+// The command line of a worker: this tool, run with the options that it was
+// run with and -sandbox-worker.
+static std::string WorkerPath;
+static std::vector<std::string> WorkerArgs;
+
+// The descriptor on which a worker talks to its parent.
+static const int WorkerFD = 3;
+
+// Answer the queries of the parent with one solver, each limited to
+// -cpu-limit more seconds of CPU time. The limit on the address space covers
+// the whole worker, which is started again once it is killed.
+static int runSandboxWorker() {
+  if (MemoryLimit) {
+    rlim_t Bytes = rlim_t(MemoryLimit) << 20;
+    rlimit Limit = {Bytes, Bytes};
+    setrlimit(RLIMIT_AS, &Limit);
+  }
+  KVStore *KV = nullptr;
+  std::unique_ptr<Solver> S = GetSolver(KV);
+  std::string Query;
+  while (!readMessage(WorkerFD, Query)) {
+    if (CPULimit) {
+      rusage Usage;
+      rlimit Limit;
+      if (!getrusage(RUSAGE_SELF, &Usage) &&
+          !getrlimit(RLIMIT_CPU, &Limit)) {
+        // The seconds used so far, rounded up.
+        rlim_t Used = Usage.ru_utime.tv_sec + Usage.ru_stime.tv_sec + 1;
+        Limit.rlim_cur = std::min<rlim_t>(Used + CPULimit, Limit.rlim_max);
+        setrlimit(RLIMIT_CPU, &Limit);
+      }
+    }
+    if (writeMessage(WorkerFD, answerQuery(*S, Query)))
+      return 1;
+  }
+  return 0;
+}
+
+namespace {
+
+// A worker process that solves LHSs for one thread. It is started with
+// posix_spawn(), which runs this tool again from the start: a child forked
+// from a multithreaded process could block forever on a lock that another
+// thread held at the time of the fork, as soon as it set up a solver.
+class SandboxWorker {
+  pid_t Pid = -1;
+  int FD = -1;
+
+  std::error_code start() {
+    int FDs[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, FDs) < 0)
+      return std::error_code(errno, std::generic_category());
+    std::vector<char *> Argv;
+    for (std::string &Arg : WorkerArgs)
+      Argv.push_back(&Arg[0]);
+    Argv.push_back(nullptr);
+    posix_spawn_file_actions_t Actions;
+    posix_spawn_file_actions_init(&Actions);
+    posix_spawn_file_actions_adddup2(&Actions, FDs[1], WorkerFD);
+    int Err = posix_spawn(&Pid, WorkerPath.c_str(), &Actions, nullptr,
+                          Argv.data(), environ);
+    posix_spawn_file_actions_destroy(&Actions);
+    close(FDs[1]);
+    if (Err) {
+      close(FDs[0]);
+      Pid = -1;
+      return std::error_code(Err, std::generic_category());
+    }
+    FD = FDs[0];
+    return std::error_code();
+  }
+
+  // Kill the worker, and return whether it had been killed for its CPU
+  // time before.
+  bool stop() {
+    close(FD);
+    FD = -1;
+    kill(Pid, SIGKILL);
+    int Status;
+    while (waitpid(Pid, &Status, 0) < 0 && errno == EINTR)
+      ;
+    Pid = -1;
+    return WIFSIGNALED(Status) && WTERMSIG(Status) == SIGXCPU;
+  }
+
+public:
+  ~SandboxWorker() {
+    if (Pid >= 0)
+      stop();
+  }
+
+  // Solve the LHS in the worker, which is killed if it takes more than
+  // -wall-limit seconds. Answered is set when the worker answered, rather
+  // than crashing or being killed.
+  std::error_code solve(StringRef LHS, std::string &RHS, bool &Answered) {
+    Answered = false;
+    if (Pid < 0) {
+      if (std::error_code EC = start())
+        return EC;
+    }
+    std::string Answer;
+    std::error_code EC = writeMessage(FD, inferQuery(LHS));
+    if (!EC) {
+      auto Deadline = std::chrono::steady_clock::now() +
+                      std::chrono::seconds(WallLimit);
+      pollfd P = {FD, POLLIN, 0};
+      int N;
+      do {
+        auto Left = std::chrono::ceil<std::chrono::milliseconds>(
+          Deadline - std::chrono::steady_clock::now());
+        N = poll(&P, 1, std::max<int>(Left.count(), 0));
+      } while (N < 0 && errno == EINTR);
+      if (N == 0) {
+        stop();
+        return std::make_error_code(std::errc::timed_out);
+      }
+      EC = readMessage(FD, Answer);
+    }
+    if (EC) {
+      // The worker is gone: it crashed, ran out of memory or used up its
+      // CPU time.
+      return stop() ? std::make_error_code(std::errc::timed_out)
+                    : std::make_error_code(std::errc::state_not_recoverable);
+    }
+    Answered = true;
+    return parseAnswer(Answer, RHS);
+  }
+};
+
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Souper cache inference\n");
+  if (SandboxWorkerMode)
+    return runSandboxWorker();
+  if (Sandbox) {
+    if (!WallLimit) {
+      errs() << "-wall-limit must be at least one second\n";
+      return 1;
+    }
+    WorkerPath = sys::fs::getMainExecutable(argv[0], (void *)&main);
+    WorkerArgs.assign(argv, argv + argc);
+    WorkerArgs.push_back("-sandbox-worker");
+  }
+
+  Checkpoint CP;
+  if (!CheckpointFile.empty()) {
+    if (std::error_code EC = CP.open(CheckpointFile)) {
+      errs() << CheckpointFile << ": " << EC.message() << '\n';
+      return 1;
+    }
+  }
+
+  // Keys are looked up while they are scanned; only the LHSs that are left
+  // to solve are kept.
+  KVStore KV;
+  std::vector<Task> Tasks;
+  StringSet<> Seen;
+  unsigned Skipped = 0, Resumed = 0, Solved = 0;
+  KV.scan([&](StringRef Key) {
+    if (Key.startswith("fcache ") || !Seen.insert(Key).second)
+      return;
+    if (CP.Done.count(Key)) {
+      ++Resumed;
+      return;
+    }
+    std::map<std::string, std::string> Fields;
+    KV.hGetAll(Key, Fields);
+    auto TagIt = Fields.find(TagField);
+    if (TagIt != Fields.end() && TagIt->second == Tag) {
+      ++Skipped;
+      return;
+    }
+    if (Fields.count("rhs")) {
+      ++Solved;
+      return;
+    }
+    Task T;
+    T.LHS = Key.str();
+    T.StaticCount = sumCounts(Fields, "sprofile ");
+    T.DynamicCount = sumCounts(Fields, "dprofile ");
+    Tasks.push_back(std::move(T));
+  });
+
+  if (PriorityOrder == Priority::Static || PriorityOrder == Priority::Both)
+    rankBy(Tasks, &Task::StaticCount);
+  if (PriorityOrder == Priority::Dynamic || PriorityOrder == Priority::Both)
+    rankBy(Tasks, &Task::DynamicCount);
+  std::stable_sort(Tasks.begin(), Tasks.end(),
+                   [](const Task &A, const Task &B) {
+                     return A.Rank < B.Rank;
+                   });
+
+  // The tasks are taken in order by whichever worker is free, so the LHSs
+  // with the highest priority are always solved first.
+  std::atomic<unsigned> Next(0), Good(0), Fail(0), Errors(0);
+  std::mutex OutputMutex;
+  // Alive2 shares one Z3 context, so in this process it solves one LHS at
+  // a time; sandboxed workers each have their own.
+  ThreadPool Pool(hardware_concurrency(UseAlive && !Sandbox ? 1 : Jobs));
+  for (unsigned W = 0, E = Pool.getThreadCount(); W != E; ++W) {
+    Pool.async([&] {
+      KVStore WorkerKV;
+      KVStore *SolverKV = nullptr;
+      std::unique_ptr<Solver> S;
+      SandboxWorker SW;
+      if (!Sandbox)
+        S = GetSolver(SolverKV);
+      for (unsigned I = Next++; I < Tasks.size(); I = Next++) {
+        const std::string &LHS = Tasks[I].LHS;
+        std::string RHS;
+        std::error_code EC;
+        bool Answered = true;
+        auto Deadline = std::chrono::steady_clock::now() +
+                        std::chrono::seconds(CPULimit);
+        if (Sandbox)
+          EC = SW.solve(LHS, RHS, Answered);
+        else
+          EC = parseAnswer(answerQuery(*S, inferQuery(LHS)), RHS);
+        bool OutOfTime =
+          EC && CPULimit && std::chrono::steady_clock::now() >= Deadline;
+        // As in ExternalCachingSolver, an LHS without an RHS is cached as
+        // such, and so is one that the solver failed on. One that ran out
+        // of time or crashed the worker gets no result, so that it can be
+        // tried again; it is tagged like the others, as cache_infer does.
+        if (Answered && !OutOfTime)
+          WorkerKV.hSet(LHS, "rhs", EC ? "" : RHS);
+        WorkerKV.hSet(LHS, TagField, Tag);
+        CP.add(LHS);
+        if (EC)
+          ++Errors;
+        else if (RHS.empty())
+          ++Fail;
+        else
+          ++Good;
+        if (Verbose) {
+          std::lock_guard<std::mutex> Lock(OutputMutex);
+          outs() << LHS;
+          if (EC)
+            outs() << "; error: " << EC.message() << "\n\n";
+          else if (RHS.empty())
+            outs() << "; no RHS\n\n";
+          else
+            outs() << RHS << "\n";
+          outs().flush();
+        }
+      }
+    });
+  }
+  Pool.wait();
+
+  outs() << Good << " optimizations\n";
+  outs() << Fail << " not-optimizations\n";
+  outs() << Errors << " errors\n";
+  outs() << Solved << " already solved\n";
+  outs() << Skipped << " skipped due to tag match\n";
+  if (!CheckpointFile.empty())
+    outs() << Resumed << " skipped due to the checkpoint file\n";
+  return 0;
+}
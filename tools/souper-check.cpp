@@ -14,19 +14,30 @@
 
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/GraphWriter.h"
+#include "llvm/Support/JSON.h"
 #include "llvm/Support/KnownBits.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/Threading.h"
 
 #include "souper/Infer/ConstantSynthesis.h"
 #include "souper/Infer/Pruning.h"
 #include "souper/Inst/InstGraph.h"
 #include "souper/Parser/Parser.h"
+#include "souper/SMTLIB2/Solver.h"
 #include "souper/Tool/GetSolver.h"
 #include "souper/Util/DfaUtils.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 using namespace llvm;
 using namespace souper;
 
 unsigned DebugLevel;
+extern bool UseAlive;
 
 static cl::opt<unsigned, /*ExternalStorage=*/true>
 DebugFlagParser("souper-debug-level",
@@ -88,299 +99,477 @@ static cl::opt<bool> CheckAllGuesses("souper-check-all-guesses",
     cl::desc("Continue even after a valid RHS is found. (default=false)"),
     cl::init(false));
 
-int SolveInst(const MemoryBufferRef &MB, Solver *S) {
-  InstContext IC;
-  std::string ErrStr;
+static cl::opt<unsigned> Jobs("j",
+    cl::desc("Number of replacements checked at the same time, always 1 "
+             "with -souper-use-alive (default=1, 0 for one per hardware "
+             "thread)"),
+    cl::init(1));
 
-  std::vector<ParsedReplacement> Reps;
-  std::vector<ReplacementContext> Contexts;
-  if (InferRHS || ParseLHSOnly || isInferDFA()) {
-    Reps = ParseReplacementLHSs(IC, MB.getBufferIdentifier(), MB.getBuffer(),
-                                Contexts, ErrStr);
-  } else {
-    Reps = ParseReplacements(IC, MB.getBufferIdentifier(), MB.getBuffer(), ErrStr);
-  }
-  if (!ErrStr.empty()) {
-    llvm::errs() << ErrStr << '\n';
-    return 1;
-  }
-
-  if (EmitLHSDot) {
-    llvm::outs() << "; emitting DOT for parsed LHS souper IR ...\n";
-    for (auto &Rep : Reps) {
-      llvm::WriteGraph(llvm::outs(), Rep.Mapping.LHS);
-    }
-  }
+static cl::opt<bool> JSONOutput("json",
+    cl::desc("Print one JSON object per line and replacement, with its "
+             "status, time, number of SMT queries and output "
+             "(default=false)"),
+    cl::init(false));
 
-  if (ParseOnly || ParseLHSOnly) {
-    llvm::outs() << "; parsing successful\n";
-    return 0;
-  }
+namespace {
 
-  unsigned Index = 0;
+struct CheckResult {
   int Ret = 0;
-  int Success = 0, Fail = 0, Error = 0;
-  for (auto Rep : Reps) {
-    if (isInferDFA()) {
-      if (InferNeg) {
-        bool Negative;
-        if (std::error_code EC = S->negative(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
-                                             Negative, IC)) {
-          llvm::errs() << "Error: " << EC.message() << '\n';
-          Ret = 1;
-          ++Error;
-        } else {
-          llvm::outs() << "negative from souper: "
-                       << convertToStr(Negative) << "\n";
-          ++Success;
-        }
+  unsigned Success = 0, Fail = 0, Error = 0;
+  // -infer-demanded-bits only checks the first replacement.
+  bool Stop = false;
+  std::string Out, Err;
+  int64_t Microseconds = 0;
+  unsigned long Queries = 0;
+};
+
+}
+
+static std::vector<ParsedReplacement>
+parseInput(InstContext &IC, const MemoryBufferRef &MB,
+           std::vector<ReplacementContext> &Contexts, std::string &ErrStr) {
+  if (InferRHS || ParseLHSOnly || isInferDFA())
+    return ParseReplacementLHSs(IC, MB.getBufferIdentifier(), MB.getBuffer(),
+                                Contexts, ErrStr);
+  return ParseReplacements(IC, MB.getBufferIdentifier(), MB.getBuffer(),
+                           ErrStr);
+}
+
+// LHSContext has the names of the LHS if only LHSs were parsed.
+static void checkReplacement(ParsedReplacement &Rep,
+                             ReplacementContext *LHSContext, Solver *S,
+                             InstContext &IC, raw_ostream &Out,
+                             raw_ostream &Err, CheckResult &R) {
+
+  if (isInferDFA()) {
+    if (InferNeg) {
+      bool Negative;
+      if (std::error_code EC = S->negative(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
+                                           Negative, IC)) {
+        Err << "Error: " << EC.message() << '\n';
+        R.Ret = 1;
+        ++R.Error;
+      } else {
+        Out << "negative from souper: "
+            << convertToStr(Negative) << "\n";
+        ++R.Success;
       }
-      if (InferNonNeg) {
-        bool NonNegative;
-        if (std::error_code EC = S->nonNegative(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
-                                                NonNegative, IC)) {
-          llvm::errs() << "Error: " << EC.message() << '\n';
-          Ret = 1;
-          ++Error;
-        } else {
-          llvm::outs() << "nonNegative from souper: "
-                       << convertToStr(NonNegative) << "\n";
-          ++Success;
-        }
+    }
+    if (InferNonNeg) {
+      bool NonNegative;
+      if (std::error_code EC = S->nonNegative(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
+                                              NonNegative, IC)) {
+        Err << "Error: " << EC.message() << '\n';
+        R.Ret = 1;
+        ++R.Error;
+      } else {
+        Out << "nonNegative from souper: "
+            << convertToStr(NonNegative) << "\n";
+        ++R.Success;
       }
-      if (InferKnownBits) {
-        unsigned W = Rep.Mapping.LHS->Width;
-        KnownBits Known(W);
-        if (std::error_code EC = S->knownBits(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
-                                              Known, IC)) {
-          llvm::errs() << "Error: " << EC.message() << '\n';
-          Ret = 1;
-          ++Error;
-        } else {
-          llvm::outs() << "knownBits from souper: "
-                       << Inst::getKnownBitsString(Known.Zero, Known.One) << "\n";
-          ++Success;
-        }
+    }
+    if (InferKnownBits) {
+      unsigned W = Rep.Mapping.LHS->Width;
+      KnownBits Known(W);
+      if (std::error_code EC = S->knownBits(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
+                                            Known, IC)) {
+        Err << "Error: " << EC.message() << '\n';
+        R.Ret = 1;
+        ++R.Error;
+      } else {
+        Out << "knownBits from souper: "
+            << Inst::getKnownBitsString(Known.Zero, Known.One) << "\n";
+        ++R.Success;
       }
-      if (InferPowerTwo) {
-        bool PowTwo;
-        if (std::error_code EC = S->powerTwo(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
-                                             PowTwo, IC)) {
-          llvm::errs() << "Error: " << EC.message() << '\n';
-          Ret = 1;
-          ++Error;
-        } else {
-          llvm::outs() << "powerOfTwo from souper: "
-                       << convertToStr(PowTwo) << "\n";
-          ++Success;
-        }
+    }
+    if (InferPowerTwo) {
+      bool PowTwo;
+      if (std::error_code EC = S->powerTwo(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
+                                           PowTwo, IC)) {
+        Err << "Error: " << EC.message() << '\n';
+        R.Ret = 1;
+        ++R.Error;
+      } else {
+        Out << "powerOfTwo from souper: "
+            << convertToStr(PowTwo) << "\n";
+        ++R.Success;
       }
-      if (InferNonZero) {
-        bool NonZero;
-        if (std::error_code EC = S->nonZero(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
-                                            NonZero, IC)) {
-          llvm::errs() << "Error: " << EC.message() << '\n';
-          Ret = 1;
-          ++Error;
-        } else {
-          llvm::outs() << "nonZero from souper: "
-                       << convertToStr(NonZero) << "\n";
-          ++Success;
-        }
+    }
+    if (InferNonZero) {
+      bool NonZero;
+      if (std::error_code EC = S->nonZero(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
+                                          NonZero, IC)) {
+        Err << "Error: " << EC.message() << '\n';
+        R.Ret = 1;
+        ++R.Error;
+      } else {
+        Out << "nonZero from souper: "
+            << convertToStr(NonZero) << "\n";
+        ++R.Success;
       }
-      if (InferSignBits) {
-        unsigned SignBits;
-        if (std::error_code EC = S->signBits(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
-                                             SignBits, IC)) {
-          llvm::errs() << "Error: " << EC.message() << '\n';
-          Ret = 1;
-          ++Error;
-        } else {
-          llvm::outs() << "signBits from souper: "
-                       << std::to_string(SignBits) << "\n";
-          ++Success;
-        }
+    }
+    if (InferSignBits) {
+      unsigned SignBits;
+      if (std::error_code EC = S->signBits(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
+                                           SignBits, IC)) {
+        Err << "Error: " << EC.message() << '\n';
+        R.Ret = 1;
+        ++R.Error;
+      } else {
+        Out << "signBits from souper: "
+            << std::to_string(SignBits) << "\n";
+        ++R.Success;
       }
-      if (InferRange) {
-        unsigned W = Rep.Mapping.LHS->Width;
-        llvm::ConstantRange Range = S->constantRange(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS, IC);
+    }
+    if (InferRange) {
+      unsigned W = Rep.Mapping.LHS->Width;
+      llvm::ConstantRange Range = S->constantRange(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS, IC);
 
-        llvm::outs() << "range from souper: " << "[" << Range.getLower()
-                     << "," << Range.getUpper() << ")" << "\n";
-        ++Success;
+      Out << "range from souper: " << "[" << Range.getLower()
+          << "," << Range.getUpper() << ")" << "\n";
+      ++R.Success;
+    }
+    if (InferDemandedBits) {
+      std::map<std::string, APInt> DBitsVect;
+      if (std::error_code EC = S->testDemandedBits(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
+                                                   DBitsVect, IC)) {
+        Err << EC.message() << '\n';
       }
-      if (InferDemandedBits) {
-        std::map<std::string, APInt> DBitsVect;
-        if (std::error_code EC = S->testDemandedBits(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
-                                                     DBitsVect, IC)) {
-          llvm::errs() << EC.message() << '\n';
-        }
-        for (std::map<std::string,APInt>::iterator I = DBitsVect.begin();
-             I != DBitsVect.end(); ++I) {
-          std::string VarName = I->first;
-          llvm::APInt DBitsVar = DBitsVect[VarName];
-          std::string s = Inst::getDemandedBitsString(DBitsVar);
-          llvm::outs() << "demanded-bits from souper for %" << VarName << " : "<< s << "\n";
-        }
-        return 0;
+      for (std::map<std::string,APInt>::iterator I = DBitsVect.begin();
+           I != DBitsVect.end(); ++I) {
+        std::string VarName = I->first;
+        llvm::APInt DBitsVar = DBitsVect[VarName];
+        std::string s = Inst::getDemandedBitsString(DBitsVar);
+        Out << "demanded-bits from souper for %" << VarName << " : "<< s << "\n";
       }
-    } else if (InferRHS || ReInferRHS) {
-      int OldCost;
-      std::vector<Inst *> RHSs;
+      R.Stop = true;
+      return;
+    }
+  } else if (InferRHS || ReInferRHS) {
+    int OldCost;
+    std::vector<Inst *> RHSs;
+    if (ReInferRHS) {
+      OldCost = cost(Rep.Mapping.RHS);
+      Rep.Mapping.RHS = 0;
+    }
+    if (std::error_code EC = S->infer(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
+                                      RHSs, CheckAllGuesses, IC)) {
+      Err << EC.message() << '\n';
+      R.Ret = 1;
+      ++R.Error;
+    }
+    if (!RHSs.empty()) {
+      Rep.Mapping.RHS = RHSs.front();
+      ++R.Success;
       if (ReInferRHS) {
-        OldCost = cost(Rep.Mapping.RHS);
-        Rep.Mapping.RHS = 0;
-      }
-      if (std::error_code EC = S->infer(Rep.BPCs, Rep.PCs, Rep.Mapping.LHS,
-                                        RHSs, CheckAllGuesses, IC)) {
-        llvm::errs() << EC.message() << '\n';
-        Ret = 1;
-        ++Error;
+        int NewCost = cost(Rep.Mapping.RHS);
+        int LHSCost = cost(Rep.Mapping.LHS);
+        if (NewCost <= OldCost)
+          Out << "; RHS inferred successfully, no cost regression";
+        else
+          Out << "; RHS inferred successfully, but cost regressed";
+        Out << " (Old= " << OldCost << ", New= " << NewCost <<
+          ", LHS= " << LHSCost << ")\n";
+      } else {
+        Out << "; RHS inferred successfully\n";
       }
-      if (!RHSs.empty()) {
-        Rep.Mapping.RHS = RHSs.front();
-        ++Success;
-        if (ReInferRHS) {
-          int NewCost = cost(Rep.Mapping.RHS);
-          int LHSCost = cost(Rep.Mapping.LHS);
-          if (NewCost <= OldCost)
-            llvm::outs() << "; RHS inferred successfully, no cost regression";
-          else
-            llvm::outs() << "; RHS inferred successfully, but cost regressed";
-          llvm::outs() << " (Old= " << OldCost << ", New= " << NewCost <<
-            ", LHS= " << LHSCost << ")\n";
-        } else {
-          llvm::outs() << "; RHS inferred successfully\n";
-        }
 
-        if (CheckAllGuesses) {
-          for (unsigned RI = 0 ; RI < RHSs.size(); RI++) {
-            llvm::outs() << "; result " << (RI + 1) << ":\n";
-            ReplacementContext RC;
-            PrintReplacementRHS(llvm::outs(), RHSs[RI], RC);
-            llvm::outs() << "\n";
-          }
-        } else {
-          if (PrintRepl) {
-            PrintReplacement(llvm::outs(), Rep.BPCs, Rep.PCs, Rep.Mapping);
-          } else if (PrintReplSplit) {
-            ReplacementContext Context;
-            PrintReplacementLHS(llvm::outs(), Rep.BPCs, Rep.PCs,
-                                Rep.Mapping.LHS, Context);
-            PrintReplacementRHS(llvm::outs(), Rep.Mapping.RHS, Context);
-          } else {
-            ReplacementContext Context;
-            PrintReplacementRHS(llvm::outs(), Rep.Mapping.RHS,
-                                ReInferRHS ? Context : Contexts[Index]);
-          }
+      if (CheckAllGuesses) {
+        for (unsigned RI = 0 ; RI < RHSs.size(); RI++) {
+          Out << "; result " << (RI + 1) << ":\n";
+          ReplacementContext RC;
+          PrintReplacementRHS(Out, RHSs[RI], RC);
+          Out << "\n";
         }
       } else {
-        ++Fail;
-        llvm::outs() << "; Failed to infer RHS\n";
-        if (PrintRepl || PrintReplSplit) {
+        if (PrintRepl) {
+          PrintReplacement(Out, Rep.BPCs, Rep.PCs, Rep.Mapping);
+        } else if (PrintReplSplit) {
           ReplacementContext Context;
-          PrintReplacementLHS(llvm::outs(), Rep.BPCs, Rep.PCs,
+          PrintReplacementLHS(Out, Rep.BPCs, Rep.PCs,
                               Rep.Mapping.LHS, Context);
-        }
-      }
-    } else if (InferConst) {
-      ConstantSynthesis CS;
-      std::map <Inst *, llvm::APInt> ResultConstMap;
-
-      std::set<Inst *> ConstSet;
-      souper::getConstants(Rep.Mapping.RHS, ConstSet);
-      if (ConstSet.empty()) {
-        llvm::outs() << "; No reservedconst found in RHS\n";
-      } else {
-        if (std::error_code EC = S->inferConst(Rep.BPCs, Rep.PCs,
-                                               Rep.Mapping.LHS, Rep.Mapping.RHS,
-                                               ConstSet, ResultConstMap, IC)) {
-          llvm::errs() << EC.message() << '\n';
-          Ret = 1;
-          ++Error;
-        }
-
-        if (!ResultConstMap.empty()) {
-          ReplacementContext Context;
-          llvm::outs() << "; RHS inferred successfully\n";
-          PrintReplacementRHS(llvm::outs(), Rep.Mapping.RHS, Context);
-          ++Success;
+          PrintReplacementRHS(Out, Rep.Mapping.RHS, Context);
         } else {
-          ++Fail;
-          llvm::outs() << "; Failed to infer RHS\n";
+          ReplacementContext Context;
+          PrintReplacementRHS(Out, Rep.Mapping.RHS,
+                              ReInferRHS ? Context : *LHSContext);
         }
       }
-    } else if (TryDataflowPruning) {
-      SynthesisContext SC{IC, /*Solver(UNUSED)*/nullptr, Rep.Mapping.LHS,
-        /*LHSUB(UNUSED)*/nullptr, Rep.PCs, Rep.BPCs,
-        /*CheckAllGuesses(UNUSED)*/true, /*Timeout(UNUSED)*/100};
-      std::vector<Inst *> Inputs;
-      findVars(SC.LHS, Inputs);
-      PruningManager P(SC, Inputs, /*StatsLevel=*/3);
-      P.init();
-      if (P.isInfeasible(Rep.Mapping.RHS, /*StatsLevel=*/3)) {
-        llvm::outs() << "Pruning succeeded.\n";
-      } else {
-        llvm::outs() << "Pruning failed.\n";
+    } else {
+      ++R.Fail;
+      Out << "; Failed to infer RHS\n";
+      if (PrintRepl || PrintReplSplit) {
+        ReplacementContext Context;
+        PrintReplacementLHS(Out, Rep.BPCs, Rep.PCs,
+                            Rep.Mapping.LHS, Context);
+      }
+    }
+  } else if (InferConst) {
+    ConstantSynthesis CS;
+    std::map <Inst *, llvm::APInt> ResultConstMap;
+
+    std::set<Inst *> ConstSet;
+    souper::getConstants(Rep.Mapping.RHS, ConstSet);
+    if (ConstSet.empty()) {
+      Out << "; No reservedconst found in RHS\n";
+    } else {
+      if (std::error_code EC = S->inferConst(Rep.BPCs, Rep.PCs,
+                                             Rep.Mapping.LHS, Rep.Mapping.RHS,
+                                             ConstSet, ResultConstMap, IC)) {
+        Err << EC.message() << '\n';
+        R.Ret = 1;
+        ++R.Error;
       }
-    } else if (InferAP) {
-        bool FoundWeakest = false;
-        S->abstractPrecondition(Rep.BPCs, Rep.PCs, Rep.Mapping, IC, FoundWeakest);
-        if (!FoundWeakest) {
-          llvm::outs() << "Failed to find WP.\n";
-        }
 
+      if (!ResultConstMap.empty()) {
+        ReplacementContext Context;
+        Out << "; RHS inferred successfully\n";
+        PrintReplacementRHS(Out, Rep.Mapping.RHS, Context);
+        ++R.Success;
+      } else {
+        ++R.Fail;
+        Out << "; Failed to infer RHS\n";
+      }
+    }
+  } else if (TryDataflowPruning) {
+    SynthesisContext SC{IC, /*Solver(UNUSED)*/nullptr, Rep.Mapping.LHS,
+      /*LHSUB(UNUSED)*/nullptr, Rep.PCs, Rep.BPCs,
+      /*CheckAllGuesses(UNUSED)*/true, /*Timeout(UNUSED)*/100};
+    std::vector<Inst *> Inputs;
+    findVars(SC.LHS, Inputs);
+    PruningManager P(SC, Inputs, /*StatsLevel=*/3);
+    P.init();
+    if (P.isInfeasible(Rep.Mapping.RHS, /*StatsLevel=*/3)) {
+      Out << "Pruning succeeded.\n";
     } else {
-      bool Valid;
-      std::vector<std::pair<Inst *, APInt>> Models;
-      if (std::error_code EC = S->isValid(IC, Rep.BPCs, Rep.PCs,
-                                          Rep.Mapping, Valid, &Models)) {
-        llvm::errs() << EC.message() << '\n';
-        Ret = 1;
-        ++Error;
+      Out << "Pruning failed.\n";
+    }
+  } else if (InferAP) {
+      bool FoundWeakest = false;
+      S->abstractPrecondition(Rep.BPCs, Rep.PCs, Rep.Mapping, IC, FoundWeakest);
+      if (!FoundWeakest) {
+        Out << "Failed to find WP.\n";
       }
 
-      if (Valid) {
-        ++Success;
-        llvm::outs() << "; LGTM\n";
-        if (PrintRepl)
-          PrintReplacement(llvm::outs(), Rep.BPCs, Rep.PCs, Rep.Mapping);
-        if (PrintReplSplit) {
-          ReplacementContext Context;
-          PrintReplacementLHS(llvm::outs(), Rep.BPCs, Rep.PCs,
-                              Rep.Mapping.LHS, Context);
-          PrintReplacementRHS(llvm::outs(), Rep.Mapping.RHS, Context);
+  } else {
+    bool Valid;
+    std::vector<std::pair<Inst *, APInt>> Models;
+    if (std::error_code EC = S->isValid(IC, Rep.BPCs, Rep.PCs,
+                                        Rep.Mapping, Valid, &Models)) {
+      Err << EC.message() << '\n';
+      R.Ret = 1;
+      ++R.Error;
+    }
+
+    if (Valid) {
+      ++R.Success;
+      Out << "; LGTM\n";
+      if (PrintRepl)
+        PrintReplacement(Out, Rep.BPCs, Rep.PCs, Rep.Mapping);
+      if (PrintReplSplit) {
+        ReplacementContext Context;
+        PrintReplacementLHS(Out, Rep.BPCs, Rep.PCs,
+                            Rep.Mapping.LHS, Context);
+        PrintReplacementRHS(Out, Rep.Mapping.RHS, Context);
+      }
+    } else {
+      ++R.Fail;
+      Out << "Invalid";
+      if (PrintCounterExample && !Models.empty()) {
+        Out << ", e.g.\n\n";
+        std::sort(Models.begin(), Models.end(),
+                  [](const std::pair<Inst *, APInt> &A,
+                     const std::pair<Inst *, APInt> &B) {
+                    return A.first->Name < B.first->Name;
+                  });
+        for (const auto &M : Models) {
+          Out << '%' << M.first->Name << " = " << M.second << '\n';
         }
       } else {
-        ++Fail;
-        llvm::outs() << "Invalid";
-        if (PrintCounterExample && !Models.empty()) {
-          llvm::outs() << ", e.g.\n\n";
-          std::sort(Models.begin(), Models.end(),
-                    [](const std::pair<Inst *, APInt> &A,
-                       const std::pair<Inst *, APInt> &B) {
-                      return A.first->Name < B.first->Name;
-                    });
-          for (const auto &M : Models) {
-            llvm::outs() << '%' << M.first->Name << " = " << M.second << '\n';
-          }
-        } else {
-          llvm::outs() << "\n";
-        }
+        Out << "\n";
+      }
+    }
+  }
+  if (PrintRepl || PrintReplSplit)
+    Out << "\n";
+}
+
+// Checks Rep with its output kept in R, to be printed later.
+static void checkBuffered(ParsedReplacement &Rep,
+                          ReplacementContext *LHSContext, Solver *S,
+                          InstContext &IC, CheckResult &R) {
+  raw_string_ostream Out(R.Out), Err(R.Err);
+  unsigned long Queries = threadQueryCount();
+  auto Start = std::chrono::steady_clock::now();
+  checkReplacement(Rep, LHSContext, S, IC, Out, Err, R);
+  R.Microseconds = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - Start).count();
+  R.Queries = threadQueryCount() - Queries;
+  Out.flush();
+  Err.flush();
+}
+
+static void printResult(unsigned Index, const CheckResult &R) {
+  if (!JSONOutput) {
+    llvm::outs() << R.Out;
+    llvm::errs() << R.Err;
+    return;
+  }
+  const char *Status = "none";
+  if (R.Error || R.Ret)
+    Status = "error";
+  else if (R.Fail)
+    Status = "failure";
+  else if (R.Success)
+    Status = "success";
+  json::OStream J(llvm::outs());
+  J.object([&] {
+    J.attribute("index", Index);
+    J.attribute("status", Status);
+    J.attribute("time_us", R.Microseconds);
+    J.attribute("queries", int64_t(R.Queries));
+    J.attribute("output", R.Out);
+    J.attribute("errors", R.Err);
+  });
+  llvm::outs() << '\n';
+}
+
+static void addResult(CheckResult &Total, const CheckResult &R) {
+  Total.Ret |= R.Ret;
+  Total.Success += R.Success;
+  Total.Fail += R.Fail;
+  Total.Error += R.Error;
+}
+
+// Workers take the next unchecked replacement until none are left. Each has
+// its own instruction context and solver; the first one uses those of the
+// caller, the others parse the input again, which gives their instructions
+// the same names. Results are printed in input order as they become
+// available.
+static void checkInParallel(const MemoryBufferRef &MB, InstContext &IC,
+                            std::vector<ParsedReplacement> &Reps,
+                            std::vector<ReplacementContext> &Contexts,
+                            Solver *S, unsigned NumJobs, CheckResult &Total) {
+  std::vector<CheckResult> Results(Reps.size());
+  std::vector<bool> Done(Reps.size());
+  std::mutex Mutex;
+  std::condition_variable Finished;
+  std::atomic<unsigned> Next{0};
+  std::atomic<bool> Stop{false};
+
+  auto Work = [&](std::vector<ParsedReplacement> &WorkReps,
+                  std::vector<ReplacementContext> &WorkContexts,
+                  Solver *WorkS, InstContext &WorkIC) {
+    unsigned I;
+    while (!Stop && (I = Next++) < WorkReps.size()) {
+      CheckResult R;
+      checkBuffered(WorkReps[I],
+                    WorkContexts.empty() ? nullptr : &WorkContexts[I], WorkS,
+                    WorkIC, R);
+      if (R.Stop)
+        Stop = true;
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Results[I] = std::move(R);
+      Done[I] = true;
+      Finished.notify_one();
+    }
+  };
+
+  std::vector<std::thread> Workers;
+  Workers.emplace_back(Work, std::ref(Reps), std::ref(Contexts), S,
+                       std::ref(IC));
+  for (unsigned J = 1; J != NumJobs; ++J) {
+    Workers.emplace_back([&] {
+      InstContext WorkerIC;
+      std::vector<ReplacementContext> WorkerContexts;
+      std::string ErrStr;
+      std::vector<ParsedReplacement> WorkerReps =
+        parseInput(WorkerIC, MB, WorkerContexts, ErrStr);
+      KVStore *KV = 0;
+      std::unique_ptr<Solver> WorkerS = GetSolver(KV);
+      Work(WorkerReps, WorkerContexts, WorkerS.get(), WorkerIC);
+    });
+  }
+
+  for (unsigned I = 0; I != Reps.size(); ++I) {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    Finished.wait(Lock, [&] { return Done[I]; });
+    CheckResult R = std::move(Results[I]);
+    Lock.unlock();
+    printResult(I, R);
+    llvm::outs().flush();
+    if (R.Stop) {
+      Total.Stop = true;
+      break;
+    }
+    addResult(Total, R);
+  }
+  for (auto &W : Workers)
+    W.join();
+}
+
+int SolveInst(const MemoryBufferRef &MB, Solver *S) {
+  InstContext IC;
+  std::string ErrStr;
+
+  std::vector<ReplacementContext> Contexts;
+  std::vector<ParsedReplacement> Reps = parseInput(IC, MB, Contexts, ErrStr);
+  if (!ErrStr.empty()) {
+    llvm::errs() << ErrStr << '\n';
+    return 1;
+  }
+
+  if (EmitLHSDot) {
+    llvm::outs() << "; emitting DOT for parsed LHS souper IR ...\n";
+    for (auto &Rep : Reps) {
+      llvm::WriteGraph(llvm::outs(), Rep.Mapping.LHS);
+    }
+  }
+
+  if (ParseOnly || ParseLHSOnly) {
+    llvm::outs() << "; parsing successful\n";
+    return 0;
+  }
+
+  unsigned NumJobs = Jobs ? Jobs
+                     : llvm::hardware_concurrency().compute_thread_count();
+  // Alive2 shares one Z3 context, so it checks one replacement at a time.
+  if (UseAlive)
+    NumJobs = 1;
+  NumJobs = std::min<size_t>(NumJobs, Reps.size());
+  CheckResult Total;
+  if (NumJobs > 1) {
+    checkInParallel(MB, IC, Reps, Contexts, S, NumJobs, Total);
+  } else {
+    for (unsigned Index = 0; Index != Reps.size(); ++Index) {
+      ReplacementContext *LHSContext =
+        Contexts.empty() ? nullptr : &Contexts[Index];
+      CheckResult R;
+      if (JSONOutput) {
+        checkBuffered(Reps[Index], LHSContext, S, IC, R);
+        printResult(Index, R);
+      } else {
+        checkReplacement(Reps[Index], LHSContext, S, IC, llvm::outs(),
+                         llvm::errs(), R);
       }
+      if (R.Stop) {
+        Total.Stop = true;
+        break;
+      }
+      addResult(Total, R);
     }
-    ++Index;
-    if (PrintRepl || PrintReplSplit)
-      llvm::outs() << "\n";
   }
-  if ((Success + Fail + Error) > 1)
-    llvm::outs() << "successes = " << Success << ", failures = " << Fail <<
-      ", errors = " << Error << "\n";
-  return Ret;
+  if (Total.Stop)
+    return 0;
+  if (!JSONOutput && (Total.Success + Total.Fail + Total.Error) > 1)
+    llvm::outs() << "successes = " << Total.Success << ", failures = "
+                 << Total.Fail << ", errors = " << Total.Error << "\n";
+  return Total.Ret;
 }
 
 int main(int argc, char **argv) {
   cl::ParseCommandLineOptions(argc, argv);
+  llvm_shutdown_obj Y;  // Call llvm_shutdown() on exit.
   KVStore *KV = 0;
 
   std::unique_ptr<Solver> S = 0;
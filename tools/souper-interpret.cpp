@@ -13,6 +13,7 @@
 // limitations under the License.
 
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/SmallString.h"
 #include "llvm/Support/KnownBits.h"
 #include "llvm/Support/MemoryBuffer.h"
@@ -23,6 +24,8 @@
 #include "souper/Tool/GetSolver.h"
 #include "souper/Util/LLVMUtils.h"
 
+#include <random>
+
 using namespace llvm;
 using namespace souper;
 
@@ -43,6 +46,59 @@ static cl::opt<std::string>
 InputFilename(cl::Positional, cl::desc("<input souper optimization>"),
               cl::init("-"));
 
+static cl::opt<std::string> InputVectorFile("input-file",
+    cl::desc("Evaluate each LHS on the inputs in this file (default=none)"),
+    cl::init(""));
+
+enum class InputFormat { CSV, Binary };
+
+static cl::opt<InputFormat> InputVectorFormat("input-format",
+    cl::desc("Format of -input-file (default=csv)"),
+    cl::values(
+      clEnumValN(InputFormat::CSV, "csv",
+                 "A header line with the names of the variables, then one "
+                 "line of comma separated values per input"),
+      clEnumValN(InputFormat::Binary, "binary",
+                 "One record per input with the value of each variable in "
+                 "the order of their definitions, in the fewest whole bytes, "
+                 "little endian")),
+    cl::init(InputFormat::CSV));
+
+static cl::opt<unsigned> RandomInputs("random-inputs",
+    cl::desc("Evaluate each LHS on this many random inputs (default=0)"),
+    cl::init(0));
+
+static cl::opt<unsigned> RandomSeed("seed",
+    cl::desc("Seed of -random-inputs (default=0)"),
+    cl::init(0));
+
+static cl::opt<bool> ExhaustiveInputs("exhaustive-inputs",
+    cl::desc("Evaluate each LHS on all of its inputs (default=false)"),
+    cl::init(false));
+
+static cl::opt<unsigned> ExhaustiveMaxBits("exhaustive-max-bits",
+    cl::desc("Largest total width of the variables of an LHS for "
+             "-exhaustive-inputs (default=24)"),
+    cl::init(24));
+
+static cl::opt<bool> CompareRHS("compare-rhs",
+    cl::desc("Read replacements and report the inputs on which the RHS "
+             "does not refine the LHS (default=false)"),
+    cl::init(false));
+
+static cl::opt<unsigned> BatchSize("batch-size",
+    cl::desc("Number of inputs evaluated together (default=4096)"),
+    cl::init(4096));
+
+static cl::opt<unsigned> HistogramSize("histogram-size",
+    cl::desc("Number of the most frequent LHS values printed "
+             "(default=10)"),
+    cl::init(10));
+
+static cl::opt<unsigned> MaxMismatches("max-mismatches",
+    cl::desc("Number of mismatching inputs printed (default=10)"),
+    cl::init(10));
+
 namespace {
   enum class CompareDataflowResult {
     SAME,
@@ -282,16 +338,400 @@ static int Interpret(const MemoryBufferRef &MB, Solver *S) {
   return Ret;
 }
 
+namespace {
+
+// Produces the inputs of a replacement, a batch at a time. Vars are the
+// variables of the replacement in the order of their definitions.
+class InputSource {
+protected:
+  std::vector<Inst *> Vars;
+
+public:
+  InputSource(const std::vector<Inst *> &Vars) : Vars(Vars) {}
+  virtual ~InputSource() {}
+  // Replace Inputs with the next inputs, at most Max of them, and return
+  // how many there are, or 0 at the end or on an error in the input.
+  virtual size_t next(BatchInputs &Inputs, size_t Max, std::string &ErrStr) = 0;
+};
+
+class RandomInputSource : public InputSource {
+  std::mt19937_64 Gen;
+  uint64_t Left;
+
+  APInt random(unsigned Width) {
+    // Some values are the edge cases that most often tell instructions
+    // apart.
+    switch (Gen() % 16) {
+    case 0: return APInt::getZero(Width);
+    case 1: return APInt(Width, 1);
+    case 2: return APInt::getAllOnes(Width);
+    case 3: return APInt::getSignedMinValue(Width);
+    case 4: return APInt::getSignedMaxValue(Width);
+    }
+    SmallVector<uint64_t, 2> Words;
+    for (unsigned I = 0; I < (Width + 63) / 64; ++I)
+      Words.push_back(Gen());
+    return APInt(Width, Words);
+  }
+
+public:
+  RandomInputSource(const std::vector<Inst *> &Vars, uint64_t Count)
+    : InputSource(Vars), Gen(RandomSeed), Left(Count) {}
+
+  size_t next(BatchInputs &Inputs, size_t Max, std::string &) override {
+    size_t N = std::min<uint64_t>(Max, Left);
+    Left -= N;
+    for (auto *V : Vars) {
+      auto &Column = Inputs[V];
+      Column.clear();
+      for (size_t J = 0; J != N; ++J)
+        Column.push_back(random(V->Width));
+    }
+    return N;
+  }
+};
+
+// Counts through all inputs, with the bits of the first variable lowest.
+class ExhaustiveInputSource : public InputSource {
+  uint64_t Next = 0, End;
+
+public:
+  ExhaustiveInputSource(const std::vector<Inst *> &Vars, unsigned Bits)
+    : InputSource(Vars), End(uint64_t(1) << Bits) {}
+
+  size_t next(BatchInputs &Inputs, size_t Max, std::string &) override {
+    size_t N = std::min<uint64_t>(Max, End - Next);
+    for (auto *V : Vars)
+      Inputs[V].clear();
+    for (size_t J = 0; J != N; ++J, ++Next) {
+      unsigned Shift = 0;
+      for (auto *V : Vars) {
+        Inputs[V].push_back(APInt(64, Next >> Shift).trunc(V->Width));
+        Shift += V->Width;
+      }
+    }
+    return N;
+  }
+};
+
+class CSVInputSource : public InputSource {
+  StringRef Rest;
+  unsigned Line = 1;
+  // The column of each variable.
+  std::vector<unsigned> Columns;
+
+  static bool parseValue(StringRef Str, unsigned Width, APInt &Val) {
+    Str = Str.trim();
+    bool Neg = Str.consume_front("-");
+    unsigned Radix = Str.consume_front("0x") ? 16 : 10;
+    APInt A;
+    if (Str.empty() || Str.getAsInteger(Radix, A) ||
+        A.getActiveBits() > Width + 1)
+      return false;
+    A = A.zextOrTrunc(Width + 1);
+    if (Neg) {
+      A.negate();
+      if (A.getMinSignedBits() > Width)
+        return false;
+    } else if (A.getActiveBits() > Width) {
+      return false;
+    }
+    Val = A.trunc(Width);
+    return true;
+  }
+
+  bool nextLine(StringRef &L) {
+    while (!Rest.empty()) {
+      std::tie(L, Rest) = Rest.split('\n');
+      ++Line;
+      L = L.trim();
+      if (!L.empty() && !L.startswith("#"))
+        return true;
+    }
+    return false;
+  }
+
+public:
+  CSVInputSource(const std::vector<Inst *> &Vars, StringRef Buffer)
+    : InputSource(Vars), Rest(Buffer) {}
+
+  size_t next(BatchInputs &Inputs, size_t Max, std::string &ErrStr) override {
+    SmallVector<StringRef, 8> Fields;
+    StringRef L;
+    if (Columns.empty()) {
+      Line = 0;
+      if (!nextLine(L)) {
+        ErrStr = "no header line in " + InputVectorFile;
+        return 0;
+      }
+      L.split(Fields, ',');
+      for (auto *V : Vars) {
+        auto It = std::find_if(Fields.begin(), Fields.end(), [&](StringRef F) {
+          F = F.trim();
+          F.consume_front("%");
+          return F == V->Name;
+        });
+        if (It == Fields.end()) {
+          ErrStr = "no column for %" + V->Name + " in " + InputVectorFile;
+          return 0;
+        }
+        Columns.push_back(It - Fields.begin());
+      }
+    }
+    for (auto *V : Vars)
+      Inputs[V].clear();
+    size_t N = 0;
+    while (N != Max && nextLine(L)) {
+      Fields.clear();
+      L.split(Fields, ',');
+      for (unsigned I = 0; I != Vars.size(); ++I) {
+        APInt Val;
+        if (Columns[I] >= Fields.size() ||
+            !parseValue(Fields[Columns[I]], Vars[I]->Width, Val)) {
+          ErrStr = InputVectorFile + ":" + std::to_string(Line) +
+                   ": no valid value for %" + Vars[I]->Name;
+          return 0;
+        }
+        Inputs[Vars[I]].push_back(Val);
+      }
+      ++N;
+    }
+    return N;
+  }
+};
+
+class BinaryInputSource : public InputSource {
+  StringRef Rest;
+  size_t RecordSize = 0;
+
+public:
+  BinaryInputSource(const std::vector<Inst *> &Vars, StringRef Buffer)
+    : InputSource(Vars), Rest(Buffer) {
+    for (auto *V : Vars)
+      RecordSize += (V->Width + 7) / 8;
+  }
+
+  size_t next(BatchInputs &Inputs, size_t Max, std::string &ErrStr) override {
+    if (RecordSize && Rest.size() % RecordSize) {
+      ErrStr = InputVectorFile + " does not hold whole records of " +
+               std::to_string(RecordSize) + " bytes";
+      return 0;
+    }
+    size_t N = RecordSize ? std::min(Max, Rest.size() / RecordSize) : 0;
+    for (auto *V : Vars)
+      Inputs[V].clear();
+    for (size_t J = 0; J != N; ++J) {
+      for (auto *V : Vars) {
+        unsigned Bytes = (V->Width + 7) / 8;
+        APInt Val(Bytes * 8, 0);
+        for (unsigned B = 0; B != Bytes; ++B)
+          Val.insertBits(APInt(8, (unsigned char)Rest[B]), B * 8);
+        Inputs[V].push_back(Val.zextOrTrunc(V->Width));
+        Rest = Rest.drop_front(Bytes);
+      }
+    }
+    return N;
+  }
+};
+
+}
+
+// Whether R may replace L on an input. Values the interpreter does not
+// support are not reported as mismatches.
+static bool refines(const EvalValue &L, const EvalValue &R) {
+  switch (L.K) {
+  case EvalValue::ValueKind::UB:
+    return true;
+  case EvalValue::ValueKind::Poison:
+    return R.K != EvalValue::ValueKind::UB;
+  case EvalValue::ValueKind::Val:
+    return R.K == EvalValue::ValueKind::Unimplemented ||
+           (R.K == EvalValue::ValueKind::Val && R.Value == L.Value);
+  default:
+    return true;
+  }
+}
+
+static void printValue(raw_ostream &OS, const EvalValue &V) {
+  switch (V.K) {
+  case EvalValue::ValueKind::Val: V.Value.print(OS, /*isSigned=*/false); break;
+  case EvalValue::ValueKind::Poison: OS << "Poison"; break;
+  case EvalValue::ValueKind::Undef: OS << "Undef"; break;
+  case EvalValue::ValueKind::UB: OS << "Undefined Behavior"; break;
+  case EvalValue::ValueKind::Unimplemented: OS << "Unimplemented"; break;
+  }
+}
+
+// Evaluate the LHS, and the RHS with -compare-rhs, of Rep on the inputs of
+// the input source.
+static int evaluateBatches(ParsedReplacement &Rep, unsigned Index,
+                           const MemoryBuffer *File) {
+  std::vector<Inst *> Roots = {Rep.Mapping.LHS};
+  if (CompareRHS)
+    Roots.push_back(Rep.Mapping.RHS);
+  std::vector<Inst *> Vars, Phis;
+  for (auto *R : Roots) {
+    findVars(R, Vars);
+    findInsts(R, Phis, [](Inst *I) { return I->K == Inst::Phi; });
+  }
+  std::sort(Vars.begin(), Vars.end(), [](Inst *A, Inst *B) {
+    return A->Number < B->Number;
+  });
+  Vars.erase(std::unique(Vars.begin(), Vars.end()), Vars.end());
+
+  llvm::outs() << "; replacement " << Index << ": ";
+  if (!Phis.empty()) {
+    llvm::outs() << "phis are not supported by batch evaluation\n";
+    return 1;
+  }
+  unsigned Bits = 0;
+  for (auto *V : Vars)
+    Bits += V->Width;
+
+  std::unique_ptr<InputSource> Source;
+  if (File && InputVectorFormat == InputFormat::CSV) {
+    Source.reset(new CSVInputSource(Vars, File->getBuffer()));
+  } else if (File) {
+    Source.reset(new BinaryInputSource(Vars, File->getBuffer()));
+  } else if (RandomInputs) {
+    Source.reset(new RandomInputSource(Vars, RandomInputs));
+  } else {
+    // Inputs are counted in 64 bits.
+    if (Bits > std::min(ExhaustiveMaxBits.getValue(), 63u)) {
+      llvm::outs() << Bits << " input bits are too many for "
+                   << "-exhaustive-inputs\n";
+      return 1;
+    }
+    Source.reset(new ExhaustiveInputSource(Vars, Bits));
+  }
+
+  BatchInterpreter BI(Roots);
+  BatchInputs Inputs;
+  std::vector<std::vector<EvalValue>> Results;
+  uint64_t NumInputs = 0, Values = 0, Poison = 0, UB = 0, Unsupported = 0;
+  uint64_t Mismatches = 0;
+  DenseMap<APInt, uint64_t> Histogram;
+  std::string MismatchStr;
+  raw_string_ostream MismatchOS(MismatchStr);
+  std::string ErrStr;
+  while (size_t N = Source->next(Inputs, std::max(1u, BatchSize.getValue()),
+                                 ErrStr)) {
+    BI.evaluate(Inputs, N, Results);
+    for (size_t J = 0; J != N; ++J) {
+      const EvalValue &L = Results[0][J];
+      switch (L.K) {
+      case EvalValue::ValueKind::Val: ++Values; ++Histogram[L.Value]; break;
+      case EvalValue::ValueKind::Poison: ++Poison; break;
+      case EvalValue::ValueKind::UB: ++UB; break;
+      default: ++Unsupported; break;
+      }
+      if (!CompareRHS || refines(L, Results[1][J]))
+        continue;
+      if (Mismatches++ >= MaxMismatches)
+        continue;
+      MismatchOS << " ";
+      for (unsigned I = 0; I != Vars.size(); ++I) {
+        MismatchOS << (I ? ", %" : " %") << Vars[I]->Name << " = ";
+        Inputs[Vars[I]][J].print(MismatchOS, /*isSigned=*/false);
+      }
+      MismatchOS << ": LHS ";
+      printValue(MismatchOS, L);
+      MismatchOS << ", RHS ";
+      printValue(MismatchOS, Results[1][J]);
+      MismatchOS << "\n";
+    }
+    NumInputs += N;
+  }
+  if (!ErrStr.empty()) {
+    llvm::outs() << "error\n";
+    llvm::errs() << "Error: " << ErrStr << '\n';
+    return 1;
+  }
+
+  llvm::outs() << NumInputs << " inputs\n";
+  llvm::outs() << "LHS: " << Values << " values, " << Poison << " poison, "
+               << UB << " UB, " << Unsupported << " unsupported\n";
+  std::vector<std::pair<APInt, uint64_t>> Counts(Histogram.begin(),
+                                                 Histogram.end());
+  std::sort(Counts.begin(), Counts.end(),
+            [](const std::pair<APInt, uint64_t> &A,
+               const std::pair<APInt, uint64_t> &B) {
+              if (A.second != B.second)
+                return A.second > B.second;
+              return A.first.ult(B.first);
+            });
+  llvm::outs() << "LHS values: " << Counts.size() << " distinct\n";
+  for (unsigned I = 0; I != Counts.size() && I != HistogramSize; ++I) {
+    llvm::outs() << "  ";
+    Counts[I].first.print(llvm::outs(), /*isSigned=*/false);
+    llvm::outs() << ": " << Counts[I].second << "\n";
+  }
+  if (CompareRHS)
+    llvm::outs() << "RHS mismatches: " << Mismatches << "\n"
+                 << MismatchOS.str();
+  return Mismatches ? 1 : 0;
+}
+
+static int InterpretBatches(const MemoryBufferRef &MB) {
+  std::unique_ptr<MemoryBuffer> File;
+  if (!InputVectorFile.empty()) {
+    auto FileOrErr = MemoryBuffer::getFile(InputVectorFile);
+    if (!FileOrErr) {
+      llvm::errs() << InputVectorFile << ": "
+                   << FileOrErr.getError().message() << '\n';
+      return 1;
+    }
+    File = std::move(*FileOrErr);
+  }
+
+  InstContext IC;
+  std::string ErrStr;
+  std::vector<ParsedReplacement> Reps;
+  if (CompareRHS) {
+    Reps = ParseReplacements(IC, MB.getBufferIdentifier(), MB.getBuffer(),
+                             ErrStr);
+  } else {
+    std::vector<ReplacementContext> Contexts;
+    Reps = ParseReplacementLHSs(IC, MB.getBufferIdentifier(), MB.getBuffer(),
+                                Contexts, ErrStr);
+  }
+  if (!ErrStr.empty()) {
+    llvm::errs() << ErrStr << '\n';
+    return 1;
+  }
+
+  int Ret = 0;
+  for (unsigned I = 0; I != Reps.size(); ++I)
+    Ret |= evaluateBatches(Reps[I], I, File.get());
+  return Ret;
+}
+
 int main(int argc, char **argv) {
   cl::ParseCommandLineOptions(argc, argv);
-  KVStore *KV = 0;
-  std::unique_ptr<Solver> S = 0;
-  S = GetSolver(KV);
 
   auto MB = MemoryBuffer::getFileOrSTDIN(InputFilename);
   if (!MB) {
     llvm::errs() << MB.getError().message() << '\n';
     return 1;
   }
+
+  unsigned Sources = !InputVectorFile.empty() + (RandomInputs != 0) +
+                     ExhaustiveInputs;
+  if (Sources > 1) {
+    llvm::errs() << "Error: only one of -input-file, -random-inputs and "
+                 << "-exhaustive-inputs may be given\n";
+    return 1;
+  }
+  if (Sources)
+    return InterpretBatches((*MB)->getMemBufferRef());
+  if (CompareRHS) {
+    llvm::errs() << "Error: -compare-rhs needs -input-file, -random-inputs "
+                 << "or -exhaustive-inputs\n";
+    return 1;
+  }
+
+  KVStore *KV = 0;
+  std::unique_ptr<Solver> S = 0;
+  S = GetSolver(KV);
   return Interpret((*MB)->getMemBufferRef(), S.get());
 }
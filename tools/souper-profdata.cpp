@@ -0,0 +1,76 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Merges, prints, and uploads the .souperprof files written by programs
+// built with -souper-dynamic-profile.
+
+#include "souper/KVStore/KVStore.h"
+#include "souper/Tool/ProfileData.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace souper;
+using namespace llvm;
+
+static cl::opt<std::string> Command(cl::Positional, cl::Required,
+    cl::desc("<merge|show|upload>: merge the profiles into the output "
+             "file, print their counts, or add their counts to the Redis "
+             "cache for cache_dump -sort=dprofile"));
+
+static cl::list<std::string> InputFilenames(cl::Positional, cl::OneOrMore,
+    cl::desc("<profile files>"));
+
+static cl::opt<std::string> OutputFilename("o",
+    cl::desc("Output file of merge (default=default.souperprof)"),
+    cl::init("default.souperprof"));
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv);
+
+  ProfileData Data;
+  for (const auto &Input : InputFilenames) {
+    if (std::error_code EC = readProfileFile(Input, Data)) {
+      errs() << Input << ": " << EC.message() << '\n';
+      return 1;
+    }
+  }
+
+  if (Command == "merge") {
+    std::error_code EC;
+    raw_fd_ostream OS(OutputFilename, EC, sys::fs::OF_None);
+    if (EC) {
+      errs() << OutputFilename << ": " << EC.message() << '\n';
+      return 1;
+    }
+    Data.write(OS);
+  } else if (Command == "show") {
+    for (const auto &Key : Data.Counts) {
+      outs() << "Souper profile key = '" << Key.first << "'\n";
+      for (const auto &Field : Key.second)
+        outs() << "  field = '" << Field.first << "'\n"
+               << "  count = " << Field.second << "\n";
+      outs() << "\n";
+    }
+  } else if (Command == "upload") {
+    KVStore KV;
+    for (const auto &Key : Data.Counts)
+      for (const auto &Field : Key.second)
+        KV.hIncrBy(Key.first, Field.first, Field.second);
+  } else {
+    errs() << "unknown command '" << Command << "'\n";
+    return 1;
+  }
+  return 0;
+}
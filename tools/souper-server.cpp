@@ -0,0 +1,299 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Answers the solver queries of the Souper pass and tools that were started
+// with -souper-server, so that they share one set of solvers and caches
+// instead of setting up their own. The solvers are configured by the options
+// given to the server; clients whose solver options differ do not use it.
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include "souper/Tool/GetSolver.h"
+#include "souper/Tool/RemoteSolver.h"
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <future>
+#include <list>
+#include <mutex>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+using namespace llvm;
+using namespace souper;
+
+unsigned DebugLevel;
+
+static cl::opt<unsigned, /*ExternalStorage=*/true>
+DebugFlagParser("souper-debug-level",
+     cl::desc("Control the verbose level of debug output (default=1). "
+     "The larger the number is, the more fine-grained debug "
+     "information will be printed."),
+     cl::location(DebugLevel), cl::init(1));
+
+static cl::opt<std::string> SocketPath("socket",
+    cl::desc("UNIX socket to listen on (default=souper-server.sock)"),
+    cl::init("souper-server.sock"));
+
+static cl::opt<unsigned> NumSolvers("solvers",
+    cl::desc("Number of queries answered at the same time (default=0, one "
+             "per hardware thread)"),
+    cl::init(0));
+
+static cl::opt<unsigned> MaxAnswers("max-answers",
+    cl::desc("Number of answers kept for other clients, the least recently "
+             "used are dropped first (default=100000, 0 for no limit)"),
+    cl::init(100000));
+
+static cl::opt<unsigned> IdleTimeout("idle-timeout",
+    cl::desc("Exit after this many seconds without clients (default=0, "
+             "never)"),
+    cl::init(0));
+
+static cl::opt<bool> Detach("detach",
+    cl::desc("Run in the background once the socket accepts connections "
+             "(default=false)"),
+    cl::init(false));
+
+static volatile std::sig_atomic_t Stop;
+
+static void stop(int) { Stop = 1; }
+
+namespace {
+
+class Server {
+  std::mutex Mutex;
+  std::condition_variable SolverFree;
+  // Each solver answers one query at a time, since the solvers and their
+  // caches are not thread safe.
+  std::vector<std::unique_ptr<Solver>> Solvers;
+  std::string SolverOptions;
+  // Answers indexed by query, without the timeout of the client. A query
+  // that is being answered has a future that clients asking the same query
+  // wait for.
+  struct Reply {
+    std::string Answer;
+    bool Kept;
+  };
+  struct KeptAnswer {
+    std::shared_future<Reply> Answer;
+    std::list<const std::string *>::iterator Use;
+  };
+  std::unordered_map<std::string, KeptAnswer> Answers;
+  // The keys of Answers, most recently used first.
+  std::list<const std::string *> Uses;
+  unsigned Clients = 0;
+  std::chrono::steady_clock::time_point LastClient =
+    std::chrono::steady_clock::now();
+
+  void keep(const std::string &Key, std::shared_future<Reply> Answer) {
+    auto It = Answers.emplace(Key, KeptAnswer{Answer, Uses.end()}).first;
+    Uses.push_front(&It->first);
+    It->second.Use = Uses.begin();
+    // Clients waiting for a dropped answer still get it.
+    while (MaxAnswers && Answers.size() > MaxAnswers) {
+      const std::string *Oldest = Uses.back();
+      Uses.pop_back();
+      Answers.erase(*Oldest);
+    }
+  }
+
+  void drop(const std::string &Key) {
+    auto It = Answers.find(Key);
+    if (It == Answers.end())
+      return;
+    Uses.erase(It->second.Use);
+    Answers.erase(It);
+  }
+
+public:
+  Server(unsigned N) : SolverOptions(GetSolverOptionValues()) {
+    for (unsigned I = 0; I != N; ++I) {
+      KVStore *KV = nullptr;
+      Solvers.push_back(GetSolver(KV));
+    }
+  }
+
+  std::string answer(StringRef Query) {
+    StringRef Header, Repl;
+    std::tie(Header, Repl) = Query.split('\n');
+    StringRef Command = Header.split(' ').first;
+    if (Command == "options")
+      return "ok\n" + SolverOptions;
+    std::string Key = (Command + "\n" + Repl).str();
+
+    std::promise<Reply> Promise;
+    std::unique_ptr<Solver> S;
+    {
+      std::unique_lock<std::mutex> Lock(Mutex);
+      for (auto It = Answers.find(Key); It != Answers.end();
+           It = Answers.find(Key)) {
+        Uses.splice(Uses.begin(), Uses, It->second.Use);
+        std::shared_future<Reply> Kept = It->second.Answer;
+        Lock.unlock();
+        // An answer that was not kept may only hold for the client that
+        // asked first, so it is asked again.
+        const Reply &R = Kept.get();
+        if (R.Kept)
+          return "ok cached" + R.Answer.substr(2);
+        Lock.lock();
+      }
+      keep(Key, Promise.get_future().share());
+      SolverFree.wait(Lock, [this] { return !Solvers.empty(); });
+      S = std::move(Solvers.back());
+      Solvers.pop_back();
+    }
+
+    bool Complete = false;
+    std::string Answer = answerQuery(*S, Query, &Complete);
+    // Errors, timeouts in particular, and answers that found nothing before
+    // the deadline of the client depend on the client; only the others are
+    // kept.
+    bool Kept = Complete && StringRef(Answer).startswith("ok\n");
+
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Solvers.push_back(std::move(S));
+      SolverFree.notify_one();
+      if (!Kept)
+        drop(Key);
+    }
+    Promise.set_value({Answer, Kept});
+    return Answer;
+  }
+
+  void serve(int FD) {
+    std::string Query;
+    while (!readMessage(FD, Query))
+      if (writeMessage(FD, answer(Query)))
+        break;
+    close(FD);
+    std::lock_guard<std::mutex> Lock(Mutex);
+    --Clients;
+    LastClient = std::chrono::steady_clock::now();
+  }
+
+  void accept(int FD) {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      ++Clients;
+    }
+    std::thread(&Server::serve, this, FD).detach();
+  }
+
+  bool idleFor(unsigned Seconds) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    return !Clients && std::chrono::steady_clock::now() - LastClient >=
+                         std::chrono::seconds(Seconds);
+  }
+};
+
+}
+
+static int listenOn(StringRef Path) {
+  sockaddr_un Addr;
+  std::memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  if (Path.size() >= sizeof(Addr.sun_path)) {
+    errs() << "socket path '" << Path << "' is too long\n";
+    return -1;
+  }
+  std::memcpy(Addr.sun_path, Path.data(), Path.size());
+  int FD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (FD < 0) {
+    errs() << "socket: " << std::strerror(errno) << '\n';
+    return -1;
+  }
+  // A socket left behind by a server that did not exit cleanly.
+  unlink(Addr.sun_path);
+  if (bind(FD, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) < 0 ||
+      listen(FD, SOMAXCONN) < 0) {
+    errs() << Path << ": " << std::strerror(errno) << '\n';
+    close(FD);
+    return -1;
+  }
+  return FD;
+}
+
+static void detach() {
+  if (pid_t Pid = fork()) {
+    if (Pid < 0) {
+      errs() << "fork: " << std::strerror(errno) << '\n';
+      std::exit(1);
+    }
+    std::_Exit(0);
+  }
+  setsid();
+  // The client must not wait for output that will never come.
+  int Null = open("/dev/null", O_RDWR);
+  if (Null >= 0) {
+    dup2(Null, STDIN_FILENO);
+    dup2(Null, STDOUT_FILENO);
+    dup2(Null, STDERR_FILENO);
+    if (Null > STDERR_FILENO)
+      close(Null);
+  }
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Souper solver server\n");
+  if (!ServerSocket.empty()) {
+    errs() << "souper-server cannot send its queries to another server\n";
+    return 1;
+  }
+
+  int ListenFD = listenOn(SocketPath);
+  if (ListenFD < 0)
+    return 1;
+  // Solvers are set up after the fork, which must not copy their threads.
+  if (Detach)
+    detach();
+
+  struct sigaction Action;
+  std::memset(&Action, 0, sizeof(Action));
+  Action.sa_handler = stop;
+  sigaction(SIGINT, &Action, nullptr);
+  sigaction(SIGTERM, &Action, nullptr);
+
+  // Never destroyed, since clients may still be served when a signal
+  // stops the server.
+  Server *S = new Server(NumSolvers ? NumSolvers
+                         : llvm::hardware_concurrency().compute_thread_count());
+  while (!Stop) {
+    pollfd P = {ListenFD, POLLIN, 0};
+    int N = poll(&P, 1, 1000);
+    if (N < 0 && errno != EINTR) {
+      errs() << "poll: " << std::strerror(errno) << '\n';
+      break;
+    }
+    if (N > 0) {
+      int FD = ::accept(ListenFD, nullptr, nullptr);
+      if (FD >= 0)
+        S->accept(FD);
+    } else if (IdleTimeout && S->idleFor(IdleTimeout)) {
+      break;
+    }
+  }
+
+  close(ListenFD);
+  unlink(SocketPath.c_str());
+  return 0;
+}
@@ -19,6 +19,7 @@
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Signals.h"
@@ -57,8 +58,32 @@ static cl::opt<bool>
 Check("check", cl::desc("Check input for expected results"),
     cl::init(false));
 
+static cl::opt<unsigned> ExtractThreads("souper-extract-threads",
+    cl::desc("Number of threads used to extract candidates (default=1)"),
+    cl::init(1));
+
 static ExitOnError ExitOnErr;
 
+// The options that affect which candidates are extracted and how they are
+// solved, for keying the function cache.
+static std::string getCacheConfig(int argc, char **argv) {
+  std::string Config;
+  for (int I = 1; I < argc; ++I) {
+    StringRef Arg = argv[I];
+    if (Arg == "-o" || Arg == "--o") {
+      ++I;
+      continue;
+    }
+    if (Arg == InputFilename || Arg.startswith("-o=") ||
+        Arg.startswith("--o=") || Arg.contains("souper-debug-level") ||
+        Arg.contains("souper-extract-threads") ||
+        Arg.contains("souper-function-cache"))
+      continue;
+    Config += Arg.str() + "\n";
+  }
+  return Config;
+}
+
 // adapted from llvm-dis.cpp
 static std::unique_ptr<Module> openInputFile(LLVMContext &Context) {
   std::unique_ptr<MemoryBuffer> MB =
@@ -101,12 +126,34 @@ int main(int argc, char **argv) {
 
   KVStore *KV = 0;
   std::unique_ptr<Solver> S = GetSolver(KV);
+  // -check compares against the module's metadata, so it always solves.
+  std::unique_ptr<FunctionCache> FC;
+  if (!Check)
+    FC = GetFunctionCache(KV, getCacheConfig(argc, argv));
 
   InstContext IC;
   ExprBuilderContext EBC;
   CandidateMap CandMap;
 
-  AddModuleToCandidateMap(IC, EBC, CandMap, M.get());
+  ExtractionStats Stats;
+  AddModuleToCandidateMap(IC, EBC, CandMap, M.get(), ExtractThreads, &Stats,
+                          FC.get());
+  if (FC)
+    llvm::errs() << "; Function cache: reused " << FC->Reused << " of "
+                 << FC->Lookups << " functions\n";
+  if (DebugLevel > 1) {
+    llvm::errs() << "; Extracted " << CandMap.getNumCandidates()
+                 << " candidates (" << CandMap.size() << " distinct, "
+                 << Stats.Skipped << " skipped) from "
+                 << Stats.Functions << " functions in "
+                 << format("%.3f", Stats.WallSeconds) << "s using "
+                 << Stats.Threads << " thread(s), a "
+                 << format("%.2f", Stats.WallSeconds > 0 ?
+                           Stats.FunctionSeconds / Stats.WallSeconds : 1.0)
+                 << "x speedup over the "
+                 << format("%.3f", Stats.FunctionSeconds)
+                 << "s it takes to extract the functions one by one\n";
+  }
 
   if (Check) {
     return CheckCandidateMap(*M.get(), CandMap, S.get(), IC) ? 0 : 1;
@@ -114,6 +161,6 @@ int main(int argc, char **argv) {
     if (StaticProfile && !KV)
       KV = new KVStore;
     return SolveCandidateMap(llvm::outs(), CandMap, S.get(), IC,
-                             StaticProfile ? KV : 0) ? 0 : 1;
+                             StaticProfile ? KV : 0, FC.get()) ? 0 : 1;
   }
 }
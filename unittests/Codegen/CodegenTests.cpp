@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include "llvm/MC/TargetRegistry.h"
 #include "llvm/Support/raw_ostream.h"
 #include "souper/Codegen/Codegen.h"
 #include "gtest/gtest.h"
@@ -55,3 +56,68 @@ TEST(CodegenTest, Sort) {
     //EXPECT_EQ(T.WantError, ErrStr);
   }
 }
+
+TEST(CodegenTest, BackendCostModel) {
+  InstContext IC;
+  Inst *X = IC.createVar(32, "x");
+  Inst *Y = IC.createVar(32, "y");
+  Inst *And = IC.getInst(Inst::And, 32,
+                         {X, IC.getConst(llvm::APInt(32, 255))});
+  Inst *Div = IC.getInst(Inst::UDiv, 32, {X, Y});
+  // Structurally identical to And, so its cost comes from the cache.
+  Inst *Z = IC.createVar(32, "z");
+  Inst *And2 = IC.getInst(Inst::And, 32,
+                          {Z, IC.getConst(llvm::APInt(32, 255))});
+
+  BackendCostModel Model({BackendCostModel::Target{"x86_64", "skylake"}});
+  std::vector<BackendCost> Costs;
+  Model.getCosts(IC, {And, Div}, Costs);
+  ASSERT_EQ(Costs.size(), 2u);
+  ASSERT_EQ(Costs[0].C.size(), 1u);
+  EXPECT_GT(Costs[0].C[0], 0);
+  EXPECT_LT(Costs[0].C[0], Costs[1].C[0]);
+
+  BackendCost Cost = Model.getCost(IC, And2);
+  EXPECT_EQ(Cost.C, Costs[0].C);
+  EXPECT_EQ(Model.Lookups, 3u);
+  EXPECT_EQ(Model.Hits, 1u);
+}
+
+// Only the default targets that LLVM was built with are used.
+TEST(CodegenTest, BackendCostModelDefaultTargets) {
+  BackendCostModel Model;
+  for (const auto &T : Model.getTargets()) {
+    std::string Error;
+    EXPECT_NE(llvm::TargetRegistry::lookupTarget(T.Triple, Error), nullptr)
+        << Error;
+  }
+}
+
+// The targets are compiled in parallel, and each must get the costs that it
+// gets when it is the only target.
+TEST(CodegenTest, BackendCostModelTargets) {
+  InstContext IC;
+  Inst *X = IC.createVar(32, "x");
+  Inst *Y = IC.createVar(32, "y");
+  std::vector<Inst *> Is = {
+    IC.getInst(Inst::Add, 32, {X, Y}),
+    IC.getInst(Inst::Mul, 32, {IC.getInst(Inst::Xor, 32, {Y, X}), X}),
+    IC.getInst(Inst::UDiv, 32, {Y, X}),
+    IC.getInst(Inst::Select, 32, {IC.getInst(Inst::Ult, 1, {X, Y}), X, Y}),
+  };
+  std::vector<BackendCostModel::Target> Targets = {
+    {"x86_64", "skylake"}, {"aarch64", "apple-a12"},
+    {"x86_64", "x86-64"}, {"aarch64", "generic"}};
+
+  BackendCostModel Model(Targets);
+  std::vector<BackendCost> Costs;
+  Model.getCosts(IC, Is, Costs);
+  ASSERT_EQ(Costs.size(), Is.size());
+  for (unsigned T = 0; T != Targets.size(); ++T) {
+    BackendCostModel Single({Targets[T]});
+    std::vector<BackendCost> SingleCosts;
+    Single.getCosts(IC, Is, SingleCosts);
+    for (unsigned I = 0; I != Is.size(); ++I)
+      EXPECT_EQ(Costs[I].C[T], SingleCosts[I].C[0]);
+  }
+}
@@ -63,3 +63,61 @@ TEST(InstTest, Print) {
   EXPECT_EQ("%0:i64 = add 1:i64, 2:i64\n"
             "%1:i64 = mul 3:i64, %0\n", SS.str());
 }
+
+TEST(InstTest, LHSKey) {
+  InstContext IC;
+
+  Inst *X = IC.createVar(32, "x");
+  Inst *Y = IC.createVar(32, "y");
+  Inst *One = IC.getConst(llvm::APInt(32, 1));
+  Inst *XA1 = IC.getInst(Inst::Add, 32, {X, One});
+  Inst *YA1 = IC.getInst(Inst::Add, 32, {Y, One});
+  Inst *XS1 = IC.getInst(Inst::Sub, 32, {X, One});
+
+  // Keys, like printed LHSs, do not depend on the identity of variables.
+  EXPECT_EQ(GetReplacementLHSKey({}, {}, XA1),
+            GetReplacementLHSKey({}, {}, YA1));
+  EXPECT_NE(GetReplacementLHSKey({}, {}, XA1),
+            GetReplacementLHSKey({}, {}, XS1));
+
+  Inst *XY = IC.getInst(Inst::Add, 32, {X, Y});
+  Inst *XX = IC.getInst(Inst::Add, 32, {X, X});
+  EXPECT_NE(GetReplacementLHSKey({}, {}, XY),
+            GetReplacementLHSKey({}, {}, XX));
+
+  Inst *True = IC.getConst(llvm::APInt(1, 1));
+  Inst *XNe0 = IC.getInst(Inst::Ne, 1, {X, IC.getConst(llvm::APInt(32, 0))});
+  Inst *YNe0 = IC.getInst(Inst::Ne, 1, {Y, IC.getConst(llvm::APInt(32, 0))});
+  EXPECT_EQ(GetReplacementLHSKey({}, {{XNe0, True}}, XA1),
+            GetReplacementLHSKey({}, {{YNe0, True}}, YA1));
+  EXPECT_NE(GetReplacementLHSKey({}, {{YNe0, True}}, XA1),
+            GetReplacementLHSKey({}, {{XNe0, True}}, XA1));
+}
+
+TEST(InstTest, CostMetrics) {
+  InstContext IC;
+
+  Inst *X = IC.createVar(32, "x");
+  Inst *Y = IC.createVar(32, "y");
+  Inst *Add = IC.getInst(Inst::Add, 32, {X, Y});
+  Inst *Div = IC.getInst(Inst::UDiv, 32, {X, Y});
+
+  EXPECT_EQ(cost(Add, CostMetric::Default), Inst::getCost(Inst::Add));
+  for (auto Metric : {CostMetric::Latency, CostMetric::Throughput,
+                      CostMetric::UOps}) {
+    EXPECT_GT(cost(Add, Metric), 0);
+    EXPECT_LT(cost(Add, Metric), cost(Div, Metric));
+  }
+
+  // Instructions wider than 64 bits cost one 64-bit operation per word.
+  EXPECT_EQ(Inst::getCost(Inst::Add, 128, CostMetric::Latency),
+            2 * Inst::getCost(Inst::Add, 64, CostMetric::Latency));
+
+  // Kinds without a table entry keep their hand-written cost, in adds.
+  for (auto Metric : {CostMetric::Latency, CostMetric::Throughput,
+                      CostMetric::UOps})
+    EXPECT_EQ(Inst::getCost(Inst::SAddWithOverflow, 32, Metric),
+              Inst::getCost(Inst::SAddWithOverflow) *
+                  Inst::getCost(Inst::Add, 32, Metric));
+  EXPECT_EQ(Inst::getCost(Inst::SAddO, 32, CostMetric::Latency), 0);
+}
@@ -213,3 +213,35 @@ TEST(InterpreterTests, ConcreteCache) {
   // We would have got 0xFF if evaluateInst had returned result from cache.
   ASSERT_EQ(Val.getValue(), APInt(8, 0x0F, true));
 }
+
+// Checks that BatchInterpreter agrees with ConcreteInterpreter on every input
+TEST(InterpreterTests, Batch) {
+  InstContext IC;
+
+  Inst *X = IC.createVar(4, "x");
+  Inst *Y = IC.createVar(4, "y");
+  Inst *Div = IC.getInst(Inst::UDiv, 4, {X, Y});
+  Inst *Add = IC.getInst(Inst::AddNSW, 4, {Div, X});
+  Inst *Mul = IC.getInst(Inst::Mul, 4, {Add, Div});
+
+  BatchInputs Inputs;
+  for (unsigned I = 0; I != 256; ++I) {
+    Inputs[X].push_back(APInt(4, I & 0xF));
+    Inputs[Y].push_back(APInt(4, I >> 4));
+  }
+  std::vector<std::vector<EvalValue>> Results;
+  BatchInterpreter BI({Mul, Div});
+  BI.evaluate(Inputs, 256, Results);
+  ASSERT_EQ(Results.size(), 2);
+
+  for (unsigned I = 0; I != 256; ++I) {
+    ValueCache InputValues = {{X, Inputs[X][I]}, {Y, Inputs[Y][I]}};
+    souper::ConcreteInterpreter CI(InputValues);
+    for (unsigned R = 0; R != 2; ++R) {
+      auto Val = CI.evaluateInst(R ? Div : Mul);
+      ASSERT_EQ(Val.K, Results[R][I].K);
+      if (Val.hasValue())
+        ASSERT_EQ(Val.getValue(), Results[R][I].getValue());
+    }
+  }
+}
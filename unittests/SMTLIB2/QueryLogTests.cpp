@@ -0,0 +1,117 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "souper/SMTLIB2/Solver.h"
+#include "gtest/gtest.h"
+
+using namespace llvm;
+using namespace souper;
+
+namespace {
+
+QueryLog::Answer makeAnswer(decltype(QueryLog::Answer::Kind) Kind,
+                            std::vector<APInt> Models = {}) {
+  QueryLog::Answer A;
+  A.Kind = Kind;
+  A.Models = std::move(Models);
+  return A;
+}
+
+// Saves Log to a temporary file and loads it into Loaded.
+void roundTrip(const QueryLog &Log, QueryLog &Loaded) {
+  SmallString<128> Path;
+  ASSERT_FALSE(sys::fs::createTemporaryFile("querylog", "log", Path));
+  ASSERT_FALSE(Log.save(Path));
+  std::string ErrStr;
+  std::error_code EC = Loaded.load(Path, ErrStr);
+  sys::fs::remove(Path);
+  ASSERT_FALSE(EC) << ErrStr;
+}
+
+}
+
+TEST(QueryLogTest, RoundTrip) {
+  QueryLog Log;
+  Log.insert("sat", 3,
+             makeAnswer(QueryLog::Answer::Sat,
+                        {APInt(1, 1), APInt(32, 0), APInt(64, 0xdeadbeef12)}));
+  Log.insert("sat", 0, makeAnswer(QueryLog::Answer::Sat));
+  Log.insert("unsat", 0, makeAnswer(QueryLog::Answer::Unsat));
+  Log.insert("timeout", 1, makeAnswer(QueryLog::Answer::Timeout));
+  Log.insert("error", 0, makeAnswer(QueryLog::Answer::Error));
+
+  QueryLog Loaded;
+  roundTrip(Log, Loaded);
+  ASSERT_EQ(5u, Loaded.size());
+
+  QueryLog::Answer A;
+  ASSERT_TRUE(Loaded.lookup("sat", 3, A));
+  EXPECT_EQ(QueryLog::Answer::Sat, A.Kind);
+  ASSERT_EQ(3u, A.Models.size());
+  EXPECT_EQ(1u, A.Models[0].getBitWidth());
+  EXPECT_EQ(1u, A.Models[0].getZExtValue());
+  EXPECT_EQ(32u, A.Models[1].getBitWidth());
+  EXPECT_EQ(0u, A.Models[1].getZExtValue());
+  EXPECT_EQ(64u, A.Models[2].getBitWidth());
+  EXPECT_EQ(0xdeadbeef12u, A.Models[2].getZExtValue());
+
+  ASSERT_TRUE(Loaded.lookup("sat", 0, A));
+  EXPECT_EQ(QueryLog::Answer::Sat, A.Kind);
+  EXPECT_TRUE(A.Models.empty());
+
+  ASSERT_TRUE(Loaded.lookup("unsat", 0, A));
+  EXPECT_EQ(QueryLog::Answer::Unsat, A.Kind);
+  ASSERT_TRUE(Loaded.lookup("timeout", 1, A));
+  EXPECT_EQ(QueryLog::Answer::Timeout, A.Kind);
+  ASSERT_TRUE(Loaded.lookup("error", 0, A));
+  EXPECT_EQ(QueryLog::Answer::Error, A.Kind);
+
+  // The number of models is part of the key.
+  EXPECT_FALSE(Loaded.lookup("unsat", 1, A));
+  EXPECT_FALSE(Loaded.lookup("missing", 0, A));
+}
+
+TEST(QueryLogTest, Replay) {
+  QueryLog Log;
+  Log.insert("sat", 1,
+             makeAnswer(QueryLog::Answer::Sat, {APInt(8, 42)}));
+  Log.insert("unsat", 0, makeAnswer(QueryLog::Answer::Unsat));
+  Log.insert("timeout", 0, makeAnswer(QueryLog::Answer::Timeout));
+  Log.insert("error", 0, makeAnswer(QueryLog::Answer::Error));
+
+  QueryLog Loaded;
+  roundTrip(Log, Loaded);
+  std::unique_ptr<SMTLIBSolver> S = createReplayingSolver(Loaded, nullptr);
+
+  bool Result = false;
+  std::vector<APInt> Models;
+  EXPECT_FALSE(S->isSatisfiable("sat", Result, 1, &Models, 0));
+  EXPECT_TRUE(Result);
+  ASSERT_EQ(1u, Models.size());
+  EXPECT_EQ(APInt(8, 42), Models[0]);
+
+  EXPECT_FALSE(S->isSatisfiable("unsat", Result, 0, nullptr, 0));
+  EXPECT_FALSE(Result);
+
+  EXPECT_EQ(std::errc::timed_out,
+            S->isSatisfiable("timeout", Result, 0, nullptr, 0));
+  EXPECT_TRUE(S->isSatisfiable("error", Result, 0, nullptr, 0));
+
+  // Without a solver to fall back on, a query missing from the log fails
+  // and is not added to it.
+  EXPECT_TRUE(S->isSatisfiable("missing", Result, 0, nullptr, 0));
+  EXPECT_EQ(4u, Loaded.size());
+}
@@ -0,0 +1,26 @@
+# Writes the souper revision to the header OUTPUT at build time, so that it
+# does not go stale until the next configure. The header is only rewritten
+# when the revision changes, which is all that rebuilds its users. Edits to
+# a dirty tree keep its revision; -souper-function-cache-config tells such
+# builds apart.
+#
+# Usage: cmake -DSOURCE_DIR=<dir> -DOUTPUT=<header> -P revision.cmake
+
+execute_process(
+  COMMAND git describe --always --dirty
+  WORKING_DIRECTORY ${SOURCE_DIR}
+  OUTPUT_VARIABLE REVISION
+  OUTPUT_STRIP_TRAILING_WHITESPACE
+  ERROR_QUIET)
+if(NOT REVISION)
+  set(REVISION "unknown")
+endif()
+
+set(CONTENTS "#define SOUPER_REVISION \"${REVISION}\"\n")
+set(OLD_CONTENTS "")
+if(EXISTS ${OUTPUT})
+  file(READ ${OUTPUT} OLD_CONTENTS)
+endif()
+if(NOT CONTENTS STREQUAL OLD_CONTENTS)
+  file(WRITE ${OUTPUT} "${CONTENTS}")
+endif()